@@ -38,6 +38,8 @@
 #include "hw/audiodev.h"
 #include "kvm.h"
 #include "migration.h"
+#include "qemu_socket.h"
+#include "qemu-thread.h"
 #include "net.h"
 #include "gdbstub.h"
 #include "hw/smbios.h"
@@ -94,6 +96,9 @@ const uint32_t arch_type = QEMU_ARCH;
 #define RAM_SAVE_FLAG_PAGE     0x08
 #define RAM_SAVE_FLAG_EOS      0x10
 #define RAM_SAVE_FLAG_CONTINUE 0x20
+#define RAM_SAVE_FLAG_STREAMS  0x40 /* followed by the number of extra
+                                       RAM streams */
+#define RAM_SAVE_FLAG_RUN      0x80 /* a run of consecutive pages */
 
 #ifdef __ALTIVEC__
 #include <altivec.h>
@@ -164,22 +169,37 @@ static int is_dup_page(uint8_t *page)
 static RAMBlock *last_block;
 static ram_addr_t last_offset;
 
-static int ram_save_block(QEMUFile *f)
+/* With several migration streams, RAM is striped across them in chunks of
+ * this size.  A given page always travels on the same stream, so the
+ * destination sees the updates of each page in order. */
+#define RAM_STREAM_STRIPE_BITS 20
+
+/* Block of the last page sent on each stream, for RAM_SAVE_FLAG_CONTINUE */
+static RAMBlock *stream_last_block[MIGRATION_MAX_CHANNELS];
+
+static int ram_save_block(QEMUFile **files, int nr_files)
 {
-    RAMBlock *block = last_block;
+    RAMBlock *block;
     ram_addr_t offset = last_offset;
     int bytes_sent = 0;
     MemoryRegion *mr;
 
-    if (!block)
-        block = QLIST_FIRST(&ram_list.blocks);
+    /* The scan below stops when it gets back to last_block, so that must
+     * be a real block even if no page turns out to be dirty */
+    if (!last_block)
+        last_block = QLIST_FIRST(&ram_list.blocks);
+    block = last_block;
 
     do {
         mr = block->mr;
         if (memory_region_get_dirty(mr, offset, TARGET_PAGE_SIZE,
                                     DIRTY_MEMORY_MIGRATION)) {
             uint8_t *p;
-            int cont = (block == last_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+            int stream = ((block->offset + offset) >> RAM_STREAM_STRIPE_BITS)
+                         % nr_files;
+            QEMUFile *f = files[stream];
+            int cont = (block == stream_last_block[stream]) ?
+                       RAM_SAVE_FLAG_CONTINUE : 0;
 
             memory_region_reset_dirty(mr, offset, TARGET_PAGE_SIZE,
                                       DIRTY_MEMORY_MIGRATION);
@@ -202,9 +222,10 @@ static int ram_save_block(QEMUFile *f)
                     qemu_put_buffer(f, (uint8_t *)block->idstr,
                                     strlen(block->idstr));
                 }
-                qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+                qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
                 bytes_sent = TARGET_PAGE_SIZE;
             }
+            stream_last_block[stream] = block;
 
             break;
         }
@@ -226,6 +247,93 @@ static int ram_save_block(QEMUFile *f)
 
 static uint64_t bytes_transferred;
 
+/* Longest run of pages written by ram_save_runs() in one record */
+#define RAM_RUN_MAX_PAGES 2048
+
+static void ram_put_run(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                        int npages, int dup)
+{
+    uint8_t *p = (uint8_t *)qemu_safe_ram_ptr(block->offset) + offset;
+    int flags = RAM_SAVE_FLAG_RUN;
+
+    if (dup) {
+        flags |= RAM_SAVE_FLAG_COMPRESS;
+    }
+    qemu_put_be64(f, offset | flags);
+    qemu_put_byte(f, strlen(block->idstr));
+    qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+    qemu_put_be32(f, npages);
+
+    if (dup) {
+        qemu_put_byte(f, *p);
+        bytes_transferred += 1;
+    } else {
+        /* Pad so that the pages land page-aligned in the file */
+        int pad = -(qemu_ftell(f) + 2) & (TARGET_PAGE_SIZE - 1);
+
+        qemu_put_be16(f, pad);
+        while (pad--) {
+            qemu_put_byte(f, 0);
+        }
+        qemu_put_buffer_async(f, p, npages * TARGET_PAGE_SIZE);
+        bytes_transferred += npages * TARGET_PAGE_SIZE;
+    }
+}
+
+/*
+ * Write out all dirty RAM as runs of pages instead of one record per page.
+ * Used for snapshots with the ram-runs capability, where the guest is stopped
+ * and the whole of RAM goes out at once: the pages end up page-aligned and
+ * contiguous in the vmstate area, and ram_load() reads each run with a single
+ * request straight into guest memory.
+ *
+ * qemu_safe_ram_ptr() is used because memory_region_get_ram_ptr() moves
+ * the block to the head of ram_list.blocks, which is being walked here.
+ */
+static void ram_save_runs(QEMUFile *f)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        MemoryRegion *mr = block->mr;
+        uint8_t *host = qemu_safe_ram_ptr(block->offset);
+        ram_addr_t offset, start = 0;
+        int npages = 0;
+        int dup = 0;
+
+        for (offset = 0; offset < block->length; offset += TARGET_PAGE_SIZE) {
+            uint8_t *p = host + offset;
+            int page_dup;
+
+            if (!memory_region_get_dirty(mr, offset, TARGET_PAGE_SIZE,
+                                         DIRTY_MEMORY_MIGRATION)) {
+                if (npages) {
+                    ram_put_run(f, block, start, npages, dup);
+                    npages = 0;
+                }
+                continue;
+            }
+            memory_region_reset_dirty(mr, offset, TARGET_PAGE_SIZE,
+                                      DIRTY_MEMORY_MIGRATION);
+
+            page_dup = is_dup_page(p);
+            if (npages && (page_dup != dup || npages == RAM_RUN_MAX_PAGES ||
+                           (dup && *p != *(p - TARGET_PAGE_SIZE)))) {
+                ram_put_run(f, block, start, npages, dup);
+                npages = 0;
+            }
+            if (!npages) {
+                start = offset;
+                dup = page_dup;
+            }
+            npages++;
+        }
+        if (npages) {
+            ram_put_run(f, block, start, npages, dup);
+        }
+    }
+}
+
 static ram_addr_t ram_save_remaining(void)
 {
     RAMBlock *block;
@@ -294,19 +402,97 @@ static void sort_ram_list(void)
     g_free(blocks);
 }
 
+/*
+ * Incremental snapshots.  A snapshot taken with tracking requested leaves
+ * dirty logging enabled, so that the next one only has to save the pages
+ * that were written since.  Anything else that resets the migration dirty
+ * bits (a migration, a failed save) ends the tracking.
+ */
+static bool ram_snapshot_track;         /* keep logging after this save */
+static bool ram_snapshot_incremental;   /* this save writes dirty pages only */
+static bool ram_snapshot_tracking;      /* logging on since last snapshot */
+
+bool ram_snapshot_is_tracking(void)
+{
+    return ram_snapshot_tracking;
+}
+
+void ram_snapshot_begin(bool track, bool incremental)
+{
+    ram_snapshot_track = track;
+    ram_snapshot_incremental = track && incremental && ram_snapshot_tracking;
+}
+
+void ram_snapshot_end(bool success)
+{
+    if (ram_snapshot_track) {
+        if (success) {
+            ram_snapshot_tracking = true;
+        } else {
+            memory_global_dirty_log_stop();
+            ram_snapshot_tracking = false;
+        }
+    }
+    ram_snapshot_track = false;
+    ram_snapshot_incremental = false;
+}
+
+void ram_snapshot_loaded(bool success)
+{
+    RAMBlock *block;
+
+    if (!ram_snapshot_tracking) {
+        return;
+    }
+    if (!success) {
+        memory_global_dirty_log_stop();
+        ram_snapshot_tracking = false;
+        return;
+    }
+
+    /* RAM now matches the loaded snapshot, so that becomes the base of the
+     * next incremental one */
+    memory_global_sync_dirty_bitmap(get_system_memory());
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        memory_region_reset_dirty(block->mr, 0, block->length,
+                                  DIRTY_MEMORY_MIGRATION);
+    }
+}
+
+static int ram_files_rate_limit(QEMUFile **files, int nr_files)
+{
+    int i, ret;
+
+    for (i = 0; i < nr_files; i++) {
+        ret = qemu_file_rate_limit(files[i]);
+        if (ret) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
 int ram_save_live(QEMUFile *f, int stage, void *opaque)
 {
+    QEMUFile *files[MIGRATION_MAX_CHANNELS];
+    int nr_files;
     ram_addr_t addr;
     uint64_t bytes_transferred_last;
     double bwidth = 0;
     uint64_t expected_time = 0;
     int ret;
+    int i;
 
     if (stage < 0) {
         memory_global_dirty_log_stop();
+        ram_snapshot_tracking = false;
         return 0;
     }
 
+    /* Stream 0 is the main migration stream, any others only carry RAM */
+    files[0] = f;
+    nr_files = 1 + migrate_get_ram_files(f, files + 1);
+
     memory_global_sync_dirty_bitmap(get_system_memory());
 
     if (stage == 1) {
@@ -314,19 +500,30 @@ int ram_save_live(QEMUFile *f, int stage, void *opaque)
         bytes_transferred = 0;
         last_block = NULL;
         last_offset = 0;
+        memset(stream_last_block, 0, sizeof(stream_last_block));
         sort_ram_list();
 
-        /* Make sure all dirty bits are set */
-        QLIST_FOREACH(block, &ram_list.blocks, next) {
-            for (addr = 0; addr < block->length; addr += TARGET_PAGE_SIZE) {
-                if (!memory_region_get_dirty(block->mr, addr, TARGET_PAGE_SIZE,
-                                             DIRTY_MEMORY_MIGRATION)) {
-                    memory_region_set_dirty(block->mr, addr, TARGET_PAGE_SIZE);
+        if (!ram_snapshot_incremental) {
+            if (ram_snapshot_tracking) {
+                memory_global_dirty_log_stop();
+                ram_snapshot_tracking = false;
+            }
+
+            /* Make sure all dirty bits are set */
+            QLIST_FOREACH(block, &ram_list.blocks, next) {
+                for (addr = 0; addr < block->length;
+                     addr += TARGET_PAGE_SIZE) {
+                    if (!memory_region_get_dirty(block->mr, addr,
+                                                 TARGET_PAGE_SIZE,
+                                                 DIRTY_MEMORY_MIGRATION)) {
+                        memory_region_set_dirty(block->mr, addr,
+                                                TARGET_PAGE_SIZE);
+                    }
                 }
             }
-        }
 
-        memory_global_dirty_log_start();
+            memory_global_dirty_log_start();
+        }
 
         qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
 
@@ -335,15 +532,26 @@ int ram_save_live(QEMUFile *f, int stage, void *opaque)
             qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
             qemu_put_be64(f, block->length);
         }
+
+        if (nr_files > 1) {
+            qemu_put_be64(f, RAM_SAVE_FLAG_STREAMS);
+            qemu_put_be32(f, nr_files - 1);
+        }
+
+        /* Older versions can't load runs, so only write them if asked to */
+        if (migrate_ram_runs() && qemu_file_is_seekable(f) &&
+            !runstate_is_running()) {
+            ram_save_runs(f);
+        }
     }
 
     bytes_transferred_last = bytes_transferred;
     bwidth = qemu_get_clock_ns(rt_clock);
 
-    while ((ret = qemu_file_rate_limit(f)) == 0) {
+    while ((ret = ram_files_rate_limit(files, nr_files)) == 0) {
         int bytes_sent;
 
-        bytes_sent = ram_save_block(f);
+        bytes_sent = ram_save_block(files, nr_files);
         bytes_transferred += bytes_sent;
         if (bytes_sent == 0) { /* no more blocks */
             break;
@@ -368,12 +576,20 @@ int ram_save_live(QEMUFile *f, int stage, void *opaque)
         int bytes_sent;
 
         /* flush all remaining blocks regardless of rate limiting */
-        while ((bytes_sent = ram_save_block(f)) != 0) {
+        while ((bytes_sent = ram_save_block(files, nr_files)) != 0) {
             bytes_transferred += bytes_sent;
         }
-        memory_global_dirty_log_stop();
+        if (!ram_snapshot_track) {
+            memory_global_dirty_log_stop();
+        }
     }
 
+    /* The destination waits for every extra stream to reach its EOS
+     * before it goes on with the main stream, so push them out now */
+    for (i = 1; i < nr_files; i++) {
+        qemu_put_be64(files[i], RAM_SAVE_FLAG_EOS);
+        qemu_fflush(files[i]);
+    }
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
     expected_time = ram_save_remaining() * TARGET_PAGE_SIZE / bwidth;
@@ -383,19 +599,20 @@ int ram_save_live(QEMUFile *f, int stage, void *opaque)
 
 static inline void *host_from_stream_offset(QEMUFile *f,
                                             ram_addr_t offset,
-                                            int flags)
+                                            int flags,
+                                            RAMBlock **last)
 {
-    static RAMBlock *block = NULL;
+    RAMBlock *block;
     char id[256];
     uint8_t len;
 
     if (flags & RAM_SAVE_FLAG_CONTINUE) {
-        if (!block) {
+        if (!*last) {
             fprintf(stderr, "Ack, bad migration stream!\n");
             return NULL;
         }
 
-        return memory_region_get_ram_ptr(block->mr) + offset;
+        return memory_region_get_ram_ptr((*last)->mr) + offset;
     }
 
     len = qemu_get_byte(f);
@@ -403,24 +620,149 @@ static inline void *host_from_stream_offset(QEMUFile *f,
     id[len] = 0;
 
     QLIST_FOREACH(block, &ram_list.blocks, next) {
-        if (!strncmp(id, block->idstr, sizeof(id)))
+        if (!strncmp(id, block->idstr, sizeof(id))) {
+            *last = block;
             return memory_region_get_ram_ptr(block->mr) + offset;
+        }
     }
 
+    *last = NULL;
     fprintf(stderr, "Can't find block %s!\n", id);
     return NULL;
 }
 
-int ram_load(QEMUFile *f, void *opaque, int version_id)
-{
-    ram_addr_t addr;
-    int flags;
+/* Incoming side of the extra RAM streams.  Each one is drained by its own
+ * thread; the main stream waits at every RAM_SAVE_FLAG_EOS until all of
+ * them have caught up, so device state is never loaded on top of RAM that
+ * is still in flight. */
+typedef struct RamLoadStream {
+    QEMUFile *file;
+    int fd;
+    QemuThread thread;
+    RAMBlock *last_block;
+    int batches;
     int error;
+} RamLoadStream;
 
-    if (version_id < 4 || version_id > 4) {
+static RamLoadStream ram_load_streams[MIGRATION_MAX_CHANNELS - 1];
+static int ram_load_nr_streams;
+static int ram_load_batches;
+static QemuMutex ram_load_lock;
+static QemuCond ram_load_cond;
+
+static int ram_load_stream(QEMUFile *f, int version_id, RAMBlock **last);
+
+static void *ram_load_stream_thread(void *opaque)
+{
+    RamLoadStream *st = opaque;
+    int ret;
+
+    do {
+        ret = ram_load_stream(st->file, 4, &st->last_block);
+
+        qemu_mutex_lock(&ram_load_lock);
+        if (ret < 0) {
+            st->error = ret;
+        } else {
+            st->batches++;
+        }
+        qemu_cond_broadcast(&ram_load_cond);
+        qemu_mutex_unlock(&ram_load_lock);
+    } while (ret == 0);
+
+    return NULL;
+}
+
+static int ram_load_start_streams(int nr_streams)
+{
+    int i;
+
+    if (ram_load_nr_streams || nr_streams <= 0 ||
+        nr_streams >= MIGRATION_MAX_CHANNELS) {
         return -EINVAL;
     }
 
+    qemu_mutex_init(&ram_load_lock);
+    qemu_cond_init(&ram_load_cond);
+    ram_load_batches = 0;
+
+    for (; ram_load_nr_streams < nr_streams; ram_load_nr_streams++) {
+        RamLoadStream *st = &ram_load_streams[ram_load_nr_streams];
+
+        memset(st, 0, sizeof(*st));
+        st->fd = migration_incoming_accept_channel();
+        if (st->fd < 0) {
+            fprintf(stderr, "could not accept migration stream %d\n",
+                    ram_load_nr_streams + 1);
+            return -EINVAL;
+        }
+        st->file = qemu_fopen_socket(st->fd);
+    }
+
+    for (i = 0; i < nr_streams; i++) {
+        qemu_thread_create(&ram_load_streams[i].thread,
+                           ram_load_stream_thread, &ram_load_streams[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    return 0;
+}
+
+static int ram_load_wait_streams(void)
+{
+    int i, ret = 0;
+
+    ram_load_batches++;
+
+    qemu_mutex_lock(&ram_load_lock);
+    for (i = 0; i < ram_load_nr_streams; i++) {
+        RamLoadStream *st = &ram_load_streams[i];
+
+        while (st->batches < ram_load_batches && !st->error) {
+            qemu_cond_wait(&ram_load_cond, &ram_load_lock);
+        }
+        if (st->batches < ram_load_batches) {
+            ret = st->error;
+            break;
+        }
+    }
+    qemu_mutex_unlock(&ram_load_lock);
+
+    return ret;
+}
+
+void ram_load_cleanup(void)
+{
+    int i;
+
+    if (!ram_load_nr_streams) {
+        return;
+    }
+
+    /* The stream threads are blocked reading the next batch that will
+     * never come; kick them out */
+    for (i = 0; i < ram_load_nr_streams; i++) {
+        shutdown(ram_load_streams[i].fd, 2);
+    }
+    for (i = 0; i < ram_load_nr_streams; i++) {
+        RamLoadStream *st = &ram_load_streams[i];
+
+        qemu_thread_join(&st->thread);
+        qemu_fclose(st->file);
+        closesocket(st->fd);
+    }
+    ram_load_nr_streams = 0;
+
+    qemu_cond_destroy(&ram_load_cond);
+    qemu_mutex_destroy(&ram_load_lock);
+}
+
+/* Load RAM records from @f up to and including the next EOS marker */
+static int ram_load_stream(QEMUFile *f, int version_id, RAMBlock **last)
+{
+    ram_addr_t addr;
+    int flags;
+    int error;
+
     do {
         addr = qemu_get_be64(f);
 
@@ -462,11 +804,50 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
             }
         }
 
-        if (flags & RAM_SAVE_FLAG_COMPRESS) {
+        if (flags & RAM_SAVE_FLAG_STREAMS) {
+            int ret = ram_load_start_streams(qemu_get_be32(f));
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        if (flags & RAM_SAVE_FLAG_RUN) {
+            uint8_t pad[TARGET_PAGE_SIZE];
+            uint32_t npages;
+            uint8_t *host;
+
+            host = host_from_stream_offset(f, addr, flags, last);
+            npages = qemu_get_be32(f);
+            if (!host || addr >= (*last)->length ||
+                npages > ((*last)->length - addr) / TARGET_PAGE_SIZE) {
+                return -EINVAL;
+            }
+
+            if (flags & RAM_SAVE_FLAG_COMPRESS) {
+                uint8_t ch = qemu_get_byte(f);
+
+                memset(host, ch, npages * TARGET_PAGE_SIZE);
+#ifndef _WIN32
+                if (ch == 0 &&
+                    (!kvm_enabled() || kvm_has_sync_mmu())) {
+                    qemu_madvise(host, npages * TARGET_PAGE_SIZE,
+                                 QEMU_MADV_DONTNEED);
+                }
+#endif
+            } else {
+                int len = qemu_get_be16(f);
+
+                if (len > sizeof(pad)) {
+                    return -EINVAL;
+                }
+                qemu_get_buffer(f, pad, len);
+                qemu_get_buffer_direct(f, host, npages * TARGET_PAGE_SIZE);
+            }
+        } else if (flags & RAM_SAVE_FLAG_COMPRESS) {
             void *host;
             uint8_t ch;
 
-            host = host_from_stream_offset(f, addr, flags);
+            host = host_from_stream_offset(f, addr, flags, last);
             if (!host) {
                 return -EINVAL;
             }
@@ -482,9 +863,12 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
         } else if (flags & RAM_SAVE_FLAG_PAGE) {
             void *host;
 
-            host = host_from_stream_offset(f, addr, flags);
+            host = host_from_stream_offset(f, addr, flags, last);
+            if (!host) {
+                return -EINVAL;
+            }
 
-            qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            qemu_get_buffer_direct(f, host, TARGET_PAGE_SIZE);
         }
         error = qemu_file_get_error(f);
         if (error) {
@@ -495,6 +879,22 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
     return 0;
 }
 
+int ram_load(QEMUFile *f, void *opaque, int version_id)
+{
+    static RAMBlock *last;
+    int ret;
+
+    if (version_id < 4 || version_id > 4) {
+        return -EINVAL;
+    }
+
+    ret = ram_load_stream(f, version_id, &last);
+    if (ret == 0 && ram_load_nr_streams) {
+        ret = ram_load_wait_streams();
+    }
+    return ret;
+}
+
 #ifdef HAS_AUDIO
 struct soundhw {
     const char *name;
@@ -28,9 +28,16 @@
 #define BLK_MIG_FLAG_DEVICE_BLOCK       0x01
 #define BLK_MIG_FLAG_EOS                0x02
 #define BLK_MIG_FLAG_PROGRESS           0x04
+#define BLK_MIG_FLAG_ZERO_BLOCK         0x08
 
 #define MAX_IS_ALLOCATED_SEARCH 65536
 
+/* Largest number of adjacent chunks that are read with a single request */
+#define BLK_MIG_MAX_EXTENT_CHUNKS       16
+
+/* Chunks that may be in flight or waiting to be sent during the final stage */
+#define BLK_MIG_MAX_INFLIGHT_CHUNKS     64
+
 //#define DEBUG_BLK_MIGRATION
 
 #ifdef DEBUG_BLK_MIGRATION
@@ -54,11 +61,14 @@ typedef struct BlkMigDevState {
     unsigned long *aio_bitmap;
 } BlkMigDevState;
 
+/* A run of adjacent chunks of one device.  buf is NULL if the chunks are
+ * known to read as zeroes without reading them. */
 typedef struct BlkMigBlock {
     uint8_t *buf;
     BlkMigDevState *bmds;
     int64_t sector;
     int nr_sectors;
+    int nr_chunks;
     struct iovec iov;
     QEMUIOVector qiov;
     BlockDriverAIOCB *aiocb;
@@ -69,6 +79,8 @@ typedef struct BlkMigBlock {
 typedef struct BlkMigState {
     int blk_enable;
     int shared_base;
+    /* the destination accepts BLK_MIG_FLAG_ZERO_BLOCK */
+    int zero_blocks;
     QSIMPLEQ_HEAD(bmds_list, BlkMigDevState) bmds_list;
     QSIMPLEQ_HEAD(blk_list, BlkMigBlock) blk_list;
     int submitted;
@@ -86,18 +98,37 @@ static BlkMigState block_mig_state;
 
 static void blk_send(QEMUFile *f, BlkMigBlock * blk)
 {
+    int64_t sector;
+    uint8_t *buf;
+    int flags;
     int len;
+    int i;
+
+    /* Each chunk of the extent goes out as a record of its own */
+    for (i = 0; i < blk->nr_chunks; i++) {
+        sector = blk->sector + (int64_t)i * BDRV_SECTORS_PER_DIRTY_CHUNK;
+        buf = blk->buf ? blk->buf + (size_t)i * BLOCK_SIZE : NULL;
+
+        flags = BLK_MIG_FLAG_DEVICE_BLOCK;
+        len = MIN(blk->sector + blk->nr_sectors - sector,
+                  BDRV_SECTORS_PER_DIRTY_CHUNK) << BDRV_SECTOR_BITS;
+        if (buf == NULL ||
+            (block_mig_state.zero_blocks && buffer_is_zero(buf, len))) {
+            flags |= BLK_MIG_FLAG_ZERO_BLOCK;
+        }
 
-    /* sector number and flags */
-    qemu_put_be64(f, (blk->sector << BDRV_SECTOR_BITS)
-                     | BLK_MIG_FLAG_DEVICE_BLOCK);
+        /* sector number and flags */
+        qemu_put_be64(f, (sector << BDRV_SECTOR_BITS) | flags);
 
-    /* device name */
-    len = strlen(blk->bmds->bs->device_name);
-    qemu_put_byte(f, len);
-    qemu_put_buffer(f, (uint8_t *)blk->bmds->bs->device_name, len);
+        /* device name */
+        len = strlen(blk->bmds->bs->device_name);
+        qemu_put_byte(f, len);
+        qemu_put_buffer(f, (uint8_t *)blk->bmds->bs->device_name, len);
 
-    qemu_put_buffer(f, blk->buf, BLOCK_SIZE);
+        if (!(flags & BLK_MIG_FLAG_ZERO_BLOCK)) {
+            qemu_put_buffer(f, buf, BLOCK_SIZE);
+        }
+    }
 }
 
 int blk_mig_active(void)
@@ -191,25 +222,55 @@ static void blk_mig_read_cb(void *opaque, int ret)
 
     blk->ret = ret;
 
-    block_mig_state.reads++;
+    block_mig_state.reads += blk->nr_chunks;
     block_mig_state.total_time += (curr_time - block_mig_state.prev_time_offset);
     block_mig_state.prev_time_offset = curr_time;
 
     QSIMPLEQ_INSERT_TAIL(&block_mig_state.blk_list, blk, entry);
     bmds_set_aio_inflight(blk->bmds, blk->sector, blk->nr_sectors, 0);
 
-    block_mig_state.submitted--;
-    block_mig_state.read_done++;
+    block_mig_state.submitted -= blk->nr_chunks;
+    block_mig_state.read_done += blk->nr_chunks;
     assert(block_mig_state.submitted >= 0);
 }
 
-static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
+/* Start reading the extent at @sector; it is sent once the read completes */
+static void blk_submit(BlkMigDevState *bmds, int64_t sector, int nr_sectors)
+{
+    BlkMigBlock *blk;
+
+    blk = g_malloc(sizeof(BlkMigBlock));
+    blk->bmds = bmds;
+    blk->sector = sector;
+    blk->nr_sectors = nr_sectors;
+    blk->nr_chunks = DIV_ROUND_UP(nr_sectors, BDRV_SECTORS_PER_DIRTY_CHUNK);
+    blk->ret = 0;
+
+    bdrv_reset_dirty(bmds->bs, sector, nr_sectors);
+
+    blk->buf = g_malloc((size_t)blk->nr_chunks * BLOCK_SIZE);
+    blk->iov.iov_base = blk->buf;
+    blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
+
+    if (block_mig_state.submitted == 0) {
+        block_mig_state.prev_time_offset = qemu_get_clock_ns(rt_clock);
+    }
+
+    bmds_set_aio_inflight(bmds, sector, nr_sectors, 1);
+    block_mig_state.submitted += blk->nr_chunks;
+    blk->aiocb = bdrv_aio_readv(bmds->bs, sector, &blk->qiov,
+                                nr_sectors, blk_mig_read_cb, blk);
+}
+
+static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds,
+                                int max_chunks)
 {
     int64_t total_sectors = bmds->total_sectors;
     int64_t cur_sector = bmds->cur_sector;
     BlockDriverState *bs = bmds->bs;
-    BlkMigBlock *blk;
-    int nr_sectors;
+    int nr_sectors, max_sectors;
+    bool zero = false;
 
     if (bmds->shared_base) {
         while (cur_sector < total_sectors &&
@@ -228,32 +289,46 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
 
     cur_sector &= ~((int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK - 1);
 
-    /* we are going to transfer a full block even if it is not allocated */
-    nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
-
-    if (total_sectors - cur_sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
-        nr_sectors = total_sectors - cur_sector;
+    max_sectors = max_chunks * BDRV_SECTORS_PER_DIRTY_CHUNK;
+    if (total_sectors - cur_sector < max_sectors) {
+        max_sectors = total_sectors - cur_sector;
     }
 
-    blk = g_malloc(sizeof(BlkMigBlock));
-    blk->buf = g_malloc(BLOCK_SIZE);
-    blk->bmds = bmds;
-    blk->sector = cur_sector;
-    blk->nr_sectors = nr_sectors;
-
-    blk->iov.iov_base = blk->buf;
-    blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
-    qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
-
-    if (block_mig_state.submitted == 0) {
-        block_mig_state.prev_time_offset = qemu_get_clock_ns(rt_clock);
+    /* Read allocated data in extents of whole chunks, even where they are
+     * only partially allocated.  Chunks that are not allocated at all read
+     * as zeroes if there is no backing file, and don't need to be read if
+     * the destination takes zero chunks without their data. */
+    if (bdrv_is_allocated(bs, cur_sector, max_sectors, &nr_sectors)) {
+        nr_sectors = (nr_sectors + BDRV_SECTORS_PER_DIRTY_CHUNK - 1) &
+                     ~(BDRV_SECTORS_PER_DIRTY_CHUNK - 1);
+        nr_sectors = MIN(nr_sectors, max_sectors);
+    } else if (nr_sectors >= BDRV_SECTORS_PER_DIRTY_CHUNK ||
+               nr_sectors == max_sectors) {
+        if (nr_sectors < max_sectors) {
+            nr_sectors &= ~(BDRV_SECTORS_PER_DIRTY_CHUNK - 1);
+        }
+        zero = block_mig_state.zero_blocks &&
+               !bmds->shared_base && !bs->backing_hd;
+    } else {
+        nr_sectors = MIN(BDRV_SECTORS_PER_DIRTY_CHUNK, max_sectors);
     }
 
-    blk->aiocb = bdrv_aio_readv(bs, cur_sector, &blk->qiov,
-                                nr_sectors, blk_mig_read_cb, blk);
-    block_mig_state.submitted++;
-
-    bdrv_reset_dirty(bs, cur_sector, nr_sectors);
+    if (zero) {
+        /* nothing to read, so this doesn't count against the rate limit */
+        BlkMigBlock blk = {
+            .bmds = bmds,
+            .sector = cur_sector,
+            .nr_sectors = nr_sectors,
+            .nr_chunks = DIV_ROUND_UP(nr_sectors,
+                                      BDRV_SECTORS_PER_DIRTY_CHUNK),
+        };
+
+        bdrv_reset_dirty(bs, cur_sector, nr_sectors);
+        blk_send(f, &blk);
+        block_mig_state.transferred += blk.nr_chunks;
+    } else {
+        blk_submit(bmds, cur_sector, nr_sectors);
+    }
     bmds->cur_sector = cur_sector + nr_sectors;
 
     return (bmds->cur_sector >= total_sectors);
@@ -312,11 +387,12 @@ static void init_blk_migration(QEMUFile *f)
     block_mig_state.bulk_completed = 0;
     block_mig_state.total_time = 0;
     block_mig_state.reads = 0;
+    block_mig_state.zero_blocks = migrate_zero_blocks();
 
     bdrv_iterate(init_blk_migration_it, NULL);
 }
 
-static int blk_mig_save_bulked_block(QEMUFile *f)
+static int blk_mig_save_bulked_block(QEMUFile *f, int max_chunks)
 {
     int64_t completed_sector_sum = 0;
     BlkMigDevState *bmds;
@@ -325,7 +401,7 @@ static int blk_mig_save_bulked_block(QEMUFile *f)
 
     QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
         if (bmds->bulk_completed == 0) {
-            if (mig_save_device_bulk(f, bmds) == 1) {
+            if (mig_save_device_bulk(f, bmds, max_chunks) == 1) {
                 /* completed bulk section for this device */
                 bmds->bulk_completed = 1;
             }
@@ -362,80 +438,47 @@ static void blk_mig_reset_dirty_cursor(void)
     }
 }
 
+/* Start reading the next run of up to @max_chunks dirty chunks */
 static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
-                                 int is_async)
+                                 int max_chunks)
 {
-    BlkMigBlock *blk;
     int64_t total_sectors = bmds->total_sectors;
+    BlockDriverState *bs = bmds->bs;
     int64_t sector;
     int nr_sectors;
-    int ret = -EIO;
 
-    for (sector = bmds->cur_dirty; sector < bmds->total_sectors;) {
+    for (sector = bmds->cur_dirty; sector < total_sectors;) {
         if (bmds_aio_inflight(bmds, sector)) {
             bdrv_drain_all();
         }
-        if (bdrv_get_dirty(bmds->bs, sector)) {
-
-            if (total_sectors - sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
-                nr_sectors = total_sectors - sector;
-            } else {
-                nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
-            }
-            blk = g_malloc(sizeof(BlkMigBlock));
-            blk->buf = g_malloc(BLOCK_SIZE);
-            blk->bmds = bmds;
-            blk->sector = sector;
-            blk->nr_sectors = nr_sectors;
-
-            if (is_async) {
-                blk->iov.iov_base = blk->buf;
-                blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
-                qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
-
-                if (block_mig_state.submitted == 0) {
-                    block_mig_state.prev_time_offset = qemu_get_clock_ns(rt_clock);
-                }
-
-                blk->aiocb = bdrv_aio_readv(bmds->bs, sector, &blk->qiov,
-                                            nr_sectors, blk_mig_read_cb, blk);
-                block_mig_state.submitted++;
-                bmds_set_aio_inflight(bmds, sector, nr_sectors, 1);
-            } else {
-                ret = bdrv_read(bmds->bs, sector, blk->buf, nr_sectors);
-                if (ret < 0) {
-                    goto error;
-                }
-                blk_send(f, blk);
-
-                g_free(blk->buf);
-                g_free(blk);
-            }
-
-            bdrv_reset_dirty(bmds->bs, sector, nr_sectors);
+        if (bdrv_get_dirty(bs, sector)) {
+            nr_sectors = 0;
+            do {
+                nr_sectors += MIN(total_sectors - sector - nr_sectors,
+                                  BDRV_SECTORS_PER_DIRTY_CHUNK);
+            } while (nr_sectors < max_chunks * BDRV_SECTORS_PER_DIRTY_CHUNK &&
+                     sector + nr_sectors < total_sectors &&
+                     bdrv_get_dirty(bs, sector + nr_sectors) &&
+                     !bmds_aio_inflight(bmds, sector + nr_sectors));
+
+            blk_submit(bmds, sector, nr_sectors);
+            bmds->cur_dirty = sector + nr_sectors;
             break;
         }
         sector += BDRV_SECTORS_PER_DIRTY_CHUNK;
         bmds->cur_dirty = sector;
     }
 
-    return (bmds->cur_dirty >= bmds->total_sectors);
-
-error:
-    DPRINTF("Error reading sector %" PRId64 "\n", sector);
-    qemu_file_set_error(f, ret);
-    g_free(blk->buf);
-    g_free(blk);
-    return 0;
+    return (bmds->cur_dirty >= total_sectors);
 }
 
-static int blk_mig_save_dirty_block(QEMUFile *f, int is_async)
+static int blk_mig_save_dirty_block(QEMUFile *f, int max_chunks)
 {
     BlkMigDevState *bmds;
     int ret = 0;
 
     QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
-        if (mig_save_device_dirty(f, bmds, is_async) == 0) {
+        if (mig_save_device_dirty(f, bmds, max_chunks) == 0) {
             ret = 1;
             break;
         }
@@ -444,7 +487,7 @@ static int blk_mig_save_dirty_block(QEMUFile *f, int is_async)
     return ret;
 }
 
-static void flush_blks(QEMUFile* f)
+static void flush_blks(QEMUFile *f, bool rate_limited)
 {
     BlkMigBlock *blk;
 
@@ -453,7 +496,7 @@ static void flush_blks(QEMUFile* f)
             block_mig_state.transferred);
 
     while ((blk = QSIMPLEQ_FIRST(&block_mig_state.blk_list)) != NULL) {
-        if (qemu_file_rate_limit(f)) {
+        if (rate_limited && qemu_file_rate_limit(f)) {
             break;
         }
         if (blk->ret < 0) {
@@ -463,11 +506,11 @@ static void flush_blks(QEMUFile* f)
         blk_send(f, blk);
 
         QSIMPLEQ_REMOVE_HEAD(&block_mig_state.blk_list, entry);
+        block_mig_state.read_done -= blk->nr_chunks;
+        block_mig_state.transferred += blk->nr_chunks;
         g_free(blk->buf);
         g_free(blk);
 
-        block_mig_state.read_done--;
-        block_mig_state.transferred++;
         assert(block_mig_state.read_done >= 0);
     }
 
@@ -476,6 +519,16 @@ static void flush_blks(QEMUFile* f)
             block_mig_state.transferred);
 }
 
+/* Number of chunks that may still be read in this iteration */
+static int blk_mig_read_budget(QEMUFile *f)
+{
+    int64_t limit = qemu_file_get_rate_limit(f) / BLOCK_SIZE;
+
+    limit = MAX(limit, 1) - block_mig_state.submitted -
+            block_mig_state.read_done;
+    return MIN(limit, BLK_MIG_MAX_EXTENT_CHUNKS);
+}
+
 static int64_t get_remaining_dirty(void)
 {
     BlkMigDevState *bmds;
@@ -538,6 +591,7 @@ static void blk_mig_cleanup(void)
 
 static int block_save_live(QEMUFile *f, int stage, void *opaque)
 {
+    int budget;
     int ret;
 
     DPRINTF("Enter save live stage %d submitted %d transferred %d\n",
@@ -561,7 +615,7 @@ static int block_save_live(QEMUFile *f, int stage, void *opaque)
         set_dirty_tracking(1);
     }
 
-    flush_blks(f);
+    flush_blks(f, stage != 3);
 
     ret = qemu_file_get_error(f);
     if (ret) {
@@ -573,24 +627,22 @@ static int block_save_live(QEMUFile *f, int stage, void *opaque)
 
     if (stage == 2) {
         /* control the rate of transfer */
-        while ((block_mig_state.submitted +
-                block_mig_state.read_done) * BLOCK_SIZE <
-               qemu_file_get_rate_limit(f)) {
+        while ((budget = blk_mig_read_budget(f)) > 0) {
             if (block_mig_state.bulk_completed == 0) {
                 /* first finish the bulk phase */
-                if (blk_mig_save_bulked_block(f) == 0) {
+                if (blk_mig_save_bulked_block(f, budget) == 0) {
                     /* finished saving bulk on all devices */
                     block_mig_state.bulk_completed = 1;
                 }
             } else {
-                if (blk_mig_save_dirty_block(f, 1) == 0) {
+                if (blk_mig_save_dirty_block(f, budget) == 0) {
                     /* no more dirty blocks */
                     break;
                 }
             }
         }
 
-        flush_blks(f);
+        flush_blks(f, true);
 
         ret = qemu_file_get_error(f);
         if (ret) {
@@ -604,7 +656,20 @@ static int block_save_live(QEMUFile *f, int stage, void *opaque)
            all async read completed */
         assert(block_mig_state.submitted == 0);
 
-        while (blk_mig_save_dirty_block(f, 0) != 0);
+        /* keep several reads in flight and send data as it arrives */
+        while (!qemu_file_get_error(f) &&
+               blk_mig_save_dirty_block(f, BLK_MIG_MAX_EXTENT_CHUNKS) != 0) {
+            while (!qemu_file_get_error(f) &&
+                   block_mig_state.submitted + block_mig_state.read_done >=
+                   BLK_MIG_MAX_INFLIGHT_CHUNKS) {
+                if (block_mig_state.submitted) {
+                    qemu_aio_wait();
+                }
+                flush_blks(f, false);
+            }
+        }
+        bdrv_drain_all();
+        flush_blks(f, false);
         blk_mig_cleanup();
 
         /* report completion */
@@ -623,6 +688,25 @@ static int block_save_live(QEMUFile *f, int stage, void *opaque)
     return ((stage == 2) && is_stage2_completed());
 }
 
+static int blk_load_zeroes(BlockDriverState *bs, int64_t sector,
+                           int nr_sectors)
+{
+    uint8_t *buf;
+    int ret, n;
+
+    /* Don't allocate anything if the destination reads as zeroes already */
+    if (!bs->backing_hd && !bdrv_is_allocated(bs, sector, nr_sectors, &n) &&
+        n >= nr_sectors) {
+        return 0;
+    }
+
+    buf = g_malloc0(nr_sectors << BDRV_SECTOR_BITS);
+    ret = bdrv_write(bs, sector, buf, nr_sectors);
+    g_free(buf);
+
+    return ret;
+}
+
 static int block_load(QEMUFile *f, void *opaque, int version_id)
 {
     static int banner_printed;
@@ -670,12 +754,16 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
                 nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
             }
 
-            buf = g_malloc(BLOCK_SIZE);
+            if (flags & BLK_MIG_FLAG_ZERO_BLOCK) {
+                ret = blk_load_zeroes(bs, addr, nr_sectors);
+            } else {
+                buf = g_malloc(BLOCK_SIZE);
 
-            qemu_get_buffer(f, buf, BLOCK_SIZE);
-            ret = bdrv_write(bs, addr, buf, nr_sectors);
+                qemu_get_buffer(f, buf, BLOCK_SIZE);
+                ret = bdrv_write(bs, addr, buf, nr_sectors);
 
-            g_free(buf);
+                g_free(buf);
+            }
             if (ret < 0) {
                 return ret;
             }
@@ -82,6 +82,10 @@ static BlockDriverAIOCB *bdrv_co_aio_rw_vector(BlockDriverState *bs,
 static void coroutine_fn bdrv_co_do_rw(void *opaque);
 static int coroutine_fn bdrv_co_do_write_zeroes(BlockDriverState *bs,
     int64_t sector_num, int nb_sectors);
+static void bdrv_merge_queue_submit(BlockDriverState *bs);
+static void bdrv_chain_cache_invalidate(BlockDriverState *bs,
+                                        int64_t sector_num,
+                                        int64_t nb_sectors);
 
 static bool bdrv_exceed_bps_limits(BlockDriverState *bs, int nb_sectors,
         bool is_write, double elapsed_time, uint64_t *wait);
@@ -874,6 +878,10 @@ void bdrv_close(BlockDriverState *bs)
             bdrv_delete(bs->backing_hd);
             bs->backing_hd = NULL;
         }
+        g_free(bs->chain_cache);
+        bs->chain_cache = NULL;
+        bs->chain_cache_backing = NULL;
+
         bs->drv->bdrv_close(bs);
         g_free(bs->opaque);
 #ifdef _WIN32
@@ -932,6 +940,11 @@ void bdrv_drain_all(void)
     BlockDriverState *bs;
     bool busy;
 
+    /* Requests that a plugged device has queued could never complete */
+    QTAILQ_FOREACH(bs, &bdrv_states, list) {
+        bdrv_merge_queue_submit(bs);
+    }
+
     do {
         busy = qemu_aio_wait();
 
@@ -970,98 +983,137 @@ static void bdrv_rebind(BlockDriverState *bs)
     }
 }
 
+static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
+                                     BlockDriverState *bs_src)
+{
+    /* move some fields that need to stay attached to the device */
+    bs_dest->open_flags         = bs_src->open_flags;
+
+    /* dev info */
+    bs_dest->dev_ops            = bs_src->dev_ops;
+    bs_dest->dev_opaque         = bs_src->dev_opaque;
+    bs_dest->dev                = bs_src->dev;
+    bs_dest->buffer_alignment   = bs_src->buffer_alignment;
+    bs_dest->copy_on_read       = bs_src->copy_on_read;
+    bs_dest->enable_write_cache = bs_src->enable_write_cache;
+
+    /* i/o timing parameters */
+    bs_dest->slice_time         = bs_src->slice_time;
+    bs_dest->slice_start        = bs_src->slice_start;
+    bs_dest->slice_end          = bs_src->slice_end;
+    bs_dest->io_limits          = bs_src->io_limits;
+    bs_dest->io_base            = bs_src->io_base;
+    bs_dest->throttled_reqs     = bs_src->throttled_reqs;
+    bs_dest->block_timer        = bs_src->block_timer;
+    bs_dest->io_limits_enabled  = bs_src->io_limits_enabled;
+
+    /* geometry */
+    bs_dest->cyls               = bs_src->cyls;
+    bs_dest->heads              = bs_src->heads;
+    bs_dest->secs               = bs_src->secs;
+    bs_dest->translation        = bs_src->translation;
+
+    /* r/w error */
+    bs_dest->on_read_error      = bs_src->on_read_error;
+    bs_dest->on_write_error     = bs_src->on_write_error;
+
+    /* i/o status */
+    bs_dest->iostatus_enabled   = bs_src->iostatus_enabled;
+    bs_dest->iostatus           = bs_src->iostatus;
+
+    /* request merging */
+    bs_dest->io_plugged         = bs_src->io_plugged;
+    bs_dest->merge_queue        = bs_src->merge_queue;
+    bs_dest->merge_queue_len    = bs_src->merge_queue_len;
+
+    /* dirty bitmap */
+    bs_dest->dirty_count        = bs_src->dirty_count;
+    bs_dest->dirty_bitmap       = bs_src->dirty_bitmap;
+
+    /* job */
+    bs_dest->in_use             = bs_src->in_use;
+    bs_dest->job                = bs_src->job;
+
+    /* keep the same entry in bdrv_states */
+    pstrcpy(bs_dest->device_name, sizeof(bs_dest->device_name),
+            bs_src->device_name);
+    bs_dest->list = bs_src->list;
+}
+
 /*
- * Add new bs contents at the top of an image chain while the chain is
- * live, while keeping required fields on the top layer.
+ * Swap bs contents for two image chains while they are live,
+ * while keeping required fields on the BlockDriverState that is
+ * actually attached to a device.
  *
  * This will modify the BlockDriverState fields, and swap contents
- * between bs_new and bs_top. Both bs_new and bs_top are modified.
+ * between bs_new and bs_old. Both bs_new and bs_old are modified.
  *
  * bs_new is required to be anonymous.
  *
  * This function does not create any image files.
  */
-void bdrv_append(BlockDriverState *bs_new, BlockDriverState *bs_top)
+void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
 {
     BlockDriverState tmp;
 
-    /* bs_new must be anonymous */
+    /* bs_new must be anonymous and shouldn't have anything fancy enabled */
     assert(bs_new->device_name[0] == '\0');
+    assert(bs_new->dirty_bitmap == NULL);
+    assert(bs_new->job == NULL);
+    assert(bs_new->dev == NULL);
+    assert(bs_new->in_use == 0);
+    assert(bs_new->io_limits_enabled == false);
+    assert(bs_new->block_timer == NULL);
 
     tmp = *bs_new;
+    *bs_new = *bs_old;
+    *bs_old = tmp;
 
-    /* there are some fields that need to stay on the top layer: */
-    tmp.open_flags        = bs_top->open_flags;
-
-    /* dev info */
-    tmp.dev_ops           = bs_top->dev_ops;
-    tmp.dev_opaque        = bs_top->dev_opaque;
-    tmp.dev               = bs_top->dev;
-    tmp.buffer_alignment  = bs_top->buffer_alignment;
-    tmp.copy_on_read      = bs_top->copy_on_read;
-
-    /* i/o timing parameters */
-    tmp.slice_time        = bs_top->slice_time;
-    tmp.slice_start       = bs_top->slice_start;
-    tmp.slice_end         = bs_top->slice_end;
-    tmp.io_limits         = bs_top->io_limits;
-    tmp.io_base           = bs_top->io_base;
-    tmp.throttled_reqs    = bs_top->throttled_reqs;
-    tmp.block_timer       = bs_top->block_timer;
-    tmp.io_limits_enabled = bs_top->io_limits_enabled;
+    /* there are some fields that should not be swapped, move them back */
+    bdrv_move_feature_fields(&tmp, bs_old);
+    bdrv_move_feature_fields(bs_old, bs_new);
+    bdrv_move_feature_fields(bs_new, &tmp);
 
-    /* geometry */
-    tmp.cyls              = bs_top->cyls;
-    tmp.heads             = bs_top->heads;
-    tmp.secs              = bs_top->secs;
-    tmp.translation       = bs_top->translation;
+    /* bs_new shouldn't be in bdrv_states even after the swap!  */
+    assert(bs_new->device_name[0] == '\0');
 
-    /* r/w error */
-    tmp.on_read_error     = bs_top->on_read_error;
-    tmp.on_write_error    = bs_top->on_write_error;
+    /* Check a few fields that should remain attached to the device */
+    assert(bs_new->dev == NULL);
+    assert(bs_new->job == NULL);
+    assert(bs_new->in_use == 0);
+    assert(bs_new->io_limits_enabled == false);
+    assert(bs_new->block_timer == NULL);
 
-    /* i/o status */
-    tmp.iostatus_enabled  = bs_top->iostatus_enabled;
-    tmp.iostatus          = bs_top->iostatus;
+    bdrv_rebind(bs_new);
+    bdrv_rebind(bs_old);
+}
 
-    /* keep the same entry in bdrv_states */
-    pstrcpy(tmp.device_name, sizeof(tmp.device_name), bs_top->device_name);
-    tmp.list = bs_top->list;
+/*
+ * Add new bs contents at the top of an image chain while the chain is
+ * live, while keeping required fields on the top layer.
+ *
+ * This will modify the BlockDriverState fields, and swap contents
+ * between bs_new and bs_top. Both bs_new and bs_top are modified.
+ *
+ * bs_new is required to be anonymous.
+ *
+ * This function does not create any image files.
+ */
+void bdrv_append(BlockDriverState *bs_new, BlockDriverState *bs_top)
+{
+    bdrv_swap(bs_new, bs_top);
 
     /* The contents of 'tmp' will become bs_top, as we are
      * swapping bs_new and bs_top contents. */
-    tmp.backing_hd = bs_new;
-    pstrcpy(tmp.backing_file, sizeof(tmp.backing_file), bs_top->filename);
-    bdrv_get_format(bs_top, tmp.backing_format, sizeof(tmp.backing_format));
-
-    /* swap contents of the fixed new bs and the current top */
-    *bs_new = *bs_top;
-    *bs_top = tmp;
-
-    /* device_name[] was carried over from the old bs_top.  bs_new
-     * shouldn't be in bdrv_states, so we need to make device_name[]
-     * reflect the anonymity of bs_new
-     */
-    bs_new->device_name[0] = '\0';
-
-    /* clear the copied fields in the new backing file */
-    bdrv_detach_dev(bs_new, bs_new->dev);
-
-    qemu_co_queue_init(&bs_new->throttled_reqs);
-    memset(&bs_new->io_base,   0, sizeof(bs_new->io_base));
-    memset(&bs_new->io_limits, 0, sizeof(bs_new->io_limits));
-    bdrv_iostatus_disable(bs_new);
+    bs_top->backing_hd = bs_new;
+    bs_top->open_flags &= ~BDRV_O_NO_BACKING;
+    pstrcpy(bs_top->backing_file, sizeof(bs_top->backing_file),
+            bs_new->filename);
+    pstrcpy(bs_top->backing_format, sizeof(bs_top->backing_format),
+            bs_new->drv ? bs_new->drv->format_name : "");
 
-    /* we don't use bdrv_io_limits_disable() for this, because we don't want
-     * to affect or delete the block_timer, as it has been moved to bs_top */
-    bs_new->io_limits_enabled = false;
-    bs_new->block_timer       = NULL;
-    bs_new->slice_time        = 0;
-    bs_new->slice_start       = 0;
-    bs_new->slice_end         = 0;
-
-    bdrv_rebind(bs_new);
-    bdrv_rebind(bs_top);
+    /* the chain below bs_top is a different one now */
+    bdrv_chain_cache_invalidate(bs_top, 0, -1);
 }
 
 void bdrv_delete(BlockDriverState *bs)
@@ -1324,6 +1376,9 @@ int bdrv_commit(BlockDriverState *bs)
 ro_cleanup:
     g_free(buf);
 
+    /* the committed data is read from the backing file now */
+    bdrv_chain_cache_invalidate(bs, 0, -1);
+
     if (ro) {
         /* re-open as RO */
         bdrv_delete(bs->backing_hd);
@@ -1497,6 +1552,7 @@ int bdrv_change_backing_file(BlockDriverState *bs,
     if (ret == 0) {
         pstrcpy(bs->backing_file, sizeof(bs->backing_file), backing_file ?: "");
         pstrcpy(bs->backing_format, sizeof(bs->backing_format), backing_fmt ?: "");
+        bdrv_chain_cache_invalidate(bs, 0, -1);
     }
     return ret;
 }
@@ -1832,6 +1888,245 @@ err:
 /*
  * Handle a read request in coroutine context
  */
+/*
+ * Reading a range that an image doesn't have allocated goes down the backing
+ * chain one layer at a time, and every layer looks the range up in its
+ * metadata.  With deep chains, this makes reads slower with each snapshot.
+ *
+ * Images with a backing file therefore remember which layer owns the data of
+ * recently read ranges in a direct mapped cache of 64k chunks, and send
+ * reads of unallocated ranges directly to that layer.  Writes and discards
+ * drop the entries for their range, changes of the backing chain drop all
+ * of them.
+ */
+
+#define BDRV_CHAIN_CACHE_SIZE           4096
+#define BDRV_CHAIN_CACHE_CHUNK_BITS     7
+#define BDRV_CHAIN_CACHE_CHUNK_SECTORS  (1 << BDRV_CHAIN_CACHE_CHUNK_BITS)
+
+static BdrvChainCacheEntry *bdrv_chain_cache_slot(BlockDriverState *bs,
+                                                  int64_t sector_num)
+{
+    int64_t chunk = sector_num >> BDRV_CHAIN_CACHE_CHUNK_BITS;
+
+    return &bs->chain_cache[chunk % BDRV_CHAIN_CACHE_SIZE];
+}
+
+/* Drops the entries for a range, or all entries if nb_sectors is negative */
+static void bdrv_chain_cache_invalidate(BlockDriverState *bs,
+                                        int64_t sector_num,
+                                        int64_t nb_sectors)
+{
+    int64_t end = sector_num + nb_sectors;
+    int64_t chunk;
+
+    /* Lookups that are in progress must not add stale entries */
+    bs->chain_cache_gen++;
+
+    if (!bs->chain_cache) {
+        return;
+    }
+
+    if (nb_sectors < 0 || nb_sectors >= (int64_t)BDRV_CHAIN_CACHE_SIZE *
+                                        BDRV_CHAIN_CACHE_CHUNK_SECTORS) {
+        memset(bs->chain_cache, 0,
+               BDRV_CHAIN_CACHE_SIZE * sizeof(BdrvChainCacheEntry));
+        return;
+    }
+
+    /* Entries never cross a chunk boundary */
+    for (chunk = sector_num >> BDRV_CHAIN_CACHE_CHUNK_BITS;
+         chunk << BDRV_CHAIN_CACHE_CHUNK_BITS < end; chunk++) {
+        BdrvChainCacheEntry *e =
+            bdrv_chain_cache_slot(bs, chunk << BDRV_CHAIN_CACHE_CHUNK_BITS);
+        if (e->start < end && sector_num < e->end) {
+            e->end = 0;
+        }
+    }
+}
+
+static void bdrv_chain_cache_insert(BlockDriverState *bs, int64_t sector_num,
+                                    int nb_sectors, int depth)
+{
+    int64_t end = sector_num + nb_sectors;
+    int64_t chunk_end;
+
+    while (sector_num < end) {
+        BdrvChainCacheEntry *e = bdrv_chain_cache_slot(bs, sector_num);
+
+        chunk_end = ((sector_num >> BDRV_CHAIN_CACHE_CHUNK_BITS) + 1)
+                    << BDRV_CHAIN_CACHE_CHUNK_BITS;
+        e->start = sector_num;
+        e->end = MIN(end, chunk_end);
+        e->depth = depth;
+        sector_num = e->end;
+    }
+}
+
+/*
+ * Looks up the layer of the backing chain that owns the data at sector_num.
+ * *pdepth is 0 for bs itself, 1 for its backing file and so on, or -1 if no
+ * layer has the data, so that it reads as zeroes.  *pnum is set to the number
+ * of sectors that are owned by the same layer.
+ */
+static int coroutine_fn bdrv_co_chain_lookup(BlockDriverState *bs,
+                                             int64_t sector_num,
+                                             int nb_sectors,
+                                             int *pdepth, int *pnum)
+{
+    BdrvChainCacheEntry *e;
+    BlockDriverState *layer;
+    uint64_t gen;
+    int depth, n, ret;
+
+    if (bs->chain_cache_backing != bs->backing_hd) {
+        bdrv_chain_cache_invalidate(bs, 0, -1);
+        bs->chain_cache_backing = bs->backing_hd;
+    }
+    if (!bs->chain_cache) {
+        bs->chain_cache = g_new0(BdrvChainCacheEntry, BDRV_CHAIN_CACHE_SIZE);
+    }
+
+    /* Use the cached entries as long as they belong to the same layer */
+    n = 0;
+    depth = 0;
+    while (n < nb_sectors) {
+        e = bdrv_chain_cache_slot(bs, sector_num + n);
+        if (sector_num + n < e->start || sector_num + n >= e->end ||
+            (n > 0 && e->depth != depth)) {
+            break;
+        }
+        depth = e->depth;
+        n = MIN(e->end - sector_num, nb_sectors);
+    }
+    if (n > 0) {
+        *pdepth = depth;
+        *pnum = n;
+        return 0;
+    }
+
+    /* Ask each layer in turn */
+    gen = bs->chain_cache_gen;
+    n = nb_sectors;
+    for (layer = bs; layer; layer = layer->backing_hd, depth++) {
+        if (sector_num >= layer->total_sectors) {
+            /* Backing files that are shorter than the image read as zeroes */
+            layer = NULL;
+            break;
+        }
+        ret = bdrv_co_is_allocated(layer, sector_num, n, &n);
+        if (ret < 0) {
+            return ret;
+        } else if (ret) {
+            break;
+        }
+    }
+    if (!layer) {
+        depth = -1;
+    }
+
+    if (gen == bs->chain_cache_gen) {
+        bdrv_chain_cache_insert(bs, sector_num, n, depth);
+    }
+
+    *pdepth = depth;
+    *pnum = n;
+    return 0;
+}
+
+/*
+ * Looks up which layer of the backing chain of bs owns the data at
+ * sector_num.  *powner is set to that layer, or to NULL if no layer has the
+ * data so that it reads as zeroes.  *pnum is set to the number of sectors
+ * (including and immediately following sector_num) owned by the same layer.
+ */
+int coroutine_fn bdrv_co_get_owner(BlockDriverState *bs, int64_t sector_num,
+                                   int nb_sectors, BlockDriverState **powner,
+                                   int *pnum)
+{
+    BlockDriverState *owner;
+    int depth, ret;
+
+    if (!bs->drv) {
+        return -ENOMEDIUM;
+    }
+    if (sector_num >= bs->total_sectors) {
+        *powner = NULL;
+        *pnum = 0;
+        return 0;
+    }
+    nb_sectors = MIN(nb_sectors, bs->total_sectors - sector_num);
+
+    ret = bdrv_co_chain_lookup(bs, sector_num, nb_sectors, &depth, pnum);
+    if (ret < 0) {
+        return ret;
+    }
+
+    owner = NULL;
+    if (depth >= 0) {
+        for (owner = bs; depth > 0; depth--) {
+            owner = owner->backing_hd;
+        }
+    }
+    *powner = owner;
+    return 0;
+}
+
+/* Reads each part of the request from the layer of the chain that owns it */
+static int coroutine_fn bdrv_co_read_chain(BlockDriverState *bs,
+                                           int64_t sector_num, int nb_sectors,
+                                           QEMUIOVector *qiov)
+{
+    BlockDriverState *layer;
+    QEMUIOVector hd_qiov;
+    uint64_t bytes_done = 0;
+    int depth, n, i;
+    int ret;
+
+    ret = bdrv_co_chain_lookup(bs, sector_num, nb_sectors, &depth, &n);
+    if (ret < 0) {
+        return ret;
+    }
+    if (depth == 0 && n == nb_sectors) {
+        return bs->drv->bdrv_co_readv(bs, sector_num, nb_sectors, qiov);
+    }
+
+    qemu_iovec_init(&hd_qiov, qiov->niov);
+    for (;;) {
+        qemu_iovec_reset(&hd_qiov);
+        qemu_iovec_copy(&hd_qiov, qiov, bytes_done, n * BDRV_SECTOR_SIZE);
+
+        if (depth < 0) {
+            qemu_iovec_memset(&hd_qiov, 0, n * BDRV_SECTOR_SIZE);
+        } else if (depth == 0) {
+            ret = bs->drv->bdrv_co_readv(bs, sector_num, n, &hd_qiov);
+        } else {
+            for (layer = bs, i = 0; i < depth; i++) {
+                layer = layer->backing_hd;
+            }
+            ret = bdrv_co_readv(layer, sector_num, n, &hd_qiov);
+        }
+        if (ret < 0) {
+            break;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        bytes_done += n * BDRV_SECTOR_SIZE;
+        if (nb_sectors == 0) {
+            break;
+        }
+
+        ret = bdrv_co_chain_lookup(bs, sector_num, nb_sectors, &depth, &n);
+        if (ret < 0) {
+            break;
+        }
+    }
+
+    qemu_iovec_destroy(&hd_qiov);
+    return ret;
+}
+
 static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
     int64_t sector_num, int nb_sectors, QEMUIOVector *qiov,
     BdrvRequestFlags flags)
@@ -1879,7 +2174,11 @@ static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
         }
     }
 
-    ret = drv->bdrv_co_readv(bs, sector_num, nb_sectors, qiov);
+    if (bs->backing_hd && drv->bdrv_co_is_allocated) {
+        ret = bdrv_co_read_chain(bs, sector_num, nb_sectors, qiov);
+    } else {
+        ret = drv->bdrv_co_readv(bs, sector_num, nb_sectors, qiov);
+    }
 
 out:
     tracked_request_end(&req);
@@ -1971,12 +2270,18 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
 
     tracked_request_begin(&req, bs, sector_num, nb_sectors, true);
 
+    /* Invalidate before and after the write, so that neither reads that
+     * run in parallel nor later ones bypass the newly written data */
+    bdrv_chain_cache_invalidate(bs, sector_num, nb_sectors);
+
     if (flags & BDRV_REQ_ZERO_WRITE) {
         ret = bdrv_co_do_write_zeroes(bs, sector_num, nb_sectors);
     } else {
         ret = drv->bdrv_co_writev(bs, sector_num, nb_sectors, qiov);
     }
 
+    bdrv_chain_cache_invalidate(bs, sector_num, nb_sectors);
+
     if (bs->dirty_bitmap) {
         set_dirty_bitmap(bs, sector_num, nb_sectors, 1);
     }
@@ -2025,6 +2330,7 @@ int bdrv_truncate(BlockDriverState *bs, int64_t offset)
     ret = drv->bdrv_truncate(bs, offset);
     if (ret == 0) {
         ret = refresh_total_sectors(bs, offset >> BDRV_SECTOR_BITS);
+        bdrv_chain_cache_invalidate(bs, 0, -1);
         bdrv_dev_resize_cb(bs);
     }
     return ret;
@@ -2232,6 +2538,14 @@ void bdrv_set_io_limits(BlockDriverState *bs,
     bs->io_limits_enabled = bdrv_io_limits_enabled(bs);
 }
 
+/* Takes effect when the image is opened the next time */
+void bdrv_set_cache_size(BlockDriverState *bs, uint64_t l2_cache_size,
+                         uint64_t refcount_cache_size)
+{
+    bs->l2_cache_size = l2_cache_size;
+    bs->refcount_cache_size = refcount_cache_size;
+}
+
 /* Recognize floppy formats */
 typedef struct FDFormat {
     FDriveType drive;
@@ -2569,6 +2883,104 @@ int bdrv_is_allocated(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
     return data.ret;
 }
 
+typedef struct BdrvCoGetBlockStatusData {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    int nb_sectors;
+    int *pnum;
+    int64_t ret;
+    bool done;
+} BdrvCoGetBlockStatusData;
+
+/*
+ * Returns the BDRV_BLOCK_* flags of the specified sector, or a negative errno
+ * value on failure.  Drivers that don't know better report everything as
+ * data.  Sectors that are neither allocated in the image nor in its backing
+ * file are reported as zero.
+ *
+ * 'pnum' and 'nb_sectors' work as for bdrv_co_is_allocated().
+ */
+int64_t coroutine_fn bdrv_co_get_block_status(BlockDriverState *bs,
+                                              int64_t sector_num,
+                                              int nb_sectors, int *pnum)
+{
+    int64_t n, ret;
+
+    if (sector_num >= bs->total_sectors) {
+        *pnum = 0;
+        return 0;
+    }
+
+    n = bs->total_sectors - sector_num;
+    if (n < nb_sectors) {
+        nb_sectors = n;
+    }
+
+    if (bs->drv->bdrv_co_get_block_status) {
+        ret = bs->drv->bdrv_co_get_block_status(bs, sector_num, nb_sectors,
+                                                pnum);
+    } else if (bs->drv->bdrv_co_is_allocated) {
+        ret = bs->drv->bdrv_co_is_allocated(bs, sector_num, nb_sectors, pnum);
+        if (ret > 0) {
+            ret = BDRV_BLOCK_DATA;
+        }
+    } else {
+        *pnum = nb_sectors;
+        ret = BDRV_BLOCK_DATA;
+    }
+
+    if (ret < 0 || (ret & (BDRV_BLOCK_DATA | BDRV_BLOCK_ZERO))) {
+        return ret;
+    }
+
+    if (!bs->backing_hd ||
+        sector_num >= bdrv_getlength(bs->backing_hd) >> BDRV_SECTOR_BITS) {
+        ret |= BDRV_BLOCK_ZERO;
+    }
+
+    return ret;
+}
+
+/* Coroutine wrapper for bdrv_get_block_status() */
+static void coroutine_fn bdrv_get_block_status_co_entry(void *opaque)
+{
+    BdrvCoGetBlockStatusData *data = opaque;
+
+    data->ret = bdrv_co_get_block_status(data->bs, data->sector_num,
+                                         data->nb_sectors, data->pnum);
+    data->done = true;
+}
+
+/*
+ * Synchronous wrapper around bdrv_co_get_block_status().
+ *
+ * See bdrv_co_get_block_status() for details.
+ */
+int64_t bdrv_get_block_status(BlockDriverState *bs, int64_t sector_num,
+                              int nb_sectors, int *pnum)
+{
+    Coroutine *co;
+    BdrvCoGetBlockStatusData data = {
+        .bs = bs,
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+        .pnum = pnum,
+        .done = false,
+    };
+
+    if (qemu_in_coroutine()) {
+        /* Fast-path if already in coroutine context */
+        bdrv_get_block_status_co_entry(&data);
+    } else {
+        co = qemu_coroutine_create(bdrv_get_block_status_co_entry);
+        qemu_coroutine_enter(co, &data);
+        while (!data.done) {
+            qemu_aio_wait();
+        }
+    }
+    return data.ret;
+}
+
 BlockInfoList *qmp_query_block(Error **errp)
 {
     BlockInfoList *head = NULL, *cur_item = NULL;
@@ -2634,7 +3046,7 @@ BlockInfoList *qmp_query_block(Error **errp)
 }
 
 /* Consider exposing this as a full fledged QMP command */
-static BlockStats *qmp_query_blockstat(const BlockDriverState *bs, Error **errp)
+static BlockStats *qmp_query_blockstat(BlockDriverState *bs, Error **errp)
 {
     BlockStats *s;
 
@@ -2655,6 +3067,12 @@ static BlockStats *qmp_query_blockstat(const BlockDriverState *bs, Error **errp)
     s->stats->wr_total_time_ns = bs->total_time_ns[BDRV_ACCT_WRITE];
     s->stats->rd_total_time_ns = bs->total_time_ns[BDRV_ACCT_READ];
     s->stats->flush_total_time_ns = bs->total_time_ns[BDRV_ACCT_FLUSH];
+    s->stats->rd_merged = bs->nr_merged[BDRV_ACCT_READ];
+    s->stats->wr_merged = bs->nr_merged[BDRV_ACCT_WRITE];
+
+    if (bs->drv && bs->drv->bdrv_get_stats) {
+        bs->drv->bdrv_get_stats(bs, s->stats);
+    }
 
     if (bs->file) {
         s->has_parent = true;
@@ -2701,13 +3119,13 @@ void bdrv_get_backing_filename(BlockDriverState *bs,
     pstrcpy(filename, filename_size, bs->backing_file);
 }
 
-int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                          const uint8_t *buf, int nb_sectors)
+int coroutine_fn bdrv_co_write_compressed(BlockDriverState *bs,
+    int64_t sector_num, const uint8_t *buf, int nb_sectors)
 {
     BlockDriver *drv = bs->drv;
     if (!drv)
         return -ENOMEDIUM;
-    if (!drv->bdrv_write_compressed)
+    if (!drv->bdrv_co_write_compressed)
         return -ENOTSUP;
     if (bdrv_check_request(bs, sector_num, nb_sectors))
         return -EIO;
@@ -2715,8 +3133,50 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
     if (bs->dirty_bitmap) {
         set_dirty_bitmap(bs, sector_num, nb_sectors, 1);
     }
+    bdrv_chain_cache_invalidate(bs, sector_num, nb_sectors);
+
+    return drv->bdrv_co_write_compressed(bs, sector_num, buf, nb_sectors);
+}
+
+typedef struct WriteCompressedCo {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    const uint8_t *buf;
+    int nb_sectors;
+    int ret;
+} WriteCompressedCo;
+
+static void coroutine_fn bdrv_write_compressed_co_entry(void *opaque)
+{
+    WriteCompressedCo *wco = opaque;
+
+    wco->ret = bdrv_co_write_compressed(wco->bs, wco->sector_num, wco->buf,
+                                        wco->nb_sectors);
+}
+
+int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
+                          const uint8_t *buf, int nb_sectors)
+{
+    Coroutine *co;
+    WriteCompressedCo wco = {
+        .bs = bs,
+        .sector_num = sector_num,
+        .buf = buf,
+        .nb_sectors = nb_sectors,
+        .ret = NOT_DONE,
+    };
 
-    return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
+    if (qemu_in_coroutine()) {
+        /* Fast-path if already in coroutine context */
+        bdrv_write_compressed_co_entry(&wco);
+    } else {
+        co = qemu_coroutine_create(bdrv_write_compressed_co_entry);
+        qemu_coroutine_enter(co, &wco);
+        while (wco.ret == NOT_DONE) {
+            qemu_aio_wait();
+        }
+    }
+    return wco.ret;
 }
 
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
@@ -2832,6 +3292,8 @@ int bdrv_snapshot_goto(BlockDriverState *bs,
 
     if (!drv)
         return -ENOMEDIUM;
+
+    bdrv_chain_cache_invalidate(bs, 0, -1);
     if (drv->bdrv_snapshot_goto)
         return drv->bdrv_snapshot_goto(bs, snapshot_id);
 
@@ -2985,12 +3447,205 @@ char *bdrv_snapshot_dump(char *buf, int buf_size, QEMUSnapshotInfo *sn)
 /**************************************************************/
 /* async I/Os */
 
+/*
+ * Read and write requests that a device model issues between bdrv_io_plug()
+ * and bdrv_io_unplug() are queued.  When the device is unplugged, they are
+ * sorted, and runs of requests that are adjacent on the disk are submitted
+ * as a single request.
+ */
+
+/* Merged requests are kept at the size Linux uses for its own merging, so
+ * that a long sequential stream still keeps several requests in flight */
+#define BDRV_MERGE_MAX_SECTORS 1024
+
+struct BdrvMergeAIOCB {
+    BlockDriverAIOCB common;
+    int64_t sector_num;
+    int nb_sectors;
+    QEMUIOVector *qiov;
+    bool is_write;
+    bool cancelled;
+    int seq;                    /* position in the queue */
+    QSLIST_ENTRY(BdrvMergeAIOCB) queue;
+};
+
+typedef struct BdrvMergedRequest {
+    QEMUIOVector qiov;          /* only used if num_reqs > 1 */
+    int num_reqs;
+    BdrvMergeAIOCB *reqs[];
+} BdrvMergedRequest;
+
+static void bdrv_merge_aio_cancel(BlockDriverAIOCB *blockacb)
+{
+    BdrvMergeAIOCB *acb = container_of(blockacb, BdrvMergeAIOCB, common);
+
+    if (acb->seq >= 0) {
+        /* Still queued, it is dropped on submission */
+        acb->cancelled = true;
+        return;
+    }
+
+    /* Same as for the coroutine request that it was turned into */
+    qemu_aio_flush();
+}
+
+static AIOPool bdrv_merge_aio_pool = {
+    .aiocb_size         = sizeof(BdrvMergeAIOCB),
+    .cancel             = bdrv_merge_aio_cancel,
+};
+
+static BlockDriverAIOCB *bdrv_merge_queue_add(BlockDriverState *bs,
+                                              int64_t sector_num,
+                                              QEMUIOVector *qiov,
+                                              int nb_sectors,
+                                              BlockDriverCompletionFunc *cb,
+                                              void *opaque,
+                                              bool is_write)
+{
+    BdrvMergeAIOCB *acb;
+
+    acb = qemu_aio_get(&bdrv_merge_aio_pool, bs, cb, opaque);
+    acb->sector_num = sector_num;
+    acb->nb_sectors = nb_sectors;
+    acb->qiov = qiov;
+    acb->is_write = is_write;
+    acb->cancelled = false;
+    acb->seq = bs->merge_queue_len++;
+    QSLIST_INSERT_HEAD(&bs->merge_queue, acb, queue);
+
+    return &acb->common;
+}
+
+static void bdrv_merged_request_cb(void *opaque, int ret)
+{
+    BdrvMergedRequest *mr = opaque;
+    int i;
+
+    for (i = 0; i < mr->num_reqs; i++) {
+        BdrvMergeAIOCB *acb = mr->reqs[i];
+
+        acb->common.cb(acb->common.opaque, ret);
+        qemu_aio_release(acb);
+    }
+
+    if (mr->num_reqs > 1) {
+        qemu_iovec_destroy(&mr->qiov);
+    }
+    g_free(mr);
+}
+
+/* Reads come first, then requests are sorted by sector.  Requests for the
+ * same sector keep their order, so that overlapping writes stay in order. */
+static int bdrv_merge_req_compare(const void *a, const void *b)
+{
+    const BdrvMergeAIOCB *req1 = *(BdrvMergeAIOCB * const *)a;
+    const BdrvMergeAIOCB *req2 = *(BdrvMergeAIOCB * const *)b;
+
+    if (req1->is_write != req2->is_write) {
+        return req1->is_write ? 1 : -1;
+    }
+    if (req1->sector_num != req2->sector_num) {
+        return req1->sector_num > req2->sector_num ? 1 : -1;
+    }
+    return req1->seq - req2->seq;
+}
+
+static void bdrv_merge_submit(BlockDriverState *bs, BdrvMergeAIOCB **reqs,
+                              int num_reqs, int niov, int nb_sectors)
+{
+    BdrvMergedRequest *mr;
+    QEMUIOVector *qiov;
+    int i;
+
+    mr = g_malloc(sizeof(*mr) + num_reqs * sizeof(mr->reqs[0]));
+    mr->num_reqs = num_reqs;
+    memcpy(mr->reqs, reqs, num_reqs * sizeof(mr->reqs[0]));
+
+    if (num_reqs == 1) {
+        qiov = reqs[0]->qiov;
+    } else {
+        qiov = &mr->qiov;
+        qemu_iovec_init(qiov, niov);
+        for (i = 0; i < num_reqs; i++) {
+            qemu_iovec_concat(qiov, reqs[i]->qiov, reqs[i]->qiov->size);
+        }
+        bs->nr_merged[reqs[0]->is_write ? BDRV_ACCT_WRITE : BDRV_ACCT_READ] +=
+            num_reqs - 1;
+    }
+
+    bdrv_co_aio_rw_vector(bs, reqs[0]->sector_num, qiov, nb_sectors,
+                          bdrv_merged_request_cb, mr, reqs[0]->is_write);
+}
+
+static void bdrv_merge_queue_submit(BlockDriverState *bs)
+{
+    BdrvMergeAIOCB **reqs, *acb;
+    int num_reqs, num_submitted, i, j;
+
+    if (QSLIST_EMPTY(&bs->merge_queue)) {
+        return;
+    }
+
+    reqs = g_malloc(bs->merge_queue_len * sizeof(reqs[0]));
+    num_reqs = 0;
+    while ((acb = QSLIST_FIRST(&bs->merge_queue)) != NULL) {
+        QSLIST_REMOVE_HEAD(&bs->merge_queue, queue);
+        if (acb->cancelled) {
+            qemu_aio_release(acb);
+            continue;
+        }
+        reqs[num_reqs++] = acb;
+    }
+    bs->merge_queue_len = 0;
+
+    qsort(reqs, num_reqs, sizeof(reqs[0]), bdrv_merge_req_compare);
+
+    /* From here on, a cancel has to wait for the request */
+    for (i = 0; i < num_reqs; i++) {
+        reqs[i]->seq = -1;
+    }
+
+    num_submitted = 0;
+    for (i = 0; i < num_reqs; i = j) {
+        int niov = reqs[i]->qiov->niov;
+        int nb_sectors = reqs[i]->nb_sectors;
+
+        for (j = i + 1; j < num_reqs; j++) {
+            if (reqs[j]->is_write != reqs[i]->is_write ||
+                reqs[j]->sector_num != reqs[i]->sector_num + nb_sectors ||
+                nb_sectors + reqs[j]->nb_sectors > BDRV_MERGE_MAX_SECTORS ||
+                niov + reqs[j]->qiov->niov > IOV_MAX) {
+                break;
+            }
+            niov += reqs[j]->qiov->niov;
+            nb_sectors += reqs[j]->nb_sectors;
+        }
+
+        bdrv_merge_submit(bs, &reqs[i], j - i, niov, nb_sectors);
+        num_submitted++;
+    }
+
+    trace_bdrv_merge_queue_submit(bs, num_reqs, num_reqs - num_submitted);
+    g_free(reqs);
+}
+
+static bool bdrv_merge_queue_enabled(BlockDriverState *bs)
+{
+    /* Only requests coming from the guest are worth the trouble */
+    return bs->io_plugged > 0 && bs->dev;
+}
+
 BlockDriverAIOCB *bdrv_aio_readv(BlockDriverState *bs, int64_t sector_num,
                                  QEMUIOVector *qiov, int nb_sectors,
                                  BlockDriverCompletionFunc *cb, void *opaque)
 {
     trace_bdrv_aio_readv(bs, sector_num, nb_sectors, opaque);
 
+    if (bdrv_merge_queue_enabled(bs)) {
+        return bdrv_merge_queue_add(bs, sector_num, qiov, nb_sectors,
+                                    cb, opaque, false);
+    }
+
     return bdrv_co_aio_rw_vector(bs, sector_num, qiov, nb_sectors,
                                  cb, opaque, false);
 }
@@ -3001,6 +3656,11 @@ BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
 {
     trace_bdrv_aio_writev(bs, sector_num, nb_sectors, opaque);
 
+    if (bdrv_merge_queue_enabled(bs)) {
+        return bdrv_merge_queue_add(bs, sector_num, qiov, nb_sectors,
+                                    cb, opaque, true);
+    }
+
     return bdrv_co_aio_rw_vector(bs, sector_num, qiov, nb_sectors,
                                  cb, opaque, true);
 }
@@ -3167,6 +3827,7 @@ int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
 
     // Check for mergable requests
     num_reqs = multiwrite_merge(bs, reqs, num_reqs, mcb);
+    bs->nr_merged[BDRV_ACCT_WRITE] += mcb->num_callbacks - num_reqs;
 
     trace_bdrv_aio_multiwrite(mcb, mcb->num_callbacks, num_reqs);
 
@@ -3185,6 +3846,41 @@ void bdrv_aio_cancel(BlockDriverAIOCB *acb)
     acb->pool->cancel(acb);
 }
 
+/*
+ * Requests submitted between bdrv_io_plug() and bdrv_io_unplug() may be
+ * queued and passed to the host together when the device is unplugged.
+ * Calls nest; format drivers pass them on to their protocol.
+ */
+void bdrv_io_plug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    bs->io_plugged++;
+
+    if (drv && drv->bdrv_io_plug) {
+        drv->bdrv_io_plug(bs);
+    } else if (bs->file) {
+        bdrv_io_plug(bs->file);
+    }
+}
+
+void bdrv_io_unplug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    assert(bs->io_plugged > 0);
+    if (--bs->io_plugged == 0) {
+        /* Before the protocol is unplugged, so that it batches them too */
+        bdrv_merge_queue_submit(bs);
+    }
+
+    if (drv && drv->bdrv_io_unplug) {
+        drv->bdrv_io_unplug(bs);
+    } else if (bs->file) {
+        bdrv_io_unplug(bs->file);
+    }
+}
+
 /* block I/O throttling */
 static bool bdrv_exceed_bps_limits(BlockDriverState *bs, int nb_sectors,
                  bool is_write, double elapsed_time, uint64_t *wait)
@@ -3519,6 +4215,9 @@ BlockDriverAIOCB *bdrv_aio_flush(BlockDriverState *bs,
     Coroutine *co;
     BlockDriverAIOCBCoroutine *acb;
 
+    /* Queued writes are issued before the flush */
+    bdrv_merge_queue_submit(bs);
+
     acb = qemu_aio_get(&bdrv_em_co_aio_pool, bs, cb, opaque);
     co = qemu_coroutine_create(bdrv_aio_flush_co_entry);
     qemu_coroutine_enter(co, acb);
@@ -3545,6 +4244,8 @@ BlockDriverAIOCB *bdrv_aio_discard(BlockDriverState *bs,
 
     trace_bdrv_aio_discard(bs, sector_num, nb_sectors, opaque);
 
+    bdrv_merge_queue_submit(bs);
+
     acb = qemu_aio_get(&bdrv_em_co_aio_pool, bs, cb, opaque);
     acb->req.sector = sector_num;
     acb->req.nb_sectors = nb_sectors;
@@ -3768,8 +4469,8 @@ static void coroutine_fn bdrv_discard_co_entry(void *opaque)
     rwco->ret = bdrv_co_discard(rwco->bs, rwco->sector_num, rwco->nb_sectors);
 }
 
-int coroutine_fn bdrv_co_discard(BlockDriverState *bs, int64_t sector_num,
-                                 int nb_sectors)
+static int coroutine_fn bdrv_co_do_discard(BlockDriverState *bs,
+                                          int64_t sector_num, int nb_sectors)
 {
     if (!bs->drv) {
         return -ENOMEDIUM;
@@ -3798,6 +4499,23 @@ int coroutine_fn bdrv_co_discard(BlockDriverState *bs, int64_t sector_num,
     }
 }
 
+int coroutine_fn bdrv_co_discard(BlockDriverState *bs, int64_t sector_num,
+                                 int nb_sectors)
+{
+    int ret;
+
+    /* Discarded clusters may be read from the backing file afterwards */
+    bdrv_chain_cache_invalidate(bs, sector_num, nb_sectors);
+    ret = bdrv_co_do_discard(bs, sector_num, nb_sectors);
+    bdrv_chain_cache_invalidate(bs, sector_num, nb_sectors);
+
+    if (ret == 0 && bs->dirty_bitmap) {
+        set_dirty_bitmap(bs, sector_num, nb_sectors, 1);
+    }
+
+    return ret;
+}
+
 int bdrv_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
 {
     Coroutine *co;
@@ -3950,6 +4668,12 @@ int bdrv_get_dirty(BlockDriverState *bs, int64_t sector)
     }
 }
 
+void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector,
+                    int nr_sectors)
+{
+    set_dirty_bitmap(bs, cur_sector, nr_sectors, 1);
+}
+
 void bdrv_reset_dirty(BlockDriverState *bs, int64_t cur_sector,
                       int nr_sectors)
 {
@@ -4218,7 +4942,7 @@ void *block_job_create(const BlockJobType *job_type, BlockDriverState *bs,
     return job;
 }
 
-void block_job_complete(BlockJob *job, int ret)
+void block_job_completed(BlockJob *job, int ret)
 {
     BlockDriverState *bs = job->bs;
 
@@ -4229,6 +4953,37 @@ void block_job_complete(BlockJob *job, int ret)
     bdrv_set_in_use(bs, 0);
 }
 
+QObject *qobject_from_block_job(BlockJob *job)
+{
+    return qobject_from_jsonf("{ 'type': %s,"
+                              "'device': %s,"
+                              "'len': %" PRId64 ","
+                              "'offset': %" PRId64 ","
+                              "'speed': %" PRId64 " }",
+                              job->job_type->job_type,
+                              bdrv_get_device_name(job->bs),
+                              job->len,
+                              job->offset,
+                              job->speed);
+}
+
+void block_job_ready(BlockJob *job)
+{
+    QObject *data = qobject_from_block_job(job);
+
+    monitor_protocol_event(QEVENT_BLOCK_JOB_READY, data);
+    qobject_decref(data);
+}
+
+void block_job_complete(BlockJob *job, Error **errp)
+{
+    if (!job->job_type->complete) {
+        error_set(errp, QERR_NOT_SUPPORTED);
+        return;
+    }
+    job->job_type->complete(job, errp);
+}
+
 void block_job_set_speed(BlockJob *job, int64_t speed, Error **errp)
 {
     Error *local_err = NULL;
@@ -0,0 +1,390 @@
+/*
+ * Cache of decompressed chunks for compressed image formats
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Formats like dmg, cloop and compressed vmdk store the image in chunks that
+ * can only be decompressed as a whole.  The chunks of all images share one
+ * cache of limited size, which drops the least recently used chunks first.
+ *
+ * Chunks are decompressed in the thread pool.  When a client reads its
+ * chunks in order, a coroutine reads the next chunks ahead, and the threads
+ * decompress them while the guest is still busy with the current one.
+ */
+
+#include "qemu-common.h"
+#include "qemu-queue.h"
+#include "qemu-coroutine.h"
+#include "trace.h"
+#include "block/chunk-cache.h"
+#include <zlib.h>
+
+#ifdef CONFIG_POSIX
+#include "block/raw-posix-aio.h"
+#endif
+
+/* Total size of the decompressed chunks that are kept */
+#define CHUNK_CACHE_SIZE (64 * 1024 * 1024)
+
+#define CHUNK_CACHE_BUCKETS 1024
+
+/* Reading ahead starts when this many chunks were read in order */
+#define CHUNK_CACHE_SEQUENTIAL 2
+
+/* Number of chunks that are read ahead of the current one */
+#define CHUNK_CACHE_READ_AHEAD 8
+
+typedef struct ChunkCacheEntry {
+    ChunkCacheClient *client;       /* NULL once the client is released */
+    uint64_t index;
+    uint8_t *data;
+    size_t len;                     /* valid bytes in data */
+    bool loading;
+    bool read_ahead;                /* not loaded for a guest request */
+    bool cached;                    /* in the LRU list */
+    int ret;                        /* result of the load */
+    int refs;                       /* load in progress and waiters */
+    CoQueue waiters;
+    QLIST_ENTRY(ChunkCacheEntry) hash_next;
+    QTAILQ_ENTRY(ChunkCacheEntry) lru_next;
+} ChunkCacheEntry;
+
+typedef struct ChunkCacheJob {
+    ChunkCacheEntry *entry;
+    ChunkData data;
+    uint8_t *out;
+    size_t len;
+} ChunkCacheJob;
+
+static struct {
+    QLIST_HEAD(, ChunkCacheEntry) buckets[CHUNK_CACHE_BUCKETS];
+    QTAILQ_HEAD(, ChunkCacheEntry) lru;     /* least recently used first */
+    size_t size;
+} cache = {
+    .lru = QTAILQ_HEAD_INITIALIZER(cache.lru),
+};
+
+static unsigned int chunk_cache_hash(ChunkCacheClient *c, uint64_t index)
+{
+    uint64_t h = (uintptr_t)c ^ (index * 0x9e3779b97f4a7c15ULL);
+
+    return (h ^ (h >> 32)) % CHUNK_CACHE_BUCKETS;
+}
+
+static ChunkCacheEntry *chunk_cache_find(ChunkCacheClient *c, uint64_t index)
+{
+    ChunkCacheEntry *e;
+
+    QLIST_FOREACH(e, &cache.buckets[chunk_cache_hash(c, index)], hash_next) {
+        if (e->client == c && e->index == index) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void chunk_cache_unref(ChunkCacheEntry *e)
+{
+    if (--e->refs == 0 && !e->cached) {
+        g_free(e->data);
+        g_free(e);
+    }
+}
+
+static void chunk_cache_drop(ChunkCacheEntry *e)
+{
+    trace_chunk_cache_drop(e->client, e->index);
+
+    QLIST_REMOVE(e, hash_next);
+    QTAILQ_REMOVE(&cache.lru, e, lru_next);
+    cache.size -= e->len;
+    e->cached = false;
+
+    e->refs++;
+    chunk_cache_unref(e);
+}
+
+static void chunk_cache_evict(void)
+{
+    ChunkCacheEntry *e, *next;
+
+    QTAILQ_FOREACH_SAFE(e, &cache.lru, lru_next, next) {
+        if (cache.size <= CHUNK_CACHE_SIZE) {
+            break;
+        }
+        /* Waiters that were just woken up still copy from the entry */
+        if (e->refs == 0) {
+            chunk_cache_drop(e);
+        }
+    }
+}
+
+/* Runs in a worker thread, so it must only touch the job */
+static int chunk_cache_decompress(void *opaque)
+{
+    ChunkCacheJob *job = opaque;
+    ChunkData *d = &job->data;
+    uLongf len = d->size;
+
+    switch (d->encoding) {
+    case CHUNK_ZLIB:
+        if (uncompress(job->out, &len, d->buf + d->offset, d->len) != Z_OK) {
+            return -EIO;
+        }
+        break;
+    case CHUNK_RAW:
+        if (d->len > d->size) {
+            return -EIO;
+        }
+        memcpy(job->out, d->buf + d->offset, d->len);
+        len = d->len;
+        break;
+    case CHUNK_ZERO:
+        memset(job->out, 0, d->size);
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    job->len = len;
+    return 0;
+}
+
+static void chunk_cache_load_cb(void *opaque, int ret)
+{
+    ChunkCacheJob *job = opaque;
+    ChunkCacheEntry *e = job->entry;
+    ChunkCacheClient *c = e->client;
+
+    trace_chunk_cache_load_done(c, e->index, ret);
+
+    if (!c) {
+        /* The client was released while the chunk was loaded, and the entry
+         * is not in the hash table any more */
+        if (ret == 0) {
+            ret = -ECANCELED;
+        }
+    } else {
+        c->in_flight--;
+        if (ret < 0) {
+            QLIST_REMOVE(e, hash_next);
+        }
+    }
+
+    e->loading = false;
+    e->ret = ret;
+    if (ret == 0) {
+        e->data = job->out;
+        e->len = job->len;
+        e->cached = true;
+        QTAILQ_INSERT_TAIL(&cache.lru, e, lru_next);
+        cache.size += e->len;
+        chunk_cache_evict();
+    } else {
+        g_free(job->out);
+    }
+
+    g_free(job->data.buf);
+    g_free(job);
+
+    qemu_co_queue_restart_all(&e->waiters);
+    chunk_cache_unref(e);
+}
+
+static bool chunk_cache_use_threads(void)
+{
+#ifdef CONFIG_POSIX
+    return paio_init() == 0;
+#else
+    return false;
+#endif
+}
+
+/*
+ * Reads chunk @index and starts to decompress it.  Returns the new entry,
+ * which is still loading unless the chunk could not be read, with a
+ * reference for the caller.
+ */
+static ChunkCacheEntry *coroutine_fn chunk_cache_load(ChunkCacheClient *c,
+                                                      uint64_t index,
+                                                      bool read_ahead)
+{
+    ChunkCacheEntry *e;
+    ChunkCacheJob *job;
+    int ret;
+
+    trace_chunk_cache_load(c, index, read_ahead);
+
+    e = g_malloc0(sizeof(*e));
+    e->client = c;
+    e->index = index;
+    e->loading = true;
+    e->read_ahead = read_ahead;
+    e->refs = 2;
+    qemu_co_queue_init(&e->waiters);
+    QLIST_INSERT_HEAD(&cache.buckets[chunk_cache_hash(c, index)], e,
+                      hash_next);
+    c->in_flight++;
+
+    job = g_malloc0(sizeof(*job));
+    job->entry = e;
+
+    ret = c->read(c->bs, c->opaque, index, &job->data);
+    if (ret < 0) {
+        chunk_cache_load_cb(job, ret);
+        return e;
+    }
+
+    job->out = g_malloc(job->data.size);
+    if (chunk_cache_use_threads()) {
+#ifdef CONFIG_POSIX
+        paio_submit_func(c->bs, chunk_cache_decompress, job,
+                         chunk_cache_load_cb, job);
+#endif
+    } else {
+        chunk_cache_load_cb(job, chunk_cache_decompress(job));
+    }
+    return e;
+}
+
+static void coroutine_fn chunk_cache_read_ahead_entry(void *opaque)
+{
+    ChunkCacheClient *c = opaque;
+    ChunkCacheEntry *e;
+    uint64_t i = c->last_index + 1;
+
+    while (!c->releasing && c->in_flight < CHUNK_CACHE_READ_AHEAD) {
+        /* The guest may have moved on while we waited */
+        i = MAX(i, c->last_index + 1);
+        if (i >= c->nb_chunks || i > c->last_index + CHUNK_CACHE_READ_AHEAD) {
+            break;
+        }
+
+        /* The lock is taken before the entry exists, so that a request that
+         * holds the lock never waits for a chunk that is still to be read */
+        if (c->lock) {
+            qemu_co_mutex_lock(c->lock);
+        }
+        if (!chunk_cache_find(c, i)) {
+            e = chunk_cache_load(c, i, true);
+            chunk_cache_unref(e);
+        }
+        if (c->lock) {
+            qemu_co_mutex_unlock(c->lock);
+        }
+        i++;
+    }
+
+    c->read_ahead_co = NULL;
+}
+
+static void chunk_cache_read_ahead(ChunkCacheClient *c, uint64_t index)
+{
+    if (index == c->last_index) {
+        return;
+    }
+    c->sequential = index == c->last_index + 1 ? c->sequential + 1 : 0;
+    c->last_index = index;
+
+    /* Without threads, decompressing ahead would only delay the request */
+    if (c->sequential < CHUNK_CACHE_SEQUENTIAL || !chunk_cache_use_threads()) {
+        return;
+    }
+
+    /* A running coroutine follows last_index by itself */
+    if (!c->read_ahead_co) {
+        c->read_ahead_co = qemu_coroutine_create(chunk_cache_read_ahead_entry);
+        qemu_coroutine_enter(c->read_ahead_co, c);
+    }
+}
+
+int coroutine_fn chunk_cache_co_read(ChunkCacheClient *c, uint64_t index,
+                                     size_t offset, uint8_t *buf,
+                                     size_t bytes)
+{
+    ChunkCacheEntry *e;
+    bool read_ahead = false;
+    int ret;
+
+    for (;;) {
+        e = chunk_cache_find(c, index);
+        trace_chunk_cache_read(c, index, e != NULL);
+        if (e) {
+            e->refs++;
+        } else {
+            e = chunk_cache_load(c, index, false);
+        }
+
+        /* The following chunks are decompressed while we wait for this one.
+         * The coroutine returns as soon as it has to wait itself, so the
+         * request doesn't wait for the chunks that are read ahead. */
+        if (!read_ahead) {
+            chunk_cache_read_ahead(c, index);
+            read_ahead = true;
+        }
+
+        while (e->loading) {
+            qemu_co_queue_wait(&e->waiters);
+        }
+
+        ret = e->ret;
+        if (ret == 0) {
+            if (offset + bytes > e->len) {
+                ret = -EIO;
+            } else {
+                memcpy(buf, e->data + offset, bytes);
+                QTAILQ_REMOVE(&cache.lru, e, lru_next);
+                QTAILQ_INSERT_TAIL(&cache.lru, e, lru_next);
+            }
+            chunk_cache_unref(e);
+            return ret;
+        }
+
+        /* Errors are only reported for the chunks that were requested */
+        if (!e->read_ahead) {
+            chunk_cache_unref(e);
+            return ret;
+        }
+        chunk_cache_unref(e);
+    }
+}
+
+void chunk_cache_init_client(ChunkCacheClient *c, BlockDriverState *bs,
+                             uint64_t nb_chunks, ChunkReadFunc *read,
+                             void *opaque, CoMutex *lock)
+{
+    *c = (ChunkCacheClient) {
+        .bs         = bs,
+        .read       = read,
+        .opaque     = opaque,
+        .lock       = lock,
+        .nb_chunks  = nb_chunks,
+        .last_index = UINT64_MAX,
+    };
+}
+
+void chunk_cache_release_client(ChunkCacheClient *c)
+{
+    ChunkCacheEntry *e, *next;
+    int i;
+
+    c->releasing = true;
+    while (c->read_ahead_co) {
+        qemu_aio_wait();
+    }
+
+    for (i = 0; i < CHUNK_CACHE_BUCKETS; i++) {
+        QLIST_FOREACH_SAFE(e, &cache.buckets[i], hash_next, next) {
+            if (e->client != c) {
+                continue;
+            }
+            if (e->loading) {
+                QLIST_REMOVE(e, hash_next);
+                e->client = NULL;
+            } else {
+                chunk_cache_drop(e);
+            }
+        }
+    }
+}
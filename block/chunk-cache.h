@@ -0,0 +1,75 @@
+/*
+ * Cache of decompressed chunks for compressed image formats
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef BLOCK_CHUNK_CACHE_H
+#define BLOCK_CHUNK_CACHE_H
+
+#include "qemu-common.h"
+#include "block_int.h"
+
+typedef enum {
+    CHUNK_ZLIB,         /* zlib stream */
+    CHUNK_RAW,          /* stored uncompressed */
+    CHUNK_ZERO,         /* not stored, reads as zeroes */
+} ChunkEncoding;
+
+/* A chunk as it is stored in the image file */
+typedef struct ChunkData {
+    ChunkEncoding encoding;
+    uint8_t *buf;       /* allocated with g_malloc, freed by the cache */
+    size_t offset;      /* the stored data starts at buf + offset */
+    size_t len;         /* length of the stored data */
+    size_t size;        /* maximum size of the chunk once decompressed */
+} ChunkData;
+
+/*
+ * Reads the stored data of chunk @index into @data.  Returns -ENOENT if the
+ * chunk is not present in the image, which is only expected for chunks that
+ * are read ahead, and another negative errno on failure.
+ *
+ * For the chunks that a guest request needs, the function runs with whatever
+ * locks the caller of chunk_cache_co_read() holds.  Chunks that are read ahead
+ * are read in a coroutine of their own, which holds the lock of the client.
+ */
+typedef int coroutine_fn ChunkReadFunc(BlockDriverState *bs, void *opaque,
+                                       uint64_t index, ChunkData *data);
+
+/* The chunks of one image, or one extent of an image */
+typedef struct ChunkCacheClient {
+    BlockDriverState *bs;
+    ChunkReadFunc *read;
+    void *opaque;
+    CoMutex *lock;          /* held by the callers of chunk_cache_co_read() */
+    uint64_t nb_chunks;
+    uint64_t last_index;    /* last chunk that was read */
+    int sequential;         /* number of chunks read in order up to it */
+    int in_flight;          /* chunks that are being loaded */
+    Coroutine *read_ahead_co;
+    bool releasing;
+} ChunkCacheClient;
+
+/*
+ * The client is used as part of the cache key, so it must not move in memory
+ * between the first chunk_cache_co_read() and chunk_cache_release_client().
+ *
+ * @lock is the lock that the callers of chunk_cache_co_read() hold, if any.
+ */
+void chunk_cache_init_client(ChunkCacheClient *c, BlockDriverState *bs,
+                             uint64_t nb_chunks, ChunkReadFunc *read,
+                             void *opaque, CoMutex *lock);
+void chunk_cache_release_client(ChunkCacheClient *c);
+
+/*
+ * Copies @bytes bytes at @offset in decompressed chunk @index to @buf,
+ * loading the chunk if it is not cached.  Returns 0 on success and -errno on
+ * failure.
+ */
+int coroutine_fn chunk_cache_co_read(ChunkCacheClient *c, uint64_t index,
+                                     size_t offset, uint8_t *buf,
+                                     size_t bytes);
+
+#endif
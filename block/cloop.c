@@ -24,18 +24,14 @@
 #include "qemu-common.h"
 #include "block_int.h"
 #include "module.h"
-#include <zlib.h>
+#include "block/chunk-cache.h"
 
 typedef struct BDRVCloopState {
-    CoMutex lock;
     uint32_t block_size;
     uint32_t n_blocks;
     uint64_t *offsets;
     uint32_t sectors_per_block;
-    uint32_t current_block;
-    uint8_t *compressed_block;
-    uint8_t *uncompressed_block;
-    z_stream zstream;
+    ChunkCacheClient blocks;
 } BDRVCloopState;
 
 static int cloop_probe(const uint8_t *buf, int buf_size, const char *filename)
@@ -53,10 +49,29 @@ static int cloop_probe(const uint8_t *buf, int buf_size, const char *filename)
     return 0;
 }
 
+static int coroutine_fn cloop_read_block(BlockDriverState *bs, void *opaque,
+                                         uint64_t block_num, ChunkData *data)
+{
+    BDRVCloopState *s = bs->opaque;
+    uint32_t bytes = s->offsets[block_num + 1] - s->offsets[block_num];
+    int ret;
+
+    data->encoding = CHUNK_ZLIB;
+    data->buf = g_malloc(bytes);
+    data->len = bytes;
+    data->size = s->block_size;
+
+    ret = bdrv_pread(bs->file, s->offsets[block_num], data->buf, bytes);
+    if (ret != bytes) {
+        return ret < 0 ? ret : -EIO;
+    }
+    return 0;
+}
+
 static int cloop_open(BlockDriverState *bs, int flags)
 {
     BDRVCloopState *s = bs->opaque;
-    uint32_t offsets_size, max_compressed_block_size = 1, i;
+    uint32_t offsets_size, i;
 
     bs->read_only = 1;
 
@@ -80,102 +95,49 @@ static int cloop_open(BlockDriverState *bs, int flags)
     }
     for(i=0;i<s->n_blocks;i++) {
         s->offsets[i] = be64_to_cpu(s->offsets[i]);
-        if (i > 0) {
-            uint32_t size = s->offsets[i] - s->offsets[i - 1];
-            if (size > max_compressed_block_size) {
-                max_compressed_block_size = size;
-            }
-        }
     }
 
-    /* initialize zlib engine */
-    s->compressed_block = g_malloc(max_compressed_block_size + 1);
-    s->uncompressed_block = g_malloc(s->block_size);
-    if (inflateInit(&s->zstream) != Z_OK) {
-        goto cloop_close;
-    }
-    s->current_block = s->n_blocks;
+    chunk_cache_init_client(&s->blocks, bs, s->n_blocks, cloop_read_block,
+                            NULL, NULL);
 
     s->sectors_per_block = s->block_size/512;
     bs->total_sectors = s->n_blocks * s->sectors_per_block;
-    qemu_co_mutex_init(&s->lock);
     return 0;
 
 cloop_close:
     return -1;
 }
 
-static inline int cloop_read_block(BlockDriverState *bs, int block_num)
+static coroutine_fn int cloop_co_read(BlockDriverState *bs, int64_t sector_num,
+                                      uint8_t *buf, int nb_sectors)
 {
     BDRVCloopState *s = bs->opaque;
+    int ret;
 
-    if (s->current_block != block_num) {
-        int ret;
-        uint32_t bytes = s->offsets[block_num + 1] - s->offsets[block_num];
-
-        ret = bdrv_pread(bs->file, s->offsets[block_num], s->compressed_block,
-                         bytes);
-        if (ret != bytes) {
-            return -1;
-        }
-
-        s->zstream.next_in = s->compressed_block;
-        s->zstream.avail_in = bytes;
-        s->zstream.next_out = s->uncompressed_block;
-        s->zstream.avail_out = s->block_size;
-        ret = inflateReset(&s->zstream);
-        if (ret != Z_OK) {
-            return -1;
-        }
-        ret = inflate(&s->zstream, Z_FINISH);
-        if (ret != Z_STREAM_END || s->zstream.total_out != s->block_size) {
-            return -1;
-        }
-
-        s->current_block = block_num;
-    }
-    return 0;
-}
+    while (nb_sectors > 0) {
+        uint32_t sector_offset_in_block = sector_num % s->sectors_per_block;
+        uint32_t block_num = sector_num / s->sectors_per_block;
+        int n = MIN(nb_sectors, s->sectors_per_block - sector_offset_in_block);
 
-static int cloop_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
-{
-    BDRVCloopState *s = bs->opaque;
-    int i;
-
-    for (i = 0; i < nb_sectors; i++) {
-        uint32_t sector_offset_in_block =
-            ((sector_num + i) % s->sectors_per_block),
-            block_num = (sector_num + i) / s->sectors_per_block;
-        if (cloop_read_block(bs, block_num) != 0) {
-            return -1;
+        ret = chunk_cache_co_read(&s->blocks, block_num,
+                                  sector_offset_in_block * 512, buf, n * 512);
+        if (ret < 0) {
+            return ret;
         }
-        memcpy(buf + i * 512,
-            s->uncompressed_block + sector_offset_in_block * 512, 512);
+        nb_sectors -= n;
+        sector_num += n;
+        buf += n * 512;
     }
     return 0;
 }
 
-static coroutine_fn int cloop_co_read(BlockDriverState *bs, int64_t sector_num,
-                                      uint8_t *buf, int nb_sectors)
-{
-    int ret;
-    BDRVCloopState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = cloop_read(bs, sector_num, buf, nb_sectors);
-    qemu_co_mutex_unlock(&s->lock);
-    return ret;
-}
-
 static void cloop_close(BlockDriverState *bs)
 {
     BDRVCloopState *s = bs->opaque;
+    chunk_cache_release_client(&s->blocks);
     if (s->n_blocks > 0) {
         g_free(s->offsets);
     }
-    g_free(s->compressed_block);
-    g_free(s->uncompressed_block);
-    inflateEnd(&s->zstream);
 }
 
 static BlockDriver bdrv_cloop = {
@@ -25,10 +25,9 @@
 #include "block_int.h"
 #include "bswap.h"
 #include "module.h"
-#include <zlib.h>
+#include "block/chunk-cache.h"
 
 typedef struct BDRVDMGState {
-    CoMutex lock;
     /* each chunk contains a certain number of sectors,
      * offsets[i] is the offset in the .dmg file,
      * lengths[i] is the length of the compressed chunk,
@@ -43,10 +42,7 @@ typedef struct BDRVDMGState {
     uint64_t* lengths;
     uint64_t* sectors;
     uint64_t* sectorcounts;
-    uint32_t current_chunk;
-    uint8_t *compressed_chunk;
-    uint8_t *uncompressed_chunk;
-    z_stream zstream;
+    ChunkCacheClient chunks;
 } BDRVDMGState;
 
 static int dmg_probe(const uint8_t *buf, int buf_size, const char *filename)
@@ -73,12 +69,43 @@ static off_t read_uint32(BlockDriverState *bs, int64_t offset)
 	return be32_to_cpu(buffer);
 }
 
+static int coroutine_fn dmg_read_chunk(BlockDriverState *bs, void *opaque,
+                                       uint64_t chunk, ChunkData *data)
+{
+    BDRVDMGState *s = bs->opaque;
+    int ret;
+
+    data->size = 512 * s->sectorcounts[chunk];
+
+    switch (s->types[chunk]) {
+    case 0x80000005: /* zlib compressed */
+        data->encoding = CHUNK_ZLIB;
+        break;
+    case 1: /* copy */
+        data->encoding = CHUNK_RAW;
+        break;
+    case 2: /* zero */
+        data->encoding = CHUNK_ZERO;
+        return 0;
+    default:
+        return -EIO;
+    }
+
+    data->buf = g_malloc(s->lengths[chunk]);
+    data->len = s->lengths[chunk];
+    ret = bdrv_pread(bs->file, s->offsets[chunk], data->buf, data->len);
+    if (ret != data->len) {
+        return ret < 0 ? ret : -EIO;
+    }
+    return 0;
+}
+
 static int dmg_open(BlockDriverState *bs, int flags)
 {
     BDRVDMGState *s = bs->opaque;
     off_t info_begin,info_end,last_in_offset,last_out_offset;
     uint32_t count;
-    uint32_t max_compressed_size=1,max_sectors_per_chunk=1,i;
+    uint32_t i;
     int64_t offset;
 
     bs->read_only = 1;
@@ -160,40 +187,24 @@ static int dmg_open(BlockDriverState *bs, int flags)
 
 		s->lengths[i] = read_off(bs, offset);
 		offset += 8;
-
-		if(s->lengths[i]>max_compressed_size)
-		    max_compressed_size = s->lengths[i];
-		if(s->sectorcounts[i]>max_sectors_per_chunk)
-		    max_sectors_per_chunk = s->sectorcounts[i];
 	    }
 	    s->n_chunks+=chunk_count;
 	}
     }
 
-    /* initialize zlib engine */
-    s->compressed_chunk = g_malloc(max_compressed_size+1);
-    s->uncompressed_chunk = g_malloc(512*max_sectors_per_chunk);
-    if(inflateInit(&s->zstream) != Z_OK)
-	goto fail;
-
-    s->current_chunk = s->n_chunks;
+    /* the image ends with the last chunk, the sectors array is ordered */
+    if (s->n_chunks > 0) {
+        bs->total_sectors = s->sectors[s->n_chunks - 1] +
+                            s->sectorcounts[s->n_chunks - 1];
+    }
 
-    qemu_co_mutex_init(&s->lock);
+    chunk_cache_init_client(&s->chunks, bs, s->n_chunks, dmg_read_chunk, NULL,
+                            NULL);
     return 0;
 fail:
     return -1;
 }
 
-static inline int is_sector_in_chunk(BDRVDMGState* s,
-		uint32_t chunk_num,int sector_num)
-{
-    if(chunk_num>=s->n_chunks || s->sectors[chunk_num]>sector_num ||
-	    s->sectors[chunk_num]+s->sectorcounts[chunk_num]<=sector_num)
-	return 0;
-    else
-	return -1;
-}
-
 static inline uint32_t search_chunk(BDRVDMGState* s,int sector_num)
 {
     /* binary search */
@@ -210,89 +221,35 @@ static inline uint32_t search_chunk(BDRVDMGState* s,int sector_num)
     return s->n_chunks; /* error */
 }
 
-static inline int dmg_read_chunk(BlockDriverState *bs, int sector_num)
+static coroutine_fn int dmg_co_read(BlockDriverState *bs, int64_t sector_num,
+                                    uint8_t *buf, int nb_sectors)
 {
     BDRVDMGState *s = bs->opaque;
+    int ret;
 
-    if(!is_sector_in_chunk(s,s->current_chunk,sector_num)) {
-	int ret;
-	uint32_t chunk = search_chunk(s,sector_num);
-
-	if(chunk>=s->n_chunks)
-	    return -1;
-
-	s->current_chunk = s->n_chunks;
-	switch(s->types[chunk]) {
-	case 0x80000005: { /* zlib compressed */
-	    int i;
-
-	    /* we need to buffer, because only the chunk as whole can be
-	     * inflated. */
-	    i=0;
-	    do {
-                ret = bdrv_pread(bs->file, s->offsets[chunk] + i,
-                                 s->compressed_chunk+i, s->lengths[chunk]-i);
-		if(ret<0 && errno==EINTR)
-		    ret=0;
-		i+=ret;
-	    } while(ret>=0 && ret+i<s->lengths[chunk]);
-
-	    if (ret != s->lengths[chunk])
-		return -1;
-
-	    s->zstream.next_in = s->compressed_chunk;
-	    s->zstream.avail_in = s->lengths[chunk];
-	    s->zstream.next_out = s->uncompressed_chunk;
-	    s->zstream.avail_out = 512*s->sectorcounts[chunk];
-	    ret = inflateReset(&s->zstream);
-	    if(ret != Z_OK)
-		return -1;
-	    ret = inflate(&s->zstream, Z_FINISH);
-	    if(ret != Z_STREAM_END || s->zstream.total_out != 512*s->sectorcounts[chunk])
-		return -1;
-	    break; }
-	case 1: /* copy */
-	    ret = bdrv_pread(bs->file, s->offsets[chunk],
-                             s->uncompressed_chunk, s->lengths[chunk]);
-	    if (ret != s->lengths[chunk])
-		return -1;
-	    break;
-	case 2: /* zero */
-	    memset(s->uncompressed_chunk, 0, 512*s->sectorcounts[chunk]);
-	    break;
-	}
-	s->current_chunk = chunk;
+    while (nb_sectors > 0) {
+        uint32_t chunk = search_chunk(s, sector_num);
+        uint64_t sector_offset_in_chunk;
+        int n;
+
+        if (chunk >= s->n_chunks) {
+            return -EIO;
+        }
+        sector_offset_in_chunk = sector_num - s->sectors[chunk];
+        n = MIN(nb_sectors, s->sectorcounts[chunk] - sector_offset_in_chunk);
+
+        ret = chunk_cache_co_read(&s->chunks, chunk,
+                                  sector_offset_in_chunk * 512, buf, n * 512);
+        if (ret < 0) {
+            return ret;
+        }
+        nb_sectors -= n;
+        sector_num += n;
+        buf += n * 512;
     }
     return 0;
 }
 
-static int dmg_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
-{
-    BDRVDMGState *s = bs->opaque;
-    int i;
-
-    for(i=0;i<nb_sectors;i++) {
-	uint32_t sector_offset_in_chunk;
-	if(dmg_read_chunk(bs, sector_num+i) != 0)
-	    return -1;
-	sector_offset_in_chunk = sector_num+i-s->sectors[s->current_chunk];
-	memcpy(buf+i*512,s->uncompressed_chunk+sector_offset_in_chunk*512,512);
-    }
-    return 0;
-}
-
-static coroutine_fn int dmg_co_read(BlockDriverState *bs, int64_t sector_num,
-                                    uint8_t *buf, int nb_sectors)
-{
-    int ret;
-    BDRVDMGState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = dmg_read(bs, sector_num, buf, nb_sectors);
-    qemu_co_mutex_unlock(&s->lock);
-    return ret;
-}
-
 static void dmg_close(BlockDriverState *bs)
 {
     BDRVDMGState *s = bs->opaque;
@@ -303,9 +260,7 @@ static void dmg_close(BlockDriverState *bs)
 	free(s->sectors);
 	free(s->sectorcounts);
     }
-    free(s->compressed_chunk);
-    free(s->uncompressed_chunk);
-    inflateEnd(&s->zstream);
+    chunk_cache_release_client(&s->chunks);
 }
 
 static BlockDriver bdrv_dmg = {
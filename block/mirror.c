@@ -0,0 +1,331 @@
+/*
+ * Image mirroring
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The job copies a live block device to a target image.  Everything that
+ * has to be copied is marked in the dirty bitmap of the source first, and
+ * guest writes keep marking it while the job runs, so the job only ever
+ * has to look at the bitmap: it copies dirty chunks in batches of parallel
+ * requests until no dirty chunk is left.  From then on the target is in
+ * sync and the job keeps it that way until it is completed, which switches
+ * the device over to the target, or cancelled, which leaves the source
+ * alone.
+ */
+
+#include "trace.h"
+#include "block_int.h"
+#include "ratelimit.h"
+
+#define SLICE_TIME 100000000ULL /* ns */
+
+/* Chunks are copied whole, so that they match the dirty bitmap */
+#define MIRROR_CHUNK_SECTORS BDRV_SECTORS_PER_DIRTY_CHUNK
+
+/* Number of chunks that are copied in parallel */
+#define MIRROR_MAX_IN_FLIGHT 16
+
+typedef struct MirrorBlockJob {
+    BlockJob common;
+    RateLimit limit;
+    BlockDriverState *target;
+    MirrorSyncMode mode;
+    bool synced;            /* the target has caught up with the source */
+    bool should_complete;   /* block-job-complete was issued */
+    bool waiting;           /* mirror_run waits for a copy to finish */
+    int64_t sector_num;     /* where the next search for dirty chunks starts */
+    int in_flight;
+    int ret;                /* first error of a copy operation */
+} MirrorBlockJob;
+
+typedef struct MirrorOp {
+    MirrorBlockJob *s;
+    struct iovec iov;
+    QEMUIOVector qiov;
+    int64_t sector_num;
+    int nb_sectors;
+} MirrorOp;
+
+static void coroutine_fn mirror_co_copy(void *opaque)
+{
+    MirrorOp *op = opaque;
+    MirrorBlockJob *s = op->s;
+    int ret;
+
+    ret = bdrv_co_readv(s->common.bs, op->sector_num, op->nb_sectors,
+                        &op->qiov);
+    if (ret >= 0) {
+        ret = bdrv_co_writev(s->target, op->sector_num, op->nb_sectors,
+                             &op->qiov);
+    }
+    trace_mirror_iteration_done(s, op->sector_num, op->nb_sectors, ret);
+
+    if (ret < 0) {
+        /* The chunk is still out of date on the target */
+        bdrv_set_dirty(s->common.bs, op->sector_num, op->nb_sectors);
+        if (s->ret == 0) {
+            s->ret = ret;
+        }
+    }
+
+    s->in_flight--;
+    qemu_vfree(op->iov.iov_base);
+    g_free(op);
+
+    if (s->waiting) {
+        s->waiting = false;
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+static void mirror_start_op(MirrorBlockJob *s, int64_t sector_num,
+                            int nb_sectors)
+{
+    MirrorOp *op;
+    Coroutine *co;
+
+    op = g_malloc(sizeof(*op));
+    op->s = s;
+    op->sector_num = sector_num;
+    op->nb_sectors = nb_sectors;
+    op->iov.iov_base = qemu_blockalign(s->common.bs,
+                                       nb_sectors * BDRV_SECTOR_SIZE);
+    op->iov.iov_len = nb_sectors * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&op->qiov, &op->iov, 1);
+
+    /* Guest writes that complete after this point, and that the read may
+     * or may not see, mark the chunk dirty again.  It is only copied again
+     * in the next batch, so the older data cannot win. */
+    bdrv_reset_dirty(s->common.bs, sector_num, nb_sectors);
+    s->in_flight++;
+
+    trace_mirror_one_iteration(s, sector_num, nb_sectors);
+    co = qemu_coroutine_create(mirror_co_copy);
+    qemu_coroutine_enter(co, op);
+}
+
+/*
+ * Start a batch of up to MIRROR_MAX_IN_FLIGHT copies of dirty chunks.
+ * Returns how long to wait before starting the next batch if the speed
+ * limit has been reached.
+ */
+static uint64_t mirror_iteration(MirrorBlockJob *s)
+{
+    BlockDriverState *source = s->common.bs;
+    int64_t end = s->common.len >> BDRV_SECTOR_BITS;
+    int64_t nb_chunks = DIV_ROUND_UP(end, MIRROR_CHUNK_SECTORS);
+    int64_t scanned;
+    uint64_t delay_ns = 0;
+
+    for (scanned = 0; scanned < nb_chunks; scanned++) {
+        int64_t sector_num = s->sector_num;
+        int nb_sectors = MIN(end - sector_num, MIRROR_CHUNK_SECTORS);
+
+        if (s->in_flight == MIRROR_MAX_IN_FLIGHT || delay_ns > 0 ||
+            bdrv_get_dirty_count(source) == 0) {
+            break;
+        }
+
+        s->sector_num += MIRROR_CHUNK_SECTORS;
+        if (s->sector_num >= end) {
+            s->sector_num = 0;
+        }
+
+        if (!bdrv_get_dirty(source, sector_num)) {
+            continue;
+        }
+
+        if (s->common.speed) {
+            delay_ns = ratelimit_calculate_delay(&s->limit, nb_sectors);
+        }
+        mirror_start_op(s, sector_num, nb_sectors);
+    }
+
+    return delay_ns;
+}
+
+static void coroutine_fn mirror_wait_for_io(MirrorBlockJob *s)
+{
+    /* Copies in flight reenter the coroutine, so the job stays busy */
+    s->waiting = true;
+    qemu_coroutine_yield();
+}
+
+static void coroutine_fn mirror_run(void *opaque)
+{
+    MirrorBlockJob *s = opaque;
+    BlockDriverState *bs = s->common.bs;
+    int64_t sector_num, end;
+    int ret = 0;
+    int n;
+
+    s->common.len = bdrv_getlength(bs);
+    if (s->common.len < 0) {
+        ret = s->common.len;
+        goto immediate_exit;
+    }
+
+    end = s->common.len >> BDRV_SECTOR_BITS;
+
+    /* Mark everything that has to be copied as dirty, the main loop then
+     * treats it just like data that the guest wrote */
+    if (s->mode != MIRROR_SYNC_MODE_NONE) {
+        for (sector_num = 0; sector_num < end; sector_num += n) {
+            n = MIN(end - sector_num, MIRROR_CHUNK_SECTORS);
+            if (s->mode == MIRROR_SYNC_MODE_TOP) {
+                ret = bdrv_co_is_allocated(bs, sector_num, n, &n);
+                if (ret < 0) {
+                    goto immediate_exit;
+                } else if (ret == 0) {
+                    continue;
+                }
+            }
+            bdrv_set_dirty(bs, sector_num, n);
+        }
+        ret = 0;
+    }
+
+    for (;;) {
+        uint64_t delay_ns = 0;
+        bool should_complete, idle;
+        int64_t cnt;
+
+        if (s->ret < 0) {
+            ret = s->ret;
+            break;
+        }
+
+        cnt = bdrv_get_dirty_count(bs);
+        if (cnt > 0) {
+            delay_ns = mirror_iteration(s);
+            cnt = bdrv_get_dirty_count(bs);
+        }
+
+        if (s->in_flight == 0 && cnt == 0) {
+            /* Once in sync, cancelling the job still leaves a consistent
+             * copy on the target, so do it the same way as completion */
+            s->common.offset = s->common.len;
+            if (!s->synced) {
+                s->synced = true;
+                block_job_ready(&s->common);
+            }
+
+            should_complete = s->should_complete ||
+                              block_job_is_cancelled(&s->common);
+            if (should_complete) {
+                trace_mirror_before_flush(s);
+                ret = bdrv_co_flush(s->target);
+                if (ret < 0) {
+                    break;
+                }
+
+                /* Guest requests that are still in flight only mark the
+                 * dirty bitmap when they complete */
+                trace_mirror_before_drain(s, cnt);
+                bdrv_drain_all();
+                cnt = bdrv_get_dirty_count(bs);
+                if (cnt == 0) {
+                    /* No yield from here to the switch over */
+                    break;
+                }
+                continue;
+            }
+        } else if (!s->synced) {
+            s->common.offset = MAX(0, end - cnt * MIRROR_CHUNK_SECTORS) *
+                               BDRV_SECTOR_SIZE;
+        }
+
+        /* Copies are started in batches, and the whole batch completes
+         * before the next one starts.  Note that even when no rate limit is
+         * applied we need to yield with no pending I/O here so that
+         * qemu_aio_flush() returns; starting new copies as soon as others
+         * complete would keep it waiting until the target is in sync.
+         */
+        idle = s->in_flight == 0 && cnt == 0;
+        while (s->in_flight > 0) {
+            trace_mirror_yield(s, cnt, s->in_flight);
+            mirror_wait_for_io(s);
+        }
+        if (delay_ns == 0 && idle) {
+            /* Nothing to copy until the guest writes again */
+            delay_ns = SLICE_TIME;
+        }
+        trace_mirror_before_sleep(s, cnt, s->synced);
+        block_job_sleep_ns(&s->common, rt_clock, delay_ns);
+
+        if (block_job_is_cancelled(&s->common) && !s->synced) {
+            break;
+        }
+    }
+
+immediate_exit:
+    while (s->in_flight > 0) {
+        mirror_wait_for_io(s);
+    }
+    bdrv_set_dirty_tracking(bs, 0);
+
+    if (ret == 0 && s->should_complete) {
+        /* The device uses the target from now on, and what used to be the
+         * source is closed below */
+        bdrv_swap(s->target, bs);
+    }
+    bdrv_delete(s->target);
+    block_job_completed(&s->common, ret);
+}
+
+static void mirror_set_speed(BlockJob *job, int64_t speed, Error **errp)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
+
+    if (speed < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER, "speed");
+        return;
+    }
+    ratelimit_set_speed(&s->limit, speed / BDRV_SECTOR_SIZE, SLICE_TIME);
+}
+
+static void mirror_complete(BlockJob *job, Error **errp)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
+
+    if (!s->synced) {
+        error_set(errp, QERR_BLOCK_JOB_NOT_READY, job->bs->device_name);
+        return;
+    }
+
+    s->should_complete = true;
+    if (job->co && !job->busy) {
+        qemu_coroutine_enter(job->co, NULL);
+    }
+}
+
+static BlockJobType mirror_job_type = {
+    .instance_size = sizeof(MirrorBlockJob),
+    .job_type      = "mirror",
+    .set_speed     = mirror_set_speed,
+    .complete      = mirror_complete,
+};
+
+void mirror_start(BlockDriverState *bs, BlockDriverState *target,
+                  int64_t speed, MirrorSyncMode mode,
+                  BlockDriverCompletionFunc *cb,
+                  void *opaque, Error **errp)
+{
+    MirrorBlockJob *s;
+
+    s = block_job_create(&mirror_job_type, bs, speed, cb, opaque, errp);
+    if (!s) {
+        return;
+    }
+
+    s->target = target;
+    s->mode = mode;
+
+    /* Track guest writes from the start, before anything is copied */
+    bdrv_set_dirty_tracking(bs, 1);
+
+    s->common.co = qemu_coroutine_create(mirror_run);
+    trace_mirror_start(bs, s, s->common.co, opaque);
+    qemu_coroutine_enter(s->common.co, s);
+}
@@ -31,11 +31,14 @@
 #include "block_int.h"
 #include "module.h"
 #include "qemu_socket.h"
+#include "qemu-timer.h"
 
 #include <sys/types.h>
 #include <unistd.h>
 
 #define EN_OPTSTR ":exportname="
+#define CONN_OPTSTR ":connections="
+#define RA_OPTSTR ":readahead="
 
 /* #define DEBUG_NBD */
 
@@ -47,15 +50,18 @@
 #endif
 
 #define MAX_NBD_REQUESTS	16
-#define HANDLE_TO_INDEX(bs, handle) ((handle) ^ ((uint64_t)(intptr_t)bs))
-#define INDEX_TO_HANDLE(bs, index)  ((index)  ^ ((uint64_t)(intptr_t)bs))
+#define MAX_NBD_CONNECTIONS	16
+#define HANDLE_TO_INDEX(conn, handle) ((handle) ^ ((uint64_t)(intptr_t)conn))
+#define INDEX_TO_HANDLE(conn, index)  ((index)  ^ ((uint64_t)(intptr_t)conn))
 
-typedef struct BDRVNBDState {
+/* The read-ahead window starts with this many sectors when sequential reads
+ * are detected, and doubles with each further sequential read */
+#define NBD_READAHEAD_MIN_SECTORS	256
+#define NBD_READAHEAD_MAX_SECTORS	8192
+#define NBD_READAHEAD_SLOTS	2
+
+typedef struct NBDConnection {
     int sock;
-    uint32_t nbdflags;
-    off_t size;
-    size_t blocksize;
-    char *export_name; /* An NBD server may export several devices */
 
     CoMutex send_mutex;
     CoMutex free_sema;
@@ -65,22 +71,107 @@ typedef struct BDRVNBDState {
     Coroutine *recv_coroutine[MAX_NBD_REQUESTS];
     struct nbd_reply reply;
 
+    /* Statistics */
+    uint64_t nr_requests;
+    uint64_t total_time_ns;
+    uint64_t max_time_ns;
+} NBDConnection;
+
+typedef struct NBDReadahead {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    int nb_sectors;         /* 0 if the slot is unused */
+    uint8_t *buf;
+    bool in_flight;
+    bool valid;             /* cleared by overlapping writes */
+    int ret;
+    CoQueue waiters;
+} NBDReadahead;
+
+typedef struct BDRVNBDState {
+    uint32_t nbdflags;
+    off_t size;
+    size_t blocksize;
+    char *export_name; /* An NBD server may export several devices */
+
+    /* Requests are spread over several connections to the same export */
+    NBDConnection conns[MAX_NBD_CONNECTIONS];
+    int nb_conns;
+    int next_conn;
+
+    /* Sequential read-ahead */
+    bool readahead;
+    int64_t ra_next;        /* sector after the last read */
+    int64_t ra_end;         /* end of the data read ahead */
+    int ra_window;          /* 0 while reads are not sequential */
+    NBDReadahead ra[NBD_READAHEAD_SLOTS];
+    uint64_t ra_hits;
+    uint64_t ra_bytes;
+
     /* If it begins with  '/', this is a UNIX domain socket. Otherwise,
      * it's a string of the form <hostname|ip4|\[ip6\]>:port
      */
     char *host_spec;
 } BDRVNBDState;
 
+/*
+ * Removes the option @optstr from @file and returns its value, which the
+ * caller must free, or NULL if it isn't present.
+ */
+static char *nbd_extract_option(char *file, const char *optstr)
+{
+    char *opt, *end, *value;
+
+    opt = strstr(file, optstr);
+    if (!opt) {
+        return NULL;
+    }
+
+    end = strchr(opt + 1, ':');
+    if (!end) {
+        end = opt + strlen(opt);
+    }
+
+    value = g_strndup(opt + strlen(optstr), end - opt - strlen(optstr));
+    memmove(opt, end, strlen(end) + 1);
+    return value;
+}
+
 static int nbd_config(BDRVNBDState *s, const char *filename, int flags)
 {
     char *file;
     char *export_name;
+    char *opt, *end;
     const char *host_spec;
     const char *unixpath;
     int err = -EINVAL;
 
     file = g_strdup(filename);
 
+    s->nb_conns = 1;
+    opt = nbd_extract_option(file, CONN_OPTSTR);
+    if (opt) {
+        s->nb_conns = strtol(opt, &end, 10);
+        if (!*opt || *end || s->nb_conns < 1 ||
+            s->nb_conns > MAX_NBD_CONNECTIONS) {
+            g_free(opt);
+            goto out;
+        }
+        g_free(opt);
+    }
+
+    s->readahead = true;
+    opt = nbd_extract_option(file, RA_OPTSTR);
+    if (opt) {
+        if (!strcmp(opt, "off")) {
+            s->readahead = false;
+        } else if (strcmp(opt, "on")) {
+            g_free(opt);
+            goto out;
+        }
+        g_free(opt);
+    }
+
     export_name = strstr(file, EN_OPTSTR);
     if (export_name) {
         if (export_name[strlen(EN_OPTSTR)] == 0) {
@@ -117,53 +208,71 @@ out:
     return err;
 }
 
-static void nbd_coroutine_start(BDRVNBDState *s, struct nbd_request *request)
+/* Picks the connection with the fewest requests in flight */
+static NBDConnection *nbd_get_connection(BDRVNBDState *s)
+{
+    NBDConnection *best = NULL;
+    int i;
+
+    for (i = 0; i < s->nb_conns; i++) {
+        NBDConnection *conn = &s->conns[(s->next_conn + i) % s->nb_conns];
+        if (!best || conn->in_flight < best->in_flight) {
+            best = conn;
+        }
+    }
+
+    s->next_conn = (best - s->conns + 1) % s->nb_conns;
+    return best;
+}
+
+static void nbd_coroutine_start(NBDConnection *conn,
+                                struct nbd_request *request)
 {
     int i;
 
     /* Poor man semaphore.  The free_sema is locked when no other request
      * can be accepted, and unlocked after receiving one reply.  */
-    if (s->in_flight >= MAX_NBD_REQUESTS - 1) {
-        qemu_co_mutex_lock(&s->free_sema);
-        assert(s->in_flight < MAX_NBD_REQUESTS);
+    if (conn->in_flight >= MAX_NBD_REQUESTS - 1) {
+        qemu_co_mutex_lock(&conn->free_sema);
+        assert(conn->in_flight < MAX_NBD_REQUESTS);
     }
-    s->in_flight++;
+    conn->in_flight++;
 
     for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        if (s->recv_coroutine[i] == NULL) {
-            s->recv_coroutine[i] = qemu_coroutine_self();
+        if (conn->recv_coroutine[i] == NULL) {
+            conn->recv_coroutine[i] = qemu_coroutine_self();
             break;
         }
     }
 
     assert(i < MAX_NBD_REQUESTS);
-    request->handle = INDEX_TO_HANDLE(s, i);
+    request->handle = INDEX_TO_HANDLE(conn, i);
 }
 
 static int nbd_have_request(void *opaque)
 {
-    BDRVNBDState *s = opaque;
+    NBDConnection *conn = opaque;
 
-    return s->in_flight > 0;
+    return conn->in_flight > 0;
 }
 
 static void nbd_reply_ready(void *opaque)
 {
-    BDRVNBDState *s = opaque;
+    NBDConnection *conn = opaque;
     uint64_t i;
     int ret;
 
-    if (s->reply.handle == 0) {
+    if (conn->reply.handle == 0) {
         /* No reply already in flight.  Fetch a header.  It is possible
          * that another thread has done the same thing in parallel, so
          * the socket is not readable anymore.
          */
-        ret = nbd_receive_reply(s->sock, &s->reply);
+        ret = nbd_receive_reply(conn->sock, &conn->reply);
         if (ret == -EAGAIN) {
             return;
         }
         if (ret < 0) {
-            s->reply.handle = 0;
+            conn->reply.handle = 0;
             goto fail;
         }
     }
@@ -171,54 +280,56 @@ static void nbd_reply_ready(void *opaque)
     /* There's no need for a mutex on the receive side, because the
      * handler acts as a synchronization point and ensures that only
      * one coroutine is called until the reply finishes.  */
-    i = HANDLE_TO_INDEX(s, s->reply.handle);
+    i = HANDLE_TO_INDEX(conn, conn->reply.handle);
     if (i >= MAX_NBD_REQUESTS) {
         goto fail;
     }
 
-    if (s->recv_coroutine[i]) {
-        qemu_coroutine_enter(s->recv_coroutine[i], NULL);
+    if (conn->recv_coroutine[i]) {
+        qemu_coroutine_enter(conn->recv_coroutine[i], NULL);
         return;
     }
 
 fail:
     for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        if (s->recv_coroutine[i]) {
-            qemu_coroutine_enter(s->recv_coroutine[i], NULL);
+        if (conn->recv_coroutine[i]) {
+            qemu_coroutine_enter(conn->recv_coroutine[i], NULL);
         }
     }
 }
 
 static void nbd_restart_write(void *opaque)
 {
-    BDRVNBDState *s = opaque;
-    qemu_coroutine_enter(s->send_coroutine, NULL);
+    NBDConnection *conn = opaque;
+    qemu_coroutine_enter(conn->send_coroutine, NULL);
 }
 
-static int nbd_co_send_request(BDRVNBDState *s, struct nbd_request *request,
+static int nbd_co_send_request(NBDConnection *conn,
+                               struct nbd_request *request,
                                struct iovec *iov, int offset)
 {
     int rc, ret;
 
-    qemu_co_mutex_lock(&s->send_mutex);
-    s->send_coroutine = qemu_coroutine_self();
-    qemu_aio_set_fd_handler(s->sock, nbd_reply_ready, nbd_restart_write,
-                            nbd_have_request, s);
-    rc = nbd_send_request(s->sock, request);
+    qemu_co_mutex_lock(&conn->send_mutex);
+    conn->send_coroutine = qemu_coroutine_self();
+    qemu_aio_set_fd_handler(conn->sock, nbd_reply_ready, nbd_restart_write,
+                            nbd_have_request, conn);
+    rc = nbd_send_request(conn->sock, request);
     if (rc >= 0 && iov) {
-        ret = qemu_co_sendv(s->sock, iov, request->len, offset);
+        ret = qemu_co_sendv(conn->sock, iov, request->len, offset);
         if (ret != request->len) {
-            return -EIO;
+            rc = -EIO;
         }
     }
-    qemu_aio_set_fd_handler(s->sock, nbd_reply_ready, NULL,
-                            nbd_have_request, s);
-    s->send_coroutine = NULL;
-    qemu_co_mutex_unlock(&s->send_mutex);
+    qemu_aio_set_fd_handler(conn->sock, nbd_reply_ready, NULL,
+                            nbd_have_request, conn);
+    conn->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&conn->send_mutex);
     return rc;
 }
 
-static void nbd_co_receive_reply(BDRVNBDState *s, struct nbd_request *request,
+static void nbd_co_receive_reply(NBDConnection *conn,
+                                 struct nbd_request *request,
                                  struct nbd_reply *reply,
                                  struct iovec *iov, int offset)
 {
@@ -227,36 +338,68 @@ static void nbd_co_receive_reply(BDRVNBDState *s, struct nbd_request *request,
     /* Wait until we're woken up by the read handler.  TODO: perhaps
      * peek at the next reply and avoid yielding if it's ours?  */
     qemu_coroutine_yield();
-    *reply = s->reply;
+    *reply = conn->reply;
     if (reply->handle != request->handle) {
         reply->error = EIO;
     } else {
         if (iov && reply->error == 0) {
-            ret = qemu_co_recvv(s->sock, iov, request->len, offset);
+            ret = qemu_co_recvv(conn->sock, iov, request->len, offset);
             if (ret != request->len) {
                 reply->error = EIO;
             }
         }
 
         /* Tell the read handler to read another header.  */
-        s->reply.handle = 0;
+        conn->reply.handle = 0;
+    }
+}
+
+static void nbd_coroutine_end(NBDConnection *conn,
+                              struct nbd_request *request)
+{
+    int i = HANDLE_TO_INDEX(conn, request->handle);
+    conn->recv_coroutine[i] = NULL;
+    if (conn->in_flight-- == MAX_NBD_REQUESTS) {
+        qemu_co_mutex_unlock(&conn->free_sema);
     }
 }
 
-static void nbd_coroutine_end(BDRVNBDState *s, struct nbd_request *request)
+/* Sends a request and waits for its reply */
+static int nbd_co_request(NBDConnection *conn, struct nbd_request *request,
+                          QEMUIOVector *qiov, int offset)
 {
-    int i = HANDLE_TO_INDEX(s, request->handle);
-    s->recv_coroutine[i] = NULL;
-    if (s->in_flight-- == MAX_NBD_REQUESTS) {
-        qemu_co_mutex_unlock(&s->free_sema);
+    struct nbd_reply reply;
+    int64_t start, elapsed;
+    ssize_t ret;
+    bool is_write = (request->type & NBD_CMD_MASK_COMMAND) == NBD_CMD_WRITE;
+
+    start = get_clock();
+    nbd_coroutine_start(conn, request);
+    ret = nbd_co_send_request(conn, request,
+                              is_write ? qiov->iov : NULL, offset);
+    if (ret < 0) {
+        reply.error = -ret;
+    } else {
+        nbd_co_receive_reply(conn, request, &reply,
+                             qiov && !is_write ? qiov->iov : NULL, offset);
     }
+    nbd_coroutine_end(conn, request);
+
+    elapsed = get_clock() - start;
+    conn->nr_requests++;
+    conn->total_time_ns += elapsed;
+    conn->max_time_ns = MAX(conn->max_time_ns, elapsed);
+
+    return -reply.error;
 }
 
-static int nbd_establish_connection(BlockDriverState *bs)
+static int nbd_establish_connection(BlockDriverState *bs,
+                                    NBDConnection *conn)
 {
     BDRVNBDState *s = bs->opaque;
     int sock;
     int ret;
+    uint32_t nbdflags;
     off_t size;
     size_t blocksize;
 
@@ -273,7 +416,7 @@ static int nbd_establish_connection(BlockDriverState *bs)
     }
 
     /* NBD handshake */
-    ret = nbd_receive_negotiate(sock, s->export_name, &s->nbdflags, &size,
+    ret = nbd_receive_negotiate(sock, s->export_name, &nbdflags, &size,
                                 &blocksize);
     if (ret < 0) {
         logout("Failed to negotiate with the NBD server\n");
@@ -281,13 +424,23 @@ static int nbd_establish_connection(BlockDriverState *bs)
         return ret;
     }
 
+    /* All connections must go to the same export */
+    if (conn != &s->conns[0] && (size != s->size || nbdflags != s->nbdflags)) {
+        logout("Connections to the NBD server see different exports\n");
+        closesocket(sock);
+        return -EINVAL;
+    }
+
     /* Now that we're connected, set the socket to be non-blocking and
      * kick the reply mechanism.  */
     socket_set_nonblock(sock);
     qemu_aio_set_fd_handler(sock, nbd_reply_ready, NULL,
-                            nbd_have_request, s);
+                            nbd_have_request, conn);
 
-    s->sock = sock;
+    qemu_co_mutex_init(&conn->send_mutex);
+    qemu_co_mutex_init(&conn->free_sema);
+    conn->sock = sock;
+    s->nbdflags = nbdflags;
     s->size = size;
     s->blocksize = blocksize;
 
@@ -295,27 +448,24 @@ static int nbd_establish_connection(BlockDriverState *bs)
     return 0;
 }
 
-static void nbd_teardown_connection(BlockDriverState *bs)
+static void nbd_teardown_connection(NBDConnection *conn)
 {
-    BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
 
     request.type = NBD_CMD_DISC;
     request.from = 0;
     request.len = 0;
-    nbd_send_request(s->sock, &request);
+    nbd_send_request(conn->sock, &request);
 
-    qemu_aio_set_fd_handler(s->sock, NULL, NULL, NULL, NULL);
-    closesocket(s->sock);
+    qemu_aio_set_fd_handler(conn->sock, NULL, NULL, NULL, NULL);
+    closesocket(conn->sock);
 }
 
 static int nbd_open(BlockDriverState *bs, const char* filename, int flags)
 {
     BDRVNBDState *s = bs->opaque;
     int result;
-
-    qemu_co_mutex_init(&s->send_mutex);
-    qemu_co_mutex_init(&s->free_sema);
+    int i;
 
     /* Pop the config into our state object. Exit if invalid. */
     result = nbd_config(s, filename, flags);
@@ -323,12 +473,29 @@ static int nbd_open(BlockDriverState *bs, const char* filename, int flags)
         return result;
     }
 
-    /* establish TCP connection, return error if it fails
+    /* The first read doesn't count as sequential */
+    s->ra_next = -1;
+    for (i = 0; i < NBD_READAHEAD_SLOTS; i++) {
+        s->ra[i].bs = bs;
+        qemu_co_queue_init(&s->ra[i].waiters);
+    }
+
+    /* establish TCP connections, return error if one of them fails
      * TODO: Configurable retry-until-timeout behaviour.
      */
-    result = nbd_establish_connection(bs);
+    for (i = 0; i < s->nb_conns; i++) {
+        result = nbd_establish_connection(bs, &s->conns[i]);
+        if (result < 0) {
+            while (--i >= 0) {
+                nbd_teardown_connection(&s->conns[i]);
+            }
+            g_free(s->export_name);
+            g_free(s->host_spec);
+            return result;
+        }
+    }
 
-    return result;
+    return 0;
 }
 
 static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
@@ -337,23 +504,12 @@ static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
 {
     BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
-    struct nbd_reply reply;
-    ssize_t ret;
 
     request.type = NBD_CMD_READ;
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, NULL, 0);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(s, &request, &reply, qiov->iov, offset);
-    }
-    nbd_coroutine_end(s, &request);
-    return -reply.error;
-
+    return nbd_co_request(nbd_get_connection(s), &request, qiov, offset);
 }
 
 static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
@@ -362,8 +518,6 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
 {
     BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
-    struct nbd_reply reply;
-    ssize_t ret;
 
     request.type = NBD_CMD_WRITE;
     if (!bdrv_enable_write_cache(bs) && (s->nbdflags & NBD_FLAG_SEND_FUA)) {
@@ -373,83 +527,294 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, qiov->iov, offset);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(s, &request, &reply, NULL, 0);
-    }
-    nbd_coroutine_end(s, &request);
-    return -reply.error;
+    return nbd_co_request(nbd_get_connection(s), &request, qiov, offset);
 }
 
 /* qemu-nbd has a limit of slightly less than 1M per request.  Try to
  * remain aligned to 4K. */
 #define NBD_MAX_SECTORS 2040
 
+/*
+ * Requests larger than NBD_MAX_SECTORS are split, and the parts are sent in
+ * parallel from separate coroutines, so that they are spread over all
+ * connections.
+ */
+typedef struct NBDSplitRequest {
+    Coroutine *co;
+    int pending;
+    int ret;
+} NBDSplitRequest;
+
+typedef struct NBDSplitPart {
+    NBDSplitRequest *req;
+    BlockDriverState *bs;
+    int64_t sector_num;
+    int nb_sectors;
+    QEMUIOVector *qiov;
+    int offset;
+    bool is_write;
+} NBDSplitPart;
+
+static void coroutine_fn nbd_split_part_entry(void *opaque)
+{
+    NBDSplitPart *part = opaque;
+    NBDSplitRequest *req = part->req;
+    int ret;
+
+    if (part->is_write) {
+        ret = nbd_co_writev_1(part->bs, part->sector_num, part->nb_sectors,
+                              part->qiov, part->offset);
+    } else {
+        ret = nbd_co_readv_1(part->bs, part->sector_num, part->nb_sectors,
+                             part->qiov, part->offset);
+    }
+    if (ret < 0 && req->ret == 0) {
+        req->ret = ret;
+    }
+
+    if (--req->pending == 0) {
+        qemu_coroutine_enter(req->co, NULL);
+    }
+}
+
+static int nbd_co_rw(BlockDriverState *bs, int64_t sector_num,
+                     int nb_sectors, QEMUIOVector *qiov, bool is_write)
+{
+    NBDSplitRequest req;
+    NBDSplitPart *parts;
+    int i, nb_parts, n;
+
+    if (nb_sectors <= NBD_MAX_SECTORS) {
+        if (is_write) {
+            return nbd_co_writev_1(bs, sector_num, nb_sectors, qiov, 0);
+        } else {
+            return nbd_co_readv_1(bs, sector_num, nb_sectors, qiov, 0);
+        }
+    }
+
+    nb_parts = DIV_ROUND_UP(nb_sectors, NBD_MAX_SECTORS);
+    parts = g_new(NBDSplitPart, nb_parts);
+    req = (NBDSplitRequest) {
+        .co         = qemu_coroutine_self(),
+        .pending    = nb_parts + 1,
+        .ret        = 0,
+    };
+
+    for (i = 0; i < nb_parts; i++) {
+        n = MIN(nb_sectors - i * NBD_MAX_SECTORS, NBD_MAX_SECTORS);
+        parts[i] = (NBDSplitPart) {
+            .req        = &req,
+            .bs         = bs,
+            .sector_num = sector_num + i * NBD_MAX_SECTORS,
+            .nb_sectors = n,
+            .qiov       = qiov,
+            .offset     = i * NBD_MAX_SECTORS * 512,
+            .is_write   = is_write,
+        };
+        qemu_coroutine_enter(qemu_coroutine_create(nbd_split_part_entry),
+                             &parts[i]);
+    }
+
+    /* The parts only complete after yielding */
+    if (--req.pending > 0) {
+        qemu_coroutine_yield();
+    }
+
+    g_free(parts);
+    return req.ret;
+}
+
+/*
+ * Sequential reads are detected by comparing each read with the end of the
+ * previous one.  While they continue, the next window is read into one of
+ * the read-ahead slots in the background, and the window grows up to
+ * NBD_READAHEAD_MAX_SECTORS.  Reads that are completely covered by a slot
+ * are served from it; a random read resets the window.
+ */
+
+static void coroutine_fn nbd_readahead_entry(void *opaque)
+{
+    NBDReadahead *ra = opaque;
+    BDRVNBDState *s = ra->bs->opaque;
+    QEMUIOVector qiov;
+    struct iovec iov = {
+        .iov_base   = ra->buf,
+        .iov_len    = ra->nb_sectors * 512,
+    };
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    ra->ret = nbd_co_rw(ra->bs, ra->sector_num, ra->nb_sectors, &qiov,
+                        false);
+    if (ra->ret == 0) {
+        s->ra_bytes += ra->nb_sectors * 512;
+    }
+
+    ra->in_flight = false;
+    qemu_co_queue_restart_all(&ra->waiters);
+}
+
+static bool nbd_readahead_overlaps(NBDReadahead *ra, int64_t sector_num,
+                                   int64_t end)
+{
+    return ra->nb_sectors && ra->sector_num < end &&
+           sector_num < ra->sector_num + ra->nb_sectors;
+}
+
+static void nbd_readahead_start(BlockDriverState *bs, int64_t sector_num,
+                                int nb_sectors)
+{
+    BDRVNBDState *s = bs->opaque;
+    int64_t total_sectors = s->size / 512;
+    int64_t start;
+    NBDReadahead *ra = NULL;
+    int i, n;
+
+    if (sector_num == s->ra_next) {
+        s->ra_window = s->ra_window ? MIN(s->ra_window * 2,
+                                          NBD_READAHEAD_MAX_SECTORS)
+                                    : NBD_READAHEAD_MIN_SECTORS;
+    } else {
+        s->ra_window = 0;
+        s->ra_end = 0;
+    }
+    s->ra_next = sector_num + nb_sectors;
+
+    /* Stay one window ahead of the reader */
+    start = MAX(s->ra_next, s->ra_end);
+    if (s->ra_window == 0 || start - s->ra_next >= s->ra_window ||
+        start >= total_sectors) {
+        return;
+    }
+
+    /* Slots with data that the current read or later ones need are busy */
+    for (i = 0; i < NBD_READAHEAD_SLOTS; i++) {
+        if (!s->ra[i].in_flight &&
+            !nbd_readahead_overlaps(&s->ra[i], sector_num, s->ra_end)) {
+            ra = &s->ra[i];
+            break;
+        }
+    }
+    if (!ra) {
+        return;
+    }
+
+    n = MIN(s->ra_window, total_sectors - start);
+    if (!ra->buf) {
+        ra->buf = qemu_blockalign(bs, NBD_READAHEAD_MAX_SECTORS * 512);
+    }
+    ra->sector_num = start;
+    ra->nb_sectors = n;
+    ra->in_flight = true;
+    ra->valid = true;
+    s->ra_end = start + n;
+
+    qemu_coroutine_enter(qemu_coroutine_create(nbd_readahead_entry), ra);
+}
+
+/* Returns true if the read was served from the read-ahead slots */
+static bool coroutine_fn nbd_readahead_read(BlockDriverState *bs,
+                                            int64_t sector_num,
+                                            int nb_sectors,
+                                            QEMUIOVector *qiov)
+{
+    BDRVNBDState *s = bs->opaque;
+    int64_t end = sector_num + nb_sectors;
+    NBDReadahead *ra;
+    int i;
+
+    for (i = 0; i < NBD_READAHEAD_SLOTS; i++) {
+        ra = &s->ra[i];
+        while (ra->in_flight && ra->valid && ra->sector_num <= sector_num &&
+               end <= ra->sector_num + ra->nb_sectors) {
+            qemu_co_queue_wait(&ra->waiters);
+        }
+
+        /* The slot may have been invalidated or reused while waiting */
+        if (!ra->in_flight && ra->valid && ra->ret == 0 &&
+            ra->sector_num <= sector_num &&
+            end <= ra->sector_num + ra->nb_sectors) {
+            qemu_iovec_from_buffer(qiov,
+                ra->buf + (sector_num - ra->sector_num) * 512,
+                nb_sectors * 512);
+            s->ra_hits++;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void nbd_readahead_invalidate(BDRVNBDState *s, int64_t sector_num,
+                                     int nb_sectors)
+{
+    int i;
+
+    for (i = 0; i < NBD_READAHEAD_SLOTS; i++) {
+        if (nbd_readahead_overlaps(&s->ra[i], sector_num,
+                                   sector_num + nb_sectors)) {
+            s->ra[i].valid = false;
+        }
+    }
+}
+
 static int nbd_co_readv(BlockDriverState *bs, int64_t sector_num,
                         int nb_sectors, QEMUIOVector *qiov)
 {
-    int offset = 0;
-    int ret;
-    while (nb_sectors > NBD_MAX_SECTORS) {
-        ret = nbd_co_readv_1(bs, sector_num, NBD_MAX_SECTORS, qiov, offset);
-        if (ret < 0) {
-            return ret;
+    BDRVNBDState *s = bs->opaque;
+
+    if (s->readahead) {
+        nbd_readahead_start(bs, sector_num, nb_sectors);
+        if (nbd_readahead_read(bs, sector_num, nb_sectors, qiov)) {
+            return 0;
         }
-        offset += NBD_MAX_SECTORS * 512;
-        sector_num += NBD_MAX_SECTORS;
-        nb_sectors -= NBD_MAX_SECTORS;
     }
-    return nbd_co_readv_1(bs, sector_num, nb_sectors, qiov, offset);
+
+    return nbd_co_rw(bs, sector_num, nb_sectors, qiov, false);
 }
 
 static int nbd_co_writev(BlockDriverState *bs, int64_t sector_num,
                          int nb_sectors, QEMUIOVector *qiov)
 {
-    int offset = 0;
+    BDRVNBDState *s = bs->opaque;
     int ret;
-    while (nb_sectors > NBD_MAX_SECTORS) {
-        ret = nbd_co_writev_1(bs, sector_num, NBD_MAX_SECTORS, qiov, offset);
-        if (ret < 0) {
-            return ret;
-        }
-        offset += NBD_MAX_SECTORS * 512;
-        sector_num += NBD_MAX_SECTORS;
-        nb_sectors -= NBD_MAX_SECTORS;
-    }
-    return nbd_co_writev_1(bs, sector_num, nb_sectors, qiov, offset);
+
+    /* Read-ahead that overlaps the write, even if it is only sent while the
+     * write is in flight, may return old data */
+    nbd_readahead_invalidate(s, sector_num, nb_sectors);
+    ret = nbd_co_rw(bs, sector_num, nb_sectors, qiov, true);
+    nbd_readahead_invalidate(s, sector_num, nb_sectors);
+
+    return ret;
 }
 
 static int nbd_co_flush(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
-    struct nbd_reply reply;
-    ssize_t ret;
+    int i, ret;
 
     if (!(s->nbdflags & NBD_FLAG_SEND_FLUSH)) {
         return 0;
     }
 
-    request.type = NBD_CMD_FLUSH;
-    if (s->nbdflags & NBD_FLAG_SEND_FUA) {
-        request.type |= NBD_CMD_FLAG_FUA;
-    }
+    /* The server may only flush writes that were sent over the same
+     * connection */
+    for (i = 0; i < s->nb_conns; i++) {
+        request.type = NBD_CMD_FLUSH;
+        if (s->nbdflags & NBD_FLAG_SEND_FUA) {
+            request.type |= NBD_CMD_FLAG_FUA;
+        }
 
-    request.from = 0;
-    request.len = 0;
+        request.from = 0;
+        request.len = 0;
 
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, NULL, 0);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(s, &request, &reply, NULL, 0);
+        ret = nbd_co_request(&s->conns[i], &request, NULL, 0);
+        if (ret < 0) {
+            return ret;
+        }
     }
-    nbd_coroutine_end(s, &request);
-    return -reply.error;
+
+    return 0;
 }
 
 static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
@@ -457,8 +822,7 @@ static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
 {
     BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
-    struct nbd_reply reply;
-    ssize_t ret;
+    int ret;
 
     if (!(s->nbdflags & NBD_FLAG_SEND_TRIM)) {
         return 0;
@@ -467,24 +831,29 @@ static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, NULL, 0);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(s, &request, &reply, NULL, 0);
-    }
-    nbd_coroutine_end(s, &request);
-    return -reply.error;
+    nbd_readahead_invalidate(s, sector_num, nb_sectors);
+    ret = nbd_co_request(nbd_get_connection(s), &request, NULL, 0);
+    nbd_readahead_invalidate(s, sector_num, nb_sectors);
+
+    return ret;
 }
 
 static void nbd_close(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
+    int i;
+
     g_free(s->export_name);
     g_free(s->host_spec);
 
-    nbd_teardown_connection(bs);
+    for (i = 0; i < NBD_READAHEAD_SLOTS; i++) {
+        assert(!s->ra[i].in_flight);
+        qemu_vfree(s->ra[i].buf);
+    }
+
+    for (i = 0; i < s->nb_conns; i++) {
+        nbd_teardown_connection(&s->conns[i]);
+    }
 }
 
 static int64_t nbd_getlength(BlockDriverState *bs)
@@ -494,6 +863,34 @@ static int64_t nbd_getlength(BlockDriverState *bs)
     return s->size;
 }
 
+static void nbd_get_stats(BlockDriverState *bs, BlockDeviceStats *stats)
+{
+    BDRVNBDState *s = bs->opaque;
+    NbdConnectionStatsList *list = NULL, *entry;
+    int i;
+
+    stats->has_readahead_hits = true;
+    stats->readahead_hits = s->ra_hits;
+    stats->has_readahead_bytes = true;
+    stats->readahead_bytes = s->ra_bytes;
+
+    for (i = s->nb_conns - 1; i >= 0; i--) {
+        NBDConnection *conn = &s->conns[i];
+
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->requests = conn->nr_requests;
+        entry->value->in_flight = conn->in_flight;
+        entry->value->total_time_ns = conn->total_time_ns;
+        entry->value->max_time_ns = conn->max_time_ns;
+        entry->next = list;
+        list = entry;
+    }
+
+    stats->has_nbd_connections = true;
+    stats->nbd_connections = list;
+}
+
 static BlockDriver bdrv_nbd = {
     .format_name         = "nbd",
     .instance_size       = sizeof(BDRVNBDState),
@@ -504,6 +901,7 @@ static BlockDriver bdrv_nbd = {
     .bdrv_co_flush_to_os = nbd_co_flush,
     .bdrv_co_discard     = nbd_co_discard,
     .bdrv_getlength      = nbd_getlength,
+    .bdrv_get_stats      = nbd_get_stats,
     .protocol_name       = "nbd",
 };
 
@@ -769,8 +769,10 @@ static int qcow_make_empty(BlockDriverState *bs)
 
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
-static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                                 const uint8_t *buf, int nb_sectors)
+static coroutine_fn int qcow_co_write_compressed(BlockDriverState *bs,
+                                                 int64_t sector_num,
+                                                 const uint8_t *buf,
+                                                 int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
     z_stream strm;
@@ -778,6 +780,9 @@ static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
     uint8_t *out_buf;
     uint64_t cluster_offset;
 
+    if (nb_sectors == 0) {
+        return 0;
+    }
     if (nb_sectors != s->cluster_sectors)
         return -EINVAL;
 
@@ -815,15 +820,18 @@ static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
             goto fail;
         }
     } else {
+        qemu_co_mutex_lock(&s->lock);
         cluster_offset = get_cluster_offset(bs, sector_num << 9, 2,
                                             out_len, 0, 0);
         if (cluster_offset == 0) {
+            qemu_co_mutex_unlock(&s->lock);
             ret = -EIO;
             goto fail;
         }
 
         cluster_offset &= s->cluster_offset_mask;
         ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
+        qemu_co_mutex_unlock(&s->lock);
         if (ret < 0) {
             goto fail;
         }
@@ -876,7 +884,7 @@ static BlockDriver bdrv_qcow = {
 
     .bdrv_set_key           = qcow_set_key,
     .bdrv_make_empty        = qcow_make_empty,
-    .bdrv_write_compressed  = qcow_write_compressed,
+    .bdrv_co_write_compressed = qcow_co_write_compressed,
     .bdrv_get_info          = qcow_get_info,
 
     .create_options = qcow_create_options,
@@ -31,8 +31,9 @@ typedef struct Qcow2CachedTable {
     void*   table;
     int64_t offset;
     bool    dirty;
-    int     cache_hits;
     int     ref;
+    int     hash_next;  /* next entry in the same hash bucket, or -1 */
+    QTAILQ_ENTRY(Qcow2CachedTable) lru;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
@@ -41,6 +42,21 @@ struct Qcow2Cache {
     int                     size;
     bool                    depends_on_flush;
     bool                    writethrough;
+
+    /* all tables in one allocation, so that put() can find the entry of a
+     * table without searching */
+    uint8_t*                tables;
+    int                     table_bits;
+
+    /* cached offsets are hashed into buckets of entry indexes */
+    int*                    buckets;
+    int                     hash_bits;
+
+    /* least recently used entries first */
+    QTAILQ_HEAD(, Qcow2CachedTable) lru;
+
+    uint64_t                hits;
+    uint64_t                misses;
 };
 
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
@@ -55,8 +71,23 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
     c->entries = g_malloc0(sizeof(*c->entries) * num_tables);
     c->writethrough = writethrough;
 
+    c->table_bits = s->cluster_bits;
+    c->tables = qemu_blockalign(bs, (size_t)num_tables << c->table_bits);
+
+    c->hash_bits = 1;
+    while ((1 << c->hash_bits) < num_tables) {
+        c->hash_bits++;
+    }
+    c->buckets = g_malloc(sizeof(*c->buckets) << c->hash_bits);
+    for (i = 0; i < (1 << c->hash_bits); i++) {
+        c->buckets[i] = -1;
+    }
+
+    QTAILQ_INIT(&c->lru);
     for (i = 0; i < c->size; i++) {
-        c->entries[i].table = qemu_blockalign(bs, s->cluster_size);
+        c->entries[i].table = c->tables + ((size_t)i << c->table_bits);
+        c->entries[i].hash_next = -1;
+        QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru);
     }
 
     return c;
@@ -68,15 +99,77 @@ int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        qemu_vfree(c->entries[i].table);
     }
 
+    qemu_vfree(c->tables);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
     return 0;
 }
 
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses)
+{
+    *hits = c->hits;
+    *misses = c->misses;
+}
+
+static int qcow2_cache_hash(Qcow2Cache *c, uint64_t offset)
+{
+    return ((offset >> c->table_bits) * 0x9e3779b97f4a7c15ULL) >>
+           (64 - c->hash_bits);
+}
+
+static int qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i;
+
+    for (i = c->buckets[qcow2_cache_hash(c, offset)]; i >= 0;
+         i = c->entries[i].hash_next) {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void qcow2_cache_hash_remove(Qcow2Cache *c, int i)
+{
+    int *p;
+
+    if (!c->entries[i].offset) {
+        return;
+    }
+
+    p = &c->buckets[qcow2_cache_hash(c, c->entries[i].offset)];
+    while (*p != i) {
+        assert(*p >= 0);
+        p = &c->entries[*p].hash_next;
+    }
+    *p = c->entries[i].hash_next;
+    c->entries[i].hash_next = -1;
+    c->entries[i].offset = 0;
+}
+
+static void qcow2_cache_hash_insert(Qcow2Cache *c, int i, uint64_t offset)
+{
+    int h = qcow2_cache_hash(c, offset);
+
+    c->entries[i].offset = offset;
+    c->entries[i].hash_next = c->buckets[h];
+    c->buckets[h] = i;
+}
+
+static int qcow2_cache_table_index(Qcow2Cache *c, void *table)
+{
+    ptrdiff_t pos = (uint8_t *)table - c->tables;
+
+    assert(pos >= 0 && (pos >> c->table_bits) < c->size &&
+           (pos & ((1 << c->table_bits) - 1)) == 0);
+    return pos >> c->table_bits;
+}
+
 static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
 {
     int ret;
@@ -190,32 +283,18 @@ void qcow2_cache_depends_on_flush(Qcow2Cache *c)
 
 static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c)
 {
-    int i;
-    int min_count = INT_MAX;
-    int min_index = -1;
-
+    Qcow2CachedTable *entry;
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].ref) {
-            continue;
-        }
-
-        if (c->entries[i].cache_hits < min_count) {
-            min_index = i;
-            min_count = c->entries[i].cache_hits;
+    /* Evict the least recently used table that isn't in use */
+    QTAILQ_FOREACH(entry, &c->lru, lru) {
+        if (!entry->ref) {
+            return entry - c->entries;
         }
-
-        /* Give newer hits priority */
-        /* TODO Check how to optimize the replacement strategy */
-        c->entries[i].cache_hits /= 2;
     }
 
-    if (min_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
-    }
-    return min_index;
+    /* This can't happen in current synchronous code, but leave the check
+     * here as a reminder for whoever starts using AIO with the cache */
+    abort();
 }
 
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
@@ -229,10 +308,10 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
                           offset, read_from_disk);
 
     /* Check if the table is already cached */
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            goto found;
-        }
+    i = qcow2_cache_lookup(c, offset);
+    if (i >= 0) {
+        c->hits++;
+        goto found;
     }
 
     /* If not, write a table back and replace it */
@@ -250,8 +329,9 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    qcow2_cache_hash_remove(c, i);
     if (read_from_disk) {
+        c->misses++;
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
@@ -262,14 +342,12 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
         }
     }
 
-    /* Give the table some hits for the start so that it won't be replaced
-     * immediately. The number 32 is completely arbitrary. */
-    c->entries[i].cache_hits = 32;
-    c->entries[i].offset = offset;
+    qcow2_cache_hash_insert(c, i, offset);
 
     /* And return the right table */
 found:
-    c->entries[i].cache_hits++;
+    QTAILQ_REMOVE(&c->lru, &c->entries[i], lru);
+    QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru);
     c->entries[i].ref++;
     *table = c->entries[i].table;
 
@@ -293,16 +371,8 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 {
-    int i;
-
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == *table) {
-            goto found;
-        }
-    }
-    return -ENOENT;
+    int i = qcow2_cache_table_index(c, *table);
 
-found:
     c->entries[i].ref--;
     *table = NULL;
 
@@ -315,19 +385,19 @@ found:
     }
 }
 
-void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
+void qcow2_cache_put_deferred(Qcow2Cache *c, void **table)
 {
-    int i;
+    int i = qcow2_cache_table_index(c, *table);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == table) {
-            goto found;
-        }
-    }
-    abort();
+    c->entries[i].ref--;
+    *table = NULL;
 
-found:
-    c->entries[i].dirty = true;
+    assert(c->entries[i].ref >= 0);
+}
+
+void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
+{
+    c->entries[qcow2_cache_table_index(c, table)].dirty = true;
 }
 
 bool qcow2_cache_set_writethrough(BlockDriverState *bs, Qcow2Cache *c,
@@ -69,9 +69,11 @@ int qcow2_grow_l1_table(BlockDriverState *bs, int min_size, bool exact_size)
         return new_l1_table_offset;
     }
 
-    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
-    if (ret < 0) {
-        goto fail;
+    if (qcow2_need_accurate_refcounts(s)) {
+        ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+        if (ret < 0) {
+            goto fail;
+        }
     }
 
     BLKDBG_EVENT(bs->file, BLKDBG_L1_GROW_WRITE_TABLE);
@@ -175,14 +177,16 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 
     /* allocate a new l2 entry */
 
-    l2_offset = qcow2_alloc_clusters(bs, s->l2_size * sizeof(uint64_t));
+    l2_offset = qcow2_alloc_clusters(bs, s->cluster_size);
     if (l2_offset < 0) {
         return l2_offset;
     }
 
-    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
-    if (ret < 0) {
-        goto fail;
+    if (qcow2_need_accurate_refcounts(s)) {
+        ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+        if (ret < 0) {
+            goto fail;
+        }
     }
 
     /* allocate a new entry in the l2 cache */
@@ -197,7 +201,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 
     if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
         /* if there was no old l2 table, clear the new table */
-        memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
+        memset(l2_table, 0, s->cluster_size);
     } else {
         uint64_t* old_table;
 
@@ -253,33 +257,42 @@ fail:
  * to the first cluster, the search is stopped and the cluster is not counted
  * as contiguous. (This allows it, for example, to stop at the first compressed
  * cluster which may require a different handling)
+ *
+ * Standard clusters that have unallocated subclusters are never counted.
  */
-static int count_contiguous_clusters(uint64_t nb_clusters, int cluster_size,
-        uint64_t *l2_table, uint64_t start, uint64_t stop_flags)
+static int count_contiguous_clusters(BDRVQcowState *s, uint64_t nb_clusters,
+        uint64_t *l2_table, int l2_index, uint64_t stop_flags)
 {
     int i;
     uint64_t mask = stop_flags | L2E_OFFSET_MASK;
-    uint64_t offset = be64_to_cpu(l2_table[0]) & mask;
+    uint64_t offset = get_l2_entry(s, l2_table, l2_index) & mask;
 
     if (!offset)
         return 0;
 
-    for (i = start; i < start + nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[i]) & mask;
-        if (offset + (uint64_t) i * cluster_size != l2_entry) {
+    for (i = 0; i < nb_clusters; i++) {
+        uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index + i);
+        if (offset + (uint64_t) i * s->cluster_size != (l2_entry & mask)) {
+            break;
+        }
+        if (qcow2_get_cluster_type(l2_entry) == QCOW2_CLUSTER_NORMAL &&
+            get_l2_bitmap(s, l2_table, l2_index + i) !=
+            QCOW_EXTL2_ALL_ALLOCATED) {
             break;
         }
     }
 
-	return (i - start);
+    return i;
 }
 
-static int count_contiguous_free_clusters(uint64_t nb_clusters, uint64_t *l2_table)
+static int count_contiguous_free_clusters(BDRVQcowState *s,
+        uint64_t nb_clusters, uint64_t *l2_table, int l2_index)
 {
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        int type = qcow2_get_cluster_type(be64_to_cpu(l2_table[i]));
+        int type = qcow2_get_cluster_type(get_l2_entry(s, l2_table,
+                                                       l2_index + i));
 
         if (type != QCOW2_CLUSTER_UNALLOCATED) {
             break;
@@ -289,29 +302,42 @@ static int count_contiguous_free_clusters(uint64_t nb_clusters, uint64_t *l2_tab
     return i;
 }
 
-/* The crypt function is compatible with the linux cryptoloop
-   algorithm for < 4 GB images. NOTE: out_buf == in_buf is
-   supported */
-void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
-                           uint8_t *out_buf, const uint8_t *in_buf,
-                           int nb_sectors, int enc,
-                           const AES_KEY *key)
+/*
+ * Returns the subclusters that overlap the sectors [start, end) of a cluster
+ * as a bitmap for an extended L2 entry.
+ */
+static uint32_t subcluster_bitmap(BDRVQcowState *s, int start, int end)
 {
-    union {
-        uint64_t ll[2];
-        uint8_t b[16];
-    } ivec;
-    int i;
+    int first, last;
 
-    for(i = 0; i < nb_sectors; i++) {
-        ivec.ll[0] = cpu_to_le64(sector_num);
-        ivec.ll[1] = 0;
-        AES_cbc_encrypt(in_buf, out_buf, 512, key,
-                        ivec.b, enc);
-        sector_num++;
-        in_buf += 512;
-        out_buf += 512;
+    if (start >= end) {
+        return 0;
     }
+
+    first = start / s->subcluster_sectors;
+    last = DIV_ROUND_UP(end, s->subcluster_sectors);
+
+    return ((1ULL << last) - 1) & ~((1ULL << first) - 1);
+}
+
+/*
+ * Starting at the subcluster that contains the sector index_in_cluster, finds
+ * the subclusters that are all allocated or all unallocated in bitmap.
+ * Returns the first sector after them; *allocated is set to their state.
+ */
+static int count_subcluster_sectors(BDRVQcowState *s, uint32_t bitmap,
+                                    int index_in_cluster, bool *allocated)
+{
+    int i = index_in_cluster / s->subcluster_sectors;
+
+    *allocated = bitmap & (1U << i);
+    for (i++; i < QCOW_EXTL2_SUBCLUSTERS; i++) {
+        if (!!(bitmap & (1U << i)) != *allocated) {
+            break;
+        }
+    }
+
+    return i * s->subcluster_sectors;
 }
 
 static int coroutine_fn copy_sectors(BlockDriverState *bs,
@@ -355,9 +381,9 @@ static int coroutine_fn copy_sectors(BlockDriverState *bs,
     }
 
     if (s->crypt_method) {
-        qcow2_encrypt_sectors(s, start_sect + n_start,
-                        iov.iov_base, iov.iov_base, n, 1,
-                        &s->aes_encrypt_key);
+        qcow2_co_encrypt_sectors(bs, start_sect + n_start,
+                                 iov.iov_base, iov.iov_base, n, 1,
+                                 &s->aes_encrypt_key);
     }
 
     BLKDBG_EVENT(bs->file, BLKDBG_COW_WRITE);
@@ -443,7 +469,7 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     /* find the cluster offset for the given disk offset */
 
     l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
-    *cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    *cluster_offset = get_l2_entry(s, l2_table, l2_index);
     nb_clusters = size_to_clusters(s, nb_needed << 9);
 
     ret = qcow2_get_cluster_type(*cluster_offset);
@@ -454,28 +480,43 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
         *cluster_offset &= L2E_COMPRESSED_OFFSET_SIZE_MASK;
         break;
     case QCOW2_CLUSTER_ZERO:
-        c = count_contiguous_clusters(nb_clusters, s->cluster_size,
-                &l2_table[l2_index], 0,
+        c = count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
                 QCOW_OFLAG_COMPRESSED | QCOW_OFLAG_ZERO);
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_UNALLOCATED:
         /* how many empty clusters ? */
-        c = count_contiguous_free_clusters(nb_clusters, &l2_table[l2_index]);
+        c = count_contiguous_free_clusters(s, nb_clusters, l2_table, l2_index);
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_NORMAL:
         /* how many allocated clusters ? */
-        c = count_contiguous_clusters(nb_clusters, s->cluster_size,
-                &l2_table[l2_index], 0,
+        c = count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
                 QCOW_OFLAG_COMPRESSED | QCOW_OFLAG_ZERO);
         *cluster_offset &= L2E_OFFSET_MASK;
+
+        if (c == 0) {
+            /* Not all subclusters are allocated, so the cluster must be
+             * split into parts that are read from the image and parts that
+             * are read from the backing file */
+            bool allocated;
+
+            nb_available = count_subcluster_sectors(s,
+                get_l2_bitmap(s, l2_table, l2_index), index_in_cluster,
+                &allocated);
+            if (!allocated) {
+                ret = QCOW2_CLUSTER_UNALLOCATED;
+                *cluster_offset = 0;
+            }
+        }
         break;
     }
 
     qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
 
-    nb_available = (c * s->cluster_sectors);
+    if (c > 0) {
+        nb_available = (c * s->cluster_sectors);
+    }
 
 out:
     if (nb_available > nb_needed)
@@ -536,7 +577,7 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
 
         /* Then decrease the refcount of the old table */
         if (l2_offset) {
-            qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t));
+            qcow2_free_clusters(bs, l2_offset, s->cluster_size);
         }
         l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
     }
@@ -581,7 +622,7 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     /* Compression can't overwrite anything. Fail if the cluster was already
      * allocated. */
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_table, l2_index);
     if (cluster_offset & L2E_OFFSET_MASK) {
         qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
         return 0;
@@ -605,7 +646,8 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE_COMPRESSED);
     qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
-    l2_table[l2_index] = cpu_to_be64(cluster_offset);
+    set_l2_entry(s, l2_table, l2_index, cluster_offset);
+    set_l2_bitmap(s, l2_table, l2_index, 0);
     ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
     if (ret < 0) {
         return 0;
@@ -631,21 +673,21 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 
     /* copy content of unmodified sectors */
     start_sect = (m->offset & ~(s->cluster_size - 1)) >> 9;
-    if (m->n_start) {
+    if (m->n_start > m->cow_start) {
         cow = true;
         qemu_co_mutex_unlock(&s->lock);
-        ret = copy_sectors(bs, start_sect, cluster_offset, 0, m->n_start);
+        ret = copy_sectors(bs, start_sect, cluster_offset, m->cow_start,
+                m->n_start);
         qemu_co_mutex_lock(&s->lock);
         if (ret < 0)
             goto err;
     }
 
-    if (m->nb_available & (s->cluster_sectors - 1)) {
-        uint64_t end = m->nb_available & ~(uint64_t)(s->cluster_sectors - 1);
+    if (m->cow_end > m->nb_available) {
         cow = true;
         qemu_co_mutex_unlock(&s->lock);
-        ret = copy_sectors(bs, start_sect + end, cluster_offset + (end << 9),
-                m->nb_available - end, s->cluster_sectors);
+        ret = copy_sectors(bs, start_sect, cluster_offset, m->nb_available,
+                m->cow_end);
         qemu_co_mutex_lock(&s->lock);
         if (ret < 0)
             goto err;
@@ -656,13 +698,23 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
      *
      * Before we update the L2 table to actually point to the new cluster, we
      * need to be sure that the refcounts have been increased and COW was
-     * handled.
+     * handled. With lazy refcounts, the image is marked dirty instead and the
+     * refcounts are left to be written whenever the cache is flushed.
      */
     if (cow) {
         qcow2_cache_depends_on_flush(s->l2_table_cache);
     }
 
-    qcow2_cache_set_dependency(bs, s->l2_table_cache, s->refcount_block_cache);
+    if (s->use_lazy_refcounts) {
+        ret = qcow2_mark_dirty(bs);
+        if (ret < 0) {
+            goto err;
+        }
+    }
+    if (qcow2_need_accurate_refcounts(s)) {
+        qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                   s->refcount_block_cache);
+    }
     ret = get_cluster_table(bs, m->offset, &l2_table, &l2_index);
     if (ret < 0) {
         goto err;
@@ -670,24 +722,42 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
     qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
 
     for (i = 0; i < m->nb_clusters; i++) {
+        uint64_t old_entry = get_l2_entry(s, l2_table, l2_index + i);
+        uint64_t new_entry = (cluster_offset + (i << s->cluster_bits)) |
+                             QCOW_OFLAG_COPIED;
+        bool in_place = (old_entry == new_entry);
+
         /* if two concurrent writes happen to the same unallocated cluster
 	 * each write allocates separate cluster and writes data concurrently.
 	 * The first one to complete updates l2 table with pointer to its
 	 * cluster the second one has to do RMW (which is done above by
 	 * copy_sectors()), update l2 table with its cluster pointer and free
 	 * old cluster. This is what this loop does */
-        if(l2_table[l2_index + i] != 0)
-            old_cluster[j++] = l2_table[l2_index + i];
+        if (old_entry != 0 && !in_place) {
+            old_cluster[j++] = old_entry;
+        }
+
+        set_l2_entry(s, l2_table, l2_index + i, new_entry);
+
+        if (s->extended_l2) {
+            int first = i * s->cluster_sectors;
+            uint32_t bitmap;
 
-        l2_table[l2_index + i] = cpu_to_be64((cluster_offset +
-                    (i << s->cluster_bits)) | QCOW_OFLAG_COPIED);
+            /* Subclusters outside the COW areas keep reading from the
+             * backing file */
+            bitmap = subcluster_bitmap(s, MAX(m->cow_start, first) - first,
+                MIN(m->cow_end, first + s->cluster_sectors) - first);
+            if (in_place) {
+                bitmap |= get_l2_bitmap(s, l2_table, l2_index + i);
+            }
+            set_l2_bitmap(s, l2_table, l2_index + i, bitmap);
+        }
      }
 
 
-    ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
-    if (ret < 0) {
-        goto err;
-    }
+    /* In writethrough mode, the caller writes the table back, possibly
+     * together with the updates of other requests */
+    qcow2_cache_put_deferred(s->l2_table_cache, (void**) &l2_table);
 
     /*
      * If this was a COW, we need to decrease the refcount of the old cluster.
@@ -695,7 +765,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
      */
     if (j != 0) {
         for (i = 0; i < j; i++) {
-            qcow2_free_any_clusters(bs, be64_to_cpu(old_cluster[i]), 1);
+            qcow2_free_any_clusters(bs, old_cluster[i], 1);
         }
     }
 
@@ -716,7 +786,7 @@ static int count_cow_clusters(BDRVQcowState *s, int nb_clusters,
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[l2_index + i]);
+        uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index + i);
         int cluster_type = qcow2_get_cluster_type(l2_entry);
 
         switch(cluster_type) {
@@ -740,38 +810,20 @@ out:
 }
 
 /*
- * Allocates new clusters for the given guest_offset.
- *
- * At most *nb_clusters are allocated, and on return *nb_clusters is updated to
- * contain the number of clusters that have been allocated and are contiguous
- * in the image file.
- *
- * If *host_offset is non-zero, it specifies the offset in the image file at
- * which the new clusters must start. *nb_clusters can be 0 on return in this
- * case if the cluster at host_offset is already in use. If *host_offset is
- * zero, the clusters can be allocated anywhere in the image file.
- *
- * *host_offset is updated to contain the offset into the image file at which
- * the first allocated cluster starts.
+ * Check if there already is an AIO write request in flight which allocates
+ * the same cluster. In this case we need to wait until the previous request
+ * has completed and updated the L2 table accordingly.
  *
- * Return 0 on success and -errno in error cases. -EAGAIN means that the
- * function has been waiting for another request and the allocation must be
- * restarted, but the whole request should not be failed.
+ * *nb_clusters is reduced so that the request stops at the start of the
+ * first conflicting allocation. Returns -EAGAIN if the request had to wait
+ * for another one and must recheck the L2 table, 0 otherwise.
  */
-static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
-    uint64_t *host_offset, unsigned int *nb_clusters)
+static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
+    unsigned int *nb_clusters)
 {
     BDRVQcowState *s = bs->opaque;
     QCowL2Meta *old_alloc;
 
-    trace_qcow2_do_alloc_clusters_offset(qemu_coroutine_self(), guest_offset,
-                                         *host_offset, *nb_clusters);
-
-    /*
-     * Check if there already is an AIO write request in flight which allocates
-     * the same cluster. In this case we need to wait until the previous
-     * request has completed and updated the L2 table accordingly.
-     */
     QLIST_FOREACH(old_alloc, &s->cluster_allocs, next_in_flight) {
 
         uint64_t start = guest_offset >> s->cluster_bits;
@@ -779,7 +831,7 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
         uint64_t old_start = old_alloc->offset >> s->cluster_bits;
         uint64_t old_end = old_start + old_alloc->nb_clusters;
 
-        if (end < old_start || start > old_end) {
+        if (end <= old_start || start >= old_end) {
             /* No intersection */
         } else {
             if (start < old_start) {
@@ -800,6 +852,42 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
         }
     }
 
+    return 0;
+}
+
+/*
+ * Allocates new clusters for the given guest_offset.
+ *
+ * At most *nb_clusters are allocated, and on return *nb_clusters is updated to
+ * contain the number of clusters that have been allocated and are contiguous
+ * in the image file.
+ *
+ * If *host_offset is non-zero, it specifies the offset in the image file at
+ * which the new clusters must start. *nb_clusters can be 0 on return in this
+ * case if the cluster at host_offset is already in use. If *host_offset is
+ * zero, the clusters can be allocated anywhere in the image file.
+ *
+ * *host_offset is updated to contain the offset into the image file at which
+ * the first allocated cluster starts.
+ *
+ * Return 0 on success and -errno in error cases. -EAGAIN means that the
+ * function has been waiting for another request and the allocation must be
+ * restarted, but the whole request should not be failed.
+ */
+static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
+    uint64_t *host_offset, unsigned int *nb_clusters)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    trace_qcow2_do_alloc_clusters_offset(qemu_coroutine_self(), guest_offset,
+                                         *host_offset, *nb_clusters);
+
+    ret = handle_dependencies(bs, guest_offset, nb_clusters);
+    if (ret < 0) {
+        return ret;
+    }
+
     if (!*nb_clusters) {
         abort();
     }
@@ -815,7 +903,7 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
         *host_offset = cluster_offset;
         return 0;
     } else {
-        int ret = qcow2_alloc_clusters_at(bs, *host_offset, *nb_clusters);
+        ret = qcow2_alloc_clusters_at(bs, *host_offset, *nb_clusters);
         if (ret < 0) {
             return ret;
         }
@@ -824,6 +912,69 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
     }
 }
 
+/*
+ * With extended L2 entries, a partial write to a cluster that is unallocated in
+ * this image, or to an allocated cluster that still has unallocated
+ * subclusters, only needs to copy the subclusters that it touches; the others
+ * keep reading from the backing file. Returns the subclusters that are already
+ * allocated in such a cluster, or -1 if the whole cluster must be copied.
+ */
+static int64_t get_cow_bitmap(BDRVQcowState *s, uint64_t *l2_table,
+                              int l2_index)
+{
+    uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index);
+
+    if (!s->extended_l2) {
+        return -1;
+    }
+
+    switch (qcow2_get_cluster_type(l2_entry)) {
+    case QCOW2_CLUSTER_UNALLOCATED:
+        return 0;
+    case QCOW2_CLUSTER_NORMAL:
+        if (l2_entry & QCOW_OFLAG_COPIED) {
+            return get_l2_bitmap(s, l2_table, l2_index);
+        }
+        return -1;
+    default:
+        return -1;
+    }
+}
+
+/* Returns the first sector of a cluster that must be copied when a write
+ * starts at sector n_start in it */
+static int get_cow_start(BDRVQcowState *s, int64_t old_bitmap, int n_start)
+{
+    int sc;
+
+    if (old_bitmap < 0) {
+        return 0;
+    }
+
+    sc = n_start / s->subcluster_sectors;
+    if (old_bitmap & (1U << sc)) {
+        return n_start;
+    }
+    return sc * s->subcluster_sectors;
+}
+
+/* Returns the end of the area in a cluster that must be copied when a write
+ * ends at sector n_end (exclusive) in it */
+static int get_cow_end(BDRVQcowState *s, int64_t old_bitmap, int n_end)
+{
+    int sc;
+
+    if (old_bitmap < 0) {
+        return s->cluster_sectors;
+    }
+
+    sc = (n_end - 1) / s->subcluster_sectors;
+    if (old_bitmap & (1U << sc)) {
+        return n_end;
+    }
+    return (sc + 1) * s->subcluster_sectors;
+}
+
 /*
  * alloc_cluster_offset
  *
@@ -831,7 +982,9 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
  * file. If the offset is not found, allocate a new cluster.
  *
  * If the cluster was already allocated, m->nb_clusters is set to 0 and
- * other fields in m are meaningless.
+ * other fields in m are meaningless. With extended L2 entries, an allocated
+ * cluster is treated like a newly allocated one (in the same place) if the
+ * write touches some of its unallocated subclusters.
  *
  * If the cluster is newly allocated, m->nb_clusters is set to the number of
  * contiguous clusters that have been allocated. In this case, the other
@@ -849,8 +1002,10 @@ int qcow2_alloc_cluster_offset(BlockDriverState *bs, uint64_t offset,
     BDRVQcowState *s = bs->opaque;
     int l2_index, ret, sectors;
     uint64_t *l2_table;
-    unsigned int nb_clusters, keep_clusters;
+    unsigned int nb_clusters, keep_clusters, last_cluster;
     uint64_t cluster_offset;
+    int64_t first_bitmap, last_bitmap;
+    bool in_place;
 
     trace_qcow2_alloc_clusters_offset(qemu_coroutine_self(), offset,
                                       n_start, n_end);
@@ -869,7 +1024,8 @@ again:
     nb_clusters = MIN(size_to_clusters(s, n_end << BDRV_SECTOR_BITS),
                       s->l2_size - l2_index);
 
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_table, l2_index);
+    in_place = false;
 
     /*
      * Check how many clusters are already allocated and don't need COW, and how
@@ -880,9 +1036,21 @@ again:
     {
         /* We keep all QCOW_OFLAG_COPIED clusters */
         keep_clusters =
-            count_contiguous_clusters(nb_clusters, s->cluster_size,
-                                      &l2_table[l2_index], 0,
+            count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
                                       QCOW_OFLAG_COPIED | QCOW_OFLAG_ZERO);
+        if (keep_clusters == 0) {
+            /* Only some subclusters are allocated. If the write doesn't
+             * touch the others, it can still go to the cluster directly. */
+            uint32_t bitmap = get_l2_bitmap(s, l2_table, l2_index);
+            uint32_t needed = subcluster_bitmap(s, n_start,
+                MIN(n_end, s->cluster_sectors));
+
+            if ((bitmap & needed) == needed) {
+                keep_clusters = 1;
+            } else {
+                in_place = true;
+            }
+        }
         assert(keep_clusters <= nb_clusters);
         nb_clusters -= keep_clusters;
     } else {
@@ -890,9 +1058,12 @@ again:
         cluster_offset = 0;
     }
 
-    if (nb_clusters > 0) {
+    if (in_place) {
+        /* Allocate the missing subclusters in the existing cluster */
+        nb_clusters = 1;
+    } else if (nb_clusters > 0) {
         /* For the moment, overwrite compressed clusters one by one */
-        uint64_t entry = be64_to_cpu(l2_table[l2_index + keep_clusters]);
+        uint64_t entry = get_l2_entry(s, l2_table, l2_index + keep_clusters);
         if (entry & QCOW_OFLAG_COMPRESSED) {
             nb_clusters = 1;
         } else {
@@ -901,6 +1072,16 @@ again:
         }
     }
 
+    /* Find out how much of the first and the last cluster must be copied */
+    first_bitmap = last_bitmap = -1;
+    last_cluster = size_to_clusters(s, n_end << BDRV_SECTOR_BITS) - 1;
+    if (nb_clusters > 0) {
+        first_bitmap = get_cow_bitmap(s, l2_table, l2_index + keep_clusters);
+    }
+    if (last_cluster < keep_clusters + nb_clusters) {
+        last_bitmap = get_cow_bitmap(s, l2_table, l2_index + last_cluster);
+    }
+
     cluster_offset &= L2E_OFFSET_MASK;
 
     /*
@@ -930,15 +1111,20 @@ again:
         /* Calculate start and size of allocation */
         alloc_offset = offset + keep_bytes;
 
-        if (keep_clusters == 0) {
-            alloc_cluster_offset = 0;
+        if (in_place) {
+            alloc_cluster_offset = cluster_offset;
+            ret = handle_dependencies(bs, alloc_offset, &nb_clusters);
         } else {
-            alloc_cluster_offset = cluster_offset + keep_bytes;
-        }
+            if (keep_clusters == 0) {
+                alloc_cluster_offset = 0;
+            } else {
+                alloc_cluster_offset = cluster_offset + keep_bytes;
+            }
 
-        /* Allocate, if necessary at a given offset in the image file */
-        ret = do_alloc_cluster_offset(bs, alloc_offset, &alloc_cluster_offset,
-                                      &nb_clusters);
+            /* Allocate, if necessary at a given offset in the image file */
+            ret = do_alloc_cluster_offset(bs, alloc_offset,
+                                          &alloc_cluster_offset, &nb_clusters);
+        }
         if (ret == -EAGAIN) {
             goto again;
         } else if (ret < 0) {
@@ -948,17 +1134,29 @@ again:
         /* save info needed for meta data update */
         if (nb_clusters > 0) {
             int requested_sectors = n_end - keep_clusters * s->cluster_sectors;
-            int avail_sectors = (keep_clusters + nb_clusters)
+            int avail_sectors = nb_clusters
                                 << (s->cluster_bits - BDRV_SECTOR_BITS);
+            int alloc_n_start = keep_clusters == 0 ? n_start : 0;
+            int cow_end = avail_sectors;
+
+            if (requested_sectors <= avail_sectors) {
+                int last_start = avail_sectors - s->cluster_sectors;
+                cow_end = last_start + get_cow_end(s, last_bitmap,
+                                                   requested_sectors -
+                                                   last_start);
+            }
 
             *m = (QCowL2Meta) {
                 .cluster_offset = keep_clusters == 0 ?
                                   alloc_cluster_offset : cluster_offset,
                 .alloc_offset   = alloc_cluster_offset,
                 .offset         = alloc_offset,
-                .n_start        = keep_clusters == 0 ? n_start : 0,
+                .n_start        = alloc_n_start,
                 .nb_clusters    = nb_clusters,
                 .nb_available   = MIN(requested_sectors, avail_sectors),
+                .cow_start      = get_cow_start(s, first_bitmap,
+                                                alloc_n_start),
+                .cow_end        = cow_end,
             };
             qemu_co_queue_init(&m->dependent_requests);
             QLIST_INSERT_HEAD(&s->cluster_allocs, m, next_in_flight);
@@ -1060,14 +1258,15 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_offset;
 
-        old_offset = be64_to_cpu(l2_table[l2_index + i]);
+        old_offset = get_l2_entry(s, l2_table, l2_index + i);
         if ((old_offset & L2E_OFFSET_MASK) == 0) {
             continue;
         }
 
         /* First remove L2 entries */
         qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
-        l2_table[l2_index + i] = cpu_to_be64(0);
+        set_l2_entry(s, l2_table, l2_index + i, 0);
+        set_l2_bitmap(s, l2_table, l2_index + i, 0);
 
         /* Then decrease the refcount */
         qcow2_free_any_clusters(bs, old_offset, 1);
@@ -1140,15 +1339,17 @@ static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_offset;
 
-        old_offset = be64_to_cpu(l2_table[l2_index + i]);
+        old_offset = get_l2_entry(s, l2_table, l2_index + i);
 
         /* Update L2 entries */
         qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
         if (old_offset & QCOW_OFLAG_COMPRESSED) {
-            l2_table[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
+            set_l2_entry(s, l2_table, l2_index + i, QCOW_OFLAG_ZERO);
+            set_l2_bitmap(s, l2_table, l2_index + i, 0);
             qcow2_free_any_clusters(bs, old_offset, 1);
         } else {
-            l2_table[l2_index + i] |= cpu_to_be64(QCOW_OFLAG_ZERO);
+            set_l2_entry(s, l2_table, l2_index + i,
+                         old_offset | QCOW_OFLAG_ZERO);
         }
     }
 
@@ -0,0 +1,342 @@
+/*
+ * AES encryption for the QCOW2 format
+ *
+ * Copyright (c) 2004-2006 Fabrice Bellard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu-common.h"
+#include "block_int.h"
+#include "qemu-aio.h"
+#include "qemu-coroutine.h"
+#include "block/qcow2.h"
+
+#ifdef CONFIG_POSIX
+#include "block/raw-posix-aio.h"
+#endif
+
+#ifdef CONFIG_AESNI
+#include <cpuid.h>
+#include <wmmintrin.h>
+#endif
+
+//#define DEBUG_CRYPT
+
+#ifdef DEBUG_CRYPT
+#define DPRINTF(fmt, ...) \
+    do { printf("qcow2-crypto: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+/* Requests are only split between threads in pieces of at least this many
+ * sectors, smaller ones are not worth the round trip to another thread */
+#define QCOW2_CRYPT_MIN_JOB_SECTORS 64
+
+#define QCOW2_CRYPT_MAX_THREADS 16
+
+#ifdef CONFIG_AESNI
+
+/* Number of sectors that are encrypted side by side.  CBC encryption is
+ * serial within a sector, so this is what keeps the AES unit busy. */
+#define AESNI_LANES 4
+
+#define AESNI_FN __attribute__((target("aes,sse2")))
+
+static bool aesni_available;
+
+/* aes.c keeps the round keys as big endian words, and its decryption
+ * schedule is already the one for the equivalent inverse cipher that
+ * AESDEC implements, so both can be used as they are. */
+static AESNI_FN void aesni_load_key(__m128i *rk, const AES_KEY *key)
+{
+    int i;
+
+    for (i = 0; i <= key->rounds; i++) {
+        const uint32_t *w = &key->rd_key[4 * i];
+        rk[i] = _mm_set_epi32(bswap32(w[3]), bswap32(w[2]),
+                              bswap32(w[1]), bswap32(w[0]));
+    }
+}
+
+static AESNI_FN void aesni_encrypt_sectors(int64_t sector_num,
+                                           uint8_t *out_buf,
+                                           const uint8_t *in_buf,
+                                           int nb_sectors,
+                                           const AES_KEY *key)
+{
+    __m128i rk[AES_MAXNR + 1];
+    __m128i iv[AESNI_LANES], b[AESNI_LANES];
+    int rounds = key->rounds;
+    int i, j, r, n, off;
+
+    aesni_load_key(rk, key);
+
+    for (i = 0; i < nb_sectors; i += n) {
+        n = MIN(nb_sectors - i, AESNI_LANES);
+        for (j = 0; j < n; j++) {
+            iv[j] = _mm_set_epi64x(0, sector_num + i + j);
+        }
+        for (off = 0; off < 512; off += AES_BLOCK_SIZE) {
+            for (j = 0; j < n; j++) {
+                const uint8_t *in = in_buf + (i + j) * 512 + off;
+                b[j] = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in),
+                                     iv[j]);
+                b[j] = _mm_xor_si128(b[j], rk[0]);
+            }
+            for (r = 1; r < rounds; r++) {
+                for (j = 0; j < n; j++) {
+                    b[j] = _mm_aesenc_si128(b[j], rk[r]);
+                }
+            }
+            for (j = 0; j < n; j++) {
+                uint8_t *out = out_buf + (i + j) * 512 + off;
+                iv[j] = _mm_aesenclast_si128(b[j], rk[rounds]);
+                _mm_storeu_si128((__m128i *)out, iv[j]);
+            }
+        }
+    }
+}
+
+static AESNI_FN void aesni_decrypt_sectors(int64_t sector_num,
+                                           uint8_t *out_buf,
+                                           const uint8_t *in_buf,
+                                           int nb_sectors,
+                                           const AES_KEY *key)
+{
+    __m128i rk[AES_MAXNR + 1];
+    __m128i c[AESNI_LANES], b[AESNI_LANES], prev;
+    int rounds = key->rounds;
+    int i, j, r, off;
+
+    aesni_load_key(rk, key);
+
+    /* CBC decryption has no dependency between blocks, so decrypt
+     * AESNI_LANES blocks of the same sector at a time.  All input blocks
+     * are loaded before anything is stored, which keeps in-place
+     * decryption working. */
+    for (i = 0; i < nb_sectors; i++) {
+        prev = _mm_set_epi64x(0, sector_num + i);
+        for (off = 0; off < 512; off += AESNI_LANES * AES_BLOCK_SIZE) {
+            const uint8_t *in = in_buf + i * 512 + off;
+            uint8_t *out = out_buf + i * 512 + off;
+
+            for (j = 0; j < AESNI_LANES; j++) {
+                c[j] = _mm_loadu_si128((const __m128i *)in + j);
+                b[j] = _mm_xor_si128(c[j], rk[0]);
+            }
+            for (r = 1; r < rounds; r++) {
+                for (j = 0; j < AESNI_LANES; j++) {
+                    b[j] = _mm_aesdec_si128(b[j], rk[r]);
+                }
+            }
+            for (j = 0; j < AESNI_LANES; j++) {
+                b[j] = _mm_aesdeclast_si128(b[j], rk[rounds]);
+                b[j] = _mm_xor_si128(b[j], j ? c[j - 1] : prev);
+                _mm_storeu_si128((__m128i *)out + j, b[j]);
+            }
+            prev = c[AESNI_LANES - 1];
+        }
+    }
+}
+
+static void __attribute__((constructor)) aesni_init(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_AES)) {
+        aesni_available = true;
+    }
+}
+#endif /* CONFIG_AESNI */
+
+/* The crypt function is compatible with the linux cryptoloop
+   algorithm for < 4 GB images. NOTE: out_buf == in_buf is
+   supported */
+void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
+                           uint8_t *out_buf, const uint8_t *in_buf,
+                           int nb_sectors, int enc,
+                           const AES_KEY *key)
+{
+    union {
+        uint64_t ll[2];
+        uint8_t b[16];
+    } ivec;
+    int i;
+
+#ifdef CONFIG_AESNI
+    if (aesni_available) {
+        if (enc) {
+            aesni_encrypt_sectors(sector_num, out_buf, in_buf, nb_sectors, key);
+        } else {
+            aesni_decrypt_sectors(sector_num, out_buf, in_buf, nb_sectors, key);
+        }
+        return;
+    }
+#endif
+
+    for(i = 0; i < nb_sectors; i++) {
+        ivec.ll[0] = cpu_to_le64(sector_num);
+        ivec.ll[1] = 0;
+        AES_cbc_encrypt(in_buf, out_buf, 512, key,
+                        ivec.b, enc);
+        sector_num++;
+        in_buf += 512;
+        out_buf += 512;
+    }
+}
+
+#ifdef CONFIG_POSIX
+
+/*
+ * Large requests are split into jobs that are handed to the posix-aio-compat
+ * thread pool.  The coroutine that submitted them processes one of the jobs
+ * itself and then yields until the workers are done; the completion of the
+ * last job wakes it up again.
+ */
+
+typedef struct Qcow2CryptBatch {
+    Coroutine *co;
+    int pending;        /* jobs not finished yet */
+} Qcow2CryptBatch;
+
+typedef struct Qcow2CryptJob {
+    Qcow2CryptBatch *batch;
+    int64_t sector_num;
+    uint8_t *out_buf;
+    const uint8_t *in_buf;
+    int nb_sectors;
+    int enc;
+    const AES_KEY *key;
+} Qcow2CryptJob;
+
+static struct {
+    bool initialized;
+    int nr_threads;     /* 0 if everything is done inline */
+} pool;
+
+/* Runs in a worker thread */
+static int qcow2_crypt_job_fn(void *opaque)
+{
+    Qcow2CryptJob *job = opaque;
+
+    qcow2_encrypt_sectors(NULL, job->sector_num, job->out_buf,
+                          job->in_buf, job->nb_sectors, job->enc,
+                          job->key);
+    return 0;
+}
+
+static void qcow2_crypt_job_cb(void *opaque, int ret)
+{
+    Qcow2CryptJob *job = opaque;
+    Qcow2CryptBatch *batch = job->batch;
+
+    if (--batch->pending == 0) {
+        qemu_coroutine_enter(batch->co, NULL);
+    }
+}
+
+static void qcow2_crypt_init(void)
+{
+    long cpus;
+
+    pool.initialized = true;
+
+    /* The submitting coroutine does its share of the work, too */
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus <= 1 || paio_init() < 0) {
+        return;
+    }
+
+    pool.nr_threads = MIN(cpus, QCOW2_CRYPT_MAX_THREADS) - 1;
+    DPRINTF("splitting requests for %d worker threads\n", pool.nr_threads);
+}
+
+void coroutine_fn qcow2_co_encrypt_sectors(BlockDriverState *bs,
+                                           int64_t sector_num,
+                                           uint8_t *out_buf,
+                                           const uint8_t *in_buf,
+                                           int nb_sectors, int enc,
+                                           const AES_KEY *key)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CryptJob jobs[QCOW2_CRYPT_MAX_THREADS];
+    Qcow2CryptBatch batch;
+    int nb_jobs, per_job, i;
+
+    if (!pool.initialized) {
+        qcow2_crypt_init();
+    }
+
+    nb_jobs = MIN(pool.nr_threads + 1,
+                  nb_sectors / QCOW2_CRYPT_MIN_JOB_SECTORS);
+    if (nb_jobs <= 1) {
+        qcow2_encrypt_sectors(s, sector_num, out_buf, in_buf, nb_sectors,
+                              enc, key);
+        return;
+    }
+
+    per_job = DIV_ROUND_UP(nb_sectors, nb_jobs);
+    batch.co = qemu_coroutine_self();
+    batch.pending = nb_jobs;
+
+    for (i = 0; i < nb_jobs; i++) {
+        int offset = i * per_job;
+
+        jobs[i] = (Qcow2CryptJob) {
+            .batch      = &batch,
+            .sector_num = sector_num + offset,
+            .out_buf    = out_buf + offset * 512,
+            .in_buf     = in_buf + offset * 512,
+            .nb_sectors = MIN(per_job, nb_sectors - offset),
+            .enc        = enc,
+            .key        = key,
+        };
+    }
+
+    for (i = 1; i < nb_jobs; i++) {
+        paio_submit_func(bs, qcow2_crypt_job_fn, &jobs[i],
+                         qcow2_crypt_job_cb, &jobs[i]);
+    }
+
+    qcow2_encrypt_sectors(s, jobs[0].sector_num, jobs[0].out_buf,
+                          jobs[0].in_buf, jobs[0].nb_sectors, enc, key);
+
+    /* Completions are only processed once we yield */
+    if (--batch.pending > 0) {
+        qemu_coroutine_yield();
+    }
+}
+
+#else /* CONFIG_POSIX */
+
+void coroutine_fn qcow2_co_encrypt_sectors(BlockDriverState *bs,
+                                           int64_t sector_num,
+                                           uint8_t *out_buf,
+                                           const uint8_t *in_buf,
+                                           int nb_sectors, int enc,
+                                           const AES_KEY *key)
+{
+    qcow2_encrypt_sectors(bs->opaque, sector_num, out_buf, in_buf,
+                          nb_sectors, enc, key);
+}
+
+#endif /* CONFIG_POSIX */
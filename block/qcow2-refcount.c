@@ -776,7 +776,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
             }
 
             for(j = 0; j < s->l2_size; j++) {
-                offset = be64_to_cpu(l2_table[j]);
+                offset = get_l2_entry(s, l2_table, j);
                 if (offset != 0) {
                     old_offset = offset;
                     offset &= ~QCOW_OFLAG_COPIED;
@@ -820,7 +820,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                             qcow2_cache_set_dependency(bs, s->l2_table_cache,
                                 s->refcount_block_cache);
                         }
-                        l2_table[j] = cpu_to_be64(offset);
+                        set_l2_entry(s, l2_table, j, offset);
                         qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
                     }
                 }
@@ -945,7 +945,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
     int i, l2_size, nb_csectors, refcount;
 
     /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
+    l2_size = s->cluster_size;
     l2_table = g_malloc(l2_size);
 
     if (bdrv_pread(bs->file, l2_offset, l2_table, l2_size) != l2_size)
@@ -953,7 +953,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
-        l2_entry = be64_to_cpu(l2_table[i]);
+        l2_entry = get_l2_entry(s, l2_table, i);
 
         switch (qcow2_get_cluster_type(l2_entry)) {
         case QCOW2_CLUSTER_COMPRESSED:
@@ -1119,10 +1119,15 @@ fail:
 /*
  * Checks an image for refcount consistency.
  *
+ * If repair is true, the refcounts stored in the image are overwritten with
+ * the ones computed from the L1/L2 tables instead of being reported.  This is
+ * used for images that were marked dirty when they were last closed.
+ *
  * Returns 0 if no errors are found, the number of errors in case the image is
  * detected as corrupted, and -errno when an internal error occurred.
  */
-int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res)
+int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                          bool repair)
 {
     BDRVQcowState *s = bs->opaque;
     int64_t size;
@@ -1139,9 +1144,10 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res)
     inc_refcounts(bs, res, refcount_table, nb_clusters,
         0, s->cluster_size);
 
-    /* current L1 table */
+    /* current L1 table; QCOW_OFLAG_COPIED can't be checked against refcounts
+     * that are about to be rebuilt */
     ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
-                       s->l1_table_offset, s->l1_size, 1);
+                       s->l1_table_offset, s->l1_size, !repair);
     if (ret < 0) {
         goto fail;
     }
@@ -1204,7 +1210,15 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res)
         }
 
         refcount2 = refcount_table[i];
-        if (refcount1 != refcount2) {
+        if (refcount1 != refcount2 && repair) {
+            ret = update_refcount(bs, (int64_t) i << s->cluster_bits,
+                                  1, refcount2 - refcount1);
+            if (ret < 0) {
+                fprintf(stderr, "Can't repair refcount for cluster %d: %s\n",
+                        i, strerror(-ret));
+                goto fail;
+            }
+        } else if (refcount1 != refcount2) {
             fprintf(stderr, "%s cluster %d refcount=%d reference=%d\n",
                    refcount1 < refcount2 ? "ERROR" : "Leaked",
                    i, refcount1, refcount2);
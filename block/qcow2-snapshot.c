@@ -49,8 +49,14 @@ typedef struct QEMU_PACKED QCowSnapshotHeader {
 typedef struct QEMU_PACKED QCowSnapshotExtraData {
     uint64_t vm_state_size_large;
     uint64_t disk_size;
+    uint16_t parent_id_size;
+    /* parent id follows, only present if parent_id_size is */
 } QCowSnapshotExtraData;
 
+/* Size of the extra data of a snapshot that has no parent */
+#define QCOW2_SNAPSHOT_EXTRA_BASE_SIZE \
+    offsetof(QCowSnapshotExtraData, parent_id_size)
+
 void qcow2_free_snapshots(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
@@ -59,6 +65,7 @@ void qcow2_free_snapshots(BlockDriverState *bs)
     for(i = 0; i < s->nb_snapshots; i++) {
         g_free(s->snapshots[i].name);
         g_free(s->snapshots[i].id_str);
+        g_free(s->snapshots[i].parent_id);
     }
     g_free(s->snapshots);
     s->snapshots = NULL;
@@ -112,7 +119,6 @@ int qcow2_read_snapshots(BlockDriverState *bs)
         if (ret < 0) {
             goto fail;
         }
-        offset += extra_data_size;
 
         if (extra_data_size >= 8) {
             sn->vm_state_size = be64_to_cpu(extra.vm_state_size_large);
@@ -124,6 +130,25 @@ int qcow2_read_snapshots(BlockDriverState *bs)
             sn->disk_size = bs->total_sectors * BDRV_SECTOR_SIZE;
         }
 
+        if (extra_data_size >= sizeof(extra)) {
+            int parent_id_size = be16_to_cpu(extra.parent_id_size);
+
+            if (parent_id_size > extra_data_size - sizeof(extra)) {
+                ret = -EINVAL;
+                goto fail;
+            }
+            if (parent_id_size) {
+                sn->parent_id = g_malloc(parent_id_size + 1);
+                ret = bdrv_pread(bs->file, offset + sizeof(extra),
+                                 sn->parent_id, parent_id_size);
+                if (ret < 0) {
+                    goto fail;
+                }
+                sn->parent_id[parent_id_size] = '\0';
+            }
+        }
+        offset += extra_data_size;
+
         /* Read snapshot ID */
         sn->id_str = g_malloc(id_str_size + 1);
         ret = bdrv_pread(bs->file, offset, sn->id_str, id_str_size);
@@ -151,6 +176,37 @@ fail:
     return ret;
 }
 
+static int snapshot_extra_data_size(QCowSnapshot *sn)
+{
+    if (!sn->parent_id) {
+        return QCOW2_SNAPSHOT_EXTRA_BASE_SIZE;
+    }
+    return sizeof(QCowSnapshotExtraData) + strlen(sn->parent_id);
+}
+
+/*
+ * An implementation that doesn't know about parent links would load an
+ * incremental VM state as a full one and drop the links when it rewrites the
+ * snapshot table, so the links are protected by an incompatible feature bit.
+ * The bit is set before the first link is written and cleared once the last
+ * one is gone.
+ */
+static int qcow2_update_snapshot_parent_bit(BlockDriverState *bs, bool set)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (set == !!(s->incompatible_features & QCOW2_INCOMPAT_SNAP_PARENT)) {
+        return 0;
+    }
+
+    if (set) {
+        s->incompatible_features |= QCOW2_INCOMPAT_SNAP_PARENT;
+    } else {
+        s->incompatible_features &= ~QCOW2_INCOMPAT_SNAP_PARENT;
+    }
+    return qcow2_update_header(bs);
+}
+
 /* add at the end of the file a new list of snapshots */
 static int qcow2_write_snapshots(BlockDriverState *bs)
 {
@@ -158,26 +214,35 @@ static int qcow2_write_snapshots(BlockDriverState *bs)
     QCowSnapshot *sn;
     QCowSnapshotHeader h;
     QCowSnapshotExtraData extra;
-    int i, name_size, id_str_size, snapshots_size;
+    int i, name_size, id_str_size, extra_data_size, snapshots_size;
     struct {
         uint32_t nb_snapshots;
         uint64_t snapshots_offset;
     } QEMU_PACKED header_data;
     int64_t offset, snapshots_offset;
+    bool has_parents = false;
     int ret;
 
     /* compute the size of the snapshots */
     offset = 0;
     for(i = 0; i < s->nb_snapshots; i++) {
         sn = s->snapshots + i;
+        has_parents |= sn->parent_id != NULL;
         offset = align_offset(offset, 8);
         offset += sizeof(h);
-        offset += sizeof(extra);
+        offset += snapshot_extra_data_size(sn);
         offset += strlen(sn->id_str);
         offset += strlen(sn->name);
     }
     snapshots_size = offset;
 
+    if (has_parents) {
+        ret = qcow2_update_snapshot_parent_bit(bs, true);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     /* Allocate space for the new snapshot list */
     snapshots_offset = qcow2_alloc_clusters(bs, snapshots_size);
     bdrv_flush(bs->file);
@@ -200,11 +265,15 @@ static int qcow2_write_snapshots(BlockDriverState *bs)
         h.date_sec = cpu_to_be32(sn->date_sec);
         h.date_nsec = cpu_to_be32(sn->date_nsec);
         h.vm_clock_nsec = cpu_to_be64(sn->vm_clock_nsec);
-        h.extra_data_size = cpu_to_be32(sizeof(extra));
+        extra_data_size = snapshot_extra_data_size(sn);
+        h.extra_data_size = cpu_to_be32(extra_data_size);
 
         memset(&extra, 0, sizeof(extra));
         extra.vm_state_size_large = cpu_to_be64(sn->vm_state_size);
         extra.disk_size = cpu_to_be64(sn->disk_size);
+        if (sn->parent_id) {
+            extra.parent_id_size = cpu_to_be16(strlen(sn->parent_id));
+        }
 
         id_str_size = strlen(sn->id_str);
         name_size = strlen(sn->name);
@@ -218,11 +287,19 @@ static int qcow2_write_snapshots(BlockDriverState *bs)
         }
         offset += sizeof(h);
 
-        ret = bdrv_pwrite(bs->file, offset, &extra, sizeof(extra));
+        ret = bdrv_pwrite(bs->file, offset, &extra,
+                          MIN(sizeof(extra), extra_data_size));
         if (ret < 0) {
             goto fail;
         }
-        offset += sizeof(extra);
+        if (sn->parent_id) {
+            ret = bdrv_pwrite(bs->file, offset + sizeof(extra), sn->parent_id,
+                              strlen(sn->parent_id));
+            if (ret < 0) {
+                goto fail;
+            }
+        }
+        offset += extra_data_size;
 
         ret = bdrv_pwrite(bs->file, offset, sn->id_str, id_str_size);
         if (ret < 0) {
@@ -262,6 +339,13 @@ static int qcow2_write_snapshots(BlockDriverState *bs)
     qcow2_free_clusters(bs, s->snapshots_offset, s->snapshots_size);
     s->snapshots_offset = snapshots_offset;
     s->snapshots_size = snapshots_size;
+
+    if (!has_parents) {
+        ret = qcow2_update_snapshot_parent_bit(bs, false);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
     return 0;
 
 fail:
@@ -334,9 +418,23 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
         return -EEXIST;
     }
 
+    /* The VM state cannot be restored without its parent, and only version 3
+     * images can protect the link with an incompatible feature bit */
+    if (sn_info->parent_id[0] != '\0') {
+        if (find_snapshot_by_id(bs, sn_info->parent_id) < 0) {
+            return -ENOENT;
+        }
+        if (s->qcow_version < 3) {
+            return -ENOTSUP;
+        }
+    }
+
     /* Populate sn with passed data */
     sn->id_str = g_strdup(sn_info->id_str);
     sn->name = g_strdup(sn_info->name);
+    if (sn_info->parent_id[0] != '\0') {
+        sn->parent_id = g_strdup(sn_info->parent_id);
+    }
 
     sn->disk_size = bs->total_sectors * BDRV_SECTOR_SIZE;
     sn->vm_state_size = sn_info->vm_state_size;
@@ -405,7 +503,7 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
 #ifdef DEBUG_ALLOC
     {
       BdrvCheckResult result = {0};
-      qcow2_check_refcounts(bs, &result);
+      qcow2_check_refcounts(bs, &result, false);
     }
 #endif
     return 0;
@@ -413,6 +511,7 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
 fail:
     g_free(sn->id_str);
     g_free(sn->name);
+    g_free(sn->parent_id);
     g_free(l1_table);
 
     return ret;
@@ -522,7 +621,7 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
-        qcow2_check_refcounts(bs, &result);
+        qcow2_check_refcounts(bs, &result, false);
     }
 #endif
     return 0;
@@ -536,7 +635,7 @@ int qcow2_snapshot_delete(BlockDriverState *bs, const char *snapshot_id)
 {
     BDRVQcowState *s = bs->opaque;
     QCowSnapshot sn;
-    int snapshot_index, ret;
+    int snapshot_index, i, ret;
 
     /* Search the snapshot */
     snapshot_index = find_snapshot_by_id_or_name(bs, snapshot_id);
@@ -545,6 +644,14 @@ int qcow2_snapshot_delete(BlockDriverState *bs, const char *snapshot_id)
     }
     sn = s->snapshots[snapshot_index];
 
+    /* Incremental snapshots need their parent to restore the VM state */
+    for (i = 0; i < s->nb_snapshots; i++) {
+        if (s->snapshots[i].parent_id &&
+            !strcmp(s->snapshots[i].parent_id, sn.id_str)) {
+            return -EBUSY;
+        }
+    }
+
     /* Remove it from the snapshot list */
     memmove(s->snapshots + snapshot_index,
             s->snapshots + snapshot_index + 1,
@@ -561,6 +668,7 @@ int qcow2_snapshot_delete(BlockDriverState *bs, const char *snapshot_id)
      */
     g_free(sn.id_str);
     g_free(sn.name);
+    g_free(sn.parent_id);
 
     /*
      * Now decrease the refcounts of clusters referenced by the snapshot and
@@ -582,7 +690,7 @@ int qcow2_snapshot_delete(BlockDriverState *bs, const char *snapshot_id)
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
-        qcow2_check_refcounts(bs, &result);
+        qcow2_check_refcounts(bs, &result, false);
     }
 #endif
     return 0;
@@ -612,6 +720,10 @@ int qcow2_snapshot_list(BlockDriverState *bs, QEMUSnapshotInfo **psn_tab)
         sn_info->date_sec = sn->date_sec;
         sn_info->date_nsec = sn->date_nsec;
         sn_info->vm_clock_nsec = sn->vm_clock_nsec;
+        if (sn->parent_id) {
+            pstrcpy(sn_info->parent_id, sizeof(sn_info->parent_id),
+                    sn->parent_id);
+        }
     }
     *psn_tab = sn_tab;
     return s->nb_snapshots;
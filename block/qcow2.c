@@ -31,6 +31,10 @@
 #include "qerror.h"
 #include "trace.h"
 
+#ifdef CONFIG_POSIX
+#include "block/raw-posix-aio.h"
+#endif
+
 /*
   Differences with QCOW:
 
@@ -214,6 +218,100 @@ static void report_unsupported_feature(BlockDriverState *bs,
     }
 }
 
+/* Number of L2 tables and refcount blocks to cache */
+static void qcow2_get_cache_sizes(BlockDriverState *bs, int *l2_cache_size,
+                                  int *refcount_cache_size)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t l2_tables, refcount_blocks;
+
+    if (bs->l2_cache_size) {
+        l2_tables = MAX(bs->l2_cache_size >> s->cluster_bits,
+                        MIN_L2_CACHE_SIZE);
+    } else {
+        l2_tables = DIV_ROUND_UP(bs->total_sectors * BDRV_SECTOR_SIZE,
+                                 (uint64_t)s->cluster_size << s->l2_bits);
+        l2_tables = MIN(l2_tables,
+                        DEFAULT_L2_CACHE_MAX_SIZE >> s->cluster_bits);
+        l2_tables = MAX(l2_tables, L2_CACHE_SIZE);
+    }
+
+    refcount_blocks = REFCOUNT_CACHE_SIZE;
+    if (bs->refcount_cache_size) {
+        refcount_blocks = MAX(bs->refcount_cache_size >> s->cluster_bits,
+                              REFCOUNT_CACHE_SIZE);
+    }
+
+    *l2_cache_size = MIN(l2_tables, INT_MAX >> s->cluster_bits);
+    *refcount_cache_size = MIN(refcount_blocks, INT_MAX >> s->cluster_bits);
+}
+
+/*
+ * Sets the dirty bit in the image header.  Afterwards refcount updates may
+ * be written in any order relative to the L2 tables that use the clusters.
+ */
+int qcow2_mark_dirty(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t val;
+    int ret;
+
+    assert(s->qcow_version >= 3);
+
+    if (!qcow2_need_accurate_refcounts(s)) {
+        return 0; /* already dirty */
+    }
+
+    val = cpu_to_be64(s->incompatible_features | QCOW2_INCOMPAT_DIRTY);
+    ret = bdrv_pwrite_sync(bs->file,
+                           offsetof(QCowHeader, incompatible_features),
+                           &val, sizeof(val));
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Only treat the image as dirty once the header is on disk */
+    s->incompatible_features |= QCOW2_INCOMPAT_DIRTY;
+
+    /* Refcount blocks are written back lazily even with cache=writethrough */
+    qcow2_cache_set_writethrough(bs, s->refcount_block_cache, false);
+    return 0;
+}
+
+/*
+ * Clears the dirty bit in the image header after writing out all metadata,
+ * which makes the refcounts on disk accurate again.
+ */
+static int qcow2_mark_clean(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    if (qcow2_need_accurate_refcounts(s)) {
+        return 0;
+    }
+
+    ret = qcow2_cache_flush(bs, s->l2_table_cache);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_flush(bs->file);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->incompatible_features &= ~QCOW2_INCOMPAT_DIRTY;
+    qcow2_cache_set_writethrough(bs, s->refcount_block_cache,
+                                 !(s->flags & BDRV_O_CACHE_WB));
+    return qcow2_update_header(bs);
+}
+
 static int qcow2_open(BlockDriverState *bs, int flags)
 {
     BDRVQcowState *s = bs->opaque;
@@ -221,6 +319,7 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     QCowHeader header;
     uint64_t ext_end;
     bool writethrough;
+    int l2_cache_size, refcount_cache_size;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -287,13 +386,16 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     s->incompatible_features    = header.incompatible_features;
     s->compatible_features      = header.compatible_features;
     s->autoclear_features       = header.autoclear_features;
+    s->use_lazy_refcounts       =
+        !!(s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS);
 
-    if (s->incompatible_features != 0) {
+    if (s->incompatible_features & ~QCOW2_INCOMPAT_MASK) {
         void *feature_table = NULL;
         qcow2_read_extensions(bs, header.header_length, ext_end,
                               &feature_table);
         report_unsupported_feature(bs, feature_table,
-                                   s->incompatible_features);
+                                   s->incompatible_features &
+                                   ~QCOW2_INCOMPAT_MASK);
         ret = -ENOTSUP;
         goto fail;
     }
@@ -323,6 +425,11 @@ static int qcow2_open(BlockDriverState *bs, int flags)
         ret = -EINVAL;
         goto fail;
     }
+    s->extended_l2 = !!(s->incompatible_features & QCOW2_INCOMPAT_EXTL2);
+    if (s->extended_l2 && header.cluster_bits < QCOW_EXTL2_MIN_CLUSTER_BITS) {
+        ret = -EINVAL;
+        goto fail;
+    }
     s->crypt_method_header = header.crypt_method;
     if (s->crypt_method_header) {
         bs->encrypted = 1;
@@ -330,8 +437,10 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     s->cluster_bits = header.cluster_bits;
     s->cluster_size = 1 << s->cluster_bits;
     s->cluster_sectors = 1 << (s->cluster_bits - 9);
-    s->l2_bits = s->cluster_bits - 3; /* L2 is always one cluster */
+    /* L2 is always one cluster */
+    s->l2_bits = s->cluster_bits - (s->extended_l2 ? 4 : 3);
     s->l2_size = 1 << s->l2_bits;
+    s->subcluster_sectors = s->cluster_sectors / QCOW_EXTL2_SUBCLUSTERS;
     bs->total_sectors = header.size / 512;
     s->csize_shift = (62 - (s->cluster_bits - 8));
     s->csize_mask = (1 << (s->cluster_bits - 8)) - 1;
@@ -368,8 +477,9 @@ static int qcow2_open(BlockDriverState *bs, int flags)
 
     /* alloc L2 table/refcount block cache */
     writethrough = ((flags & BDRV_O_CACHE_WB) == 0);
-    s->l2_table_cache = qcow2_cache_create(bs, L2_CACHE_SIZE, writethrough);
-    s->refcount_block_cache = qcow2_cache_create(bs, REFCOUNT_CACHE_SIZE,
+    qcow2_get_cache_sizes(bs, &l2_cache_size, &refcount_cache_size);
+    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_size, writethrough);
+    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size,
         writethrough);
 
     s->cluster_cache = g_malloc(s->cluster_size);
@@ -413,11 +523,27 @@ static int qcow2_open(BlockDriverState *bs, int flags)
 
     /* Initialise locks */
     qemu_co_mutex_init(&s->lock);
+    qemu_co_queue_init(&s->l2_commit_queue);
+
+    /* Rebuild the refcounts if the image wasn't closed cleanly */
+    if (!bs->read_only && !qcow2_need_accurate_refcounts(s)) {
+        BdrvCheckResult result = {0};
+
+        ret = qcow2_check_refcounts(bs, &result, true);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        ret = qcow2_mark_clean(bs);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
 
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
-        qcow2_check_refcounts(bs, &result);
+        qcow2_check_refcounts(bs, &result, false);
     }
 #endif
     return ret;
@@ -495,7 +621,46 @@ static int coroutine_fn qcow2_co_is_allocated(BlockDriverState *bs,
         *pnum = 0;
     }
 
-    return (cluster_offset != 0);
+    /* Zero clusters hide the backing file just like data clusters */
+    return (cluster_offset != 0) || (ret == QCOW2_CLUSTER_ZERO);
+}
+
+static int64_t coroutine_fn qcow2_co_get_block_status(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, int *pnum)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t cluster_offset;
+    int index_in_cluster;
+    int64_t status = 0;
+    int ret;
+
+    *pnum = nb_sectors;
+    qemu_co_mutex_lock(&s->lock);
+    ret = qcow2_get_cluster_offset(bs, sector_num << 9, pnum, &cluster_offset);
+    qemu_co_mutex_unlock(&s->lock);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (cluster_offset != 0 && ret != QCOW2_CLUSTER_COMPRESSED &&
+        !s->crypt_method) {
+        index_in_cluster = sector_num & (s->cluster_sectors - 1);
+        cluster_offset += (uint64_t)index_in_cluster << BDRV_SECTOR_BITS;
+        status |= BDRV_BLOCK_OFFSET_VALID | cluster_offset;
+    }
+
+    switch (ret) {
+    case QCOW2_CLUSTER_ZERO:
+        status |= BDRV_BLOCK_ZERO;
+        break;
+    case QCOW2_CLUSTER_UNALLOCATED:
+        break;
+    default:
+        status |= BDRV_BLOCK_DATA;
+        break;
+    }
+
+    return status;
 }
 
 /* handle reading after the end of the backing file */
@@ -623,13 +788,15 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
             ret = bdrv_co_readv(bs->file,
                                 (cluster_offset >> 9) + index_in_cluster,
                                 cur_nr_sectors, &hd_qiov);
+            if (ret >= 0 && s->crypt_method) {
+                qcow2_co_encrypt_sectors(bs, sector_num, cluster_data,
+                    cluster_data, cur_nr_sectors, 0, &s->aes_decrypt_key);
+            }
             qemu_co_mutex_lock(&s->lock);
             if (ret < 0) {
                 goto fail;
             }
             if (s->crypt_method) {
-                qcow2_encrypt_sectors(s, sector_num,  cluster_data,
-                    cluster_data, cur_nr_sectors, 0, &s->aes_decrypt_key);
                 qemu_iovec_reset(&hd_qiov);
                 qemu_iovec_copy(&hd_qiov, qiov, bytes_done,
                     cur_nr_sectors * 512);
@@ -674,6 +841,55 @@ static void run_dependent_requests(BDRVQcowState *s, QCowL2Meta *m)
     }
 }
 
+/* An allocating write has linked its clusters into the L2 table, or failed */
+static void l2_update_done(BDRVQcowState *s)
+{
+    assert(s->l2_updates_ready > 0);
+    if (--s->l2_updates_ready == 0) {
+        qemu_co_queue_restart_all(&s->l2_commit_queue);
+    }
+}
+
+/*
+ * In writethrough mode, make sure that the L2 updates up to generation @gen
+ * are on disk.  As long as other allocating writes have completed their data
+ * write but not updated the L2 table yet, wait for them, so that a single
+ * write back of the L2 table covers all of them.
+ */
+static coroutine_fn int qcow2_commit_l2_updates(BlockDriverState *bs,
+                                                uint64_t gen)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t flush_gen;
+    int ret;
+
+    if (s->flags & BDRV_O_CACHE_WB) {
+        return 0;
+    }
+
+    while (s->l2_committed_gen < gen) {
+        if (s->l2_updates_ready > 0 &&
+            s->l2_update_gen - s->l2_committed_gen < QCOW2_MAX_L2_BATCH) {
+            qemu_co_mutex_unlock(&s->lock);
+            qemu_co_queue_wait(&s->l2_commit_queue);
+            qemu_co_mutex_lock(&s->lock);
+            continue;
+        }
+
+        flush_gen = s->l2_update_gen;
+        ret = qcow2_cache_flush(bs, s->l2_table_cache);
+        if (ret == 0 && s->l2_committed_gen < flush_gen) {
+            s->l2_committed_gen = flush_gen;
+        }
+        qemu_co_queue_restart_all(&s->l2_commit_queue);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
 static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
                            int64_t sector_num,
                            int remaining_sectors,
@@ -688,6 +904,7 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
     QEMUIOVector hd_qiov;
     uint64_t bytes_done = 0;
     uint8_t *cluster_data = NULL;
+    uint64_t l2_gen = 0;
     QCowL2Meta l2meta = {
         .nb_clusters = 0,
     };
@@ -735,10 +952,6 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
             assert(hd_qiov.size <=
                    QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
             qemu_iovec_to_buffer(&hd_qiov, cluster_data);
-
-            qcow2_encrypt_sectors(s, sector_num, cluster_data,
-                cluster_data, cur_nr_sectors, 1, &s->aes_encrypt_key);
-
             qemu_iovec_reset(&hd_qiov);
             qemu_iovec_add(&hd_qiov, cluster_data,
                 cur_nr_sectors * 512);
@@ -746,17 +959,30 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
 
         BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
         qemu_co_mutex_unlock(&s->lock);
+        if (s->crypt_method) {
+            /* cluster_data belongs to this request, no need for the lock */
+            qcow2_co_encrypt_sectors(bs, sector_num, cluster_data,
+                cluster_data, cur_nr_sectors, 1, &s->aes_encrypt_key);
+        }
         trace_qcow2_writev_data(qemu_coroutine_self(),
                                 (cluster_offset >> 9) + index_in_cluster);
         ret = bdrv_co_writev(bs->file,
                              (cluster_offset >> 9) + index_in_cluster,
                              cur_nr_sectors, &hd_qiov);
-        qemu_co_mutex_lock(&s->lock);
-        if (ret < 0) {
-            goto fail;
+        if (l2meta.nb_clusters != 0) {
+            s->l2_updates_ready++;
         }
+        qemu_co_mutex_lock(&s->lock);
 
-        ret = qcow2_alloc_cluster_link_l2(bs, &l2meta);
+        if (ret >= 0) {
+            ret = qcow2_alloc_cluster_link_l2(bs, &l2meta);
+        }
+        if (l2meta.nb_clusters != 0) {
+            if (ret >= 0) {
+                l2_gen = ++s->l2_update_gen;
+            }
+            l2_update_done(s);
+        }
         if (ret < 0) {
             goto fail;
         }
@@ -768,11 +994,16 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
         bytes_done += cur_nr_sectors * 512;
         trace_qcow2_writev_done_part(qemu_coroutine_self(), cur_nr_sectors);
     }
+
     ret = 0;
 
 fail:
     run_dependent_requests(s, &l2meta);
 
+    if (ret == 0) {
+        ret = qcow2_commit_l2_updates(bs, l2_gen);
+    }
+
     qemu_co_mutex_unlock(&s->lock);
 
     qemu_iovec_destroy(&hd_qiov);
@@ -790,6 +1021,10 @@ static void qcow2_close(BlockDriverState *bs)
     qcow2_cache_flush(bs, s->l2_table_cache);
     qcow2_cache_flush(bs, s->refcount_block_cache);
 
+    if (!bs->read_only) {
+        qcow2_mark_clean(bs);
+    }
+
     qcow2_cache_destroy(bs, s->l2_table_cache);
     qcow2_cache_destroy(bs, s->refcount_block_cache);
 
@@ -954,7 +1189,26 @@ int qcow2_update_header(BlockDriverState *bs)
 
     /* Feature table */
     Qcow2Feature features[] = {
-        /* no feature defined yet */
+        {
+            .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+            .bit  = QCOW2_INCOMPAT_DIRTY_BITNR,
+            .name = "dirty bit",
+        },
+        {
+            .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+            .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
+            .name = "extended L2 entries",
+        },
+        {
+            .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+            .bit  = QCOW2_INCOMPAT_SNAP_PARENT_BITNR,
+            .name = "snapshot parent links",
+        },
+        {
+            .type = QCOW2_FEAT_TYPE_COMPATIBLE,
+            .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
+            .name = "lazy refcounts",
+        },
     };
 
     ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -1051,8 +1305,6 @@ static int preallocate(BlockDriverState *bs)
          * from the list of in-flight requests */
         run_dependent_requests(bs->opaque, &meta);
 
-        /* TODO Preallocate data if requested */
-
         nb_sectors -= num;
         offset += num << 9;
     }
@@ -1074,9 +1326,57 @@ static int preallocate(BlockDriverState *bs)
     return 0;
 }
 
+/*
+ * Returns an upper bound for the size of an image file of total_size bytes
+ * after metadata preallocation, i.e. the guest data plus the header, L1, L2
+ * and refcount tables.
+ */
+static int64_t qcow2_prealloc_file_size(int64_t total_size,
+                                        size_t cluster_size, int flags)
+{
+    size_t l2_entry_size = (flags & BLOCK_FLAG_EXTL2) ? 16 : 8;
+    size_t refcount_size = 1 << REFCOUNT_SHIFT;
+    int64_t aligned_total_size = align_offset(total_size, cluster_size);
+    int64_t meta_size = 0;
+    uint64_t nl1e, nl2e, nrefblocke, nreftablee;
+
+    /* Header */
+    meta_size += cluster_size;
+
+    /* L2 tables */
+    nl2e = aligned_total_size / cluster_size;
+    nl2e = align_offset(nl2e, cluster_size / l2_entry_size);
+    meta_size += nl2e * l2_entry_size;
+
+    /* L1 table */
+    nl1e = nl2e * l2_entry_size / cluster_size;
+    nl1e = align_offset(nl1e, cluster_size / sizeof(uint64_t));
+    meta_size += nl1e * sizeof(uint64_t);
+
+    /*
+     * Refcount blocks cover every host cluster, including themselves and the
+     * refcount table that points to them. With a the size of the data and
+     * metadata so far, c the cluster size and r the size of a refcount, the
+     * number n of refcount block entries satisfies
+     *   n = (a + n * r + n * r * 8 / c) / c
+     */
+    nrefblocke = (aligned_total_size + meta_size + cluster_size) /
+        (cluster_size - refcount_size -
+         1.0 * refcount_size * sizeof(uint64_t) / cluster_size);
+    nrefblocke = align_offset(nrefblocke, cluster_size / refcount_size);
+    meta_size += nrefblocke * refcount_size;
+
+    /* Refcount table */
+    nreftablee = nrefblocke * refcount_size / cluster_size;
+    nreftablee = align_offset(nreftablee, cluster_size / sizeof(uint64_t));
+    meta_size += nreftablee * sizeof(uint64_t);
+
+    return aligned_total_size + meta_size;
+}
+
 static int qcow2_create2(const char *filename, int64_t total_size,
                          const char *backing_file, const char *backing_format,
-                         int flags, size_t cluster_size, int prealloc,
+                         int flags, size_t cluster_size, PreallocMode prealloc,
                          QEMUOptionParameter *options, int version)
 {
     /* Calculate cluster_bits */
@@ -1108,7 +1408,34 @@ static int qcow2_create2(const char *filename, int64_t total_size,
     uint8_t* refcount_table;
     int ret;
 
-    ret = bdrv_create_file(filename, options);
+    if (prealloc == PREALLOC_MODE_FALLOC || prealloc == PREALLOC_MODE_FULL) {
+        /*
+         * Let the protocol allocate the whole file up front, the metadata
+         * preallocation below then only has to fill in the tables.
+         */
+        BlockDriver *proto_drv = bdrv_find_protocol(filename);
+        QEMUOptionParameter *proto_options;
+        const char *mode = prealloc == PREALLOC_MODE_FULL ? "full" : "falloc";
+
+        if (!proto_drv || !proto_drv->create_options) {
+            return -ENOTSUP;
+        }
+        proto_options = parse_option_parameters("", proto_drv->create_options,
+                                                NULL);
+        if (set_option_parameter(proto_options, BLOCK_OPT_PREALLOC, mode)) {
+            error_report("Protocol '%s' does not support preallocation "
+                         "mode '%s'", proto_drv->format_name, mode);
+            free_option_parameters(proto_options);
+            return -ENOTSUP;
+        }
+        set_option_parameter_int(proto_options, BLOCK_OPT_SIZE,
+            qcow2_prealloc_file_size(total_size * BDRV_SECTOR_SIZE,
+                                     cluster_size, flags));
+        ret = bdrv_create_file(filename, proto_options);
+        free_option_parameters(proto_options);
+    } else {
+        ret = bdrv_create_file(filename, options);
+    }
     if (ret < 0) {
         return ret;
     }
@@ -1131,6 +1458,13 @@ static int qcow2_create2(const char *filename, int64_t total_size,
     header.refcount_order = cpu_to_be32(3 + REFCOUNT_SHIFT);
     header.header_length = cpu_to_be32(sizeof(header));
 
+    if (flags & BLOCK_FLAG_EXTL2) {
+        header.incompatible_features = cpu_to_be64(QCOW2_INCOMPAT_EXTL2);
+    }
+    if (flags & BLOCK_FLAG_LAZY_REFCOUNTS) {
+        header.compatible_features = cpu_to_be64(QCOW2_COMPAT_LAZY_REFCOUNTS);
+    }
+
     if (flags & BLOCK_FLAG_ENCRYPT) {
         header.crypt_method = cpu_to_be32(QCOW_CRYPT_AES);
     } else {
@@ -1190,7 +1524,7 @@ static int qcow2_create2(const char *filename, int64_t total_size,
     }
 
     /* And if we're supposed to preallocate metadata, do that now */
-    if (prealloc) {
+    if (prealloc != PREALLOC_MODE_OFF) {
         BDRVQcowState *s = bs->opaque;
         qemu_co_mutex_lock(&s->lock);
         ret = preallocate(bs);
@@ -1213,7 +1547,7 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options)
     uint64_t sectors = 0;
     int flags = 0;
     size_t cluster_size = DEFAULT_CLUSTER_SIZE;
-    int prealloc = 0;
+    PreallocMode prealloc = PREALLOC_MODE_OFF;
     int version = 2;
 
     /* Read out options */
@@ -1230,11 +1564,19 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options)
             if (options->value.n) {
                 cluster_size = options->value.n;
             }
+        } else if (!strcmp(options->name, BLOCK_OPT_EXTL2)) {
+            flags |= options->value.n ? BLOCK_FLAG_EXTL2 : 0;
+        } else if (!strcmp(options->name, BLOCK_OPT_LAZY_REFCOUNTS)) {
+            flags |= options->value.n ? BLOCK_FLAG_LAZY_REFCOUNTS : 0;
         } else if (!strcmp(options->name, BLOCK_OPT_PREALLOC)) {
             if (!options->value.s || !strcmp(options->value.s, "off")) {
-                prealloc = 0;
+                prealloc = PREALLOC_MODE_OFF;
             } else if (!strcmp(options->value.s, "metadata")) {
-                prealloc = 1;
+                prealloc = PREALLOC_MODE_METADATA;
+            } else if (!strcmp(options->value.s, "falloc")) {
+                prealloc = PREALLOC_MODE_FALLOC;
+            } else if (!strcmp(options->value.s, "full")) {
+                prealloc = PREALLOC_MODE_FULL;
             } else {
                 fprintf(stderr, "Invalid preallocation mode: '%s'\n",
                     options->value.s);
@@ -1254,12 +1596,31 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options)
         options++;
     }
 
-    if (backing_file && prealloc) {
+    if (backing_file && prealloc != PREALLOC_MODE_OFF) {
         fprintf(stderr, "Backing file and preallocation cannot be used at "
             "the same time\n");
         return -EINVAL;
     }
 
+    if ((flags & BLOCK_FLAG_LAZY_REFCOUNTS) && version < 3) {
+        fprintf(stderr, "Lazy refcounts require compatibility level 1.1 "
+            "(compat=1.1)\n");
+        return -EINVAL;
+    }
+
+    if (flags & BLOCK_FLAG_EXTL2) {
+        if (version < 3) {
+            fprintf(stderr, "Extended L2 entries require compatibility "
+                "level 1.1 (compat=1.1)\n");
+            return -EINVAL;
+        }
+        if (cluster_size < (1 << QCOW_EXTL2_MIN_CLUSTER_BITS)) {
+            fprintf(stderr, "Extended L2 entries require a cluster size of "
+                "at least %dk\n", 1 << (QCOW_EXTL2_MIN_CLUSTER_BITS - 10));
+            return -EINVAL;
+        }
+    }
+
     return qcow2_create2(filename, sectors, backing_file, backing_fmt, flags,
                          cluster_size, prealloc, options, version);
 }
@@ -1357,13 +1718,101 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
     return 0;
 }
 
+/*
+ * Compress a cluster.  Returns the compressed size, or -ENOSPC if the
+ * cluster doesn't become any smaller.  Doesn't touch any state, so it can
+ * run in a worker thread.
+ */
+static int qcow2_compress(uint8_t *dest, const uint8_t *src, int size)
+{
+    z_stream strm;
+    int ret, out_len;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != 0) {
+        return -EINVAL;
+    }
+
+    strm.avail_in = size;
+    strm.next_in = (uint8_t *)src;
+    strm.avail_out = size;
+    strm.next_out = dest;
+
+    ret = deflate(&strm, Z_FINISH);
+    out_len = strm.next_out - dest;
+    deflateEnd(&strm);
+
+    if (ret != Z_STREAM_END && ret != Z_OK) {
+        return -EINVAL;
+    }
+    if (ret != Z_STREAM_END || out_len >= size) {
+        return -ENOSPC;
+    }
+    return out_len;
+}
+
+#ifdef CONFIG_POSIX
+typedef struct Qcow2CompressJob {
+    Coroutine *co;
+    uint8_t *dest;
+    const uint8_t *src;
+    int size;
+    int ret;
+} Qcow2CompressJob;
+
+/* Runs in a worker thread */
+static int qcow2_compress_job_fn(void *opaque)
+{
+    Qcow2CompressJob *job = opaque;
+
+    return qcow2_compress(job->dest, job->src, job->size);
+}
+
+static void qcow2_compress_job_cb(void *opaque, int ret)
+{
+    Qcow2CompressJob *job = opaque;
+
+    job->ret = ret;
+    qemu_coroutine_enter(job->co, NULL);
+}
+#endif
+
+/* Compress in the thread pool, so that several clusters can be compressed
+ * at the same time when there are several writers */
+static int coroutine_fn qcow2_co_compress(BlockDriverState *bs, uint8_t *dest,
+                                          const uint8_t *src, int size)
+{
+#ifdef CONFIG_POSIX
+    Qcow2CompressJob job = {
+        .co     = qemu_coroutine_self(),
+        .dest   = dest,
+        .src    = src,
+        .size   = size,
+    };
+
+    if (paio_init() == 0) {
+        paio_submit_func(bs, qcow2_compress_job_fn, &job,
+                         qcow2_compress_job_cb, &job);
+        qemu_coroutine_yield();
+        return job.ret;
+    }
+#endif
+
+    return qcow2_compress(dest, src, size);
+}
+
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
-static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                                  const uint8_t *buf, int nb_sectors)
+static coroutine_fn int qcow2_co_write_compressed(BlockDriverState *bs,
+                                                  int64_t sector_num,
+                                                  const uint8_t *buf,
+                                                  int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
-    z_stream strm;
     int ret, out_len;
     uint8_t *out_buf;
     uint64_t cluster_offset;
@@ -1371,9 +1820,11 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
     if (nb_sectors == 0) {
         /* align end of file to a sector boundary to ease reading with
            sector based I/Os */
+        qemu_co_mutex_lock(&s->lock);
         cluster_offset = bdrv_getlength(bs->file);
         cluster_offset = (cluster_offset + 511) & ~511;
         bdrv_truncate(bs->file, cluster_offset);
+        qemu_co_mutex_unlock(&s->lock);
         return 0;
     }
 
@@ -1382,47 +1833,31 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
 
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
-    }
-
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
-
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
-        goto fail;
-    }
-    out_len = strm.next_out - out_buf;
-
-    deflateEnd(&strm);
-
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+    out_len = qcow2_co_compress(bs, out_buf, buf, s->cluster_size);
+    if (out_len == -ENOSPC) {
         /* could not compress: write normal cluster */
         ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
         if (ret < 0) {
             goto fail;
         }
+    } else if (out_len < 0) {
+        ret = out_len;
+        goto fail;
     } else {
+        /* Compressed clusters share host sectors, so the write must be
+         * done before anyone else can allocate the rest of the sector */
+        qemu_co_mutex_lock(&s->lock);
         cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
             sector_num << 9, out_len);
         if (!cluster_offset) {
+            qemu_co_mutex_unlock(&s->lock);
             ret = -EIO;
             goto fail;
         }
         cluster_offset &= s->cluster_offset_mask;
         BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
         ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
+        qemu_co_mutex_unlock(&s->lock);
         if (ret < 0) {
             goto fail;
         }
@@ -1446,10 +1881,12 @@ static coroutine_fn int qcow2_co_flush_to_os(BlockDriverState *bs)
         return ret;
     }
 
-    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
-    if (ret < 0) {
-        qemu_co_mutex_unlock(&s->lock);
-        return ret;
+    if (qcow2_need_accurate_refcounts(s)) {
+        ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+        if (ret < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            return ret;
+        }
     }
     qemu_co_mutex_unlock(&s->lock);
 
@@ -1461,6 +1898,24 @@ static int64_t qcow2_vm_state_offset(BDRVQcowState *s)
 	return (int64_t)s->l1_vm_state_index << (s->cluster_bits + s->l2_bits);
 }
 
+static void qcow2_get_stats(BlockDriverState *bs, BlockDeviceStats *stats)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t hits, misses;
+
+    qcow2_cache_get_stats(s->l2_table_cache, &hits, &misses);
+    stats->has_l2_cache_hits = true;
+    stats->l2_cache_hits = hits;
+    stats->has_l2_cache_misses = true;
+    stats->l2_cache_misses = misses;
+
+    qcow2_cache_get_stats(s->refcount_block_cache, &hits, &misses);
+    stats->has_refcount_cache_hits = true;
+    stats->refcount_cache_hits = hits;
+    stats->has_refcount_cache_misses = true;
+    stats->refcount_cache_misses = misses;
+}
+
 static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
     BDRVQcowState *s = bs->opaque;
@@ -1472,7 +1927,13 @@ static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 
 static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result)
 {
-    return qcow2_check_refcounts(bs, result);
+    BDRVQcowState *s = bs->opaque;
+
+    if (!qcow2_need_accurate_refcounts(s)) {
+        fprintf(stderr, "Warning: image was not closed cleanly, its refcounts "
+            "are rebuilt when it is opened read-write.\n");
+    }
+    return qcow2_check_refcounts(bs, result, false);
 }
 
 #if 0
@@ -1558,10 +2019,22 @@ static QEMUOptionParameter qcow2_create_options[] = {
         .help = "qcow2 cluster size",
         .value = { .n = DEFAULT_CLUSTER_SIZE },
     },
+    {
+        .name = BLOCK_OPT_EXTL2,
+        .type = OPT_FLAG,
+        .help = "Track allocation of subclusters to avoid copy on write "
+                "(requires compat=1.1)"
+    },
+    {
+        .name = BLOCK_OPT_LAZY_REFCOUNTS,
+        .type = OPT_FLAG,
+        .help = "Postpone refcount updates (requires compat=1.1)"
+    },
     {
         .name = BLOCK_OPT_PREALLOC,
         .type = OPT_STRING,
-        .help = "Preallocation mode (allowed values: off, metadata)"
+        .help = "Preallocation mode (allowed values: off, metadata, "
+                "falloc, full)"
     },
     { NULL }
 };
@@ -1574,6 +2047,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_close         = qcow2_close,
     .bdrv_create        = qcow2_create,
     .bdrv_co_is_allocated = qcow2_co_is_allocated,
+    .bdrv_co_get_block_status = qcow2_co_get_block_status,
     .bdrv_set_key       = qcow2_set_key,
     .bdrv_make_empty    = qcow2_make_empty,
 
@@ -1584,7 +2058,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_co_write_zeroes   = qcow2_co_write_zeroes,
     .bdrv_co_discard        = qcow2_co_discard,
     .bdrv_truncate          = qcow2_truncate,
-    .bdrv_write_compressed  = qcow2_write_compressed,
+    .bdrv_co_write_compressed = qcow2_co_write_compressed,
 
     .bdrv_snapshot_create   = qcow2_snapshot_create,
     .bdrv_snapshot_goto     = qcow2_snapshot_goto,
@@ -1592,6 +2066,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_snapshot_list     = qcow2_snapshot_list,
     .bdrv_snapshot_load_tmp     = qcow2_snapshot_load_tmp,
     .bdrv_get_info      = qcow2_get_info,
+    .bdrv_get_stats         = qcow2_get_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
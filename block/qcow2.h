@@ -46,18 +46,53 @@
 /* The cluster reads as all zeros */
 #define QCOW_OFLAG_ZERO (1LL << 0)
 
+/* Incompatible feature bits */
+enum {
+    QCOW2_INCOMPAT_DIRTY_BITNR      = 0,
+    QCOW2_INCOMPAT_EXTL2_BITNR      = 4,
+    QCOW2_INCOMPAT_SNAP_PARENT_BITNR = 5,
+    QCOW2_INCOMPAT_DIRTY            = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
+    QCOW2_INCOMPAT_EXTL2            = 1 << QCOW2_INCOMPAT_EXTL2_BITNR,
+    QCOW2_INCOMPAT_SNAP_PARENT      = 1 << QCOW2_INCOMPAT_SNAP_PARENT_BITNR,
+
+    QCOW2_INCOMPAT_MASK             = QCOW2_INCOMPAT_DIRTY
+                                    | QCOW2_INCOMPAT_EXTL2
+                                    | QCOW2_INCOMPAT_SNAP_PARENT,
+};
+
+/* Compatible feature bits */
+enum {
+    QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR = 0,
+    QCOW2_COMPAT_LAZY_REFCOUNTS       = 1 << QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
+};
+
+/* With extended L2 entries, every cluster is divided into this many
+ * subclusters whose allocation is tracked separately */
+#define QCOW_EXTL2_SUBCLUSTERS 32
+#define QCOW_EXTL2_ALL_ALLOCATED 0xffffffffU
+#define QCOW_EXTL2_MIN_CLUSTER_BITS 14
+
 #define REFCOUNT_SHIFT 1 /* refcount size is 2 bytes */
 
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
+/* Number of L2 tables cached by default, unless more are needed to cover the
+ * whole image and they fit in DEFAULT_L2_CACHE_MAX_SIZE bytes */
 #define L2_CACHE_SIZE 16
+#define DEFAULT_L2_CACHE_MAX_SIZE (32 * 1024 * 1024)
+
+/* Must be at least 2 so that a new L2 table can be filled from the old one */
+#define MIN_L2_CACHE_SIZE 2
 
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define REFCOUNT_CACHE_SIZE 4
 
 #define DEFAULT_CLUSTER_SIZE 65536
 
+/* Maximum number of L2 updates that are written back together */
+#define QCOW2_MAX_L2_BATCH 32
+
 typedef struct QCowHeader {
     uint32_t magic;
     uint32_t version;
@@ -92,6 +127,7 @@ typedef struct QCowSnapshot {
     uint32_t date_sec;
     uint32_t date_nsec;
     uint64_t vm_clock_nsec;
+    char *parent_id;
 } QCowSnapshot;
 
 struct Qcow2Cache;
@@ -122,6 +158,8 @@ typedef struct BDRVQcowState {
     int cluster_sectors;
     int l2_bits;
     int l2_size;
+    bool extended_l2;
+    int subcluster_sectors;
     int l1_size;
     int l1_vm_state_index;
     int csize_shift;
@@ -138,6 +176,13 @@ typedef struct BDRVQcowState {
     uint64_t cluster_cache_offset;
     QLIST_HEAD(QCowClusterAlloc, QCowL2Meta) cluster_allocs;
 
+    /* Writing back L2 updates of allocating writes in writethrough mode,
+     * see qcow2_commit_l2_updates() */
+    int l2_updates_ready;
+    uint64_t l2_update_gen;
+    uint64_t l2_committed_gen;
+    CoQueue l2_commit_queue;
+
     uint64_t *refcount_table;
     uint64_t refcount_table_offset;
     uint32_t refcount_table_size;
@@ -162,6 +207,9 @@ typedef struct BDRVQcowState {
     uint64_t compatible_features;
     uint64_t autoclear_features;
 
+    /* refcount updates may be delayed while the image is marked dirty */
+    bool use_lazy_refcounts;
+
     size_t unknown_header_fields_size;
     void* unknown_header_fields;
     QLIST_HEAD(, Qcow2UnknownHeaderExtension) unknown_header_ext;
@@ -189,6 +237,12 @@ typedef struct QCowL2Meta
     int n_start;
     int nb_available;
     int nb_clusters;
+
+    /* The sectors [cow_start, n_start) and [nb_available, cow_end) are
+     * copied from the old contents before the L2 update. Without extended
+     * L2 entries, these are the whole first and last cluster. */
+    int cow_start;
+    int cow_end;
     CoQueue dependent_requests;
 
     QLIST_ENTRY(QCowL2Meta) next_in_flight;
@@ -224,6 +278,45 @@ static inline int64_t align_offset(int64_t offset, int n)
     return offset;
 }
 
+/*
+ * Accessors for L2 table entries. With extended L2 entries, each entry is
+ * followed by a second 64 bit word whose low 32 bits are the subcluster
+ * allocation bitmap.
+ */
+static inline int l2_entry_words(BDRVQcowState *s)
+{
+    return s->extended_l2 ? 2 : 1;
+}
+
+static inline uint64_t get_l2_entry(BDRVQcowState *s, uint64_t *l2_table,
+                                    int idx)
+{
+    return be64_to_cpu(l2_table[idx * l2_entry_words(s)]);
+}
+
+static inline void set_l2_entry(BDRVQcowState *s, uint64_t *l2_table,
+                                int idx, uint64_t entry)
+{
+    l2_table[idx * l2_entry_words(s)] = cpu_to_be64(entry);
+}
+
+static inline uint32_t get_l2_bitmap(BDRVQcowState *s, uint64_t *l2_table,
+                                     int idx)
+{
+    if (!s->extended_l2) {
+        return QCOW_EXTL2_ALL_ALLOCATED;
+    }
+    return be64_to_cpu(l2_table[idx * 2 + 1]) & QCOW_EXTL2_ALL_ALLOCATED;
+}
+
+static inline void set_l2_bitmap(BDRVQcowState *s, uint64_t *l2_table,
+                                 int idx, uint32_t bitmap)
+{
+    if (s->extended_l2) {
+        l2_table[idx * 2 + 1] = cpu_to_be64(bitmap);
+    }
+}
+
 static inline int qcow2_get_cluster_type(uint64_t l2_entry)
 {
     if (l2_entry & QCOW_OFLAG_COMPRESSED) {
@@ -237,10 +330,18 @@ static inline int qcow2_get_cluster_type(uint64_t l2_entry)
     }
 }
 
+/* While the image is marked dirty, the refcounts on disk may be stale and
+ * are rebuilt from the L1/L2 tables when the image is opened next time */
+static inline bool qcow2_need_accurate_refcounts(BDRVQcowState *s)
+{
+    return !(s->incompatible_features & QCOW2_INCOMPAT_DIRTY);
+}
+
 
 // FIXME Need qcow2_ prefix to global functions
 
 /* qcow2.c functions */
+int qcow2_mark_dirty(BlockDriverState *bs);
 int qcow2_backing_read1(BlockDriverState *bs, QEMUIOVector *qiov,
                   int64_t sector_num, int nb_sectors);
 int qcow2_update_header(BlockDriverState *bs);
@@ -261,17 +362,13 @@ void qcow2_free_any_clusters(BlockDriverState *bs,
 int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     int64_t l1_table_offset, int l1_size, int addend);
 
-int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res);
+int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                          bool repair);
 
 /* qcow2-cluster.c functions */
 int qcow2_grow_l1_table(BlockDriverState *bs, int min_size, bool exact_size);
 void qcow2_l2_cache_reset(BlockDriverState *bs);
 int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset);
-void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
-                     uint8_t *out_buf, const uint8_t *in_buf,
-                     int nb_sectors, int enc,
-                     const AES_KEY *key);
-
 int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     int *num, uint64_t *cluster_offset);
 int qcow2_alloc_cluster_offset(BlockDriverState *bs, uint64_t offset,
@@ -285,6 +382,16 @@ int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
     int nb_sectors);
 int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors);
 
+/* qcow2-crypto.c functions */
+void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
+                     uint8_t *out_buf, const uint8_t *in_buf,
+                     int nb_sectors, int enc,
+                     const AES_KEY *key);
+void coroutine_fn qcow2_co_encrypt_sectors(BlockDriverState *bs,
+                     int64_t sector_num, uint8_t *out_buf,
+                     const uint8_t *in_buf, int nb_sectors, int enc,
+                     const AES_KEY *key);
+
 /* qcow2-snapshot.c functions */
 int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info);
 int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id);
@@ -299,6 +406,7 @@ int qcow2_read_snapshots(BlockDriverState *bs);
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
     bool writethrough);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses);
 bool qcow2_cache_set_writethrough(BlockDriverState *bs, Qcow2Cache *c,
     bool enable);
 
@@ -313,5 +421,6 @@ int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table);
+void qcow2_cache_put_deferred(Qcow2Cache *c, void **table);
 
 #endif
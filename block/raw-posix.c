@@ -134,6 +134,9 @@ typedef struct BDRVRawState {
 #ifdef CONFIG_XFS
     bool is_xfs : 1;
 #endif
+    bool is_blkdev : 1;
+    bool has_discard : 1;
+    bool has_write_zeroes : 1;
 } BDRVRawState;
 
 static int fd_open(BlockDriverState *bs);
@@ -185,6 +188,7 @@ static int raw_open_common(BlockDriverState *bs, const char *filename,
                            int bdrv_flags, int open_flags)
 {
     BDRVRawState *s = bs->opaque;
+    struct stat st;
     int fd, ret;
 
     ret = raw_normalize_devicepath(&filename);
@@ -262,6 +266,14 @@ static int raw_open_common(BlockDriverState *bs, const char *filename,
     }
 #endif
 
+    if (fstat(s->fd, &st) == 0 && S_ISBLK(st.st_mode)) {
+        s->is_blkdev = true;
+    }
+
+    /* Cleared again the first time the host tells us it can't do them */
+    s->has_discard = true;
+    s->has_write_zeroes = true;
+
     return 0;
 
 out_free_buf:
@@ -357,6 +369,83 @@ static BlockDriverAIOCB *raw_aio_writev(BlockDriverState *bs,
                           cb, opaque, QEMU_AIO_WRITE);
 }
 
+static void raw_aio_plug(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+    if (s->use_aio) {
+        laio_io_plug(bs, s->aio_ctx);
+    }
+#endif
+}
+
+static void raw_aio_unplug(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+    if (s->use_aio) {
+        laio_io_unplug(bs, s->aio_ctx);
+    }
+#endif
+}
+
+/**
+ * Return the file descriptor of a raw-posix protocol BlockDriverState
+ *
+ * Like raw_get_aio_fd(), this lets the caller bypass the block layer, so it
+ * may only read data whose location it got from bdrv_get_block_status().
+ */
+int raw_get_fd(BlockDriverState *bs)
+{
+    BDRVRawState *s;
+
+    if (!bs->drv) {
+        return -ENOMEDIUM;
+    }
+
+    /* raw-posix has several protocols so just check for raw_aio_readv */
+    if (bs->drv->bdrv_aio_readv != raw_aio_readv) {
+        return -ENOTSUP;
+    }
+
+    s = bs->opaque;
+    return s->fd;
+}
+
+#ifdef CONFIG_LINUX_AIO
+/**
+ * Return the file descriptor for Linux AIO
+ *
+ * This function is a layering violation and should be removed when it becomes
+ * possible to call the block layer outside the global mutex.  It allows the
+ * caller to hijack the file descriptor so I/O can be performed outside the
+ * block layer.
+ */
+int raw_get_aio_fd(BlockDriverState *bs)
+{
+    BDRVRawState *s;
+
+    if (!bs->drv) {
+        return -ENOMEDIUM;
+    }
+
+    if (bs->drv == bdrv_find_format("raw")) {
+        bs = bs->file;
+    }
+
+    /* raw-posix has several protocols so just check for raw_aio_readv */
+    if (bs->drv->bdrv_aio_readv != raw_aio_readv) {
+        return -ENOTSUP;
+    }
+
+    s = bs->opaque;
+    if (!s->use_aio) {
+        return -ENOTSUP;
+    }
+    return s->fd;
+}
+#endif
+
 static BlockDriverAIOCB *raw_aio_flush(BlockDriverState *bs,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
@@ -368,6 +457,65 @@ static BlockDriverAIOCB *raw_aio_flush(BlockDriverState *bs,
     return paio_submit(bs, s->fd, 0, NULL, 0, cb, opaque, QEMU_AIO_FLUSH);
 }
 
+typedef struct RawCoRequest {
+    Coroutine *co;
+    int ret;
+} RawCoRequest;
+
+static void raw_co_request_cb(void *opaque, int ret)
+{
+    RawCoRequest *req = opaque;
+
+    req->ret = ret;
+    qemu_coroutine_enter(req->co, NULL);
+}
+
+/*
+ * Run a request that carries no data (discard, write zeroes) in the thread
+ * pool and wait for it to complete.
+ */
+static int coroutine_fn raw_co_submit(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, int type)
+{
+    BDRVRawState *s = bs->opaque;
+    RawCoRequest req = {
+        .co = qemu_coroutine_self(),
+    };
+    int ret;
+
+    ret = fd_open(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (s->is_blkdev) {
+        type |= QEMU_AIO_BLKDEV;
+    }
+
+    paio_submit(bs, s->fd, sector_num, NULL, nb_sectors,
+                raw_co_request_cb, &req, type);
+    qemu_coroutine_yield();
+
+    return req.ret;
+}
+
+static int coroutine_fn raw_co_write_zeroes(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors)
+{
+    BDRVRawState *s = bs->opaque;
+    int ret;
+
+    if (!s->has_write_zeroes) {
+        return -ENOTSUP;
+    }
+
+    ret = raw_co_submit(bs, sector_num, nb_sectors, QEMU_AIO_WRITE_ZEROES);
+    if (ret == -ENOTSUP) {
+        s->has_write_zeroes = false;
+    }
+    return ret;
+}
+
 static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
@@ -554,16 +702,73 @@ static int64_t raw_get_allocated_file_size(BlockDriverState *bs)
     return (int64_t)st.st_blocks * 512;
 }
 
+static int raw_preallocate(int fd, PreallocMode prealloc, int64_t size)
+{
+    int64_t offset;
+    size_t buf_size;
+    void *buf;
+    ssize_t n;
+    int ret = 0;
+
+    switch (prealloc) {
+    case PREALLOC_MODE_OFF:
+        return 0;
+    case PREALLOC_MODE_FALLOC:
+#ifdef CONFIG_FALLOCATE
+        if (size == 0 || fallocate(fd, 0, 0, size) == 0) {
+            return 0;
+        }
+        return errno == EOPNOTSUPP || errno == ENOSYS ? -ENOTSUP : -errno;
+#else
+        return -ENOTSUP;
+#endif
+    case PREALLOC_MODE_FULL:
+        buf_size = MIN(size, 1 << 20);
+        buf = g_malloc0(buf_size);
+        for (offset = 0; offset < size; offset += n) {
+            n = pwrite(fd, buf, MIN(buf_size, size - offset), offset);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    n = 0;
+                    continue;
+                }
+                ret = -errno;
+                break;
+            }
+        }
+        g_free(buf);
+        if (ret == 0 && qemu_fdatasync(fd) != 0) {
+            ret = -errno;
+        }
+        return ret;
+    default:
+        return -EINVAL;
+    }
+}
+
 static int raw_create(const char *filename, QEMUOptionParameter *options)
 {
     int fd;
     int result = 0;
     int64_t total_size = 0;
+    PreallocMode prealloc = PREALLOC_MODE_OFF;
 
     /* Read out options */
     while (options && options->name) {
         if (!strcmp(options->name, BLOCK_OPT_SIZE)) {
             total_size = options->value.n / BDRV_SECTOR_SIZE;
+        } else if (!strcmp(options->name, BLOCK_OPT_PREALLOC)) {
+            if (!options->value.s || !strcmp(options->value.s, "off")) {
+                prealloc = PREALLOC_MODE_OFF;
+            } else if (!strcmp(options->value.s, "falloc")) {
+                prealloc = PREALLOC_MODE_FALLOC;
+            } else if (!strcmp(options->value.s, "full")) {
+                prealloc = PREALLOC_MODE_FULL;
+            } else {
+                fprintf(stderr, "Invalid preallocation mode: '%s'\n",
+                    options->value.s);
+                return -EINVAL;
+            }
         }
         options++;
     }
@@ -575,6 +780,9 @@ static int raw_create(const char *filename, QEMUOptionParameter *options)
     } else {
         if (ftruncate(fd, total_size * BDRV_SECTOR_SIZE) != 0) {
             result = -errno;
+        } else {
+            result = raw_preallocate(fd, prealloc,
+                                     total_size * BDRV_SECTOR_SIZE);
         }
         if (close(fd) != 0) {
             result = -errno;
@@ -605,15 +813,71 @@ static int xfs_discard(BDRVRawState *s, int64_t sector_num, int nb_sectors)
 static coroutine_fn int raw_co_discard(BlockDriverState *bs,
     int64_t sector_num, int nb_sectors)
 {
-#ifdef CONFIG_XFS
     BDRVRawState *s = bs->opaque;
+    int ret;
 
+#ifdef CONFIG_XFS
     if (s->is_xfs) {
         return xfs_discard(s, sector_num, nb_sectors);
     }
 #endif
 
-    return 0;
+    if (!s->has_discard) {
+        return 0;
+    }
+
+    /* Discard is only a hint, so not being able to do it is no error */
+    ret = raw_co_submit(bs, sector_num, nb_sectors, QEMU_AIO_DISCARD);
+    if (ret == -ENOTSUP) {
+        s->has_discard = false;
+        ret = 0;
+    }
+    return ret;
+}
+
+/*
+ * Holes in a sparse file read as zeroes, so report them as such.  Everything
+ * is data if the file system can't tell.
+ */
+static int64_t coroutine_fn raw_co_get_block_status(BlockDriverState *bs,
+                                                    int64_t sector_num,
+                                                    int nb_sectors, int *pnum)
+{
+    off_t start = sector_num * BDRV_SECTOR_SIZE;
+    int64_t ret = BDRV_BLOCK_OFFSET_VALID | start;
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    BDRVRawState *s = bs->opaque;
+    off_t data, hole;
+
+    *pnum = nb_sectors;
+
+    hole = lseek(s->fd, start, SEEK_HOLE);
+    if (hole < 0) {
+        return ret | BDRV_BLOCK_DATA;
+    }
+
+    if (hole > start) {
+        /* Data up to the next hole */
+        *pnum = MIN(nb_sectors,
+                    DIV_ROUND_UP(hole - start, BDRV_SECTOR_SIZE));
+        return ret | BDRV_BLOCK_DATA;
+    }
+
+    data = lseek(s->fd, start, SEEK_DATA);
+    if (data < 0) {
+        /* ENXIO means there is no data after start, the rest is a hole */
+        return ret | (errno == ENXIO ? BDRV_BLOCK_ZERO : BDRV_BLOCK_DATA);
+    }
+
+    if ((data - start) / BDRV_SECTOR_SIZE == 0) {
+        return ret | BDRV_BLOCK_DATA;
+    }
+    *pnum = MIN(nb_sectors, (data - start) / BDRV_SECTOR_SIZE);
+    return ret | BDRV_BLOCK_ZERO;
+#else
+    *pnum = nb_sectors;
+    return ret | BDRV_BLOCK_DATA;
+#endif
 }
 
 static QEMUOptionParameter raw_create_options[] = {
@@ -622,6 +886,11 @@ static QEMUOptionParameter raw_create_options[] = {
         .type = OPT_SIZE,
         .help = "Virtual disk size"
     },
+    {
+        .name = BLOCK_OPT_PREALLOC,
+        .type = OPT_STRING,
+        .help = "Preallocation mode (allowed values: off, falloc, full)"
+    },
     { NULL }
 };
 
@@ -634,10 +903,14 @@ static BlockDriver bdrv_file = {
     .bdrv_close = raw_close,
     .bdrv_create = raw_create,
     .bdrv_co_discard = raw_co_discard,
+    .bdrv_co_write_zeroes = raw_co_write_zeroes,
+    .bdrv_co_get_block_status = raw_co_get_block_status,
 
     .bdrv_aio_readv = raw_aio_readv,
     .bdrv_aio_writev = raw_aio_writev,
     .bdrv_aio_flush = raw_aio_flush,
+    .bdrv_io_plug = raw_aio_plug,
+    .bdrv_io_unplug = raw_aio_unplug,
 
     .bdrv_truncate = raw_truncate,
     .bdrv_getlength = raw_getlength,
@@ -902,10 +1175,14 @@ static BlockDriver bdrv_host_device = {
     .bdrv_create        = hdev_create,
     .create_options     = raw_create_options,
     .bdrv_has_zero_init = hdev_has_zero_init,
+    .bdrv_co_discard    = raw_co_discard,
+    .bdrv_co_write_zeroes = raw_co_write_zeroes,
 
     .bdrv_aio_readv	= raw_aio_readv,
     .bdrv_aio_writev	= raw_aio_writev,
     .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_io_plug       = raw_aio_plug,
+    .bdrv_io_unplug     = raw_aio_unplug,
 
     .bdrv_truncate      = raw_truncate,
     .bdrv_getlength	= raw_getlength,
@@ -46,6 +46,19 @@ static int coroutine_fn raw_co_discard(BlockDriverState *bs,
     return bdrv_co_discard(bs->file, sector_num, nb_sectors);
 }
 
+static int coroutine_fn raw_co_write_zeroes(BlockDriverState *bs,
+                                            int64_t sector_num, int nb_sectors)
+{
+    return bdrv_co_write_zeroes(bs->file, sector_num, nb_sectors);
+}
+
+static int64_t coroutine_fn raw_co_get_block_status(BlockDriverState *bs,
+                                                    int64_t sector_num,
+                                                    int nb_sectors, int *pnum)
+{
+    return bdrv_co_get_block_status(bs->file, sector_num, nb_sectors, pnum);
+}
+
 static int raw_is_inserted(BlockDriverState *bs)
 {
     return bdrv_is_inserted(bs->file);
@@ -109,6 +122,8 @@ static BlockDriver bdrv_raw = {
     .bdrv_co_readv          = raw_co_readv,
     .bdrv_co_writev         = raw_co_writev,
     .bdrv_co_discard        = raw_co_discard,
+    .bdrv_co_write_zeroes   = raw_co_write_zeroes,
+    .bdrv_co_get_block_status = raw_co_get_block_status,
 
     .bdrv_probe         = raw_probe,
     .bdrv_getlength     = raw_getlength,
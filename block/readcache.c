@@ -0,0 +1,802 @@
+/*
+ * Block driver that caches a slow image on local disk
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Remote protocols like curl, nbd or sheepdog fetch the same data again
+ * every time an image is used.  This driver sits between the image format
+ * and such a protocol and keeps the clusters that were read in a sparse
+ * cache file, so that they are only fetched once:
+ *
+ *   readcache:<cache file>:<image>
+ *
+ * Colons in the name of the cache file are escaped with a backslash, so that
+ * it can be given with a protocol (e.g. blkdebug\:rules.cfg\:cache.img).
+ *
+ * The cache file starts with a header that records the cluster size, the
+ * size and the name of the cached image.  It is followed by a bitmap with
+ * one bit for each cluster that is valid in the cache, and the data, which
+ * is stored at the same offset it has in the image.
+ *
+ * The bitmap is only kept in memory while the image is open, and is written
+ * back when it is closed.  A cache file that was not closed cleanly is
+ * discarded.
+ *
+ * With cache=writethrough or cache=directsync, writes go to the image and
+ * update the cache.  With the other cache modes, writes are only made to the
+ * cache file and are written back to the image when the guest flushes.
+ */
+
+#include "qemu-common.h"
+#include "block_int.h"
+#include "module.h"
+#include "bswap.h"
+
+/* #define DEBUG_READCACHE */
+
+#ifdef DEBUG_READCACHE
+#define DPRINTF(fmt, ...) \
+    do { fprintf(stderr, "readcache: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+enum {
+    READCACHE_MAGIC = 'Q' | 'R' << 8 | 'C' << 16 | '\0' << 24,
+
+    /* The cache file was not closed cleanly */
+    READCACHE_F_IN_USE = 0x01,
+
+    READCACHE_CLUSTER_SIZE = 64 * 1024,
+
+    /* Dirty clusters are written back in requests of up to 1 MB */
+    READCACHE_WRITEBACK_CLUSTERS = 16,
+};
+
+typedef struct {
+    uint32_t magic;                 /* QRC\0 */
+    uint32_t cluster_size;          /* in bytes */
+    uint64_t flags;
+    uint64_t image_size;            /* in bytes */
+    uint64_t bitmap_offset;         /* in bytes */
+    uint64_t data_offset;           /* in bytes */
+
+    /* The name of the cached image, to detect a cache file that is reused
+     * for a different image */
+    uint32_t filename_offset;       /* in bytes from start of header */
+    uint32_t filename_size;         /* in bytes */
+} QEMU_PACKED ReadCacheHeader;
+
+typedef struct BDRVReadCacheState {
+    BlockDriverState *cache;        /* the cache file; bs->file is the image */
+    ReadCacheHeader header;         /* in host byte order */
+
+    int cluster_sectors;
+    int64_t nb_clusters;
+    uint8_t *valid_bitmap;          /* same layout as on disk */
+    uint8_t *dirty_bitmap;          /* only used in write-back mode */
+    bool writeback;
+
+    /* Writes are serialized against reads, so that a read can't fill the
+     * cache with data that a concurrent write overwrites */
+    CoRwlock lock;
+
+    /* Statistics, in clusters */
+    uint64_t hits;
+    uint64_t misses;
+} BDRVReadCacheState;
+
+static bool readcache_test(uint8_t *bitmap, int64_t cluster)
+{
+    return bitmap[cluster / 8] & (1 << (cluster % 8));
+}
+
+static void readcache_set(uint8_t *bitmap, int64_t cluster, int64_t n)
+{
+    for (; n > 0; cluster++, n--) {
+        bitmap[cluster / 8] |= 1 << (cluster % 8);
+    }
+}
+
+static void readcache_clear(uint8_t *bitmap, int64_t cluster, int64_t n)
+{
+    for (; n > 0; cluster++, n--) {
+        bitmap[cluster / 8] &= ~(1 << (cluster % 8));
+    }
+}
+
+static size_t readcache_bitmap_size(BDRVReadCacheState *s)
+{
+    return DIV_ROUND_UP(s->nb_clusters, 8);
+}
+
+static void readcache_header_le_to_cpu(const ReadCacheHeader *le,
+                                       ReadCacheHeader *cpu)
+{
+    cpu->magic = le32_to_cpu(le->magic);
+    cpu->cluster_size = le32_to_cpu(le->cluster_size);
+    cpu->flags = le64_to_cpu(le->flags);
+    cpu->image_size = le64_to_cpu(le->image_size);
+    cpu->bitmap_offset = le64_to_cpu(le->bitmap_offset);
+    cpu->data_offset = le64_to_cpu(le->data_offset);
+    cpu->filename_offset = le32_to_cpu(le->filename_offset);
+    cpu->filename_size = le32_to_cpu(le->filename_size);
+}
+
+static void readcache_header_cpu_to_le(const ReadCacheHeader *cpu,
+                                       ReadCacheHeader *le)
+{
+    le->magic = cpu_to_le32(cpu->magic);
+    le->cluster_size = cpu_to_le32(cpu->cluster_size);
+    le->flags = cpu_to_le64(cpu->flags);
+    le->image_size = cpu_to_le64(cpu->image_size);
+    le->bitmap_offset = cpu_to_le64(cpu->bitmap_offset);
+    le->data_offset = cpu_to_le64(cpu->data_offset);
+    le->filename_offset = cpu_to_le32(cpu->filename_offset);
+    le->filename_size = cpu_to_le32(cpu->filename_size);
+}
+
+static int readcache_write_header(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheHeader le;
+
+    readcache_header_cpu_to_le(&s->header, &le);
+    return bdrv_pwrite_sync(s->cache, 0, &le, sizeof(le));
+}
+
+/* Returns true if the cache file holds valid data for the image */
+static bool readcache_load(BlockDriverState *bs, const char *image)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheHeader le, header;
+    char *filename = NULL;
+    bool ok = false;
+
+    if (bdrv_pread(s->cache, 0, &le, sizeof(le)) != sizeof(le)) {
+        return false;
+    }
+    readcache_header_le_to_cpu(&le, &header);
+
+    if (header.magic != READCACHE_MAGIC ||
+        header.cluster_size != s->header.cluster_size ||
+        header.image_size != s->header.image_size ||
+        header.bitmap_offset != s->header.bitmap_offset ||
+        header.data_offset != s->header.data_offset ||
+        header.filename_size != strlen(image)) {
+        return false;
+    }
+
+    if (header.flags & READCACHE_F_IN_USE) {
+        DPRINTF("cache file was not closed cleanly\n");
+        return false;
+    }
+
+    filename = g_malloc(header.filename_size);
+    if (bdrv_pread(s->cache, header.filename_offset, filename,
+                   header.filename_size) != header.filename_size ||
+        memcmp(filename, image, header.filename_size)) {
+        goto out;
+    }
+
+    if (bdrv_pread(s->cache, header.bitmap_offset, s->valid_bitmap,
+                   readcache_bitmap_size(s)) != readcache_bitmap_size(s)) {
+        goto out;
+    }
+
+    ok = true;
+out:
+    g_free(filename);
+    return ok;
+}
+
+/* Discards the contents of the cache file */
+static int readcache_reset(BlockDriverState *bs, const char *image)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    memset(s->valid_bitmap, 0, readcache_bitmap_size(s));
+
+    ret = bdrv_truncate(s->cache, 0);
+    if (ret < 0 && ret != -ENOTSUP) {
+        return ret;
+    }
+
+    ret = bdrv_pwrite(s->cache, s->header.filename_offset, image,
+                      s->header.filename_size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return 0;
+}
+
+static int readcache_open_cache_file(BlockDriverState **pbs,
+                                     const char *filename, int flags)
+{
+    BlockDriver *drv;
+    QEMUOptionParameter *options;
+    int ret;
+
+    ret = bdrv_file_open(pbs, filename, flags);
+    if (ret != -ENOENT) {
+        return ret;
+    }
+
+    /* Create an empty cache file on first use */
+    drv = bdrv_find_protocol(filename);
+    if (drv == NULL || drv->create_options == NULL) {
+        return -ENOENT;
+    }
+
+    options = parse_option_parameters("", drv->create_options, NULL);
+    set_option_parameter_int(options, BLOCK_OPT_SIZE, 0);
+    ret = bdrv_create_file(filename, options);
+    free_option_parameters(options);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_file_open(pbs, filename, flags);
+}
+
+/* Valid filenames look like readcache:path/to/cache_file:path/to/image */
+static int readcache_open(BlockDriverState *bs, const char *filename,
+                          int flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    char *cache_filename, *p;
+    const char *image, *c;
+    int64_t image_size;
+    int ret;
+
+    /* Parse the readcache: prefix */
+    if (!strstart(filename, "readcache:", &filename)) {
+        return -EINVAL;
+    }
+
+    /* Parse the cache filename, up to the first colon that isn't escaped */
+    cache_filename = g_malloc(strlen(filename) + 1);
+    for (c = filename, p = cache_filename; *c && *c != ':'; c++) {
+        if (c[0] == '\\' && c[1] == ':') {
+            c++;
+        }
+        *p++ = *c;
+    }
+    *p = '\0';
+    if (*c != ':' || p == cache_filename || c[1] == '\0') {
+        ret = -EINVAL;
+        goto fail_filename;
+    }
+    image = c + 1;
+
+    if (strlen(image) > READCACHE_CLUSTER_SIZE - sizeof(ReadCacheHeader)) {
+        ret = -EINVAL;
+        goto fail_filename;
+    }
+
+    ret = bdrv_file_open(&bs->file, image, flags);
+    if (ret < 0) {
+        goto fail_filename;
+    }
+
+    image_size = bdrv_getlength(bs->file);
+    if (image_size < 0) {
+        ret = image_size;
+        goto fail;
+    }
+
+    /* The cache is filled on reads, so it is writable even if the image
+     * isn't */
+    ret = readcache_open_cache_file(&s->cache, cache_filename,
+                                    (flags & BDRV_O_CACHE_MASK) |
+                                    BDRV_O_RDWR);
+    g_free(cache_filename);
+    cache_filename = NULL;
+    if (ret < 0) {
+        goto fail;
+    }
+
+    s->cluster_sectors = READCACHE_CLUSTER_SIZE >> BDRV_SECTOR_BITS;
+    s->nb_clusters = DIV_ROUND_UP(image_size, READCACHE_CLUSTER_SIZE);
+    s->valid_bitmap = g_malloc0(readcache_bitmap_size(s));
+    s->writeback = (flags & BDRV_O_RDWR) && (flags & BDRV_O_CACHE_WB);
+    if (s->writeback) {
+        s->dirty_bitmap = g_malloc0(readcache_bitmap_size(s));
+    }
+
+    s->header = (ReadCacheHeader) {
+        .magic           = READCACHE_MAGIC,
+        .cluster_size    = READCACHE_CLUSTER_SIZE,
+        .image_size      = image_size,
+        .filename_offset = sizeof(ReadCacheHeader),
+        .filename_size   = strlen(image),
+        .bitmap_offset   = READCACHE_CLUSTER_SIZE,
+        .data_offset     = READCACHE_CLUSTER_SIZE +
+                           DIV_ROUND_UP(readcache_bitmap_size(s),
+                                        READCACHE_CLUSTER_SIZE) *
+                           READCACHE_CLUSTER_SIZE,
+    };
+
+    if (!readcache_load(bs, image)) {
+        DPRINTF("starting with an empty cache\n");
+        ret = readcache_reset(bs, image);
+        if (ret < 0) {
+            goto fail_cache;
+        }
+    }
+
+    /* The bitmap on disk is out of date from now on */
+    s->header.flags |= READCACHE_F_IN_USE;
+    ret = readcache_write_header(bs);
+    if (ret < 0) {
+        goto fail_cache;
+    }
+
+    qemu_co_rwlock_init(&s->lock);
+    return 0;
+
+fail_cache:
+    g_free(s->valid_bitmap);
+    g_free(s->dirty_bitmap);
+    bdrv_delete(s->cache);
+fail:
+    bdrv_delete(bs->file);
+    bs->file = NULL;
+fail_filename:
+    g_free(cache_filename);
+    return ret;
+}
+
+static void readcache_close(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    /* Dirty clusters have been written back by the flush in bdrv_close(),
+     * unless that failed */
+    if (s->dirty_bitmap) {
+        int64_t i;
+        for (i = 0; i < s->nb_clusters; i++) {
+            if (readcache_test(s->dirty_bitmap, i)) {
+                fprintf(stderr, "readcache: failed to write back cached "
+                        "data to %s\n", bs->file->filename);
+                goto out;
+            }
+        }
+    }
+
+    ret = bdrv_pwrite(s->cache, s->header.bitmap_offset, s->valid_bitmap,
+                      readcache_bitmap_size(s));
+    if (ret < 0 || bdrv_flush(s->cache) < 0) {
+        goto out;
+    }
+
+    s->header.flags &= ~READCACHE_F_IN_USE;
+    readcache_write_header(bs);
+
+out:
+    g_free(s->valid_bitmap);
+    g_free(s->dirty_bitmap);
+    bdrv_delete(s->cache);
+}
+
+static int64_t readcache_getlength(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    return s->header.image_size;
+}
+
+static int64_t readcache_cache_sector(BDRVReadCacheState *s,
+                                      int64_t sector_num)
+{
+    return (s->header.data_offset >> BDRV_SECTOR_BITS) + sector_num;
+}
+
+/*
+ * Reads @nb_clusters clusters from the image into @buf and stores them in
+ * the cache.  Failing to update the cache is not an error, the clusters just
+ * aren't marked valid then.
+ */
+static int coroutine_fn readcache_co_fill(BlockDriverState *bs,
+                                          int64_t cluster, int nb_clusters,
+                                          uint8_t *buf)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int64_t sector_num = cluster * s->cluster_sectors;
+    int nb_sectors;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret;
+
+    /* The last cluster may be partial */
+    nb_sectors = MIN(nb_clusters * s->cluster_sectors,
+                     (s->header.image_size >> BDRV_SECTOR_BITS) - sector_num);
+
+    iov.iov_base = buf;
+    iov.iov_len = nb_sectors << BDRV_SECTOR_BITS;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    ret = bdrv_co_readv(bs->file, sector_num, nb_sectors, &qiov);
+    if (ret < 0) {
+        return ret;
+    }
+    s->misses += nb_clusters;
+
+    BLKDBG_EVENT(s->cache, BLKDBG_WRITE_AIO);
+    ret = bdrv_co_writev(s->cache, readcache_cache_sector(s, sector_num),
+                         nb_sectors, &qiov);
+    if (ret < 0) {
+        DPRINTF("failed to fill the cache: %s\n", strerror(-ret));
+        return 0;
+    }
+
+    readcache_set(s->valid_bitmap, cluster, nb_clusters);
+    return 0;
+}
+
+static int coroutine_fn readcache_co_readv(BlockDriverState *bs,
+                                           int64_t sector_num, int nb_sectors,
+                                           QEMUIOVector *qiov)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    QEMUIOVector hd_qiov;
+    uint64_t bytes_done = 0;
+    uint8_t *buf = NULL;
+    int ret = 0;
+
+    qemu_iovec_init(&hd_qiov, qiov->niov);
+    qemu_co_rwlock_rdlock(&s->lock);
+
+    while (nb_sectors > 0) {
+        int64_t cluster = sector_num / s->cluster_sectors;
+        int64_t last = (sector_num + nb_sectors - 1) / s->cluster_sectors;
+        bool valid = readcache_test(s->valid_bitmap, cluster);
+        int64_t end;
+        int n;
+
+        /* Handle all following clusters that are in the same state at once */
+        end = cluster + 1;
+        while (end <= last && readcache_test(s->valid_bitmap, end) == valid) {
+            end++;
+        }
+        n = MIN(end * s->cluster_sectors - sector_num, nb_sectors);
+
+        qemu_iovec_reset(&hd_qiov);
+        qemu_iovec_copy(&hd_qiov, qiov, bytes_done, n << BDRV_SECTOR_BITS);
+
+        if (valid) {
+            s->hits += end - cluster;
+            ret = bdrv_co_readv(s->cache,
+                                readcache_cache_sector(s, sector_num),
+                                n, &hd_qiov);
+        } else {
+            qemu_vfree(buf);
+            buf = qemu_blockalign(bs, (end - cluster) *
+                                      READCACHE_CLUSTER_SIZE);
+            ret = readcache_co_fill(bs, cluster, end - cluster, buf);
+            if (ret == 0) {
+                qemu_iovec_from_buffer(&hd_qiov,
+                    buf + ((sector_num - cluster * s->cluster_sectors)
+                           << BDRV_SECTOR_BITS),
+                    n << BDRV_SECTOR_BITS);
+            }
+        }
+        if (ret < 0) {
+            goto out;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        bytes_done += n << BDRV_SECTOR_BITS;
+    }
+
+out:
+    qemu_co_rwlock_unlock(&s->lock);
+    qemu_iovec_destroy(&hd_qiov);
+    qemu_vfree(buf);
+    return ret;
+}
+
+/* Returns the range of clusters that a request covers completely */
+static void readcache_covered_clusters(BDRVReadCacheState *s,
+                                       int64_t sector_num, int nb_sectors,
+                                       int64_t *first, int64_t *end)
+{
+    int64_t end_sector = sector_num + nb_sectors;
+
+    *first = DIV_ROUND_UP(sector_num, s->cluster_sectors);
+    if (end_sector == s->header.image_size >> BDRV_SECTOR_BITS) {
+        *end = s->nb_clusters;
+    } else {
+        *end = end_sector / s->cluster_sectors;
+    }
+}
+
+/*
+ * Removes @cluster, which a request only covers partly and which the cache
+ * could not be updated for, from the cache.  The image already has the data
+ * of the request, but if the cluster is dirty the rest of it is only in the
+ * cache and is written back first.  If this fails, the cluster stays dirty.
+ */
+static int coroutine_fn readcache_co_drop_edge(BlockDriverState *bs,
+                                               int64_t cluster,
+                                               int64_t sector_num,
+                                               int nb_sectors)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int64_t start = cluster * s->cluster_sectors;
+    int64_t image_sectors = s->header.image_size >> BDRV_SECTOR_BITS;
+    int64_t cluster_end = MIN(start + s->cluster_sectors, image_sectors);
+    int64_t request_end = sector_num + nb_sectors;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    uint8_t *buf;
+    int ret;
+
+    if (!s->dirty_bitmap || !readcache_test(s->dirty_bitmap, cluster)) {
+        readcache_clear(s->valid_bitmap, cluster, 1);
+        return 0;
+    }
+
+    /* The part of the cluster outside the request wasn't touched by the
+     * failed write, so the cache still has the right data for it */
+    buf = qemu_blockalign(bs, READCACHE_CLUSTER_SIZE);
+    iov.iov_base = buf;
+    iov.iov_len = (cluster_end - start) << BDRV_SECTOR_BITS;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    ret = bdrv_co_readv(s->cache, readcache_cache_sector(s, start),
+                        cluster_end - start, &qiov);
+    if (ret < 0) {
+        goto out;
+    }
+
+    if (sector_num > start) {
+        iov.iov_len = (sector_num - start) << BDRV_SECTOR_BITS;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        ret = bdrv_co_writev(bs->file, start, sector_num - start, &qiov);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+    if (request_end < cluster_end) {
+        iov.iov_base = buf + ((request_end - start) << BDRV_SECTOR_BITS);
+        iov.iov_len = (cluster_end - request_end) << BDRV_SECTOR_BITS;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        ret = bdrv_co_writev(bs->file, request_end,
+                             cluster_end - request_end, &qiov);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    readcache_clear(s->dirty_bitmap, cluster, 1);
+    readcache_clear(s->valid_bitmap, cluster, 1);
+
+out:
+    qemu_vfree(buf);
+    return ret;
+}
+
+static int coroutine_fn readcache_co_writev_through(BlockDriverState *bs,
+                                                    int64_t sector_num,
+                                                    int nb_sectors,
+                                                    QEMUIOVector *qiov)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int64_t first, end;
+    int ret;
+
+    ret = bdrv_co_writev(bs->file, sector_num, nb_sectors, qiov);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Partially written clusters that are not in the cache stay invalid,
+     * the write to them is simply ignored */
+    BLKDBG_EVENT(s->cache, BLKDBG_WRITE_AIO);
+    ret = bdrv_co_writev(s->cache, readcache_cache_sector(s, sector_num),
+                         nb_sectors, qiov);
+    readcache_covered_clusters(s, sector_num, nb_sectors, &first, &end);
+    if (ret < 0) {
+        int64_t cluster = sector_num / s->cluster_sectors;
+        int64_t last = (sector_num + nb_sectors - 1) / s->cluster_sectors;
+
+        /* The image is up to date for the clusters that the request covers,
+         * so nothing needs to be written back for them */
+        if (end > first) {
+            readcache_clear(s->valid_bitmap, first, end - first);
+            if (s->dirty_bitmap) {
+                readcache_clear(s->dirty_bitmap, first, end - first);
+            }
+        }
+
+        if (cluster < first) {
+            ret = readcache_co_drop_edge(bs, cluster, sector_num, nb_sectors);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        /* A request that starts on a cluster boundary can still end inside
+         * the same cluster, which then wasn't dropped as the first one */
+        if (last >= end && (last != cluster || cluster >= first)) {
+            ret = readcache_co_drop_edge(bs, last, sector_num, nb_sectors);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        return 0;
+    }
+
+    if (end > first) {
+        readcache_set(s->valid_bitmap, first, end - first);
+    }
+    return 0;
+}
+
+static int coroutine_fn readcache_co_writev_back(BlockDriverState *bs,
+                                                 int64_t sector_num,
+                                                 int nb_sectors,
+                                                 QEMUIOVector *qiov)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int64_t cluster = sector_num / s->cluster_sectors;
+    int64_t last = (sector_num + nb_sectors - 1) / s->cluster_sectors;
+    int64_t first, end;
+    uint8_t *buf = NULL;
+    int ret;
+
+    /* Partially written clusters must be complete in the cache so that
+     * they can be marked valid */
+    readcache_covered_clusters(s, sector_num, nb_sectors, &first, &end);
+    if (cluster < first && !readcache_test(s->valid_bitmap, cluster)) {
+        buf = qemu_blockalign(bs, READCACHE_CLUSTER_SIZE);
+        ret = readcache_co_fill(bs, cluster, 1, buf);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+    if (last >= end && last != cluster &&
+        !readcache_test(s->valid_bitmap, last)) {
+        if (!buf) {
+            buf = qemu_blockalign(bs, READCACHE_CLUSTER_SIZE);
+        }
+        ret = readcache_co_fill(bs, last, 1, buf);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+    if (!readcache_test(s->valid_bitmap, cluster) ||
+        !readcache_test(s->valid_bitmap, last)) {
+        /* The cache couldn't be filled, write to the image directly */
+        ret = readcache_co_writev_through(bs, sector_num, nb_sectors, qiov);
+        goto out;
+    }
+
+    BLKDBG_EVENT(s->cache, BLKDBG_WRITE_AIO);
+    ret = bdrv_co_writev(s->cache, readcache_cache_sector(s, sector_num),
+                         nb_sectors, qiov);
+    if (ret < 0) {
+        goto out;
+    }
+
+    readcache_set(s->valid_bitmap, cluster, last - cluster + 1);
+    readcache_set(s->dirty_bitmap, cluster, last - cluster + 1);
+
+out:
+    qemu_vfree(buf);
+    return ret;
+}
+
+static int coroutine_fn readcache_co_writev(BlockDriverState *bs,
+                                            int64_t sector_num, int nb_sectors,
+                                            QEMUIOVector *qiov)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    qemu_co_rwlock_wrlock(&s->lock);
+    if (s->writeback) {
+        ret = readcache_co_writev_back(bs, sector_num, nb_sectors, qiov);
+    } else {
+        ret = readcache_co_writev_through(bs, sector_num, nb_sectors, qiov);
+    }
+    qemu_co_rwlock_unlock(&s->lock);
+
+    return ret;
+}
+
+/* Writes dirty clusters back to the image */
+static int coroutine_fn readcache_co_flush(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    uint8_t *buf;
+    int64_t cluster, end, sector_num;
+    int nb_sectors;
+    int ret = 0;
+
+    if (!s->writeback) {
+        return 0;
+    }
+
+    buf = qemu_blockalign(bs, READCACHE_WRITEBACK_CLUSTERS *
+                              READCACHE_CLUSTER_SIZE);
+    qemu_co_rwlock_wrlock(&s->lock);
+
+    for (cluster = 0; cluster < s->nb_clusters; cluster = end) {
+        if (!readcache_test(s->dirty_bitmap, cluster)) {
+            end = cluster + 1;
+            continue;
+        }
+
+        end = cluster + 1;
+        while (end < s->nb_clusters &&
+               end - cluster < READCACHE_WRITEBACK_CLUSTERS &&
+               readcache_test(s->dirty_bitmap, end)) {
+            end++;
+        }
+
+        sector_num = cluster * s->cluster_sectors;
+        nb_sectors = MIN((end - cluster) * s->cluster_sectors,
+                         (s->header.image_size >> BDRV_SECTOR_BITS) -
+                         sector_num);
+        iov.iov_base = buf;
+        iov.iov_len = nb_sectors << BDRV_SECTOR_BITS;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = bdrv_co_readv(s->cache, readcache_cache_sector(s, sector_num),
+                            nb_sectors, &qiov);
+        if (ret < 0) {
+            break;
+        }
+        ret = bdrv_co_writev(bs->file, sector_num, nb_sectors, &qiov);
+        if (ret < 0) {
+            break;
+        }
+
+        readcache_clear(s->dirty_bitmap, cluster, end - cluster);
+    }
+
+    qemu_co_rwlock_unlock(&s->lock);
+    qemu_vfree(buf);
+    return ret;
+}
+
+static void readcache_get_stats(BlockDriverState *bs, BlockDeviceStats *stats)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    stats->has_read_cache_hits = true;
+    stats->read_cache_hits = s->hits;
+    stats->has_read_cache_misses = true;
+    stats->read_cache_misses = s->misses;
+}
+
+static BlockDriver bdrv_readcache = {
+    .format_name            = "readcache",
+    .protocol_name          = "readcache",
+    .instance_size          = sizeof(BDRVReadCacheState),
+
+    .bdrv_file_open         = readcache_open,
+    .bdrv_close             = readcache_close,
+    .bdrv_getlength         = readcache_getlength,
+
+    .bdrv_co_readv          = readcache_co_readv,
+    .bdrv_co_writev         = readcache_co_writev,
+    .bdrv_co_flush_to_os    = readcache_co_flush,
+
+    .bdrv_get_stats         = readcache_get_stats,
+};
+
+static void bdrv_readcache_init(void)
+{
+    bdrv_register(&bdrv_readcache);
+}
+
+block_init(bdrv_readcache_init);
@@ -13,6 +13,7 @@
 
 #include "trace.h"
 #include "block_int.h"
+#include "ratelimit.h"
 
 enum {
     /*
@@ -21,45 +22,47 @@ enum {
      * contiguous regions of the image is efficient.
      */
     STREAM_BUFFER_SIZE = 512 * 1024, /* in bytes */
-};
 
-#define SLICE_TIME 100000000ULL /* ns */
+    /* Maximum number of buffers that are populated in parallel */
+    STREAM_MAX_IN_FLIGHT = 8,
 
-typedef struct {
-    int64_t next_slice_time;
-    uint64_t slice_quota;
-    uint64_t dispatched;
-} RateLimit;
+    /* Maximum size of a single lookup in the backing chain */
+    STREAM_LOOKUP_SECTORS = 64 * 1024 * 1024 / BDRV_SECTOR_SIZE,
 
-static int64_t ratelimit_calculate_delay(RateLimit *limit, uint64_t n)
-{
-    int64_t now = qemu_get_clock_ns(rt_clock);
+    /* Lookups between two yields while the extents are enumerated */
+    STREAM_LOOKUPS_PER_YIELD = 256,
+};
 
-    if (limit->next_slice_time < now) {
-        limit->next_slice_time = now + SLICE_TIME;
-        limit->dispatched = 0;
-    }
-    if (limit->dispatched == 0 || limit->dispatched + n <= limit->slice_quota) {
-        limit->dispatched += n;
-        return 0;
-    } else {
-        limit->dispatched = n;
-        return limit->next_slice_time - now;
-    }
-}
+#define SLICE_TIME 100000000ULL /* ns */
 
-static void ratelimit_set_speed(RateLimit *limit, uint64_t speed)
-{
-    limit->slice_quota = speed / (1000000000ULL / SLICE_TIME);
-}
+/* A range that is unallocated in the top image and has to be copied */
+typedef struct StreamExtent {
+    int64_t sector_num;
+    int64_t nb_sectors;
+} StreamExtent;
 
 typedef struct StreamBlockJob {
     BlockJob common;
     RateLimit limit;
     BlockDriverState *base;
     char backing_file_id[1024];
+
+    StreamExtent *extents;
+    int nb_extents;
+
+    int in_flight;
+    int max_in_flight;      /* adapted to the I/O of the guest */
+    uint64_t guest_ops;     /* guest requests before the current batch */
+    bool waiting;           /* stream_run waits for a buffer to complete */
+    int ret;                /* first error while populating */
 } StreamBlockJob;
 
+typedef struct StreamOp {
+    StreamBlockJob *s;
+    int64_t sector_num;
+    int nb_sectors;
+} StreamOp;
+
 static int coroutine_fn stream_populate(BlockDriverState *bs,
                                         int64_t sector_num, int nb_sectors,
                                         void *buf)
@@ -98,65 +101,178 @@ static void close_unused_images(BlockDriverState *top, BlockDriverState *base,
     top->backing_hd = base;
 }
 
+static bool stream_is_below_base(BlockDriverState *base,
+                                 BlockDriverState *owner)
+{
+    for (; base; base = base->backing_hd) {
+        if (base == owner) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void stream_add_extent(StreamBlockJob *s, int64_t sector_num,
+                              int nb_sectors)
+{
+    StreamExtent *last = s->nb_extents ? &s->extents[s->nb_extents - 1] : NULL;
+
+    if (last && last->sector_num + last->nb_sectors == sector_num) {
+        last->nb_sectors += nb_sectors;
+        return;
+    }
+
+    /* Grow the array in powers of two */
+    if ((s->nb_extents & (s->nb_extents - 1)) == 0) {
+        s->extents = g_renew(StreamExtent, s->extents,
+                             MAX(s->nb_extents * 2, 16));
+    }
+    s->extents[s->nb_extents++] = (StreamExtent) {
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+    };
+}
+
 /*
  * Given an image chain: [BASE] -> [INTER1] -> [INTER2] -> [TOP]
  *
- * Return true if the given sector is allocated in top.
- * Return false if the given sector is allocated in intermediate images.
- * Return true otherwise.
- *
- * 'pnum' is set to the number of sectors (including and immediately following
- *  the specified sector) that are known to be in the same
- *  allocated/unallocated state.
- *
+ * Collect the ranges whose data is in INTER1 or INTER2, as these are the
+ * ones that have to be copied into TOP.  Ranges that are allocated in TOP,
+ * that come from BASE or below, and that read as zeroes anyway once TOP
+ * has no backing file (if there is no BASE) are skipped and count as done.
  */
-static int coroutine_fn is_allocated_base(BlockDriverState *top,
-                                          BlockDriverState *base,
-                                          int64_t sector_num,
-                                          int nb_sectors, int *pnum)
+static int coroutine_fn stream_find_extents(StreamBlockJob *s, int64_t end)
 {
-    BlockDriverState *intermediate;
+    BlockDriverState *bs = s->common.bs;
+    BlockDriverState *owner;
+    int64_t sector_num;
+    int lookups = 0;
     int ret, n;
 
-    ret = bdrv_co_is_allocated(top, sector_num, nb_sectors, &n);
-    if (ret) {
-        *pnum = n;
-        return ret;
-    }
-
-    /*
-     * Is the unallocated chunk [sector_num, n] also
-     * unallocated between base and top?
-     */
-    intermediate = top->backing_hd;
+    for (sector_num = 0; sector_num < end; sector_num += n) {
+        bool copy;
 
-    while (intermediate != base) {
-        int pnum_inter;
+        if (++lookups % STREAM_LOOKUPS_PER_YIELD == 0) {
+            /* Cached metadata doesn't yield, so don't hog the main loop */
+            block_job_sleep_ns(&s->common, rt_clock, 0);
+            if (block_job_is_cancelled(&s->common)) {
+                return 0;
+            }
+        }
 
-        ret = bdrv_co_is_allocated(intermediate, sector_num, nb_sectors,
-                                   &pnum_inter);
+        ret = bdrv_co_get_owner(bs, sector_num,
+                                MIN(end - sector_num, STREAM_LOOKUP_SECTORS),
+                                &owner, &n);
         if (ret < 0) {
             return ret;
-        } else if (ret) {
-            *pnum = pnum_inter;
-            return 0;
         }
 
-        /*
-         * [sector_num, nb_sectors] is unallocated on top but intermediate
-         * might have
-         *
-         * [sector_num+x, nr_sectors] allocated.
-         */
-        if (n > pnum_inter) {
-            n = pnum_inter;
+        copy = owner && owner != bs && !stream_is_below_base(s->base, owner);
+        if (copy && !s->base) {
+            int64_t status;
+
+            status = bdrv_co_get_block_status(owner, sector_num, n, &n);
+            if (status < 0) {
+                return status;
+            }
+            copy = !(status & BDRV_BLOCK_ZERO);
         }
 
-        intermediate = intermediate->backing_hd;
+        trace_stream_extent(s, sector_num, n, copy);
+        if (copy) {
+            stream_add_extent(s, sector_num, n);
+        } else {
+            s->common.offset += n * BDRV_SECTOR_SIZE;
+        }
     }
 
-    *pnum = n;
-    return 1;
+    return 0;
+}
+
+static void coroutine_fn stream_co_populate(void *opaque)
+{
+    StreamOp *op = opaque;
+    StreamBlockJob *s = op->s;
+    BlockDriverState *bs = s->common.bs;
+    void *buf;
+    int ret, n;
+
+    /* The guest may have written the range since it was looked up */
+    ret = bdrv_co_is_allocated(bs, op->sector_num, op->nb_sectors, &n);
+    if (ret >= 0 && !(ret && n == op->nb_sectors)) {
+        buf = qemu_blockalign(bs, op->nb_sectors * BDRV_SECTOR_SIZE);
+        ret = stream_populate(bs, op->sector_num, op->nb_sectors, buf);
+        qemu_vfree(buf);
+    }
+
+    if (ret < 0) {
+        if (s->ret == 0) {
+            s->ret = ret;
+        }
+    } else {
+        /* Publish progress */
+        s->common.offset += op->nb_sectors * BDRV_SECTOR_SIZE;
+    }
+
+    s->in_flight--;
+    g_free(op);
+
+    if (s->waiting) {
+        s->waiting = false;
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+static void stream_start_op(StreamBlockJob *s, int64_t sector_num,
+                            int nb_sectors)
+{
+    StreamOp *op;
+    Coroutine *co;
+
+    op = g_malloc(sizeof(*op));
+    op->s = s;
+    op->sector_num = sector_num;
+    op->nb_sectors = nb_sectors;
+
+    s->in_flight++;
+    trace_stream_one_iteration(s, sector_num, nb_sectors, s->max_in_flight);
+    co = qemu_coroutine_create(stream_co_populate);
+    qemu_coroutine_enter(co, op);
+}
+
+static uint64_t stream_guest_ops(BlockDriverState *bs)
+{
+    uint64_t guest_ops = 0;
+    int i;
+
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        guest_ops += bs->nr_ops[i];
+    }
+    return guest_ops;
+}
+
+/*
+ * Guest requests that complete while the job is populating the image mean
+ * that the guest is waiting for the disk, so back off quickly when there
+ * are any, and speed up again slowly while the guest is idle.
+ */
+static void stream_adapt_pace(StreamBlockJob *s)
+{
+    uint64_t guest_ops = stream_guest_ops(s->common.bs);
+
+    if (guest_ops != s->guest_ops) {
+        s->max_in_flight = MAX(s->max_in_flight / 2, 1);
+    } else if (s->max_in_flight < STREAM_MAX_IN_FLIGHT) {
+        s->max_in_flight++;
+    }
+    s->guest_ops = guest_ops;
+}
+
+static void coroutine_fn stream_wait_for_io(StreamBlockJob *s)
+{
+    /* Buffers in flight reenter the coroutine, so the job stays busy */
+    s->waiting = true;
+    qemu_coroutine_yield();
 }
 
 static void coroutine_fn stream_run(void *opaque)
@@ -164,19 +280,17 @@ static void coroutine_fn stream_run(void *opaque)
     StreamBlockJob *s = opaque;
     BlockDriverState *bs = s->common.bs;
     BlockDriverState *base = s->base;
-    int64_t sector_num, end;
+    int64_t end, done = 0;
     int ret = 0;
-    int n = 0;
-    void *buf;
+    int i = 0;
 
     s->common.len = bdrv_getlength(bs);
     if (s->common.len < 0) {
-        block_job_complete(&s->common, s->common.len);
+        block_job_completed(&s->common, s->common.len);
         return;
     }
 
     end = s->common.len >> BDRV_SECTOR_BITS;
-    buf = qemu_blockalign(bs, STREAM_BUFFER_SIZE);
 
     /* Turn on copy-on-read for the whole block device so that guest read
      * requests help us make progress.  Only do this when copying the entire
@@ -187,44 +301,56 @@ static void coroutine_fn stream_run(void *opaque)
         bdrv_enable_copy_on_read(bs);
     }
 
-    for (sector_num = 0; sector_num < end; sector_num += n) {
+    ret = stream_find_extents(s, end);
+    s->max_in_flight = 1;
+    s->guest_ops = stream_guest_ops(bs);
+
+    while (ret == 0 && i < s->nb_extents) {
         uint64_t delay_ns = 0;
 
-wait:
-        /* Note that even when no rate limit is applied we need to yield
-         * with no pending I/O here so that qemu_aio_flush() returns.
-         */
-        block_job_sleep_ns(&s->common, rt_clock, delay_ns);
         if (block_job_is_cancelled(&s->common)) {
             break;
         }
 
-        ret = is_allocated_base(bs, base, sector_num,
-                                STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE, &n);
-        trace_stream_one_iteration(s, sector_num, n, ret);
-        if (ret == 0) {
+        /* Start a batch of buffers and wait for all of them */
+        stream_adapt_pace(s);
+        while (s->in_flight < s->max_in_flight && i < s->nb_extents) {
+            StreamExtent *e = &s->extents[i];
+            int n;
+
+            n = MIN(e->nb_sectors - done,
+                    STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE);
             if (s->common.speed) {
                 delay_ns = ratelimit_calculate_delay(&s->limit, n);
                 if (delay_ns > 0) {
-                    goto wait;
+                    break;
                 }
             }
-            ret = stream_populate(bs, sector_num, n, buf);
+
+            stream_start_op(s, e->sector_num + done, n);
+            done += n;
+            if (done == e->nb_sectors) {
+                i++;
+                done = 0;
+            }
         }
-        if (ret < 0) {
-            break;
+        while (s->in_flight > 0) {
+            stream_wait_for_io(s);
         }
-        ret = 0;
+        ret = s->ret;
 
-        /* Publish progress */
-        s->common.offset += n * BDRV_SECTOR_SIZE;
+        /* Note that even when no rate limit is applied we need to yield
+         * with no pending I/O here so that qemu_aio_flush() returns.
+         */
+        block_job_sleep_ns(&s->common, rt_clock, delay_ns);
     }
 
     if (!base) {
         bdrv_disable_copy_on_read(bs);
     }
 
-    if (!block_job_is_cancelled(&s->common) && sector_num == end && ret == 0) {
+    if (!block_job_is_cancelled(&s->common) && i == s->nb_extents &&
+        ret == 0) {
         const char *base_id = NULL, *base_fmt = NULL;
         if (base) {
             base_id = s->backing_file_id;
@@ -236,8 +362,8 @@ wait:
         close_unused_images(bs, base, base_id);
     }
 
-    qemu_vfree(buf);
-    block_job_complete(&s->common, ret);
+    g_free(s->extents);
+    block_job_completed(&s->common, ret);
 }
 
 static void stream_set_speed(BlockJob *job, int64_t speed, Error **errp)
@@ -248,7 +374,7 @@ static void stream_set_speed(BlockJob *job, int64_t speed, Error **errp)
         error_set(errp, QERR_INVALID_PARAMETER, "speed");
         return;
     }
-    ratelimit_set_speed(&s->limit, speed / BDRV_SECTOR_SIZE);
+    ratelimit_set_speed(&s->limit, speed / BDRV_SECTOR_SIZE, SLICE_TIME);
 }
 
 static BlockJobType stream_job_type = {
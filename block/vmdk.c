@@ -27,6 +27,7 @@
 #include "block_int.h"
 #include "module.h"
 #include "migration.h"
+#include "block/chunk-cache.h"
 #include <zlib.h>
 
 #define VMDK3_MAGIC (('C' << 24) | ('O' << 16) | ('W' << 8) | 'D')
@@ -88,6 +89,9 @@ typedef struct VmdkExtent {
     uint32_t l2_cache_counts[L2_CACHE_SIZE];
 
     unsigned int cluster_sectors;
+
+    /* Decompressed grains of compressed extents */
+    ChunkCacheClient grains;
 } VmdkExtent;
 
 typedef struct BDRVVmdkState {
@@ -186,6 +190,7 @@ static void vmdk_free_extents(BlockDriverState *bs)
 
     for (i = 0; i < s->num_extents; i++) {
         e = &s->extents[i];
+        chunk_cache_release_client(&e->grains);
         g_free(e->l1_table);
         g_free(e->l2_cache);
         g_free(e->l1_backup_table);
@@ -641,9 +646,12 @@ static int vmdk_open_desc_file(BlockDriverState *bs, int flags,
     return vmdk_parse_extents(buf, bs, bs->file->filename);
 }
 
+static int coroutine_fn vmdk_read_grain(BlockDriverState *bs, void *opaque,
+                                        uint64_t index, ChunkData *data);
+
 static int vmdk_open(BlockDriverState *bs, int flags)
 {
-    int ret;
+    int ret, i;
     BDRVVmdkState *s = bs->opaque;
 
     if (vmdk_open_sparse(bs, bs->file, flags) == 0) {
@@ -662,6 +670,16 @@ static int vmdk_open(BlockDriverState *bs, int flags)
     s->parent_cid = vmdk_read_cid(bs, 1);
     qemu_co_mutex_init(&s->lock);
 
+    /* The extent array doesn't move any more */
+    for (i = 0; i < s->num_extents; i++) {
+        VmdkExtent *extent = &s->extents[i];
+        if (extent->compressed) {
+            chunk_cache_init_client(&extent->grains, bs,
+                DIV_ROUND_UP(extent->sectors, extent->cluster_sectors),
+                vmdk_read_grain, extent, &s->lock);
+        }
+    }
+
     /* Disable migration when VMDK images are used */
     error_set(&s->migration_blocker,
               QERR_BLOCK_FORMAT_FEATURE_NOT_SUPPORTED,
@@ -935,69 +953,60 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
                             int nb_sectors)
 {
     int ret;
-    int cluster_bytes, buf_bytes;
-    uint8_t *cluster_buf, *compressed_data;
-    uint8_t *uncomp_buf;
-    uint32_t data_len;
-    VmdkGrainMarker *marker;
-    uLongf buf_len;
 
+    ret = bdrv_pread(extent->file,
+                      cluster_offset + offset_in_cluster,
+                      buf, nb_sectors * 512);
+    if (ret == nb_sectors * 512) {
+        return 0;
+    } else {
+        return -EIO;
+    }
+}
 
-    if (!extent->compressed) {
-        ret = bdrv_pread(extent->file,
-                          cluster_offset + offset_in_cluster,
-                          buf, nb_sectors * 512);
-        if (ret == nb_sectors * 512) {
-            return 0;
-        } else {
-            return -EIO;
-        }
+/* Reads grain @index of a compressed extent, counting from its start */
+static int coroutine_fn vmdk_read_grain(BlockDriverState *bs, void *opaque,
+                                        uint64_t index, ChunkData *data)
+{
+    VmdkExtent *extent = opaque;
+    int64_t extent_start = extent->end_sector - extent->sectors;
+    int cluster_bytes = extent->cluster_sectors * 512;
+    VmdkGrainMarker *marker;
+    uint64_t cluster_offset;
+    int ret;
+
+    ret = get_cluster_offset(bs, extent, NULL,
+                (extent_start + index * extent->cluster_sectors) << 9, 0,
+                &cluster_offset);
+    if (ret) {
+        return -ENOENT;
     }
-    cluster_bytes = extent->cluster_sectors * 512;
+
     /* Read two clusters in case GrainMarker + compressed data > one cluster */
-    buf_bytes = cluster_bytes * 2;
-    cluster_buf = g_malloc(buf_bytes);
-    uncomp_buf = g_malloc(cluster_bytes);
-    ret = bdrv_pread(extent->file,
-                cluster_offset,
-                cluster_buf, buf_bytes);
+    data->encoding = CHUNK_ZLIB;
+    data->buf = g_malloc(cluster_bytes * 2);
+    data->size = cluster_bytes;
+    ret = bdrv_pread(extent->file, cluster_offset, data->buf,
+                     cluster_bytes * 2);
     if (ret < 0) {
-        goto out;
-    }
-    compressed_data = cluster_buf;
-    buf_len = cluster_bytes;
-    data_len = cluster_bytes;
-    if (extent->has_marker) {
-        marker = (VmdkGrainMarker *)cluster_buf;
-        compressed_data = marker->data;
-        data_len = le32_to_cpu(marker->size);
-    }
-    if (!data_len || data_len > buf_bytes) {
-        ret = -EINVAL;
-        goto out;
+        return ret;
     }
-    ret = uncompress(uncomp_buf, &buf_len, compressed_data, data_len);
-    if (ret != Z_OK) {
-        ret = -EINVAL;
-        goto out;
 
+    data->offset = 0;
+    data->len = cluster_bytes;
+    if (extent->has_marker) {
+        marker = (VmdkGrainMarker *)data->buf;
+        data->offset = marker->data - data->buf;
+        data->len = le32_to_cpu(marker->size);
     }
-    if (offset_in_cluster < 0 ||
-            offset_in_cluster + nb_sectors * 512 > buf_len) {
-        ret = -EINVAL;
-        goto out;
+    if (!data->len || data->offset + data->len > cluster_bytes * 2) {
+        return -EINVAL;
     }
-    memcpy(buf, uncomp_buf + offset_in_cluster, nb_sectors * 512);
-    ret = 0;
-
- out:
-    g_free(uncomp_buf);
-    g_free(cluster_buf);
-    return ret;
+    return 0;
 }
 
-static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+static int coroutine_fn vmdk_read(BlockDriverState *bs, int64_t sector_num,
+                                  uint8_t *buf, int nb_sectors)
 {
     BDRVVmdkState *s = bs->opaque;
     int ret;
@@ -1031,6 +1040,15 @@ static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
             } else {
                 memset(buf, 0, 512 * n);
             }
+        } else if (extent->compressed) {
+            uint64_t grain = (sector_num -
+                (extent->end_sector - extent->sectors)) /
+                extent->cluster_sectors;
+            ret = chunk_cache_co_read(&extent->grains, grain,
+                                      index_in_cluster * 512, buf, n * 512);
+            if (ret) {
+                return ret;
+            }
         } else {
             ret = vmdk_read_extent(extent,
                             cluster_offset, index_in_cluster * 512,
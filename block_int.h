@@ -33,6 +33,8 @@
 
 #define BLOCK_FLAG_ENCRYPT	1
 #define BLOCK_FLAG_COMPAT6	4
+#define BLOCK_FLAG_EXTL2	8
+#define BLOCK_FLAG_LAZY_REFCOUNTS	16
 
 #define BLOCK_IO_LIMIT_READ     0
 #define BLOCK_IO_LIMIT_WRITE    1
@@ -51,9 +53,27 @@
 #define BLOCK_OPT_PREALLOC      "preallocation"
 #define BLOCK_OPT_SUBFMT        "subformat"
 #define BLOCK_OPT_COMPAT_LEVEL  "compat"
+#define BLOCK_OPT_EXTL2         "extended_l2"
+#define BLOCK_OPT_LAZY_REFCOUNTS "lazy_refcounts"
+
+/* Values of BLOCK_OPT_PREALLOC */
+typedef enum {
+    PREALLOC_MODE_OFF,
+    PREALLOC_MODE_METADATA,     /* only allocate the image metadata */
+    PREALLOC_MODE_FALLOC,       /* reserve the space with fallocate() */
+    PREALLOC_MODE_FULL,         /* write zeroes to the whole image */
+} PreallocMode;
 
 typedef struct BdrvTrackedRequest BdrvTrackedRequest;
 
+/* A range of sectors that is read from the same layer of the backing chain */
+typedef struct BdrvChainCacheEntry {
+    int64_t start;
+    int64_t end;        /* 0 if the entry is unused */
+    int depth;          /* 0 for the image itself, -1 if no layer has data */
+} BdrvChainCacheEntry;
+typedef struct BdrvMergeAIOCB BdrvMergeAIOCB;
+
 typedef struct BlockIOLimit {
     int64_t bps[3];
     int64_t iops[3];
@@ -80,6 +100,12 @@ typedef struct BlockJobType {
 
     /** Optional callback for job types that support setting a speed limit */
     void (*set_speed)(BlockJob *job, int64_t speed, Error **errp);
+
+    /**
+     * Optional callback for job types whose completion is requested by
+     * the user with block-job-complete.
+     */
+    void (*complete)(BlockJob *job, Error **errp);
 } BlockJobType;
 
 /**
@@ -160,6 +186,10 @@ struct BlockDriver {
         int64_t sector_num, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque);
 
+    /* Batch up submission of the requests issued while plugged */
+    void (*bdrv_io_plug)(BlockDriverState *bs);
+    void (*bdrv_io_unplug)(BlockDriverState *bs);
+
     int coroutine_fn (*bdrv_co_readv)(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, QEMUIOVector *qiov);
     int coroutine_fn (*bdrv_co_writev)(BlockDriverState *bs,
@@ -176,6 +206,12 @@ struct BlockDriver {
         int64_t sector_num, int nb_sectors);
     int coroutine_fn (*bdrv_co_is_allocated)(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, int *pnum);
+    /*
+     * Like .bdrv_co_is_allocated(), but returns BDRV_BLOCK_* flags.  May be
+     * NULL, .bdrv_co_is_allocated() is used then.
+     */
+    int64_t coroutine_fn (*bdrv_co_get_block_status)(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, int *pnum);
 
     /*
      * Invalidate any cached meta-data.
@@ -199,8 +235,10 @@ struct BlockDriver {
     int (*bdrv_truncate)(BlockDriverState *bs, int64_t offset);
     int64_t (*bdrv_getlength)(BlockDriverState *bs);
     int64_t (*bdrv_get_allocated_file_size)(BlockDriverState *bs);
-    int (*bdrv_write_compressed)(BlockDriverState *bs, int64_t sector_num,
-                                 const uint8_t *buf, int nb_sectors);
+    /* Several compressed writes to different clusters may be in flight
+     * at the same time.  nb_sectors == 0 marks the end of the image. */
+    int coroutine_fn (*bdrv_co_write_compressed)(BlockDriverState *bs,
+        int64_t sector_num, const uint8_t *buf, int nb_sectors);
 
     int (*bdrv_snapshot_create)(BlockDriverState *bs,
                                 QEMUSnapshotInfo *sn_info);
@@ -212,6 +250,8 @@ struct BlockDriver {
     int (*bdrv_snapshot_load_tmp)(BlockDriverState *bs,
                                   const char *snapshot_name);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
+    /* fills in the optional driver specific fields of @stats */
+    void (*bdrv_get_stats)(BlockDriverState *bs, BlockDeviceStats *stats);
 
     int (*bdrv_save_vmstate)(BlockDriverState *bs, const uint8_t *buf,
                              int64_t pos, int size);
@@ -302,10 +342,16 @@ struct BlockDriverState {
     QEMUTimer    *block_timer;
     bool         io_limits_enabled;
 
+    /* Size of the format driver's metadata caches in bytes, 0 for the
+     * driver's default */
+    uint64_t l2_cache_size;
+    uint64_t refcount_cache_size;
+
     /* I/O stats (display with "info blockstats"). */
     uint64_t nr_bytes[BDRV_MAX_IOTYPE];
     uint64_t nr_ops[BDRV_MAX_IOTYPE];
     uint64_t total_time_ns[BDRV_MAX_IOTYPE];
+    uint64_t nr_merged[BDRV_MAX_IOTYPE]; /* requests merged into others */
     uint64_t wr_highest_sector;
 
     /* Whether the disk can expand beyond total_sectors */
@@ -326,11 +372,23 @@ struct BlockDriverState {
     char device_name[32];
     unsigned long *dirty_bitmap;
     int64_t dirty_count;
+
+    /* Remembers which layer of the backing chain owns the data of recently
+     * used ranges, so that reads don't look at each layer again */
+    BdrvChainCacheEntry *chain_cache;
+    BlockDriverState *chain_cache_backing; /* backing_hd when it was filled */
+    uint64_t chain_cache_gen;              /* incremented on invalidation */
     int in_use; /* users other than guest access, eg. block migration */
     QTAILQ_ENTRY(BlockDriverState) list;
 
     QLIST_HEAD(, BdrvTrackedRequest) tracked_requests;
 
+    /* bdrv_io_plug() nesting level, and the requests of the attached
+     * device that wait for bdrv_io_unplug() to be merged and submitted */
+    int io_plugged;
+    QSLIST_HEAD(, BdrvMergeAIOCB) merge_queue;
+    int merge_queue_len;
+
     /* long-running background operation */
     BlockJob *job;
 };
@@ -339,6 +397,8 @@ int get_tmp_filename(char *filename, int size);
 
 void bdrv_set_io_limits(BlockDriverState *bs,
                         BlockIOLimit *io_limits);
+void bdrv_set_cache_size(BlockDriverState *bs, uint64_t l2_cache_size,
+                         uint64_t refcount_cache_size);
 
 #ifdef _WIN32
 int is_windows_drive(const char *filename);
@@ -378,14 +438,42 @@ void *block_job_create(const BlockJobType *job_type, BlockDriverState *bs,
 void block_job_sleep_ns(BlockJob *job, QEMUClock *clock, int64_t ns);
 
 /**
- * block_job_complete:
+ * block_job_completed:
  * @job: The job being completed.
  * @ret: The status code.
  *
  * Call the completion function that was registered at creation time, and
  * free @job.
  */
-void block_job_complete(BlockJob *job, int ret);
+void block_job_completed(BlockJob *job, int ret);
+
+/**
+ * qobject_from_block_job:
+ * @job: The job whose information is requested.
+ *
+ * Return a QDict corresponding to @job's query-block-jobs entry,
+ * as sent with the block job events.
+ */
+QObject *qobject_from_block_job(BlockJob *job);
+
+/**
+ * block_job_ready:
+ * @job: The job that is ready.
+ *
+ * Emit the BLOCK_JOB_READY event, telling the user that @job can now be
+ * completed with #block_job_complete.
+ */
+void block_job_ready(BlockJob *job);
+
+/**
+ * block_job_complete:
+ * @job: The job to be completed.
+ * @errp: Error object.
+ *
+ * Asynchronously ask the job to finish its work.  The job still calls
+ * its completion function when it is done.
+ */
+void block_job_complete(BlockJob *job, Error **errp);
 
 /**
  * block_job_set_speed:
@@ -453,4 +541,26 @@ void stream_start(BlockDriverState *bs, BlockDriverState *base,
                   BlockDriverCompletionFunc *cb,
                   void *opaque, Error **errp);
 
+/**
+ * mirror_start:
+ * @bs: Block device to operate on.
+ * @target: Block device to write to.
+ * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
+ * @mode: Whether to collapse all images in the chain to the target.
+ * @cb: Completion function for the job.
+ * @opaque: Opaque pointer value passed to @cb.
+ * @errp: Error object.
+ *
+ * Start a mirroring operation on @bs.  Clusters that are allocated
+ * in @bs will be written to @target until the job is cancelled or
+ * manually completed.  Writes that the guest submits in the meantime
+ * are tracked in the dirty bitmap of @bs and copied again.  When the
+ * job is completed, @target replaces @bs in the live BlockDriverState;
+ * when it is cancelled, @target is left alone and simply closed.
+ */
+void mirror_start(BlockDriverState *bs, BlockDriverState *target,
+                  int64_t speed, MirrorSyncMode mode,
+                  BlockDriverCompletionFunc *cb,
+                  void *opaque, Error **errp);
+
 #endif /* BLOCK_INT_H */
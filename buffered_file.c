@@ -18,12 +18,14 @@
 #include "qemu-timer.h"
 #include "qemu-char.h"
 #include "buffered_file.h"
+#include "iov.h"
 
 //#define DEBUG_BUFFERED_FILE
 
 typedef struct QEMUFileBuffered
 {
     BufferedPutFunc *put_buffer;
+    BufferedPutvFunc *put_iov;
     BufferedPutReadyFunc *put_ready;
     BufferedWaitForUnfreezeFunc *wait_for_unfreeze;
     BufferedCloseFunc *close;
@@ -170,6 +172,73 @@ static int buffered_put_buffer(void *opaque, const uint8_t *buf, int64_t pos, in
     return offset;
 }
 
+/* Send guest pages queued with qemu_put_buffer_async() without copying
+ * them; only what the backend cannot take right now ends up in the
+ * buffer. */
+static int buffered_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
+                                  int64_t pos)
+{
+    QEMUFileBuffered *s = opaque;
+    size_t size = iov_size(iov, iovcnt);
+    int i, error;
+    ssize_t ret;
+
+    DPRINTF("putting %d iovecs at %" PRId64 "\n", iovcnt, pos);
+
+    error = qemu_file_get_error(s->file);
+    if (error) {
+        DPRINTF("flush when error, bailing: %s\n", strerror(-error));
+        return error;
+    }
+
+    DPRINTF("unfreezing output\n");
+    s->freeze_output = 0;
+
+    buffered_flush(s);
+
+    /* Anything still buffered must go out first to keep the stream in
+     * order */
+    while (!s->freeze_output && s->buffer_size == 0 && iovcnt > 0) {
+        if (s->bytes_xfer > s->xfer_limit) {
+            DPRINTF("transfer limit exceeded when putting\n");
+            break;
+        }
+
+        ret = s->put_iov(s->opaque, iov, iovcnt);
+        if (ret == -EAGAIN) {
+            DPRINTF("backend not ready, freezing\n");
+            s->freeze_output = 1;
+            break;
+        }
+
+        if (ret <= 0) {
+            DPRINTF("error putting\n");
+            qemu_file_set_error(s->file, ret);
+            return -EINVAL;
+        }
+
+        DPRINTF("put %zd byte(s)\n", ret);
+        s->bytes_xfer += ret;
+
+        while (iovcnt > 0 && ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        DPRINTF("buffering %zu bytes\n", iov[i].iov_len);
+        buffered_append(s, iov[i].iov_base, iov[i].iov_len);
+    }
+
+    return size;
+}
+
 static int buffered_close(void *opaque)
 {
     QEMUFileBuffered *s = opaque;
@@ -265,6 +334,7 @@ static void buffered_rate_tick(void *opaque)
 QEMUFile *qemu_fopen_ops_buffered(void *opaque,
                                   size_t bytes_per_sec,
                                   BufferedPutFunc *put_buffer,
+                                  BufferedPutvFunc *put_iov,
                                   BufferedPutReadyFunc *put_ready,
                                   BufferedWaitForUnfreezeFunc *wait_for_unfreeze,
                                   BufferedCloseFunc *close)
@@ -276,6 +346,7 @@ QEMUFile *qemu_fopen_ops_buffered(void *opaque,
     s->opaque = opaque;
     s->xfer_limit = bytes_per_sec / 10;
     s->put_buffer = put_buffer;
+    s->put_iov = put_iov;
     s->put_ready = put_ready;
     s->wait_for_unfreeze = wait_for_unfreeze;
     s->close = close;
@@ -283,7 +354,9 @@ QEMUFile *qemu_fopen_ops_buffered(void *opaque,
     s->file = qemu_fopen_ops(s, buffered_put_buffer, NULL,
                              buffered_close, buffered_rate_limit,
                              buffered_set_rate_limit,
-			     buffered_get_rate_limit);
+                             buffered_get_rate_limit,
+                             put_iov ? buffered_writev_buffer : NULL,
+                             NULL);
 
     s->timer = qemu_new_timer_ms(rt_clock, buffered_rate_tick, s);
 
@@ -109,6 +109,22 @@ STEXI
 @item block_job_cancel
 @findex block_job_cancel
 Stop an active block streaming operation.
+ETEXI
+
+    {
+        .name       = "block_job_complete",
+        .args_type  = "device:B",
+        .params     = "device",
+        .help       = "stop an active block mirroring operation and switch "
+                      "the device to its target",
+        .mhandler.cmd = hmp_block_job_complete,
+    },
+
+STEXI
+@item block_job_complete
+@findex block_job_complete
+Stop an active block mirroring operation and switch the device to the
+mirror target.
 ETEXI
 
     {
@@ -264,19 +280,26 @@ ETEXI
 
     {
         .name       = "savevm",
-        .args_type  = "name:s?",
-        .params     = "[tag|id]",
-        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created",
+        .args_type  = "incremental:-i,name:s?",
+        .params     = "[-i] [tag|id]",
+        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created"
+                      "\n\t\t\t -i to only save RAM changed since the last snapshot",
         .mhandler.cmd = do_savevm,
     },
 
 STEXI
-@item savevm [@var{tag}|@var{id}]
+@item savevm [-i] [@var{tag}|@var{id}]
 @findex savevm
 Create a snapshot of the whole virtual machine. If @var{tag} is
 provided, it is used as human readable identifier. If there is already
 a snapshot with the same tag or ID, it is replaced. More info at
 @ref{vm_snapshots}.
+
+With -i, the snapshot only stores the guest RAM that changed since the
+previous snapshot taken with -i or loaded with loadvm, and refers to that
+snapshot as its parent. A parent cannot be deleted while it has such
+children. If there is no usable parent, a full snapshot is taken.
+Incremental snapshots require a qcow2 image for the VM state.
 ETEXI
 
     {
@@ -798,23 +821,25 @@ ETEXI
 
     {
         .name       = "migrate",
-        .args_type  = "detach:-d,blk:-b,inc:-i,uri:s",
-        .params     = "[-d] [-b] [-i] uri",
+        .args_type  = "detach:-d,blk:-b,inc:-i,uri:s,channels:i?",
+        .params     = "[-d] [-b] [-i] uri [channels]",
         .help       = "migrate to URI (using -d to not wait for completion)"
 		      "\n\t\t\t -b for migration without shared storage with"
 		      " full copy of disk\n\t\t\t -i for migration without "
 		      "shared storage with incremental copy of disk "
-		      "(base image shared between src and destination)",
+		      "(base image shared between src and destination)"
+		      "\n\t\t\t channels: number of TCP connections for RAM",
         .mhandler.cmd = hmp_migrate,
     },
 
 
 STEXI
-@item migrate [-d] [-b] [-i] @var{uri}
+@item migrate [-d] [-b] [-i] @var{uri} [@var{channels}]
 @findex migrate
 Migrate to @var{uri} (using -d to not wait for completion).
 	-b for migration with full copy of disk
 	-i for migration with incremental copy of disk (base image is shared)
+	@var{channels} spreads guest RAM over that many TCP connections
 ETEXI
 
     {
@@ -858,6 +883,30 @@ STEXI
 @item migrate_set_downtime @var{second}
 @findex migrate_set_downtime
 Set maximum tolerated downtime (in seconds) for migration.
+ETEXI
+
+    {
+        .name       = "migrate_set_capability",
+        .args_type  = "capability:s,state:b",
+        .params     = "capability state",
+        .help       = "enable or disable a migration capability",
+        .mhandler.cmd = hmp_migrate_set_capability,
+    },
+
+STEXI
+@item migrate_set_capability @var{capability} @var{state}
+@findex migrate_set_capability
+Enable (@var{state} on) or disable (@var{state} off) an optional feature of
+the migration stream.  Only enable @var{capability} if the destination
+understands it:
+@table @option
+@item zero-blocks
+send disk chunks that contain only zeroes without their data during block
+migration
+@item ram-runs
+write guest RAM in snapshots as page-aligned runs of pages, which loadvm reads
+with one request each
+@end table
 ETEXI
 
     {
@@ -898,6 +947,28 @@ STEXI
 @item snapshot_blkdev
 @findex snapshot_blkdev
 Snapshot device, using snapshot file as target if provided
+ETEXI
+
+    {
+        .name       = "drive_mirror",
+        .args_type  = "reuse:-n,full:-f,device:B,target:s,format:s?",
+        .params     = "[-n] [-f] device target [format]",
+        .help       = "initiates live storage\n\t\t\t"
+                      "migration for a device. The device's contents are\n\t\t\t"
+                      "copied to the new image file, including data that\n\t\t\t"
+                      "is written after the command is started.\n\t\t\t"
+                      "The -n flag requests QEMU to reuse the image found\n\t\t\t"
+                      "in target, instead of recreating it from scratch.\n\t\t\t"
+                      "The -f flag requests QEMU to copy the whole disk,\n\t\t\t"
+                      "so that the result does not need a backing file.",
+        .mhandler.cmd = hmp_drive_mirror,
+    },
+
+STEXI
+@item drive_mirror
+@findex drive_mirror
+Start mirroring a block device's writes to a new destination,
+using the specified target.
 ETEXI
 
     {
@@ -1393,6 +1464,8 @@ show CPU statistics
 show user network stack connection states
 @item info migrate
 show migration status
+@item info migrate_capabilities
+show the state of the migration capabilities
 @item info balloon
 show balloon information
 @item info qtree
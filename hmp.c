@@ -156,6 +156,21 @@ void hmp_info_migrate(Monitor *mon)
     qapi_free_MigrationInfo(info);
 }
 
+void hmp_info_migrate_capabilities(Monitor *mon)
+{
+    MigrationCapabilityStatusList *caps, *cap;
+
+    caps = qmp_query_migrate_capabilities(NULL);
+
+    for (cap = caps; cap; cap = cap->next) {
+        monitor_printf(mon, "%s: %s\n",
+                       MigrationCapability_lookup[cap->value->capability],
+                       cap->value->state ? "on" : "off");
+    }
+
+    qapi_free_MigrationCapabilityStatusList(caps);
+}
+
 void hmp_info_cpus(Monitor *mon)
 {
     CpuInfoList *cpu_list, *cpu;
@@ -247,9 +262,29 @@ void hmp_info_block(Monitor *mon)
     qapi_free_BlockInfoList(block_list);
 }
 
+static void hmp_info_blockstats_nbd(Monitor *mon, BlockDeviceStats *stats)
+{
+    NbdConnectionStatsList *conn;
+    int i;
+
+    monitor_printf(mon, "    readahead_hits=%" PRId64
+                   " readahead_bytes=%" PRId64 "\n",
+                   stats->readahead_hits, stats->readahead_bytes);
+
+    for (conn = stats->nbd_connections, i = 0; conn; conn = conn->next, i++) {
+        monitor_printf(mon, "    nbd_connection%d: requests=%" PRId64
+                       " in_flight=%" PRId64
+                       " total_time_ns=%" PRId64
+                       " max_time_ns=%" PRId64 "\n",
+                       i, conn->value->requests, conn->value->in_flight,
+                       conn->value->total_time_ns, conn->value->max_time_ns);
+    }
+}
+
 void hmp_info_blockstats(Monitor *mon)
 {
     BlockStatsList *stats_list, *stats;
+    BlockStats *parent;
 
     stats_list = qmp_query_blockstats(NULL);
 
@@ -267,6 +302,8 @@ void hmp_info_blockstats(Monitor *mon)
                        " wr_total_time_ns=%" PRId64
                        " rd_total_time_ns=%" PRId64
                        " flush_total_time_ns=%" PRId64
+                       " rd_merged=%" PRId64
+                       " wr_merged=%" PRId64
                        "\n",
                        stats->value->stats->rd_bytes,
                        stats->value->stats->wr_bytes,
@@ -275,7 +312,34 @@ void hmp_info_blockstats(Monitor *mon)
                        stats->value->stats->flush_operations,
                        stats->value->stats->wr_total_time_ns,
                        stats->value->stats->rd_total_time_ns,
-                       stats->value->stats->flush_total_time_ns);
+                       stats->value->stats->flush_total_time_ns,
+                       stats->value->stats->rd_merged,
+                       stats->value->stats->wr_merged);
+        if (stats->value->stats->has_l2_cache_hits) {
+            monitor_printf(mon, "    l2_cache_hits=%" PRId64
+                           " l2_cache_misses=%" PRId64
+                           " refcount_cache_hits=%" PRId64
+                           " refcount_cache_misses=%" PRId64 "\n",
+                           stats->value->stats->l2_cache_hits,
+                           stats->value->stats->l2_cache_misses,
+                           stats->value->stats->refcount_cache_hits,
+                           stats->value->stats->refcount_cache_misses);
+        }
+
+        /* The NBD client and the read cache are usually protocols below
+         * the image format */
+        for (parent = stats->value; parent;
+             parent = parent->has_parent ? parent->parent : NULL) {
+            if (parent->stats->has_nbd_connections) {
+                hmp_info_blockstats_nbd(mon, parent->stats);
+            }
+            if (parent->stats->has_read_cache_hits) {
+                monitor_printf(mon, "    read_cache_hits=%" PRId64
+                               " read_cache_misses=%" PRId64 "\n",
+                               parent->stats->read_cache_hits,
+                               parent->stats->read_cache_misses);
+            }
+        }
     }
 
     qapi_free_BlockStatsList(stats_list);
@@ -713,6 +777,29 @@ void hmp_snapshot_blkdev(Monitor *mon, const QDict *qdict)
     hmp_handle_error(mon, &errp);
 }
 
+void hmp_drive_mirror(Monitor *mon, const QDict *qdict)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    const char *filename = qdict_get_try_str(qdict, "target");
+    const char *format = qdict_get_try_str(qdict, "format");
+    int reuse = qdict_get_try_bool(qdict, "reuse", 0);
+    int full = qdict_get_try_bool(qdict, "full", 0);
+    enum NewImageMode mode;
+    Error *errp = NULL;
+
+    if (!filename) {
+        error_set(&errp, QERR_MISSING_PARAMETER, "target");
+        hmp_handle_error(mon, &errp);
+        return;
+    }
+
+    mode = reuse ? NEW_IMAGE_MODE_EXISTING : NEW_IMAGE_MODE_ABSOLUTE_PATHS;
+    qmp_drive_mirror(device, filename, !!format, format,
+                     full ? MIRROR_SYNC_MODE_FULL : MIRROR_SYNC_MODE_TOP,
+                     true, mode, false, 0, &errp);
+    hmp_handle_error(mon, &errp);
+}
+
 void hmp_migrate_cancel(Monitor *mon, const QDict *qdict)
 {
     qmp_migrate_cancel(NULL);
@@ -730,6 +817,33 @@ void hmp_migrate_set_speed(Monitor *mon, const QDict *qdict)
     qmp_migrate_set_speed(value, NULL);
 }
 
+void hmp_migrate_set_capability(Monitor *mon, const QDict *qdict)
+{
+    const char *name = qdict_get_str(qdict, "capability");
+    bool state = qdict_get_bool(qdict, "state");
+    MigrationCapabilityStatusList *caps;
+    Error *err = NULL;
+    int i;
+
+    for (i = 0; i < MIGRATION_CAPABILITY_MAX; i++) {
+        if (!strcmp(name, MigrationCapability_lookup[i])) {
+            break;
+        }
+    }
+    if (i == MIGRATION_CAPABILITY_MAX) {
+        monitor_printf(mon, "Unknown migration capability '%s'\n", name);
+        return;
+    }
+
+    caps = g_malloc0(sizeof(*caps));
+    caps->value = g_malloc0(sizeof(*caps->value));
+    caps->value->capability = i;
+    caps->value->state = state;
+    qmp_migrate_set_capabilities(caps, &err);
+    qapi_free_MigrationCapabilityStatusList(caps);
+    hmp_handle_error(mon, &err);
+}
+
 void hmp_set_password(Monitor *mon, const QDict *qdict)
 {
     const char *protocol  = qdict_get_str(qdict, "protocol");
@@ -866,6 +980,16 @@ void hmp_block_job_cancel(Monitor *mon, const QDict *qdict)
     hmp_handle_error(mon, &error);
 }
 
+void hmp_block_job_complete(Monitor *mon, const QDict *qdict)
+{
+    Error *error = NULL;
+    const char *device = qdict_get_str(qdict, "device");
+
+    qmp_block_job_complete(device, &error);
+
+    hmp_handle_error(mon, &error);
+}
+
 typedef struct MigrationStatus
 {
     QEMUTimer *timer;
@@ -912,9 +1036,12 @@ void hmp_migrate(Monitor *mon, const QDict *qdict)
     int blk = qdict_get_try_bool(qdict, "blk", 0);
     int inc = qdict_get_try_bool(qdict, "inc", 0);
     const char *uri = qdict_get_str(qdict, "uri");
+    bool has_channels = qdict_haskey(qdict, "channels");
+    int64_t channels = qdict_get_try_int(qdict, "channels", 1);
     Error *err = NULL;
 
-    qmp_migrate(uri, !!blk, blk, !!inc, inc, false, false, &err);
+    qmp_migrate(uri, !!blk, blk, !!inc, inc, false, false,
+                has_channels, channels, &err);
     if (err) {
         monitor_printf(mon, "migrate: %s\n", error_get_pretty(err));
         error_free(err);
@@ -0,0 +1,534 @@
+/*
+ * Dedicated thread for virtio-blk I/O processing
+ *
+ * Each device gets a thread that takes requests off the vring, submits them
+ * with Linux AIO and puts the completions back into the vring.  The guest's
+ * queue notifications arrive through the ioeventfd and interrupts are raised
+ * through the guest notifier, so the common path never needs the global
+ * mutex.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "trace.h"
+#include "iov.h"
+#include "qemu-thread.h"
+#include "qemu-error.h"
+#include "qerror.h"
+#include "migration.h"
+#include "kvm.h"
+#include "hw/virtio-blk.h"
+#include "hw/dataplane/event-poll.h"
+#include "hw/dataplane/vring.h"
+#include "hw/dataplane/ioq.h"
+#include "hw/dataplane/virtio-blk.h"
+
+enum {
+    SEG_MAX = 126,                  /* maximum number of I/O segments */
+    VRING_MAX = SEG_MAX + 2,        /* maximum number of vring descriptors */
+    REQ_MAX = VRING_MAX,            /* maximum number of requests in the vring,
+                                     * is VRING_MAX / 2 with traditional and
+                                     * VRING_MAX with indirect descriptors */
+};
+
+typedef struct {
+    struct iocb iocb;               /* Linux AIO control block */
+    unsigned char *status;          /* virtio_blk_inhdr status byte */
+    unsigned int head;              /* vring descriptor index */
+    size_t len;                     /* number of data bytes */
+    struct iovec bounce_iov;        /* used if guest buffers are unaligned */
+    struct iovec *read_iov;         /* guest buffers of a bounced read */
+    unsigned int read_iov_cnt;
+} VirtIOBlockRequest;
+
+struct VirtIOBlockDataPlane {
+    bool started;
+    bool starting;
+    bool stopping;
+    QemuThread thread;
+
+    VirtIOBlkConf *blk;
+    int fd;                         /* image file descriptor */
+    uint64_t nb_sectors;            /* image size, valid while started */
+    bool read_only;
+
+    VirtIODevice *vdev;
+    Vring vring;                    /* virtqueue vring */
+    EventNotifier *guest_notifier;  /* irq */
+
+    EventPoll event_poll;           /* event poller */
+    EventHandler io_handler;        /* Linux AIO completion handler */
+    EventHandler notify_handler;    /* virtqueue notify handler */
+
+    IOQueue ioqueue;                /* Linux AIO queue */
+    VirtIOBlockRequest requests[REQ_MAX]; /* pool of requests, managed by the
+                                             queue */
+
+    unsigned int num_reqs;          /* queued or in flight */
+
+    Error *migration_blocker;
+};
+
+/* Raise an interrupt to signal guest, if necessary */
+static void notify_guest(VirtIOBlockDataPlane *s)
+{
+    if (!vring_should_notify(s->vdev, &s->vring)) {
+        return;
+    }
+
+    event_notifier_set(s->guest_notifier);
+}
+
+static void complete_request(struct iocb *iocb, ssize_t ret, void *opaque)
+{
+    VirtIOBlockDataPlane *s = opaque;
+    VirtIOBlockRequest *req = container_of(iocb, VirtIOBlockRequest, iocb);
+    unsigned char status;
+
+    if (likely(ret >= 0 && ret == req->len)) {
+        status = VIRTIO_BLK_S_OK;
+    } else {
+        status = VIRTIO_BLK_S_IOERR;
+    }
+
+    trace_virtio_blk_data_plane_complete_request(s, req->head, ret);
+
+    if (req->read_iov) {
+        if (status == VIRTIO_BLK_S_OK) {
+            iov_from_buf(req->read_iov, req->read_iov_cnt,
+                         req->bounce_iov.iov_base, 0, req->len);
+        }
+        g_free(req->read_iov);
+        req->read_iov = NULL;
+    }
+    if (req->bounce_iov.iov_base) {
+        qemu_vfree(req->bounce_iov.iov_base);
+        req->bounce_iov.iov_base = NULL;
+    }
+
+    *req->status = status;
+
+    /* According to the virtio specification len should be the number of bytes
+     * written to, but for virtio-blk it seems to be the number of bytes
+     * transferred plus the status bytes.
+     */
+    vring_push(&s->vring, req->head,
+               req->len + sizeof(struct virtio_blk_inhdr));
+
+    s->num_reqs--;
+}
+
+/* Complete a request that did not need any I/O */
+static void complete_request_early(VirtIOBlockDataPlane *s, unsigned int head,
+                                   unsigned char *status,
+                                   unsigned char status_val, size_t len)
+{
+    *status = status_val;
+    vring_push(&s->vring, head, len + sizeof(struct virtio_blk_inhdr));
+    notify_guest(s);
+}
+
+static bool iov_is_aligned(struct iovec *iov, unsigned int iov_cnt,
+                           size_t align)
+{
+    unsigned int i;
+
+    for (i = 0; i < iov_cnt; i++) {
+        if ((uintptr_t)iov[i].iov_base % align || iov[i].iov_len % align) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void do_rdwr_cmd(VirtIOBlockDataPlane *s, bool read,
+                        struct iovec *iov, unsigned int iov_cnt,
+                        uint64_t sector, unsigned int head,
+                        unsigned char *status)
+{
+    unsigned int block_size = s->blk->conf.logical_block_size;
+    size_t len = iov_size(iov, iov_cnt);
+    VirtIOBlockRequest *req;
+    struct iocb *iocb;
+    struct iovec *read_iov = NULL;
+    void *bounce_buf = NULL;
+
+    if ((sector & (block_size / BDRV_SECTOR_SIZE - 1)) ||
+        len % block_size ||
+        (!read && s->read_only) ||
+        sector > s->nb_sectors ||
+        len / BDRV_SECTOR_SIZE > s->nb_sectors - sector) {
+        complete_request_early(s, head, status, VIRTIO_BLK_S_IOERR, len);
+        return;
+    }
+
+    /* O_DIRECT needs aligned buffers, go through a bounce buffer otherwise */
+    if (!iov_is_aligned(iov, iov_cnt, block_size)) {
+        bounce_buf = qemu_memalign(block_size, MAX(len, block_size));
+        if (read) {
+            read_iov = g_memdup(iov, sizeof(iov[0]) * iov_cnt);
+        } else {
+            iov_to_buf(iov, iov_cnt, bounce_buf, 0, len);
+        }
+    }
+
+    iocb = ioq_get_iocb(&s->ioqueue);
+    req = container_of(iocb, VirtIOBlockRequest, iocb);
+    req->status = status;
+    req->head = head;
+    req->len = len;
+    req->read_iov = read_iov;
+    req->read_iov_cnt = iov_cnt;
+    req->bounce_iov.iov_base = bounce_buf;
+    req->bounce_iov.iov_len = len;
+    if (bounce_buf) {
+        iov = &req->bounce_iov;
+        iov_cnt = 1;
+    }
+
+    if (read) {
+        io_prep_preadv(iocb, s->fd, iov, iov_cnt, sector * BDRV_SECTOR_SIZE);
+    } else {
+        io_prep_pwritev(iocb, s->fd, iov, iov_cnt, sector * BDRV_SECTOR_SIZE);
+    }
+    io_set_eventfd(iocb,
+                   event_notifier_get_fd(ioq_get_notifier(&s->ioqueue)));
+
+    s->num_reqs++;
+}
+
+static void do_flush_cmd(VirtIOBlockDataPlane *s, unsigned int head,
+                         unsigned char *status)
+{
+    unsigned char status_val = VIRTIO_BLK_S_OK;
+
+    /* Linux AIO has no fdatasync, but a flush only needs to cover writes that
+     * have already completed, so doing it synchronously is correct.
+     */
+    if (qemu_fdatasync(s->fd) < 0) {
+        status_val = VIRTIO_BLK_S_IOERR;
+    }
+
+    complete_request_early(s, head, status, status_val, 0);
+}
+
+static void do_get_id_cmd(VirtIOBlockDataPlane *s,
+                          struct iovec *iov, unsigned int iov_cnt,
+                          unsigned int head, unsigned char *status)
+{
+    char id[VIRTIO_BLK_ID_BYTES];
+
+    /* Per the s/n string convention the string is terminated by '\0' only
+     * when shorter than the buffer.
+     */
+    strncpy(id, s->blk->serial ? s->blk->serial : "", sizeof(id));
+    iov_from_buf(iov, iov_cnt, id, 0, sizeof(id));
+    complete_request_early(s, head, status, VIRTIO_BLK_S_OK, 0);
+}
+
+static int process_request(VirtIOBlockDataPlane *s, struct iovec iov[],
+                           unsigned int out_num, unsigned int in_num,
+                           unsigned int head)
+{
+    struct iovec *in_iov = &iov[out_num];
+    struct virtio_blk_outhdr outhdr;
+    unsigned char *status;
+    uint32_t type;
+
+    /* Same layout requirements as the emulated device */
+    if (unlikely(out_num < 1 || in_num < 1 ||
+                 iov[0].iov_len < sizeof(outhdr) ||
+                 in_iov[in_num - 1].iov_len < 1)) {
+        error_report("virtio-blk request headers not in correct element");
+        return -EFAULT;
+    }
+
+    /* The guest may change the header under our feet, take a copy */
+    memcpy(&outhdr, iov[0].iov_base, sizeof(outhdr));
+    status = in_iov[in_num - 1].iov_base;
+    type = ldl_p(&outhdr.type);
+
+    if (type & VIRTIO_BLK_T_FLUSH) {
+        do_flush_cmd(s, head, status);
+    } else if (type & VIRTIO_BLK_T_SCSI_CMD) {
+        complete_request_early(s, head, status, VIRTIO_BLK_S_UNSUPP, 0);
+    } else if (type & VIRTIO_BLK_T_GET_ID) {
+        do_get_id_cmd(s, in_iov, in_num - 1, head, status);
+    } else if (type & VIRTIO_BLK_T_OUT) {
+        do_rdwr_cmd(s, false, &iov[1], out_num - 1, ldq_p(&outhdr.sector),
+                    head, status);
+    } else {
+        do_rdwr_cmd(s, true, in_iov, in_num - 1, ldq_p(&outhdr.sector),
+                    head, status);
+    }
+    return 0;
+}
+
+/* Hand queued requests to the kernel, all of them in one system call */
+static void submit_requests(VirtIOBlockDataPlane *s)
+{
+    unsigned int num_queued = ioq_num_queued(&s->ioqueue);
+
+    if (num_queued == 0) {
+        return;
+    }
+
+    /* Requests refused by the kernel are completed with an error */
+    if (ioq_submit(&s->ioqueue, complete_request, s) < num_queued) {
+        notify_guest(s);
+    }
+}
+
+static void handle_notify(EventHandler *handler)
+{
+    VirtIOBlockDataPlane *s = container_of(handler, VirtIOBlockDataPlane,
+                                           notify_handler);
+
+    /* There is one array of iovecs into which all new requests are extracted
+     * from the vring.  Requests are read from the vring and the translated
+     * descriptors are written to the iovecs array.  The iovecs do not have to
+     * persist across handle_notify() calls because the kernel copies the
+     * iovecs on io_submit(), and submit_requests() never leaves requests
+     * queued.
+     */
+    struct iovec iovec[VRING_MAX];
+    struct iovec *end = &iovec[VRING_MAX];
+    struct iovec *iov = iovec;
+
+    /* When a request is read from the vring, the index of the first descriptor
+     * (aka head) is returned so that the completed request can be pushed onto
+     * the vring later.
+     *
+     * The number of hypervisor read-only iovecs is out_num.  The number of
+     * hypervisor write-only iovecs is in_num.
+     */
+    int head;
+    unsigned int out_num = 0, in_num = 0;
+
+    for (;;) {
+        /* Disable guest->host notifies to avoid unnecessary vmexits */
+        vring_disable_notification(s->vdev, &s->vring);
+
+        for (;;) {
+            head = vring_pop(s->vdev, &s->vring, iov, end, &out_num, &in_num);
+            if (head < 0) {
+                break; /* no more requests */
+            }
+
+            trace_virtio_blk_data_plane_process_request(s, out_num, in_num,
+                                                        head);
+
+            if (process_request(s, iov, out_num, in_num, head) < 0) {
+                vring_set_broken(&s->vring);
+                break;
+            }
+            iov += out_num + in_num;
+        }
+
+        if (likely(head == -EAGAIN)) { /* vring emptied */
+            /* Re-enable guest->host notifies and stop processing the vring.
+             * But if the guest has snuck in more descriptors, keep processing.
+             */
+            if (vring_enable_notification(s->vdev, &s->vring)) {
+                break;
+            }
+        } else { /* head == -ENOBUFS or fatal error, iovecs[] is depleted */
+            /* Since there are no iovecs[] left, stop processing for now.  Do
+             * not re-enable guest->host notifies since the I/O completion
+             * handler knows to check for more vring descriptors anyway.
+             */
+            break;
+        }
+    }
+
+    submit_requests(s);
+}
+
+static void handle_io(EventHandler *handler)
+{
+    VirtIOBlockDataPlane *s = container_of(handler, VirtIOBlockDataPlane,
+                                           io_handler);
+
+    if (ioq_run_completion(&s->ioqueue, complete_request, s) > 0) {
+        notify_guest(s);
+    }
+
+    /* If there were more requests than iovecs, the vring will not be empty yet
+     * so check again.  There should now be enough resources to process more
+     * requests.
+     */
+    if (unlikely(vring_more_avail(&s->vring)) && !s->stopping) {
+        handle_notify(&s->notify_handler);
+    }
+}
+
+static void *data_plane_thread(void *opaque)
+{
+    VirtIOBlockDataPlane *s = opaque;
+
+    do {
+        event_poll(&s->event_poll);
+    } while (!s->stopping || s->num_reqs > 0);
+    return NULL;
+}
+
+/* Context: QEMU global mutex held */
+bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
+                                  VirtIOBlockDataPlane **dataplane)
+{
+    VirtIOBlockDataPlane *s;
+    int fd;
+
+    *dataplane = NULL;
+
+    if (!blk->data_plane) {
+        return true;
+    }
+
+    if (!kvm_enabled()) {
+        error_report("x-data-plane requires KVM");
+        return false;
+    }
+
+    if (blk->scsi) {
+        error_report("device is incompatible with x-data-plane, "
+                     "use scsi=off");
+        return false;
+    }
+
+    fd = raw_get_aio_fd(blk->conf.bs);
+    if (fd < 0) {
+        error_report("drive is incompatible with x-data-plane, "
+                     "use format=raw,cache=none,aio=native");
+        return false;
+    }
+
+    s = g_new0(VirtIOBlockDataPlane, 1);
+    s->vdev = vdev;
+    s->fd = fd;
+    s->blk = blk;
+
+    /* Prevent block operations that conflict with data plane thread */
+    bdrv_set_in_use(blk->conf.bs, 1);
+
+    error_set(&s->migration_blocker, QERR_DEVICE_FEATURE_BLOCKS_MIGRATION,
+              "virtio-blk", "x-data-plane");
+    migrate_add_blocker(s->migration_blocker);
+
+    *dataplane = s;
+    return true;
+}
+
+/* Context: QEMU global mutex held */
+void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
+{
+    if (!s) {
+        return;
+    }
+
+    virtio_blk_data_plane_stop(s);
+    migrate_del_blocker(s->migration_blocker);
+    error_free(s->migration_blocker);
+    bdrv_set_in_use(s->blk->conf.bs, 0);
+    g_free(s);
+}
+
+/* Context: QEMU global mutex held */
+void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
+{
+    VirtQueue *vq;
+    int i;
+
+    if (s->started || s->starting || s->stopping) {
+        return;
+    }
+
+    vq = virtio_get_queue(s->vdev, 0);
+    if (!vring_setup(&s->vring, s->vdev, 0)) {
+        return;
+    }
+
+    /* Taking over the host notifier from virtio-pci may deliver a pending
+     * kick, which must not start us again.
+     */
+    s->starting = true;
+
+    bdrv_get_geometry(s->blk->conf.bs, &s->nb_sectors);
+    s->read_only = bdrv_is_read_only(s->blk->conf.bs);
+
+    event_poll_init(&s->event_poll);
+
+    /* Set up guest notifier (irq) */
+    if (s->vdev->binding->set_guest_notifiers(s->vdev->binding_opaque,
+                                              true) != 0) {
+        fprintf(stderr, "virtio-blk failed to set guest notifier, "
+                "ensure -enable-kvm is set\n");
+        exit(1);
+    }
+    s->guest_notifier = virtio_queue_get_guest_notifier(vq);
+
+    /* Set up virtqueue notify */
+    if (s->vdev->binding->set_host_notifier(s->vdev->binding_opaque,
+                                            0, true) != 0) {
+        fprintf(stderr, "virtio-blk failed to set host notifier\n");
+        exit(1);
+    }
+    event_poll_add(&s->event_poll, &s->notify_handler,
+                   virtio_queue_get_host_notifier(vq),
+                   handle_notify);
+
+    /* Set up ioqueue */
+    ioq_init(&s->ioqueue, s->fd, REQ_MAX);
+    for (i = 0; i < ARRAY_SIZE(s->requests); i++) {
+        ioq_put_iocb(&s->ioqueue, &s->requests[i].iocb);
+    }
+    event_poll_add(&s->event_poll, &s->io_handler,
+                   ioq_get_notifier(&s->ioqueue), handle_io);
+
+    s->starting = false;
+    s->started = true;
+    trace_virtio_blk_data_plane_start(s);
+
+    /* Kick right away to begin processing requests already in vring */
+    event_notifier_set(virtio_queue_get_host_notifier(vq));
+
+    qemu_thread_create(&s->thread, data_plane_thread, s,
+                       QEMU_THREAD_JOINABLE);
+}
+
+/* Context: QEMU global mutex held */
+void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
+{
+    VirtQueue *vq;
+
+    if (!s->started || s->stopping) {
+        return;
+    }
+    s->stopping = true;
+    trace_virtio_blk_data_plane_stop(s);
+
+    /* Tell the thread to finish the requests in flight and exit */
+    event_poll_notify(&s->event_poll);
+    qemu_thread_join(&s->thread);
+
+    ioq_cleanup(&s->ioqueue);
+
+    vq = virtio_get_queue(s->vdev, 0);
+    s->vdev->binding->set_host_notifier(s->vdev->binding_opaque, 0, false);
+
+    event_poll_cleanup(&s->event_poll);
+
+    /* Deliver a pending interrupt before the notifier goes away */
+    if (event_notifier_test_and_clear(s->guest_notifier)) {
+        virtio_irq(vq);
+    }
+    s->vdev->binding->set_guest_notifiers(s->vdev->binding_opaque, false);
+
+    vring_teardown(&s->vring, s->vdev, 0);
+
+    s->started = false;
+    s->stopping = false;
+}
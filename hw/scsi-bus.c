@@ -1496,6 +1496,36 @@ SCSIDevice *scsi_device_find(SCSIBus *bus, int channel, int id, int lun)
     return target_dev;
 }
 
+/*
+ * Let the HBA batch up the requests that it submits to the devices on the
+ * bus, see bdrv_io_plug().
+ */
+void scsi_bus_io_plug(SCSIBus *bus)
+{
+    DeviceState *qdev;
+
+    QTAILQ_FOREACH(qdev, &bus->qbus.children, sibling) {
+        SCSIDevice *dev = SCSI_DEVICE(qdev);
+
+        if (dev->conf.bs) {
+            bdrv_io_plug(dev->conf.bs);
+        }
+    }
+}
+
+void scsi_bus_io_unplug(SCSIBus *bus)
+{
+    DeviceState *qdev;
+
+    QTAILQ_FOREACH(qdev, &bus->qbus.children, sibling) {
+        SCSIDevice *dev = SCSI_DEVICE(qdev);
+
+        if (dev->conf.bs) {
+            bdrv_io_unplug(dev->conf.bs);
+        }
+    }
+}
+
 /* SCSI request list.  For simplicity, pv points to the whole device */
 
 static void put_scsi_requests(QEMUFile *f, void *pv, size_t size)
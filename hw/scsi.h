@@ -228,6 +228,8 @@ void scsi_req_retry(SCSIRequest *req);
 void scsi_device_purge_requests(SCSIDevice *sdev, SCSISense sense);
 int scsi_device_get_sense(SCSIDevice *dev, uint8_t *buf, int len, bool fixed);
 SCSIDevice *scsi_device_find(SCSIBus *bus, int channel, int target, int lun);
+void scsi_bus_io_plug(SCSIBus *bus);
+void scsi_bus_io_unplug(SCSIBus *bus);
 
 /* scsi-generic.c. */
 extern const SCSIReqOps scsi_generic_req_ops;
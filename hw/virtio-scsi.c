@@ -456,6 +456,8 @@ static void virtio_scsi_handle_cmd(VirtIODevice *vdev, VirtQueue *vq)
     VirtIOSCSIReq *req;
     int n;
 
+    scsi_bus_io_plug(&s->bus);
+
     while ((req = virtio_scsi_pop_req(s, vq))) {
         SCSIDevice *d;
         int out_size, in_size;
@@ -502,6 +504,8 @@ static void virtio_scsi_handle_cmd(VirtIODevice *vdev, VirtQueue *vq)
             scsi_req_continue(req->sreq);
         }
     }
+
+    scsi_bus_io_unplug(&s->bus);
 }
 
 static void virtio_scsi_get_config(VirtIODevice *vdev,
@@ -24,6 +24,9 @@
  */
 #define MAX_EVENTS 128
 
+/* Maximum number of requests that are queued while the device is plugged */
+#define MAX_QUEUED_IO MAX_EVENTS
+
 struct qemu_laiocb {
     BlockDriverAIOCB common;
     struct qemu_laio_state *ctx;
@@ -35,10 +38,23 @@ struct qemu_laiocb {
     QLIST_ENTRY(qemu_laiocb) node;
 };
 
+/*
+ * Requests that have been prepared but not yet passed to the kernel, so that
+ * they can be submitted with a single io_submit() call.
+ */
+typedef struct LaioQueue {
+    struct iocb *iocbs[MAX_QUEUED_IO];
+    unsigned int idx;
+    int plugged;
+    QEMUBH *unplug_bh;
+    bool unplug_bh_scheduled;
+} LaioQueue;
+
 struct qemu_laio_state {
     io_context_t ctx;
     int efd;
-    int count;
+    int count;      /* queued and in-flight requests */
+    LaioQueue io_q;
 };
 
 static inline ssize_t io_event_ret(struct io_event *ev)
@@ -76,10 +92,92 @@ static void qemu_laio_process_completion(struct qemu_laio_state *s,
     qemu_aio_release(laiocb);
 }
 
+/*
+ * Passes the queued requests to the kernel. If the kernel doesn't take all of
+ * them because it is out of resources, the rest stays queued as long as
+ * there are requests in flight whose completion will retry the submission.
+ * Otherwise the remaining requests fail.
+ */
+static void ioq_submit(struct qemu_laio_state *s)
+{
+    struct iocb *failed[MAX_QUEUED_IO];
+    int ret, i, len;
+
+    while (s->io_q.idx > 0) {
+        len = s->io_q.idx;
+        do {
+            ret = io_submit(s->ctx, len, s->io_q.iocbs);
+        } while (ret == -EINTR);
+
+        if (ret > 0) {
+            s->io_q.idx -= ret;
+            memmove(s->io_q.iocbs, &s->io_q.iocbs[ret],
+                    s->io_q.idx * sizeof(s->io_q.iocbs[0]));
+            continue;
+        }
+
+        if (ret == 0) {
+            ret = -EAGAIN;
+        }
+        if (ret == -EAGAIN && s->count > s->io_q.idx) {
+            break;
+        }
+
+        /* Callbacks may queue new requests, so empty the queue first */
+        memcpy(failed, s->io_q.iocbs, len * sizeof(failed[0]));
+        s->io_q.idx = 0;
+        for (i = 0; i < len; i++) {
+            struct qemu_laiocb *laiocb =
+                    container_of(failed[i], struct qemu_laiocb, iocb);
+
+            laiocb->ret = ret;
+            qemu_laio_process_completion(s, laiocb);
+        }
+    }
+}
+
+void laio_io_plug(BlockDriverState *bs, void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    s->io_q.plugged++;
+}
+
+void laio_io_unplug(BlockDriverState *bs, void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    assert(s->io_q.plugged > 0);
+    if (--s->io_q.plugged == 0) {
+        ioq_submit(s);
+    }
+}
+
+static void qemu_laio_unplug_bh(void *opaque)
+{
+    struct qemu_laio_state *s = opaque;
+
+    s->io_q.unplug_bh_scheduled = false;
+    laio_io_unplug(NULL, s);
+}
+
 static void qemu_laio_completion_cb(void *opaque)
 {
     struct qemu_laio_state *s = opaque;
 
+    /*
+     * Completion callbacks often submit new requests, either directly or
+     * from a bottom half (e.g. when the request was issued in a coroutine).
+     * Batch them up and pass them to the kernel together from our own bottom
+     * half. That one was created before any of the per-request ones, so it
+     * runs after them.
+     */
+    if (!s->io_q.unplug_bh_scheduled) {
+        s->io_q.unplug_bh_scheduled = true;
+        s->io_q.plugged++;
+        qemu_bh_schedule(s->io_q.unplug_bh);
+    }
+
     while (1) {
         struct io_event events[MAX_EVENTS];
         uint64_t val;
@@ -97,17 +195,25 @@ static void qemu_laio_completion_cb(void *opaque)
         if (ret != 8)
             break;
 
-        do {
-            nevents = io_getevents(s->ctx, val, MAX_EVENTS, events, &ts);
-        } while (nevents == -EINTR);
+        /* The eventfd may count more completions than fit in one batch */
+        while (val > 0) {
+            do {
+                nevents = io_getevents(s->ctx, 0, MAX_EVENTS, events, &ts);
+            } while (nevents == -EINTR);
 
-        for (i = 0; i < nevents; i++) {
-            struct iocb *iocb = events[i].obj;
-            struct qemu_laiocb *laiocb =
-                    container_of(iocb, struct qemu_laiocb, iocb);
+            if (nevents <= 0) {
+                break;
+            }
 
-            laiocb->ret = io_event_ret(&events[i]);
-            qemu_laio_process_completion(s, laiocb);
+            for (i = 0; i < nevents; i++) {
+                struct iocb *iocb = events[i].obj;
+                struct qemu_laiocb *laiocb =
+                        container_of(iocb, struct qemu_laiocb, iocb);
+
+                laiocb->ret = io_event_ret(&events[i]);
+                qemu_laio_process_completion(s, laiocb);
+            }
+            val -= MIN(val, nevents);
         }
     }
 }
@@ -116,18 +222,37 @@ static int qemu_laio_flush_cb(void *opaque)
 {
     struct qemu_laio_state *s = opaque;
 
+    /*
+     * Somebody is waiting for requests to complete, so they can't stay
+     * queued even if the device is still plugged.
+     */
+    ioq_submit(s);
+
     return (s->count > 0) ? 1 : 0;
 }
 
 static void laio_cancel(BlockDriverAIOCB *blockacb)
 {
     struct qemu_laiocb *laiocb = (struct qemu_laiocb *)blockacb;
+    struct qemu_laio_state *s = laiocb->ctx;
     struct io_event event;
-    int ret;
+    int ret, i;
 
     if (laiocb->ret != -EINPROGRESS)
         return;
 
+    /* Requests that the kernel hasn't seen yet are simply dropped */
+    for (i = 0; i < s->io_q.idx; i++) {
+        if (s->io_q.iocbs[i] == &laiocb->iocb) {
+            s->io_q.idx--;
+            memmove(&s->io_q.iocbs[i], &s->io_q.iocbs[i + 1],
+                    (s->io_q.idx - i) * sizeof(s->io_q.iocbs[0]));
+            s->count--;
+            qemu_aio_release(laiocb);
+            return;
+        }
+    }
+
     /*
      * Note that as of Linux 2.6.31 neither the block device code nor any
      * filesystem implements cancellation of AIO request.
@@ -187,10 +312,27 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
         goto out_free_aiocb;
     }
     io_set_eventfd(&laiocb->iocb, s->efd);
-    s->count++;
 
-    if (io_submit(s->ctx, 1, &iocbs) < 0)
-        goto out_dec_count;
+    if (!s->io_q.plugged && !s->io_q.idx) {
+        s->count++;
+        if (io_submit(s->ctx, 1, &iocbs) < 0)
+            goto out_dec_count;
+        return &laiocb->common;
+    }
+
+    /*
+     * Queue the request. If the queue is full, make room by submitting what
+     * is queued, but never submit this request here: a failure would call
+     * its callback before we could even return it.
+     */
+    if (s->io_q.idx == MAX_QUEUED_IO) {
+        ioq_submit(s);
+        if (s->io_q.idx == MAX_QUEUED_IO) {
+            goto out_free_aiocb;
+        }
+    }
+    s->count++;
+    s->io_q.iocbs[s->io_q.idx++] = iocbs;
     return &laiocb->common;
 
 out_dec_count:
@@ -213,6 +355,7 @@ void *laio_init(void)
     if (io_setup(MAX_EVENTS, &s->ctx) != 0)
         goto out_close_efd;
 
+    s->io_q.unplug_bh = qemu_bh_new(qemu_laio_unplug_bh, s);
     qemu_aio_set_fd_handler(s->efd, qemu_laio_completion_cb, NULL,
         qemu_laio_flush_cb, s);
 
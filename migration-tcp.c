@@ -40,6 +40,14 @@ static int socket_write(MigrationState *s, const void * buf, size_t size)
     return send(s->fd, buf, size, 0);
 }
 
+#ifndef _WIN32
+static int socket_writev(MigrationState *s, const struct iovec *iov,
+                         int iovcnt)
+{
+    return writev(s->fd, iov, iovcnt);
+}
+#endif
+
 static int tcp_close(MigrationState *s)
 {
     int r = 0;
@@ -53,6 +61,150 @@ static int tcp_close(MigrationState *s)
     return r;
 }
 
+/* Additional connections of a multi-stream migration.  They carry RAM
+ * pages only and are driven by the main stream, so they never call back
+ * into the migration code by themselves. */
+typedef struct TcpChannel {
+    QEMUFile *file;
+    int fd;
+} TcpChannel;
+
+static void tcp_channel_put_notify(void *opaque)
+{
+    TcpChannel *c = opaque;
+
+    qemu_set_fd_handler2(c->fd, NULL, NULL, NULL, NULL);
+    qemu_file_put_notify(c->file);
+}
+
+static ssize_t tcp_channel_put_buffer(void *opaque, const void *data,
+                                      size_t size)
+{
+    TcpChannel *c = opaque;
+    ssize_t ret;
+
+    do {
+        ret = send(c->fd, data, size, 0);
+    } while (ret == -1 && socket_error() == EINTR);
+
+    if (ret == -1) {
+        ret = -socket_error();
+    }
+    if (ret == -EAGAIN) {
+        qemu_set_fd_handler2(c->fd, NULL, NULL, tcp_channel_put_notify, c);
+    }
+    return ret;
+}
+
+#ifndef _WIN32
+static ssize_t tcp_channel_put_iov(void *opaque, const struct iovec *iov,
+                                   int iovcnt)
+{
+    TcpChannel *c = opaque;
+    ssize_t ret;
+
+    do {
+        ret = writev(c->fd, iov, iovcnt);
+    } while (ret == -1 && socket_error() == EINTR);
+
+    if (ret == -1) {
+        ret = -socket_error();
+    }
+    if (ret == -EAGAIN) {
+        qemu_set_fd_handler2(c->fd, NULL, NULL, tcp_channel_put_notify, c);
+    }
+    return ret;
+}
+#endif
+
+static void tcp_channel_put_ready(void *opaque)
+{
+}
+
+static void tcp_channel_wait_for_unfreeze(void *opaque)
+{
+    TcpChannel *c = opaque;
+    int ret;
+
+    do {
+        fd_set wfds;
+
+        FD_ZERO(&wfds);
+        FD_SET(c->fd, &wfds);
+
+        ret = select(c->fd + 1, NULL, &wfds, NULL, NULL);
+    } while (ret == -1 && socket_error() == EINTR);
+
+    if (ret == -1) {
+        qemu_file_set_error(c->file, -socket_error());
+    }
+}
+
+static int tcp_channel_close(void *opaque)
+{
+    TcpChannel *c = opaque;
+    int r = 0;
+
+    qemu_set_fd_handler2(c->fd, NULL, NULL, NULL, NULL);
+    if (closesocket(c->fd) < 0) {
+        r = -socket_error();
+    }
+    g_free(c);
+    return r;
+}
+
+/* Open the connections for streams 2..n once the first one is up; the
+ * destination queues them on its listening socket until it has read the
+ * stream count from the main stream. */
+static int tcp_open_ram_channels(MigrationState *s)
+{
+    const char *host_port = s->opaque;
+    Error *local_err = NULL;
+
+    while (s->nr_ram_files < s->channels - 1) {
+        TcpChannel *c;
+        int fd;
+
+        fd = inet_connect(host_port, true, &local_err);
+        if (fd < 0) {
+            DPRINTF("could not open stream %d\n", s->nr_ram_files + 2);
+            error_free(local_err);
+            return -1;
+        }
+        socket_set_nonblock(fd);
+
+        c = g_malloc0(sizeof(*c));
+        c->fd = fd;
+        c->file = qemu_fopen_ops_buffered(c, s->bandwidth_limit,
+                                          tcp_channel_put_buffer,
+#ifndef _WIN32
+                                          tcp_channel_put_iov,
+#else
+                                          NULL,
+#endif
+                                          tcp_channel_put_ready,
+                                          tcp_channel_wait_for_unfreeze,
+                                          tcp_channel_close);
+        s->ram_files[s->nr_ram_files++] = c->file;
+    }
+    return 0;
+}
+
+static void tcp_connect_done(MigrationState *s, bool connected)
+{
+    if (connected && tcp_open_ram_channels(s) < 0) {
+        connected = false;
+    }
+    g_free(s->opaque);
+    s->opaque = NULL;
+
+    if (connected) {
+        migrate_fd_connect(s);
+    } else {
+        migrate_fd_error(s);
+    }
+}
+
 static void tcp_wait_for_connect(void *opaque)
 {
     MigrationState *s = opaque;
@@ -65,17 +217,17 @@ static void tcp_wait_for_connect(void *opaque)
     } while (ret == -1 && (socket_error()) == EINTR);
 
     if (ret < 0) {
-        migrate_fd_error(s);
+        tcp_connect_done(s, false);
         return;
     }
 
     qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
 
     if (val == 0)
-        migrate_fd_connect(s);
+        tcp_connect_done(s, true);
     else {
         DPRINTF("error connecting %d\n", val);
-        migrate_fd_error(s);
+        tcp_connect_done(s, false);
     }
 }
 
@@ -84,12 +236,16 @@ int tcp_start_outgoing_migration(MigrationState *s, const char *host_port,
 {
     s->get_error = socket_errno;
     s->write = socket_write;
+#ifndef _WIN32
+    s->writev = socket_writev;
+#endif
     s->close = tcp_close;
+    s->opaque = g_strdup(host_port);
 
     s->fd = inet_connect(host_port, false, errp);
 
     if (!error_is_set(errp)) {
-        migrate_fd_connect(s);
+        tcp_connect_done(s, true);
     } else if (error_is_type(*errp, QERR_SOCKET_CONNECT_IN_PROGRESS)) {
         DPRINTF("connect in progress\n");
         qemu_set_fd_handler2(s->fd, NULL, NULL, tcp_wait_for_connect, s);
@@ -108,6 +264,21 @@ int tcp_start_outgoing_migration(MigrationState *s, const char *host_port,
     return 0;
 }
 
+static int tcp_accept_channel(void *opaque)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    int s = (intptr_t)opaque;
+    int c;
+
+    do {
+        c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
+    } while (c == -1 && socket_error() == EINTR);
+
+    DPRINTF("accepted migration stream\n");
+    return c;
+}
+
 static void tcp_accept_incoming_migration(void *opaque)
 {
     struct sockaddr_in addr;
@@ -133,7 +304,9 @@ static void tcp_accept_incoming_migration(void *opaque)
         goto out;
     }
 
+    migration_incoming_set_channel_accept(tcp_accept_channel, opaque);
     process_incoming_migration(f);
+    migration_incoming_set_channel_accept(NULL, NULL);
     qemu_fclose(f);
 out:
     close(c);
@@ -152,6 +325,9 @@ int tcp_start_incoming_migration(const char *host_port, Error **errp)
         return -1;
     }
 
+    /* Let the extra streams of a multi-stream migration queue up */
+    listen(s, MIGRATION_MAX_CHANNELS);
+
     qemu_set_fd_handler2(s, NULL, tcp_accept_incoming_migration, NULL,
                          (void *)(intptr_t)s);
 
@@ -40,6 +40,11 @@ static int unix_write(MigrationState *s, const void * buf, size_t size)
     return write(s->fd, buf, size);
 }
 
+static int unix_writev(MigrationState *s, const struct iovec *iov, int iovcnt)
+{
+    return writev(s->fd, iov, iovcnt);
+}
+
 static int unix_close(MigrationState *s)
 {
     int r = 0;
@@ -88,6 +93,7 @@ int unix_start_outgoing_migration(MigrationState *s, const char *path)
     snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
     s->get_error = unix_errno;
     s->write = unix_write;
+    s->writev = unix_writev;
     s->close = unix_close;
 
     s->fd = qemu_socket(PF_UNIX, SOCK_STREAM, 0);
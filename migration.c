@@ -82,9 +82,31 @@ int qemu_start_incoming_migration(const char *uri, Error **errp)
     return ret;
 }
 
+static MigrationAcceptChannelFunc *incoming_channel_accept;
+static void *incoming_channel_opaque;
+
+void migration_incoming_set_channel_accept(MigrationAcceptChannelFunc *accept,
+                                           void *opaque)
+{
+    incoming_channel_accept = accept;
+    incoming_channel_opaque = opaque;
+}
+
+int migration_incoming_accept_channel(void)
+{
+    if (!incoming_channel_accept) {
+        return -1;
+    }
+    return incoming_channel_accept(incoming_channel_opaque);
+}
+
 void process_incoming_migration(QEMUFile *f)
 {
-    if (qemu_loadvm_state(f) < 0) {
+    int ret;
+
+    ret = qemu_loadvm_state(f);
+    ram_load_cleanup();
+    if (ret < 0) {
         fprintf(stderr, "load of migration failed\n");
         exit(0);
     }
@@ -113,6 +135,20 @@ uint64_t migrate_max_downtime(void)
     return max_downtime;
 }
 
+bool migrate_zero_blocks(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_BLOCKS];
+}
+
+bool migrate_ram_runs(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_RAM_RUNS];
+}
+
 MigrationInfo *qmp_query_migrate(Error **errp)
 {
     MigrationInfo *info = g_malloc0(sizeof(*info));
@@ -162,12 +198,22 @@ MigrationInfo *qmp_query_migrate(Error **errp)
 static int migrate_fd_cleanup(MigrationState *s)
 {
     int ret = 0;
+    int i;
 
     qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
 
+    for (i = 0; i < s->nr_ram_files; i++) {
+        if (qemu_fclose(s->ram_files[i]) < 0) {
+            ret = -1;
+        }
+    }
+    s->nr_ram_files = 0;
+
     if (s->file) {
         DPRINTF("closing file\n");
-        ret = qemu_fclose(s->file);
+        if (qemu_fclose(s->file) < 0) {
+            ret = -1;
+        }
         s->file = NULL;
     }
 
@@ -234,6 +280,31 @@ static ssize_t migrate_fd_put_buffer(void *opaque, const void *data,
     return ret;
 }
 
+static ssize_t migrate_fd_put_iov(void *opaque, const struct iovec *iov,
+                                  int iovcnt)
+{
+    MigrationState *s = opaque;
+    ssize_t ret;
+
+    if (s->state != MIG_STATE_ACTIVE) {
+        return -EIO;
+    }
+
+    do {
+        ret = s->writev(s, iov, iovcnt);
+    } while (ret == -1 && ((s->get_error(s)) == EINTR));
+
+    if (ret == -1) {
+        ret = -(s->get_error(s));
+    }
+
+    if (ret == -EAGAIN) {
+        qemu_set_fd_handler2(s->fd, NULL, NULL, migrate_fd_put_notify, s);
+    }
+
+    return ret;
+}
+
 static void migrate_fd_put_ready(void *opaque)
 {
     MigrationState *s = opaque;
@@ -339,14 +410,38 @@ bool migration_has_failed(MigrationState *s)
             s->state == MIG_STATE_ERROR);
 }
 
+int migrate_get_ram_files(QEMUFile *f, QEMUFile **files)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (s->state != MIG_STATE_ACTIVE || s->file != f) {
+        return 0;
+    }
+
+    memcpy(files, s->ram_files, s->nr_ram_files * sizeof(*files));
+    return s->nr_ram_files;
+}
+
+/* The bandwidth limit covers the whole migration, split it evenly */
+static int64_t migrate_stream_bandwidth(MigrationState *s)
+{
+    return s->bandwidth_limit / (s->nr_ram_files + 1);
+}
+
 void migrate_fd_connect(MigrationState *s)
 {
     int ret;
+    int i;
 
     s->state = MIG_STATE_ACTIVE;
+    for (i = 0; i < s->nr_ram_files; i++) {
+        qemu_file_set_rate_limit(s->ram_files[i],
+                                 migrate_stream_bandwidth(s));
+    }
     s->file = qemu_fopen_ops_buffered(s,
-                                      s->bandwidth_limit,
+                                      migrate_stream_bandwidth(s),
                                       migrate_fd_put_buffer,
+                                      s->writev ? migrate_fd_put_iov : NULL,
                                       migrate_fd_put_ready,
                                       migrate_fd_wait_for_unfreeze,
                                       migrate_fd_close);
@@ -361,15 +456,22 @@ void migrate_fd_connect(MigrationState *s)
     migrate_fd_put_ready(s);
 }
 
-static MigrationState *migrate_init(int blk, int inc)
+static MigrationState *migrate_init(int blk, int inc, int channels)
 {
     MigrationState *s = migrate_get_current();
     int64_t bandwidth_limit = s->bandwidth_limit;
+    bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
+
+    memcpy(enabled_capabilities, s->enabled_capabilities,
+           sizeof(enabled_capabilities));
 
     memset(s, 0, sizeof(*s));
     s->bandwidth_limit = bandwidth_limit;
+    memcpy(s->enabled_capabilities, enabled_capabilities,
+           sizeof(enabled_capabilities));
     s->blk = blk;
     s->shared = inc;
+    s->channels = channels;
 
     s->bandwidth_limit = bandwidth_limit;
     s->state = MIG_STATE_SETUP;
@@ -391,7 +493,7 @@ void migrate_del_blocker(Error *reason)
 
 void qmp_migrate(const char *uri, bool has_blk, bool blk,
                  bool has_inc, bool inc, bool has_detach, bool detach,
-                 Error **errp)
+                 bool has_channels, int64_t channels, Error **errp)
 {
     MigrationState *s = migrate_get_current();
     const char *p;
@@ -411,7 +513,21 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
-    s = migrate_init(blk, inc);
+    if (!has_channels) {
+        channels = 1;
+    }
+    if (channels < 1 || channels > MIGRATION_MAX_CHANNELS) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "channels",
+                  "a number of streams between 1 and 16");
+        return;
+    }
+    if (channels > 1 && !strstart(uri, "tcp:", NULL)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "channels",
+                  "1 for migration protocols other than tcp");
+        return;
+    }
+
+    s = migrate_init(blk, inc, channels);
 
     if (strstart(uri, "tcp:", &p)) {
         ret = tcp_start_outgoing_migration(s, p, errp);
@@ -448,6 +564,7 @@ void qmp_migrate_cancel(Error **errp)
 void qmp_migrate_set_speed(int64_t value, Error **errp)
 {
     MigrationState *s;
+    int i;
 
     if (value < 0) {
         value = 0;
@@ -455,7 +572,10 @@ void qmp_migrate_set_speed(int64_t value, Error **errp)
 
     s = migrate_get_current();
     s->bandwidth_limit = value;
-    qemu_file_set_rate_limit(s->file, s->bandwidth_limit);
+    qemu_file_set_rate_limit(s->file, migrate_stream_bandwidth(s));
+    for (i = 0; i < s->nr_ram_files; i++) {
+        qemu_file_set_rate_limit(s->ram_files[i], migrate_stream_bandwidth(s));
+    }
 }
 
 void qmp_migrate_set_downtime(double value, Error **errp)
@@ -464,3 +584,38 @@ void qmp_migrate_set_downtime(double value, Error **errp)
     value = MAX(0, MIN(UINT64_MAX, value));
     max_downtime = (uint64_t)value;
 }
+
+MigrationCapabilityStatusList *qmp_query_migrate_capabilities(Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+    MigrationCapabilityStatusList *head = NULL, **next = &head;
+    int i;
+
+    for (i = 0; i < MIGRATION_CAPABILITY_MAX; i++) {
+        MigrationCapabilityStatusList *caps = g_malloc0(sizeof(*caps));
+
+        caps->value = g_malloc0(sizeof(*caps->value));
+        caps->value->capability = i;
+        caps->value->state = s->enabled_capabilities[i];
+        *next = caps;
+        next = &caps->next;
+    }
+
+    return head;
+}
+
+void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
+                                  Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+    MigrationCapabilityStatusList *cap;
+
+    if (s->state == MIG_STATE_ACTIVE) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+
+    for (cap = params; cap; cap = cap->next) {
+        s->enabled_capabilities[cap->value->capability] = cap->value->state;
+    }
+}
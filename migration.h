@@ -18,9 +18,13 @@
 #include "qemu-common.h"
 #include "notify.h"
 #include "error.h"
+#include "qapi-types.h"
 
 typedef struct MigrationState MigrationState;
 
+/* Upper bound for the number of parallel streams of a single migration */
+#define MIGRATION_MAX_CHANNELS 16
+
 struct MigrationState
 {
     int64_t bandwidth_limit;
@@ -30,17 +34,34 @@ struct MigrationState
     int (*get_error)(MigrationState *s);
     int (*close)(MigrationState *s);
     int (*write)(MigrationState *s, const void *buff, size_t size);
+    /* optional, lets guest RAM be sent without copying it first */
+    int (*writev)(MigrationState *s, const struct iovec *iov, int iovcnt);
     void *opaque;
     int blk;
     int shared;
+    int channels;
+    /* extra streams that only carry RAM pages, see migrate_get_ram_files() */
+    int nr_ram_files;
+    QEMUFile *ram_files[MIGRATION_MAX_CHANNELS - 1];
+    bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
 };
 
 void process_incoming_migration(QEMUFile *f);
 
 int qemu_start_incoming_migration(const char *uri, Error **errp);
 
+/* Register a callback that accepts one more incoming connection belonging
+ * to the migration in progress, and returns its socket or -1. */
+typedef int (MigrationAcceptChannelFunc)(void *opaque);
+void migration_incoming_set_channel_accept(MigrationAcceptChannelFunc *accept,
+                                           void *opaque);
+int migration_incoming_accept_channel(void);
+
 uint64_t migrate_max_downtime(void);
 
+bool migrate_zero_blocks(void);
+bool migrate_ram_runs(void);
+
 void do_info_migrate_print(Monitor *mon, const QObject *data);
 
 void do_info_migrate(Monitor *mon, QObject **ret_data);
@@ -66,6 +87,10 @@ void migrate_fd_error(MigrationState *s);
 
 void migrate_fd_connect(MigrationState *s);
 
+/* Store the extra RAM streams of the outgoing migration whose main stream
+ * is @f in @files, and return how many there are. */
+int migrate_get_ram_files(QEMUFile *f, QEMUFile **files);
+
 void add_migration_state_change_notifier(Notifier *notify);
 void remove_migration_state_change_notifier(Notifier *notify);
 bool migration_is_active(MigrationState *);
@@ -78,6 +103,13 @@ uint64_t ram_bytes_total(void);
 
 int ram_save_live(QEMUFile *f, int stage, void *opaque);
 int ram_load(QEMUFile *f, void *opaque, int version_id);
+void ram_load_cleanup(void);
+
+/* Incremental snapshots, see arch_init.c */
+bool ram_snapshot_is_tracking(void);
+void ram_snapshot_begin(bool track, bool incremental);
+void ram_snapshot_end(bool success);
+void ram_snapshot_loaded(bool success);
 
 /**
  * @migrate_add_blocker - prevent migration from proceeding
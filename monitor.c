@@ -484,6 +484,9 @@ void monitor_protocol_event(MonitorEvent event, QObject *data)
         case QEVENT_BLOCK_JOB_CANCELLED:
             event_name = "BLOCK_JOB_CANCELLED";
             break;
+        case QEVENT_BLOCK_JOB_READY:
+            event_name = "BLOCK_JOB_READY";
+            break;
         case QEVENT_DEVICE_TRAY_MOVED:
              event_name = "DEVICE_TRAY_MOVED";
             break;
@@ -2557,6 +2560,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show migration status",
         .mhandler.info = hmp_info_migrate,
     },
+    {
+        .name       = "migrate_capabilities",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the state of the migration capabilities",
+        .mhandler.info = hmp_info_migrate_capabilities,
+    },
     {
         .name       = "balloon",
         .args_type  = "",
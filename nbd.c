@@ -17,7 +17,7 @@
  */
 
 #include "nbd.h"
-#include "block.h"
+#include "block_int.h"
 
 #include "qemu-coroutine.h"
 
@@ -34,6 +34,9 @@
 
 #ifdef __linux__
 #include <linux/fs.h>
+#include <sys/sendfile.h>
+#include <poll.h>
+#include "block/raw-posix-aio.h"
 #endif
 
 #include "qemu_socket.h"
@@ -608,14 +611,18 @@ static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
     return 0;
 }
 
-#define MAX_NBD_REQUESTS 16
+#define MAX_NBD_REQUESTS 64
+
+/* Reads that are scattered over more pieces of the image file than this
+ * are not worth sending with sendfile() */
+#define NBD_SENDFILE_MAX_EXTENTS 16
 
 typedef struct NBDRequest NBDRequest;
 
 struct NBDRequest {
     QSIMPLEQ_ENTRY(NBDRequest) entry;
     NBDClient *client;
-    uint8_t *data;
+    uint8_t *data;      /* allocated on first use */
 };
 
 struct NBDExport {
@@ -674,7 +681,6 @@ static NBDRequest *nbd_request_get(NBDClient *client)
 
     if (QSIMPLEQ_EMPTY(&exp->requests)) {
         req = g_malloc0(sizeof(NBDRequest));
-        req->data = qemu_blockalign(exp->bs, NBD_BUFFER_SIZE);
     } else {
         req = QSIMPLEQ_FIRST(&exp->requests);
         QSIMPLEQ_REMOVE_HEAD(&exp->requests, entry);
@@ -684,6 +690,13 @@ static NBDRequest *nbd_request_get(NBDClient *client)
     return req;
 }
 
+static void nbd_request_alloc_data(NBDRequest *req)
+{
+    if (!req->data) {
+        req->data = qemu_blockalign(req->client->exp->bs, NBD_BUFFER_SIZE);
+    }
+}
+
 static void nbd_request_put(NBDRequest *req)
 {
     NBDClient *client = req->client;
@@ -755,6 +768,180 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
     return rc;
 }
 
+#ifdef __linux__
+/*
+ * Reads whose data is stored as is in a file are sent from the page cache
+ * with sendfile(), which may block on disk I/O and therefore runs in the
+ * thread pool.  The worker thread waits for the socket to become writable
+ * by itself; the coroutine keeps send_lock until it is done.
+ */
+
+typedef struct NBDSendfileExtent {
+    int fd;
+    off_t offset;
+    size_t len;
+} NBDSendfileExtent;
+
+typedef struct NBDSendfileJob {
+    Coroutine *co;
+    int sock;
+    int ret;
+    int nb_extents;
+    NBDSendfileExtent extents[NBD_SENDFILE_MAX_EXTENTS];
+} NBDSendfileJob;
+
+/*
+ * Looks up in which image file of the backing chain the data of a read
+ * request is stored.  Returns false if any part of it is not stored as is
+ * in a file that sendfile() can read (e.g. because it is compressed).
+ */
+static bool coroutine_fn nbd_co_map_read(NBDExport *exp,
+                                         struct nbd_request *request,
+                                         NBDSendfileJob *job)
+{
+    BlockDriverState *bs, *file;
+    int64_t sector_num, ret, offset;
+    NBDSendfileExtent *e;
+    int nb_sectors, pnum, fd;
+
+    if (request->len == 0 ||
+        ((request->from + exp->dev_offset) | request->len) % 512) {
+        return false;
+    }
+
+    sector_num = (request->from + exp->dev_offset) / 512;
+    nb_sectors = request->len / 512;
+    job->nb_extents = 0;
+
+    while (nb_sectors > 0) {
+        bs = exp->bs;
+        pnum = nb_sectors;
+        do {
+            ret = bdrv_co_get_block_status(bs, sector_num, pnum, &pnum);
+            if (ret < 0 || pnum == 0) {
+                return false;
+            }
+        } while (!(ret & (BDRV_BLOCK_DATA | BDRV_BLOCK_ZERO)) &&
+                 (bs = bs->backing_hd));
+
+        /* With O_DIRECT the page cache may be stale */
+        if (!bs || !(ret & BDRV_BLOCK_OFFSET_VALID) ||
+            (bs->open_flags & BDRV_O_NOCACHE)) {
+            return false;
+        }
+        file = bs->file ? bs->file : bs;
+        fd = raw_get_fd(file);
+        if (fd < 0) {
+            return false;
+        }
+
+        /* sendfile() can't pad data after the end of the file */
+        offset = ret & BDRV_BLOCK_OFFSET_MASK;
+        if (offset + pnum * 512 > bdrv_getlength(file)) {
+            return false;
+        }
+
+        e = job->nb_extents ? &job->extents[job->nb_extents - 1] : NULL;
+        if (e && e->fd == fd && e->offset + e->len == offset) {
+            e->len += pnum * 512;
+        } else if (job->nb_extents < NBD_SENDFILE_MAX_EXTENTS) {
+            e = &job->extents[job->nb_extents++];
+            e->fd = fd;
+            e->offset = offset;
+            e->len = pnum * 512;
+        } else {
+            return false;
+        }
+
+        sector_num += pnum;
+        nb_sectors -= pnum;
+    }
+
+    return true;
+}
+
+/* Runs in a worker thread */
+static int nbd_sendfile_func(void *opaque)
+{
+    NBDSendfileJob *job = opaque;
+    struct pollfd pfd = { .fd = job->sock, .events = POLLOUT };
+    int i;
+
+    for (i = 0; i < job->nb_extents; i++) {
+        off_t offset = job->extents[i].offset;
+        size_t len = job->extents[i].len;
+
+        while (len > 0) {
+            ssize_t ret = sendfile(job->sock, job->extents[i].fd, &offset,
+                                   len);
+            if (ret < 0) {
+                if (errno == EAGAIN) {
+                    poll(&pfd, 1, -1);
+                } else if (errno != EINTR) {
+                    return -errno;
+                }
+                continue;
+            }
+            if (ret == 0) {
+                return -EIO;
+            }
+            len -= ret;
+        }
+    }
+
+    return 0;
+}
+
+static void nbd_sendfile_cb(void *opaque, int ret)
+{
+    NBDSendfileJob *job = opaque;
+
+    job->ret = ret;
+    qemu_coroutine_enter(job->co, NULL);
+}
+
+static ssize_t nbd_co_sendfile_reply(NBDRequest *req, struct nbd_reply *reply,
+                                     NBDSendfileJob *job)
+{
+    NBDClient *client = req->client;
+    int csock = client->sock;
+    ssize_t rc;
+
+    qemu_co_mutex_lock(&client->send_lock);
+    qemu_set_fd_handler2(csock, nbd_can_read, nbd_read,
+                         nbd_restart_write, client);
+    client->send_coroutine = qemu_coroutine_self();
+
+    socket_set_cork(csock, 1);
+    rc = nbd_send_reply(csock, reply);
+
+    client->send_coroutine = NULL;
+    qemu_set_fd_handler2(csock, nbd_can_read, nbd_read, NULL, client);
+
+    if (rc >= 0) {
+        /* Use a duplicate of the socket, so that the worker thread can't
+         * write to another connection if the client is closed meanwhile */
+        job->sock = dup(csock);
+        job->co = qemu_coroutine_self();
+        if (job->sock < 0) {
+            rc = -errno;
+        } else {
+            paio_submit_func(client->exp->bs, nbd_sendfile_func, job,
+                             nbd_sendfile_cb, job);
+            qemu_coroutine_yield();
+            close(job->sock);
+            rc = job->ret;
+        }
+    }
+
+    if (client->sock >= 0) {
+        socket_set_cork(csock, 0);
+    }
+    qemu_co_mutex_unlock(&client->send_lock);
+    return rc;
+}
+#endif
+
 static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *request)
 {
     NBDClient *client = req->client;
@@ -789,6 +976,7 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
     if ((request->type & NBD_CMD_MASK_COMMAND) == NBD_CMD_WRITE) {
         TRACE("Reading %u byte(s)", request->len);
 
+        nbd_request_alloc_data(req);
         if (qemu_co_recv(csock, req->data, request->len) != request->len) {
             LOG("reading from socket failed");
             rc = -EIO;
@@ -810,6 +998,9 @@ static void nbd_trip(void *opaque)
     struct nbd_request request;
     struct nbd_reply reply;
     ssize_t ret;
+#ifdef __linux__
+    NBDSendfileJob job;
+#endif
 
     TRACE("Reading request.");
 
@@ -851,6 +1042,17 @@ static void nbd_trip(void *opaque)
             }
         }
 
+#ifdef __linux__
+        if (nbd_co_map_read(exp, &request, &job)) {
+            TRACE("Sending %u byte(s) from the image file", request.len);
+            if (nbd_co_sendfile_reply(req, &reply, &job) < 0) {
+                goto out;
+            }
+            break;
+        }
+#endif
+
+        nbd_request_alloc_data(req);
         ret = bdrv_read(exp->bs, (request.from + exp->dev_offset) / 512,
                         req->data, request.len / 512);
         if (ret < 0) {
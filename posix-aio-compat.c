@@ -32,32 +32,57 @@
 
 #include "block/raw-posix-aio.h"
 
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+#if defined(CONFIG_FALLOCATE_PUNCH_HOLE) || defined(CONFIG_FALLOCATE_ZERO_RANGE)
+#include <linux/falloc.h>
+#endif
+
 static void do_spawn_thread(void);
 
+typedef struct PaioQueue PaioQueue;
+
 struct qemu_paiocb {
     BlockDriverAIOCB common;
     int aio_fildes;
     union {
         struct iovec *aio_iov;
         void *aio_ioctl_buf;
+        void *aio_func_arg;         /* for QEMU_AIO_FUNC */
     };
+    PaioFunc *aio_func;
     int aio_niov;
     size_t aio_nbytes;
 #define aio_ioctl_cmd   aio_nbytes /* for QEMU_AIO_IOCTL */
     off_t aio_offset;
 
+    /* in the queue of its BlockDriverState, or in completed_list when done */
     QTAILQ_ENTRY(qemu_paiocb) node;
+    PaioQueue *queue;
     int aio_type;
     ssize_t ret;
     int active;
-    struct qemu_paiocb *next;
+};
+
+/*
+ * Requests of one BlockDriverState that wait for a worker. Only queues with
+ * pending requests exist; workers serve them round robin, so a single busy
+ * drive can't starve the others.
+ */
+struct PaioQueue {
+    BlockDriverState *bs;
+    QTAILQ_HEAD(, qemu_paiocb) requests;
+    QTAILQ_ENTRY(PaioQueue) next;
 };
 
 typedef struct PosixAioState {
     int rfd, wfd;
-    struct qemu_paiocb *first_aio;
+    int nr_requests;    /* submitted, but callback not yet called */
 } PosixAioState;
 
+static PosixAioState *posix_aio_state;
+
 
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
@@ -69,7 +94,8 @@ static int idle_threads = 0;
 static int new_threads = 0;     /* backlog of threads we need to create */
 static int pending_threads = 0; /* threads created but not running yet */
 static QEMUBH *new_thread_bh;
-static QTAILQ_HEAD(, qemu_paiocb) request_list;
+static QTAILQ_HEAD(, PaioQueue) queue_list;
+static QTAILQ_HEAD(, qemu_paiocb) completed_list;
 
 #ifdef CONFIG_PREADV
 static int preadv_present = 1;
@@ -150,6 +176,104 @@ static ssize_t handle_aiocb_flush(struct qemu_paiocb *aiocb)
     return 0;
 }
 
+#ifdef __linux__
+/*
+ * Errors that only say that the host (kernel, file system or device) can't
+ * do the operation for us, in which case the caller has to fall back to
+ * something slower.  Anything else, like EINVAL for a request that the
+ * device doesn't accept, is an error of this request only.
+ */
+static ssize_t translate_err(ssize_t err)
+{
+    if (err == -ENOSYS || err == -EOPNOTSUPP || err == -ENOTTY) {
+        err = -ENOTSUP;
+    }
+    return err;
+}
+
+static ssize_t do_blkdev_range_ioctl(int fd, unsigned long int req,
+                                     off_t offset, off_t len)
+{
+    uint64_t range[2] = { offset, len };
+
+    if (ioctl(fd, req, range) == 0) {
+        return 0;
+    }
+    return translate_err(-errno);
+}
+#endif
+
+#if defined(CONFIG_FALLOCATE_PUNCH_HOLE) || defined(CONFIG_FALLOCATE_ZERO_RANGE)
+static ssize_t do_fallocate(int fd, int mode, off_t offset, off_t len)
+{
+    do {
+        if (fallocate(fd, mode, offset, len) == 0) {
+            return 0;
+        }
+    } while (errno == EINTR);
+
+    return translate_err(-errno);
+}
+#endif
+
+static ssize_t handle_aiocb_write_zeroes(struct qemu_paiocb *aiocb)
+{
+    ssize_t ret = -ENOTSUP;
+
+    if (aiocb->aio_type & QEMU_AIO_BLKDEV) {
+#ifdef BLKZEROOUT
+        ret = do_blkdev_range_ioctl(aiocb->aio_fildes, BLKZEROOUT,
+                                    aiocb->aio_offset, aiocb->aio_nbytes);
+#endif
+        goto out;
+    }
+
+#ifdef CONFIG_FALLOCATE_ZERO_RANGE
+    ret = do_fallocate(aiocb->aio_fildes, FALLOC_FL_ZERO_RANGE,
+                       aiocb->aio_offset, aiocb->aio_nbytes);
+    if (ret != -ENOTSUP) {
+        goto out;
+    }
+#endif
+
+#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+    /*
+     * Punching a hole and allocating it again leaves zeroed, allocated
+     * blocks behind and extends the file if the range goes past EOF.
+     */
+    ret = do_fallocate(aiocb->aio_fildes,
+                       FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                       aiocb->aio_offset, aiocb->aio_nbytes);
+    if (ret == 0) {
+        ret = do_fallocate(aiocb->aio_fildes, 0,
+                           aiocb->aio_offset, aiocb->aio_nbytes);
+    }
+#endif
+
+out:
+    return ret < 0 ? ret : aiocb->aio_nbytes;
+}
+
+static ssize_t handle_aiocb_discard(struct qemu_paiocb *aiocb)
+{
+    ssize_t ret = -ENOTSUP;
+
+    if (aiocb->aio_type & QEMU_AIO_BLKDEV) {
+#ifdef BLKDISCARD
+        ret = do_blkdev_range_ioctl(aiocb->aio_fildes, BLKDISCARD,
+                                    aiocb->aio_offset, aiocb->aio_nbytes);
+#endif
+    } else {
+#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+        ret = do_fallocate(aiocb->aio_fildes,
+                           FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                           aiocb->aio_offset, aiocb->aio_nbytes);
+#endif
+    }
+
+    return ret < 0 ? ret : aiocb->aio_nbytes;
+}
+
 #ifdef CONFIG_PREADV
 
 static ssize_t
@@ -311,6 +435,86 @@ static ssize_t handle_aiocb_rw(struct qemu_paiocb *aiocb)
 
 static void posix_aio_notify_event(void);
 
+/* Called with lock held */
+static void paio_enqueue(struct qemu_paiocb *aiocb)
+{
+    BlockDriverState *bs = aiocb->common.bs;
+    struct qemu_paiocb *prev = NULL, *req;
+    PaioQueue *q;
+
+    QTAILQ_FOREACH(q, &queue_list, next) {
+        if (q->bs == bs) {
+            break;
+        }
+    }
+    if (!q) {
+        q = g_malloc(sizeof(*q));
+        q->bs = bs;
+        QTAILQ_INIT(&q->requests);
+        QTAILQ_INSERT_TAIL(&queue_list, q, next);
+    }
+    aiocb->queue = q;
+
+    /*
+     * Flushes are usually waited for, so don't make them wait behind the data
+     * requests.  The block layer doesn't order them against requests that
+     * haven't completed yet anyway.  They still stay in order among each
+     * other.  Ioctls can carry data (SG_IO reads and writes from scsi-generic
+     * and scsi-block), so they keep their place like other requests.
+     */
+    if ((aiocb->aio_type & QEMU_AIO_TYPE_MASK) != QEMU_AIO_FLUSH) {
+        QTAILQ_INSERT_TAIL(&q->requests, aiocb, node);
+        return;
+    }
+
+    QTAILQ_FOREACH(req, &q->requests, node) {
+        if ((req->aio_type & QEMU_AIO_TYPE_MASK) != QEMU_AIO_FLUSH) {
+            break;
+        }
+        prev = req;
+    }
+    if (prev) {
+        QTAILQ_INSERT_AFTER(&q->requests, prev, aiocb, node);
+    } else {
+        QTAILQ_INSERT_HEAD(&q->requests, aiocb, node);
+    }
+    QTAILQ_REMOVE(&queue_list, q, next);
+    QTAILQ_INSERT_HEAD(&queue_list, q, next);
+}
+
+/* Called with lock held */
+static void paio_dequeue(struct qemu_paiocb *aiocb)
+{
+    PaioQueue *q = aiocb->queue;
+
+    QTAILQ_REMOVE(&q->requests, aiocb, node);
+    aiocb->queue = NULL;
+    if (QTAILQ_EMPTY(&q->requests)) {
+        QTAILQ_REMOVE(&queue_list, q, next);
+        g_free(q);
+    }
+}
+
+/* Called with lock held */
+static struct qemu_paiocb *paio_next_request(void)
+{
+    PaioQueue *q = QTAILQ_FIRST(&queue_list);
+    struct qemu_paiocb *aiocb;
+
+    if (!q) {
+        return NULL;
+    }
+
+    aiocb = QTAILQ_FIRST(&q->requests);
+    if (QTAILQ_NEXT(aiocb, node)) {
+        /* Next time it's the turn of the next drive */
+        QTAILQ_REMOVE(&queue_list, q, next);
+        QTAILQ_INSERT_TAIL(&queue_list, q, next);
+    }
+    paio_dequeue(aiocb);
+    return aiocb;
+}
+
 static void *aio_thread(void *unused)
 {
     mutex_lock(&lock);
@@ -321,6 +525,7 @@ static void *aio_thread(void *unused)
     while (1) {
         struct qemu_paiocb *aiocb;
         ssize_t ret = 0;
+        bool notify;
         qemu_timeval tv;
         struct timespec ts;
 
@@ -330,18 +535,17 @@ static void *aio_thread(void *unused)
 
         mutex_lock(&lock);
 
-        while (QTAILQ_EMPTY(&request_list) &&
+        while (QTAILQ_EMPTY(&queue_list) &&
                !(ret == ETIMEDOUT)) {
             idle_threads++;
             ret = cond_timedwait(&cond, &lock, &ts);
             idle_threads--;
         }
 
-        if (QTAILQ_EMPTY(&request_list))
+        aiocb = paio_next_request();
+        if (!aiocb)
             break;
 
-        aiocb = QTAILQ_FIRST(&request_list);
-        QTAILQ_REMOVE(&request_list, aiocb, node);
         aiocb->active = 1;
         mutex_unlock(&lock);
 
@@ -369,17 +573,34 @@ static void *aio_thread(void *unused)
         case QEMU_AIO_IOCTL:
             ret = handle_aiocb_ioctl(aiocb);
             break;
+        case QEMU_AIO_DISCARD:
+            ret = handle_aiocb_discard(aiocb);
+            break;
+        case QEMU_AIO_WRITE_ZEROES:
+            ret = handle_aiocb_write_zeroes(aiocb);
+            break;
+        case QEMU_AIO_FUNC:
+            ret = aiocb->aio_func(aiocb->aio_func_arg);
+            break;
         default:
             fprintf(stderr, "invalid aio request (0x%x)\n", aiocb->aio_type);
             ret = -EINVAL;
             break;
         }
 
+        /*
+         * Only the first completion after the main loop has emptied the list
+         * needs to wake it up, it picks up all the others at the same time.
+         */
         mutex_lock(&lock);
         aiocb->ret = ret;
+        notify = QTAILQ_EMPTY(&completed_list);
+        QTAILQ_INSERT_TAIL(&completed_list, aiocb, node);
         mutex_unlock(&lock);
 
-        posix_aio_notify_event();
+        if (notify) {
+            posix_aio_notify_event();
+        }
     }
 
     cur_threads--;
@@ -437,45 +658,23 @@ static void qemu_paio_submit(struct qemu_paiocb *aiocb)
 {
     aiocb->ret = -EINPROGRESS;
     aiocb->active = 0;
+    posix_aio_state->nr_requests++;
     mutex_lock(&lock);
     if (idle_threads == 0 && cur_threads < max_threads)
         spawn_thread();
-    QTAILQ_INSERT_TAIL(&request_list, aiocb, node);
+    paio_enqueue(aiocb);
     mutex_unlock(&lock);
     cond_signal(&cond);
 }
 
-static ssize_t qemu_paio_return(struct qemu_paiocb *aiocb)
-{
-    ssize_t ret;
-
-    mutex_lock(&lock);
-    ret = aiocb->ret;
-    mutex_unlock(&lock);
-
-    return ret;
-}
-
-static int qemu_paio_error(struct qemu_paiocb *aiocb)
-{
-    ssize_t ret = qemu_paio_return(aiocb);
-
-    if (ret < 0)
-        ret = -ret;
-    else
-        ret = 0;
-
-    return ret;
-}
-
 static void posix_aio_read(void *opaque)
 {
     PosixAioState *s = opaque;
-    struct qemu_paiocb *acb, **pacb;
+    struct qemu_paiocb *acb;
     int ret;
     ssize_t len;
 
-    /* read all bytes from signal pipe */
+    /* read all bytes from the event notifier, before looking at the list */
     for (;;) {
         char bytes[16];
 
@@ -487,106 +686,78 @@ static void posix_aio_read(void *opaque)
         break;
     }
 
-    for(;;) {
-        pacb = &s->first_aio;
-        for(;;) {
-            acb = *pacb;
-            if (!acb)
-                return;
-
-            ret = qemu_paio_error(acb);
-            if (ret == ECANCELED) {
-                /* remove the request */
-                *pacb = acb->next;
-                qemu_aio_release(acb);
-            } else if (ret != EINPROGRESS) {
-                /* end of aio */
-                if (ret == 0) {
-                    ret = qemu_paio_return(acb);
-                    if (ret == acb->aio_nbytes)
-                        ret = 0;
-                    else
-                        ret = -EINVAL;
-                } else {
-                    ret = -ret;
-                }
-
-                trace_paio_complete(acb, acb->common.opaque, ret);
-
-                /* remove the request */
-                *pacb = acb->next;
-                /* call the callback */
-                acb->common.cb(acb->common.opaque, ret);
-                qemu_aio_release(acb);
-                break;
-            } else {
-                pacb = &acb->next;
-            }
+    /*
+     * Take the requests off the list one by one, a callback may cancel
+     * another completed request.
+     */
+    for (;;) {
+        mutex_lock(&lock);
+        acb = QTAILQ_FIRST(&completed_list);
+        if (acb) {
+            QTAILQ_REMOVE(&completed_list, acb, node);
         }
+        mutex_unlock(&lock);
+
+        if (!acb) {
+            break;
+        }
+
+        ret = acb->ret;
+        if ((acb->aio_type & QEMU_AIO_TYPE_MASK) == QEMU_AIO_FUNC) {
+            /* passed on as is */
+        } else if (ret >= 0) {
+            ret = (ret == acb->aio_nbytes) ? 0 : -EINVAL;
+        }
+
+        trace_paio_complete(acb, acb->common.opaque, ret);
+
+        s->nr_requests--;
+        acb->common.cb(acb->common.opaque, ret);
+        qemu_aio_release(acb);
     }
 }
 
 static int posix_aio_flush(void *opaque)
 {
     PosixAioState *s = opaque;
-    return !!s->first_aio;
+    return s->nr_requests > 0;
 }
 
-static PosixAioState *posix_aio_state;
-
 static void posix_aio_notify_event(void)
 {
-    char byte = 0;
+    /* 8 bytes, so that it works both with an eventfd and a pipe */
+    uint64_t value = 1;
     ssize_t ret;
 
-    ret = write(posix_aio_state->wfd, &byte, sizeof(byte));
+    do {
+        ret = write(posix_aio_state->wfd, &value, sizeof(value));
+    } while (ret < 0 && errno == EINTR);
     if (ret < 0 && errno != EAGAIN)
         die("write()");
 }
 
-static void paio_remove(struct qemu_paiocb *acb)
-{
-    struct qemu_paiocb **pacb;
-
-    /* remove the callback from the queue */
-    pacb = &posix_aio_state->first_aio;
-    for(;;) {
-        if (*pacb == NULL) {
-            fprintf(stderr, "paio_remove: aio request not found!\n");
-            break;
-        } else if (*pacb == acb) {
-            *pacb = acb->next;
-            qemu_aio_release(acb);
-            break;
-        }
-        pacb = &(*pacb)->next;
-    }
-}
-
 static void paio_cancel(BlockDriverAIOCB *blockacb)
 {
     struct qemu_paiocb *acb = (struct qemu_paiocb *)blockacb;
-    int active = 0;
 
     trace_paio_cancel(acb, acb->common.opaque);
 
     mutex_lock(&lock);
     if (!acb->active) {
-        QTAILQ_REMOVE(&request_list, acb, node);
-        acb->ret = -ECANCELED;
-    } else if (acb->ret == -EINPROGRESS) {
-        active = 1;
-    }
-    mutex_unlock(&lock);
-
-    if (active) {
+        paio_dequeue(acb);
+    } else {
         /* fail safe: if the aio could not be canceled, we wait for
            it */
-        while (qemu_paio_error(acb) == EINPROGRESS)
-            ;
+        while (acb->ret == -EINPROGRESS) {
+            mutex_unlock(&lock);
+            mutex_lock(&lock);
+        }
+        QTAILQ_REMOVE(&completed_list, acb, node);
     }
+    mutex_unlock(&lock);
 
-    paio_remove(acb);
+    posix_aio_state->nr_requests--;
+    qemu_aio_release(acb);
 }
 
 static AIOPool raw_aio_pool = {
@@ -608,12 +779,9 @@ BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
         acb->aio_iov = qiov->iov;
         acb->aio_niov = qiov->niov;
     }
-    acb->aio_nbytes = nb_sectors * 512;
+    acb->aio_nbytes = (size_t)nb_sectors * 512;
     acb->aio_offset = sector_num * 512;
 
-    acb->next = posix_aio_state->first_aio;
-    posix_aio_state->first_aio = acb;
-
     trace_paio_submit(acb, opaque, sector_num, nb_sectors, type);
     qemu_paio_submit(acb);
     return &acb->common;
@@ -632,8 +800,22 @@ BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, int fd,
     acb->aio_ioctl_buf = buf;
     acb->aio_ioctl_cmd = req;
 
-    acb->next = posix_aio_state->first_aio;
-    posix_aio_state->first_aio = acb;
+    qemu_paio_submit(acb);
+    return &acb->common;
+}
+
+BlockDriverAIOCB *paio_submit_func(BlockDriverState *bs, PaioFunc *func,
+        void *arg, BlockDriverCompletionFunc *cb, void *opaque)
+{
+    struct qemu_paiocb *acb;
+
+    acb = qemu_aio_get(&raw_aio_pool, bs, cb, opaque);
+    acb->aio_type = QEMU_AIO_FUNC;
+    acb->aio_fildes = -1;
+    acb->aio_func = func;
+    acb->aio_func_arg = arg;
+    acb->aio_nbytes = 0;
+    acb->aio_offset = 0;
 
     qemu_paio_submit(acb);
     return &acb->common;
@@ -650,9 +832,9 @@ int paio_init(void)
 
     s = g_malloc(sizeof(PosixAioState));
 
-    s->first_aio = NULL;
-    if (qemu_pipe(fds) == -1) {
-        fprintf(stderr, "failed to create pipe\n");
+    s->nr_requests = 0;
+    if (qemu_eventfd(fds) == -1) {
+        fprintf(stderr, "failed to create event notifier\n");
         g_free(s);
         return -1;
     }
@@ -673,7 +855,8 @@ int paio_init(void)
     if (ret)
         die2(ret, "pthread_attr_setdetachstate");
 
-    QTAILQ_INIT(&request_list);
+    QTAILQ_INIT(&queue_list);
+    QTAILQ_INIT(&completed_list);
     new_thread_bh = qemu_bh_new(spawn_thread_bh_fn, NULL);
 
     posix_aio_state = s;
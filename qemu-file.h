@@ -59,12 +59,29 @@ typedef int (QEMUFileRateLimit)(void *opaque);
 typedef int64_t (QEMUFileSetRateLimit)(void *opaque, int64_t new_rate);
 typedef int64_t (QEMUFileGetRateLimit)(void *opaque);
 
+/* Write the contents of an iovec to a file at the given position.  The
+ * iovec may point to memory owned by the caller (e.g. guest RAM), so the
+ * handler must either consume the data or copy it before returning.  The
+ * handler may modify the iovec array.  Return the number of bytes
+ * consumed, or a negative error number.
+ */
+typedef int (QEMUFileWritevBufferFunc)(void *opaque, struct iovec *iov,
+                                       int iovcnt, int64_t pos);
+
+/* Scatter a read from the given position over an iovec.  Like
+ * QEMUFileGetBufferFunc, return the number of bytes actually read.
+ */
+typedef int (QEMUFileReadvBufferFunc)(void *opaque, struct iovec *iov,
+                                      int iovcnt, int64_t pos);
+
 QEMUFile *qemu_fopen_ops(void *opaque, QEMUFilePutBufferFunc *put_buffer,
                          QEMUFileGetBufferFunc *get_buffer,
                          QEMUFileCloseFunc *close,
                          QEMUFileRateLimit *rate_limit,
                          QEMUFileSetRateLimit *set_rate_limit,
-                         QEMUFileGetRateLimit *get_rate_limit);
+                         QEMUFileGetRateLimit *get_rate_limit,
+                         QEMUFileWritevBufferFunc *writev_buffer,
+                         QEMUFileReadvBufferFunc *readv_buffer);
 QEMUFile *qemu_fopen(const char *filename, const char *mode);
 QEMUFile *qemu_fdopen(int fd, const char *mode);
 QEMUFile *qemu_fopen_socket(int fd);
@@ -75,6 +92,12 @@ void qemu_fflush(QEMUFile *f);
 int qemu_fclose(QEMUFile *f);
 void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size);
 void qemu_put_byte(QEMUFile *f, int v);
+/*
+ * Like qemu_put_buffer(), but the data is referenced rather than copied
+ * when the file supports vectored writes.  @buf must stay valid and
+ * unchanged until the next qemu_fflush() on @f.
+ */
+void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size);
 
 static inline void qemu_put_ubyte(QEMUFile *f, unsigned int v)
 {
@@ -87,6 +110,12 @@ void qemu_put_be16(QEMUFile *f, unsigned int v);
 void qemu_put_be32(QEMUFile *f, unsigned int v);
 void qemu_put_be64(QEMUFile *f, uint64_t v);
 int qemu_get_buffer(QEMUFile *f, uint8_t *buf, int size);
+/*
+ * Like qemu_get_buffer(), but reads straight into @buf instead of staging
+ * the data through the file's internal buffer when the file supports
+ * vectored reads.
+ */
+int qemu_get_buffer_direct(QEMUFile *f, uint8_t *buf, int size);
 int qemu_get_byte(QEMUFile *f);
 
 static inline unsigned int qemu_get_ubyte(QEMUFile *f)
@@ -233,6 +262,9 @@ static inline void qemu_get_sbe64s(QEMUFile *f, int64_t *pv)
 }
 
 int64_t qemu_ftell(QEMUFile *f);
+/* Whether positions in @f are stable storage offsets (e.g. the vmstate
+ * area of a snapshot) rather than just a count of bytes on a stream */
+int qemu_file_is_seekable(QEMUFile *f);
 int64_t qemu_fseek(QEMUFile *f, int64_t pos, int whence);
 
 #endif
@@ -27,7 +27,10 @@
 #include "osdep.h"
 #include "sysemu.h"
 #include "block_int.h"
+#include "qemu-timer.h"
+#include "host-utils.h"
 #include <stdio.h>
+#include <getopt.h>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -84,6 +87,25 @@ static void help(void)
            "  '-p' show progress of command (only certain commands)\n"
            "  '-S' indicates the consecutive number of bytes that must contain only zeros\n"
            "       for qemu-img to create a sparse image during conversion\n"
+           "  '-m' number of parallel coroutines for convert (1 to 16, default 8)\n"
+           "  '-W' allow convert to write the target out of order\n"
+           "  'ofmt' is the output format of map, 'human' (default) or 'json'\n"
+           "\n"
+           "Parameters to compare subcommand:\n"
+           "  '-f' first image format\n"
+           "  '-F' second image format\n"
+           "  '-s' run in strict mode - fail on different image size or sector allocation\n"
+           "\n"
+           "Parameters to bench subcommand:\n"
+           "  '-c' number of requests to send (default 75000)\n"
+           "  '-d' number of requests in flight at the same time (default 64)\n"
+           "  '-M' percentage of write requests, the others are reads (default 0)\n"
+           "  '-n' use native AIO (Linux only)\n"
+           "  '-r' use random offsets instead of sequential ones\n"
+           "  '-s' size of each request in bytes (default 4096)\n"
+           "  '-T' run for the given number of seconds instead of sending a fixed\n"
+           "       number of requests\n"
+           "  '-w' send write requests instead of read requests (same as -M 100)\n"
            "\n"
            "Parameters to snapshot subcommand:\n"
            "  'snapshot' is the name of the snapshot to create, apply or delete\n"
@@ -590,6 +612,8 @@ static int is_allocated_sectors_min(const uint8_t *buf, int n, int *pnum,
     return 1;
 }
 
+#define COMPARE_CHUNK_SECTORS 64
+
 /*
  * Compares two buffers sector by sector. Returns 0 if the first sector of both
  * buffers matches, non-zero otherwise.
@@ -608,11 +632,20 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
     }
 
     res = !!memcmp(buf1, buf2, 512);
-    for(i = 1; i < n; i++) {
-        buf1 += 512;
-        buf2 += 512;
+    i = 1;
+
+    /* Long runs of equal sectors are the common case; comparing them in
+     * bigger chunks lets memcmp() use its vectorized loop */
+    if (!res) {
+        while (i + COMPARE_CHUNK_SECTORS <= n &&
+               !memcmp(buf1 + i * 512, buf2 + i * 512,
+                       COMPARE_CHUNK_SECTORS * 512)) {
+            i += COMPARE_CHUNK_SECTORS;
+        }
+    }
 
-        if (!!memcmp(buf1, buf2, 512) != res) {
+    for(; i < n; i++) {
+        if (!!memcmp(buf1 + i * 512, buf2 + i * 512, 512) != res) {
             break;
         }
     }
@@ -622,25 +655,384 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
 }
 
 #define IO_BUF_SIZE (2 * 1024 * 1024)
+#define MAX_COROUTINES 16
+
+/*
+ * convert copies the image with several coroutines.  Each of them takes the
+ * next chunk of the image, reads it, and writes it to the target.  Unless
+ * out-of-order writes are allowed, a coroutine waits before writing until
+ * all chunks before its own have been written.
+ */
+
+enum ImgConvertBlockStatus {
+    BLK_DATA,
+    BLK_ZERO,
+    BLK_BACKING_FILE,
+};
+
+typedef struct ImgConvertState {
+    BlockDriverState **src;
+    int64_t *src_sectors;
+    int src_num;
+    int64_t total_sectors;
+    enum ImgConvertBlockStatus status;
+    int64_t sector_next_status;
+    BlockDriverState *target;
+    bool has_zero_init;
+    bool compressed;
+    bool target_has_backing;
+    int min_sparse;
+    int cluster_sectors;
+    int buf_sectors;
+    int num_coroutines;
+    int running_coroutines;
+    bool wr_in_order;
+    int64_t sector_num;         /* first sector that is not handed out yet */
+    int64_t wr_offs;            /* first sector that is not written yet */
+    Coroutine *co[MAX_COROUTINES];
+    int64_t wait_sector_num[MAX_COROUTINES];
+    CoMutex lock;
+    int ret;
+} ImgConvertState;
+
+static void convert_select_part(ImgConvertState *s, int64_t sector_num,
+                                int *src_cur, int64_t *src_cur_offset)
+{
+    *src_cur = 0;
+    *src_cur_offset = 0;
+    while (sector_num - *src_cur_offset >= s->src_sectors[*src_cur]) {
+        *src_cur_offset += s->src_sectors[*src_cur];
+        (*src_cur)++;
+        assert(*src_cur < s->src_num);
+    }
+}
+
+/*
+ * Returns the size of the next chunk, starting at sector_num, and sets
+ * s->status for it.  Only data is read from the source; zeroes are known
+ * from the allocation status and don't need to be read and scanned.
+ */
+static int coroutine_fn convert_iteration_sectors(ImgConvertState *s,
+                                                  int64_t sector_num)
+{
+    int64_t src_cur_offset;
+    int src_cur, ret, n;
+
+    if (s->compressed) {
+        /* Whole clusters are read and compressed, even across sources */
+        s->status = BLK_DATA;
+        return MIN(s->cluster_sectors, s->total_sectors - sector_num);
+    }
+
+    convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+
+    if (s->sector_next_status <= sector_num) {
+        BlockDriverState *bs = s->src[src_cur];
+        int64_t count = s->src_sectors[src_cur] -
+                        (sector_num - src_cur_offset);
+
+        count = MIN(count, INT_MAX / BDRV_SECTOR_SIZE);
+        ret = bdrv_co_is_allocated(bs, sector_num - src_cur_offset, count,
+                                   &n);
+        if (ret < 0) {
+            return ret;
+        }
+        assert(n > 0);
+
+        if (ret) {
+            s->status = BLK_DATA;
+        } else if (s->has_zero_init && s->target_has_backing) {
+            /* The output image is created as a copy on write image, assume
+               that sectors which are unallocated in the input image are
+               present in both the output's and input's base images */
+            s->status = BLK_BACKING_FILE;
+        } else if (!bs->backing_hd) {
+            s->status = BLK_ZERO;
+        } else {
+            s->status = BLK_DATA;
+        }
+        s->sector_next_status = sector_num + n;
+    }
+
+    n = s->sector_next_status - sector_num;
+    if (s->status == BLK_DATA || !s->has_zero_init) {
+        n = MIN(n, s->buf_sectors);
+    }
+    return n;
+}
+
+static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
+                                        int nb_sectors, uint8_t *buf)
+{
+    int64_t src_cur_offset;
+    int src_cur, n, ret;
+
+    while (nb_sectors > 0) {
+        QEMUIOVector qiov;
+        struct iovec iov;
+
+        convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+        n = MIN(nb_sectors,
+                s->src_sectors[src_cur] - (sector_num - src_cur_offset));
+
+        iov.iov_base = buf;
+        iov.iov_len = n << BDRV_SECTOR_BITS;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = bdrv_co_readv(s->src[src_cur], sector_num - src_cur_offset,
+                            n, &qiov);
+        if (ret < 0) {
+            error_report("error while reading sector %" PRId64 ": %s",
+                         sector_num - src_cur_offset, strerror(-ret));
+            return ret;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n << BDRV_SECTOR_BITS;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn convert_co_write(ImgConvertState *s,
+                                         int64_t sector_num, int nb_sectors,
+                                         uint8_t *buf,
+                                         enum ImgConvertBlockStatus status)
+{
+    int ret = 0, n;
+
+    while (nb_sectors > 0) {
+        n = nb_sectors;
+
+        switch (status) {
+        case BLK_BACKING_FILE:
+            break;
+
+        case BLK_DATA:
+            if (s->compressed) {
+                if (n < s->cluster_sectors) {
+                    memset(buf + n * BDRV_SECTOR_SIZE, 0,
+                           (s->cluster_sectors - n) * BDRV_SECTOR_SIZE);
+                }
+                if (!buffer_is_zero(buf,
+                                    s->cluster_sectors * BDRV_SECTOR_SIZE)) {
+                    ret = bdrv_co_write_compressed(s->target, sector_num, buf,
+                                                   s->cluster_sectors);
+                }
+                break;
+            }
+
+            /* If the output image is being created as a copy on write image,
+               copy all sectors even the ones containing only NUL bytes,
+               because they may differ from the sectors in the base image.
+
+               If the output is to a host device, we also write out
+               sectors that are entirely 0, since whatever data was
+               already there is garbage, not 0s. */
+            if (!s->has_zero_init || s->target_has_backing ||
+                is_allocated_sectors_min(buf, n, &n, s->min_sparse)) {
+                QEMUIOVector qiov;
+                struct iovec iov = {
+                    .iov_base = buf,
+                    .iov_len = n << BDRV_SECTOR_BITS,
+                };
+
+                qemu_iovec_init_external(&qiov, &iov, 1);
+                ret = bdrv_co_writev(s->target, sector_num, n, &qiov);
+            }
+            break;
+
+        case BLK_ZERO:
+            if (!s->has_zero_init) {
+                ret = bdrv_co_write_zeroes(s->target, sector_num, n);
+            }
+            break;
+        }
+
+        if (ret < 0) {
+            error_report("error while %s sector %" PRId64 ": %s",
+                         s->compressed ? "compressing" : "writing",
+                         sector_num, strerror(-ret));
+            return ret;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+
+    return 0;
+}
+
+static void convert_wake_waiting(ImgConvertState *s, int64_t sector_num)
+{
+    int i;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] && s->wait_sector_num[i] >= 0 &&
+            (sector_num < 0 || s->wait_sector_num[i] == sector_num)) {
+            qemu_coroutine_enter(s->co[i], NULL);
+        }
+    }
+}
+
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    uint8_t *buf;
+    int ret, i, index = -1;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
+        }
+    }
+    assert(index >= 0);
+
+    buf = qemu_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    for (;;) {
+        enum ImgConvertBlockStatus status;
+        int64_t sector_num;
+        int n;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        n = convert_iteration_sectors(s, s->sector_num);
+        if (n < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            error_report("error while reading allocation status of sector %"
+                         PRId64 ": %s", s->sector_num, strerror(-n));
+            s->ret = n;
+            break;
+        }
+        sector_num = s->sector_num;
+        status = s->status;
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (status == BLK_DATA) {
+            ret = convert_co_read(s, sector_num, n, buf);
+            if (ret < 0) {
+                s->ret = ret;
+                break;
+            }
+        }
+
+        if (s->wr_in_order) {
+            while (s->wr_offs != sector_num) {
+                if (s->ret != -EINPROGRESS) {
+                    goto out;
+                }
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            s->wait_sector_num[index] = -1;
+        }
+
+        ret = convert_co_write(s, sector_num, n, buf, status);
+        if (ret < 0) {
+            s->ret = ret;
+            break;
+        }
+
+        qemu_progress_print(100.0 * n / s->total_sectors, 100);
+
+        if (s->wr_in_order) {
+            /* Let the coroutine that waits for this chunk go on */
+            s->wr_offs = sector_num + n;
+            convert_wake_waiting(s, s->wr_offs);
+        }
+    }
+
+out:
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->wait_sector_num[index] = -1;
+    s->running_coroutines--;
+
+    if (s->ret != -EINPROGRESS) {
+        /* Nobody is going to write the chunks they are waiting for */
+        convert_wake_waiting(s, -1);
+    } else if (s->running_coroutines == 0) {
+        s->ret = 0;
+    }
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    BlockDriverInfo bdi;
+    int ret, i;
+
+    if (s->compressed) {
+        ret = bdrv_get_info(s->target, &bdi);
+        if (ret < 0) {
+            error_report("could not get block driver info");
+            return ret;
+        }
+        if (bdi.cluster_size <= 0 || bdi.cluster_size > IO_BUF_SIZE) {
+            error_report("invalid cluster size");
+            return -EINVAL;
+        }
+        s->cluster_sectors = bdi.cluster_size >> BDRV_SECTOR_BITS;
+        s->buf_sectors = s->cluster_sectors;
+    } else {
+        s->buf_sectors = IO_BUF_SIZE >> BDRV_SECTOR_BITS;
+    }
+
+    s->has_zero_init = bdrv_has_zero_init(s->target);
+    s->sector_num = 0;
+    s->wr_offs = 0;
+    s->sector_next_status = 0;
+    s->ret = -EINPROGRESS;
+    qemu_co_mutex_init(&s->lock);
+
+    s->running_coroutines = s->num_coroutines;
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->wait_sector_num[i] = -1;
+    }
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy);
+        qemu_coroutine_enter(s->co[i], s);
+    }
+
+    while (s->ret == -EINPROGRESS) {
+        qemu_aio_wait();
+    }
+
+    if (s->compressed && s->ret == 0) {
+        /* signal EOF to align */
+        ret = bdrv_write_compressed(s->target, 0, NULL, 0);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return s->ret;
+}
 
 static int img_convert(int argc, char **argv)
 {
-    int c, ret = 0, n, n1, bs_n, bs_i, compress, cluster_size, cluster_sectors;
+    int c, ret = 0, bs_n, bs_i, compress;
     int progress = 0, flags;
     const char *fmt, *out_fmt, *cache, *out_baseimg, *out_filename;
     BlockDriver *drv, *proto_drv;
     BlockDriverState **bs = NULL, *out_bs = NULL;
-    int64_t total_sectors, nb_sectors, sector_num, bs_offset;
-    uint64_t bs_sectors;
-    uint8_t * buf = NULL;
-    const uint8_t *buf1;
-    BlockDriverInfo bdi;
+    int64_t total_sectors;
+    int64_t *bs_sectors = NULL;
     QEMUOptionParameter *param = NULL, *create_options = NULL;
     QEMUOptionParameter *out_baseimg_param;
     char *options = NULL;
     const char *snapshot_name = NULL;
-    float local_progress;
     int min_sparse = 8; /* Need at least 4k of zeros for sparse detection */
+    int num_coroutines = 8;
+    bool wr_in_order = true;
+    ImgConvertState state;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -648,7 +1040,7 @@ static int img_convert(int argc, char **argv)
     out_baseimg = NULL;
     compress = 0;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:");
+        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:m:W");
         if (c == -1) {
             break;
         }
@@ -702,6 +1094,22 @@ static int img_convert(int argc, char **argv)
         case 't':
             cache = optarg;
             break;
+        case 'm':
+        {
+            char *end;
+            num_coroutines = strtol(optarg, &end, 10);
+            if (*end || num_coroutines < 1 ||
+                num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number "
+                             "of coroutines is between 1 and %d",
+                             MAX_COROUTINES);
+                return 1;
+            }
+            break;
+        }
+        case 'W':
+            wr_in_order = false;
+            break;
         }
     }
 
@@ -730,17 +1138,21 @@ static int img_convert(int argc, char **argv)
     qemu_progress_print(0, 100);
 
     bs = g_malloc0(bs_n * sizeof(BlockDriverState *));
+    bs_sectors = g_malloc0(bs_n * sizeof(int64_t));
 
     total_sectors = 0;
     for (bs_i = 0; bs_i < bs_n; bs_i++) {
+        uint64_t nb_sectors;
+
         bs[bs_i] = bdrv_new_open(argv[optind + bs_i], fmt, BDRV_O_FLAGS);
         if (!bs[bs_i]) {
             error_report("Could not open '%s'", argv[optind + bs_i]);
             ret = -1;
             goto out;
         }
-        bdrv_get_geometry(bs[bs_i], &bs_sectors);
-        total_sectors += bs_sectors;
+        bdrv_get_geometry(bs[bs_i], &nb_sectors);
+        bs_sectors[bs_i] = nb_sectors;
+        total_sectors += nb_sectors;
     }
 
     if (snapshot_name != NULL) {
@@ -806,7 +1218,7 @@ static int img_convert(int argc, char **argv)
         QEMUOptionParameter *preallocation =
             get_option_parameter(param, BLOCK_OPT_PREALLOC);
 
-        if (!drv->bdrv_write_compressed) {
+        if (!drv->bdrv_co_write_compressed) {
             error_report("Compression not supported for this file format");
             ret = -1;
             goto out;
@@ -858,185 +1270,25 @@ static int img_convert(int argc, char **argv)
         goto out;
     }
 
-    bs_i = 0;
-    bs_offset = 0;
-    bdrv_get_geometry(bs[0], &bs_sectors);
-    buf = qemu_blockalign(out_bs, IO_BUF_SIZE);
-
-    if (compress) {
-        ret = bdrv_get_info(out_bs, &bdi);
-        if (ret < 0) {
-            error_report("could not get block driver info");
-            goto out;
-        }
-        cluster_size = bdi.cluster_size;
-        if (cluster_size <= 0 || cluster_size > IO_BUF_SIZE) {
-            error_report("invalid cluster size");
-            ret = -1;
-            goto out;
-        }
-        cluster_sectors = cluster_size >> 9;
-        sector_num = 0;
-
-        nb_sectors = total_sectors;
-        local_progress = (float)100 /
-            (nb_sectors / MIN(nb_sectors, cluster_sectors));
-
-        for(;;) {
-            int64_t bs_num;
-            int remainder;
-            uint8_t *buf2;
-
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0)
-                break;
-            if (nb_sectors >= cluster_sectors)
-                n = cluster_sectors;
-            else
-                n = nb_sectors;
-
-            bs_num = sector_num - bs_offset;
-            assert (bs_num >= 0);
-            remainder = n;
-            buf2 = buf;
-            while (remainder > 0) {
-                int nlow;
-                while (bs_num == bs_sectors) {
-                    bs_i++;
-                    assert (bs_i < bs_n);
-                    bs_offset += bs_sectors;
-                    bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                    bs_num = 0;
-                    /* printf("changing part: sector_num=%" PRId64 ", "
-                       "bs_i=%d, bs_offset=%" PRId64 ", bs_sectors=%" PRId64
-                       "\n", sector_num, bs_i, bs_offset, bs_sectors); */
-                }
-                assert (bs_num < bs_sectors);
-
-                nlow = (remainder > bs_sectors - bs_num) ? bs_sectors - bs_num : remainder;
-
-                ret = bdrv_read(bs[bs_i], bs_num, buf2, nlow);
-                if (ret < 0) {
-                    error_report("error while reading sector %" PRId64 ": %s",
-                                 bs_num, strerror(-ret));
-                    goto out;
-                }
-
-                buf2 += nlow * 512;
-                bs_num += nlow;
-
-                remainder -= nlow;
-            }
-            assert (remainder == 0);
-
-            if (n < cluster_sectors) {
-                memset(buf + n * 512, 0, cluster_size - n * 512);
-            }
-            if (!buffer_is_zero(buf, cluster_size)) {
-                ret = bdrv_write_compressed(out_bs, sector_num, buf,
-                                            cluster_sectors);
-                if (ret != 0) {
-                    error_report("error while compressing sector %" PRId64
-                                 ": %s", sector_num, strerror(-ret));
-                    goto out;
-                }
-            }
-            sector_num += n;
-            qemu_progress_print(local_progress, 100);
-        }
-        /* signal EOF to align */
-        bdrv_write_compressed(out_bs, 0, NULL, 0);
-    } else {
-        int has_zero_init = bdrv_has_zero_init(out_bs);
-
-        sector_num = 0; // total number of sectors converted so far
-        nb_sectors = total_sectors - sector_num;
-        local_progress = (float)100 /
-            (nb_sectors / MIN(nb_sectors, IO_BUF_SIZE / 512));
-
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0) {
-                break;
-            }
-            if (nb_sectors >= (IO_BUF_SIZE / 512)) {
-                n = (IO_BUF_SIZE / 512);
-            } else {
-                n = nb_sectors;
-            }
-
-            while (sector_num - bs_offset >= bs_sectors) {
-                bs_i ++;
-                assert (bs_i < bs_n);
-                bs_offset += bs_sectors;
-                bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                /* printf("changing part: sector_num=%" PRId64 ", bs_i=%d, "
-                  "bs_offset=%" PRId64 ", bs_sectors=%" PRId64 "\n",
-                   sector_num, bs_i, bs_offset, bs_sectors); */
-            }
-
-            if (n > bs_offset + bs_sectors - sector_num) {
-                n = bs_offset + bs_sectors - sector_num;
-            }
-
-            if (has_zero_init) {
-                /* If the output image is being created as a copy on write image,
-                   assume that sectors which are unallocated in the input image
-                   are present in both the output's and input's base images (no
-                   need to copy them). */
-                if (out_baseimg) {
-                    if (!bdrv_is_allocated(bs[bs_i], sector_num - bs_offset,
-                                           n, &n1)) {
-                        sector_num += n1;
-                        continue;
-                    }
-                    /* The next 'n1' sectors are allocated in the input image. Copy
-                       only those as they may be followed by unallocated sectors. */
-                    n = n1;
-                }
-            } else {
-                n1 = n;
-            }
+    state = (ImgConvertState) {
+        .src                = bs,
+        .src_sectors        = bs_sectors,
+        .src_num            = bs_n,
+        .total_sectors      = total_sectors,
+        .target             = out_bs,
+        .compressed         = compress,
+        .target_has_backing = out_baseimg != NULL,
+        .min_sparse         = min_sparse,
+        .num_coroutines     = num_coroutines,
+        .wr_in_order        = wr_in_order,
+    };
+    ret = convert_do_copy(&state);
 
-            ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
-            if (ret < 0) {
-                error_report("error while reading sector %" PRId64 ": %s",
-                             sector_num - bs_offset, strerror(-ret));
-                goto out;
-            }
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                /* If the output image is being created as a copy on write image,
-                   copy all sectors even the ones containing only NUL bytes,
-                   because they may differ from the sectors in the base image.
-
-                   If the output is to a host device, we also write out
-                   sectors that are entirely 0, since whatever data was
-                   already there is garbage, not 0s. */
-                if (!has_zero_init || out_baseimg ||
-                    is_allocated_sectors_min(buf1, n, &n1, min_sparse)) {
-                    ret = bdrv_write(out_bs, sector_num, buf1, n1);
-                    if (ret < 0) {
-                        error_report("error while writing sector %" PRId64
-                                     ": %s", sector_num, strerror(-ret));
-                        goto out;
-                    }
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
-            qemu_progress_print(local_progress, 100);
-        }
-    }
 out:
     qemu_progress_end();
     free_option_parameters(create_options);
     free_option_parameters(param);
-    qemu_vfree(buf);
+    g_free(bs_sectors);
     if (out_bs) {
         bdrv_delete(out_bs);
     }
@@ -1533,45 +1785,470 @@ out:
     return 0;
 }
 
-static int img_resize(int argc, char **argv)
+/*
+ * Returns the block status of the sectors starting at sector_num, like
+ * bdrv_get_block_status(), but looks through the backing chain for sectors
+ * that are unallocated in bs.  *file is set to the image in the chain that
+ * the data comes from and *depth to its position in the chain (0 for bs).
+ */
+static int64_t get_block_status(BlockDriverState *bs, int64_t sector_num,
+                                int nb_sectors, int *pnum, int *depth,
+                                BlockDriverState **file)
 {
-    int c, ret, relative;
-    const char *filename, *fmt, *size;
-    int64_t n, total_size;
-    BlockDriverState *bs = NULL;
-    QEMUOptionParameter *param;
-    QEMUOptionParameter resize_options[] = {
-        {
-            .name = BLOCK_OPT_SIZE,
-            .type = OPT_SIZE,
-            .help = "Virtual disk size"
-        },
-        { NULL }
-    };
-
-    /* Remove size from argv manually so that negative numbers are not treated
-     * as options by getopt. */
-    if (argc < 3) {
-        help();
-        return 1;
-    }
-
-    size = argv[--argc];
+    int64_t ret;
 
-    /* Parse getopt arguments */
-    fmt = NULL;
-    for(;;) {
-        c = getopt(argc, argv, "f:h");
-        if (c == -1) {
-            break;
+    *depth = 0;
+    for (;;) {
+        ret = bdrv_get_block_status(bs, sector_num, nb_sectors, pnum);
+        if (ret < 0) {
+            return ret;
         }
-        switch(c) {
-        case '?':
-        case 'h':
-            help();
-            break;
-        case 'f':
-            fmt = optarg;
+        if (*pnum == 0) {
+            return -EIO;
+        }
+        if ((ret & (BDRV_BLOCK_DATA | BDRV_BLOCK_ZERO)) || !bs->backing_hd) {
+            break;
+        }
+        bs = bs->backing_hd;
+        nb_sectors = *pnum;
+        (*depth)++;
+    }
+
+    *file = bs;
+    return ret;
+}
+
+/*
+ * Checks that the sectors of bs starting at sector_num are all zero.  Returns
+ * -1 if they are, the first sector that isn't zero otherwise.
+ */
+static int64_t check_zero_sectors(BlockDriverState *bs, int64_t sector_num,
+                                  int nb_sectors, uint8_t *buf, int *err)
+{
+    int ret, pnum;
+
+    ret = bdrv_read(bs, sector_num, buf, nb_sectors);
+    if (ret < 0) {
+        *err = ret;
+        return -1;
+    }
+
+    ret = is_allocated_sectors(buf, nb_sectors, &pnum);
+    if (ret || pnum != nb_sectors) {
+        return sector_num + (ret ? 0 : pnum);
+    }
+    return -1;
+}
+
+/*
+ * Compares the guest visible content of two images.  Sectors that read as
+ * zeroes in both images, or that come from the same offset in the same
+ * backing file, are not read at all.
+ *
+ * Returns 0 if the images are identical, 1 if they differ and 2 on errors.
+ */
+static int img_compare(int argc, char **argv)
+{
+    const char *fmt1 = NULL, *fmt2 = NULL, *filename1, *filename2;
+    BlockDriverState *bs1 = NULL, *bs2 = NULL, *bs_long, *file1, *file2;
+    int64_t total_sectors1, total_sectors2, total_sectors, sector_num;
+    int64_t status1, status2, mismatch;
+    uint8_t *buf1 = NULL, *buf2 = NULL;
+    int c, ret, nb_sectors, pnum1, pnum2, pnum, depth;
+    int progress = 0, strict = 0;
+    float local_progress;
+
+    for (;;) {
+        c = getopt(argc, argv, "hpf:F:s");
+        if (c == -1) {
+            break;
+        }
+        switch (c) {
+        case '?':
+        case 'h':
+            help();
+            break;
+        case 'f':
+            fmt1 = optarg;
+            break;
+        case 'F':
+            fmt2 = optarg;
+            break;
+        case 'p':
+            progress = 1;
+            break;
+        case 's':
+            strict = 1;
+            break;
+        }
+    }
+
+    if (optind + 2 != argc) {
+        help();
+    }
+    filename1 = argv[optind++];
+    filename2 = argv[optind++];
+
+    ret = 2;
+    qemu_progress_init(progress, 2.0);
+    qemu_progress_print(0, 100);
+
+    bs1 = bdrv_new_open(filename1, fmt1, BDRV_O_FLAGS);
+    if (!bs1) {
+        goto out;
+    }
+    bs2 = bdrv_new_open(filename2, fmt2, BDRV_O_FLAGS);
+    if (!bs2) {
+        goto out;
+    }
+
+    buf1 = qemu_blockalign(bs1, IO_BUF_SIZE);
+    buf2 = qemu_blockalign(bs2, IO_BUF_SIZE);
+
+    total_sectors1 = bdrv_getlength(bs1) >> BDRV_SECTOR_BITS;
+    total_sectors2 = bdrv_getlength(bs2) >> BDRV_SECTOR_BITS;
+    if (total_sectors1 < 0 || total_sectors2 < 0) {
+        error_report("Could not get the size of the images");
+        goto out;
+    }
+
+    if (strict && total_sectors1 != total_sectors2) {
+        printf("Strict mode: Image size mismatch!\n");
+        ret = 1;
+        goto out;
+    }
+
+    total_sectors = MAX(total_sectors1, total_sectors2);
+    local_progress = total_sectors ?
+        (float)100 / (total_sectors / MIN(total_sectors,
+                                          IO_BUF_SIZE / BDRV_SECTOR_SIZE)) :
+        0;
+    total_sectors = MIN(total_sectors1, total_sectors2);
+
+    for (sector_num = 0; sector_num < total_sectors; sector_num += nb_sectors) {
+        nb_sectors = MIN(total_sectors - sector_num,
+                         IO_BUF_SIZE / BDRV_SECTOR_SIZE);
+
+        status1 = get_block_status(bs1, sector_num, nb_sectors, &pnum1,
+                                   &depth, &file1);
+        if (status1 < 0) {
+            error_report("Sector allocation test failed for %s: %s",
+                         filename1, strerror(-status1));
+            goto out;
+        }
+        status2 = get_block_status(bs2, sector_num, nb_sectors, &pnum2,
+                                   &depth, &file2);
+        if (status2 < 0) {
+            error_report("Sector allocation test failed for %s: %s",
+                         filename2, strerror(-status2));
+            goto out;
+        }
+        nb_sectors = MIN(pnum1, pnum2);
+
+        if (strict && (status1 & BDRV_BLOCK_DATA) !=
+                      (status2 & BDRV_BLOCK_DATA)) {
+            printf("Strict mode: Offset %" PRId64 " allocation mismatch!\n",
+                   sector_num << BDRV_SECTOR_BITS);
+            ret = 1;
+            goto out;
+        }
+
+        mismatch = -1;
+        if (!(status1 & BDRV_BLOCK_DATA) && !(status2 & BDRV_BLOCK_DATA)) {
+            /* Zero in both images */
+        } else if ((status1 & status2 & BDRV_BLOCK_OFFSET_VALID) &&
+                   (status1 & BDRV_BLOCK_OFFSET_MASK) ==
+                   (status2 & BDRV_BLOCK_OFFSET_MASK) &&
+                   file1->drv == file2->drv &&
+                   !strcmp(file1->filename, file2->filename)) {
+            /* The same data of a shared backing file */
+        } else if (!(status1 & BDRV_BLOCK_DATA)) {
+            mismatch = check_zero_sectors(bs2, sector_num, nb_sectors, buf2,
+                                          &ret);
+        } else if (!(status2 & BDRV_BLOCK_DATA)) {
+            mismatch = check_zero_sectors(bs1, sector_num, nb_sectors, buf1,
+                                          &ret);
+        } else {
+            ret = bdrv_read(bs1, sector_num, buf1, nb_sectors);
+            if (ret >= 0) {
+                ret = bdrv_read(bs2, sector_num, buf2, nb_sectors);
+            }
+            if (ret >= 0) {
+                if (compare_sectors(buf1, buf2, nb_sectors, &pnum)) {
+                    mismatch = sector_num;
+                } else if (pnum != nb_sectors) {
+                    mismatch = sector_num + pnum;
+                }
+            }
+        }
+
+        if (ret < 0) {
+            error_report("Error while reading offset %" PRId64 ": %s",
+                         sector_num << BDRV_SECTOR_BITS, strerror(-ret));
+            ret = 2;
+            goto out;
+        }
+        if (mismatch >= 0) {
+            printf("Content mismatch at offset %" PRId64 "!\n",
+                   mismatch << BDRV_SECTOR_BITS);
+            ret = 1;
+            goto out;
+        }
+        qemu_progress_print(local_progress * nb_sectors /
+                            (IO_BUF_SIZE / BDRV_SECTOR_SIZE), 100);
+    }
+
+    /* The part that only one of the images has must be zero */
+    if (total_sectors1 != total_sectors2) {
+        bs_long = total_sectors1 > total_sectors2 ? bs1 : bs2;
+        total_sectors = MAX(total_sectors1, total_sectors2);
+        for (; sector_num < total_sectors; sector_num += nb_sectors) {
+            nb_sectors = MIN(total_sectors - sector_num,
+                             IO_BUF_SIZE / BDRV_SECTOR_SIZE);
+            status1 = get_block_status(bs_long, sector_num, nb_sectors,
+                                       &nb_sectors, &depth, &file1);
+            if (status1 < 0) {
+                error_report("Sector allocation test failed for %s: %s",
+                             bs_long->filename, strerror(-status1));
+                ret = 2;
+                goto out;
+            }
+
+            if (status1 & BDRV_BLOCK_DATA) {
+                mismatch = check_zero_sectors(bs_long, sector_num, nb_sectors,
+                                              buf1, &ret);
+                if (ret < 0) {
+                    error_report("Error while reading offset %" PRId64 ": %s",
+                                 sector_num << BDRV_SECTOR_BITS,
+                                 strerror(-ret));
+                    ret = 2;
+                    goto out;
+                }
+                if (mismatch >= 0) {
+                    printf("Content mismatch at offset %" PRId64 "!\n",
+                           mismatch << BDRV_SECTOR_BITS);
+                    ret = 1;
+                    goto out;
+                }
+            }
+            qemu_progress_print(local_progress * nb_sectors /
+                                (IO_BUF_SIZE / BDRV_SECTOR_SIZE), 100);
+        }
+    }
+
+    printf("Images are identical.\n");
+    ret = 0;
+
+out:
+    qemu_progress_end();
+    qemu_vfree(buf1);
+    qemu_vfree(buf2);
+    if (bs1) {
+        bdrv_delete(bs1);
+    }
+    if (bs2) {
+        bdrv_delete(bs2);
+    }
+    return ret;
+}
+
+typedef struct MapEntry {
+    int64_t start;
+    int64_t length;
+    int64_t flags;
+    int depth;
+    BlockDriverState *file;
+} MapEntry;
+
+enum {
+    OUTPUT_HUMAN,
+    OUTPUT_JSON,
+};
+
+static void dump_map_entry(int output, MapEntry *e, bool first)
+{
+    switch (output) {
+    case OUTPUT_HUMAN:
+        /* Only data that is stored somewhere has a mapping */
+        if ((e->flags & BDRV_BLOCK_DATA) &&
+            (e->flags & BDRV_BLOCK_OFFSET_VALID)) {
+            printf("%#-16" PRIx64 "%#-16" PRIx64 "%#-16" PRIx64 "%s\n",
+                   e->start, e->length,
+                   (int64_t)(e->flags & BDRV_BLOCK_OFFSET_MASK),
+                   e->file->file ? e->file->file->filename :
+                                   e->file->filename);
+        }
+        break;
+    case OUTPUT_JSON:
+        printf("%s{ \"start\": %" PRId64 ", \"length\": %" PRId64 ", "
+               "\"depth\": %d, \"zero\": %s, \"data\": %s",
+               first ? "[" : ",\n",
+               e->start, e->length, e->depth,
+               (e->flags & BDRV_BLOCK_ZERO) ? "true" : "false",
+               (e->flags & BDRV_BLOCK_DATA) ? "true" : "false");
+        if (e->flags & BDRV_BLOCK_OFFSET_VALID) {
+            printf(", \"offset\": %" PRId64,
+                   (int64_t)(e->flags & BDRV_BLOCK_OFFSET_MASK));
+        }
+        printf(" }");
+        break;
+    }
+}
+
+/*
+ * Prints which parts of the image are allocated in which image of the
+ * backing chain, and where their data is stored.
+ */
+static int img_map(int argc, char **argv)
+{
+    static const struct option long_options[] = {
+        { "help", no_argument, NULL, 'h' },
+        { "format", required_argument, NULL, 'f' },
+        { "output", required_argument, NULL, 'o' },
+        { NULL, 0, NULL, 0 }
+    };
+    const char *filename, *fmt = NULL;
+    BlockDriverState *bs, *file;
+    MapEntry curr = { .length = 0 }, next;
+    int64_t total_sectors, sector_num, flags;
+    int c, nb_sectors, depth, ret = 0;
+    int output = OUTPUT_HUMAN;
+
+    for (;;) {
+        c = getopt_long(argc, argv, "hf:", long_options, NULL);
+        if (c == -1) {
+            break;
+        }
+        switch (c) {
+        case '?':
+        case 'h':
+            help();
+            break;
+        case 'f':
+            fmt = optarg;
+            break;
+        case 'o':
+            if (!strcmp(optarg, "json")) {
+                output = OUTPUT_JSON;
+            } else if (!strcmp(optarg, "human")) {
+                output = OUTPUT_HUMAN;
+            } else {
+                error_report("--output must be used with human or json as "
+                             "argument.");
+                return 1;
+            }
+            break;
+        }
+    }
+    if (optind >= argc) {
+        help();
+    }
+    filename = argv[optind++];
+
+    bs = bdrv_new_open(filename, fmt, BDRV_O_FLAGS);
+    if (!bs) {
+        return 1;
+    }
+
+    if (output == OUTPUT_HUMAN) {
+        printf("%-16s%-16s%-16s%s\n", "Offset", "Length", "Mapped to", "File");
+    }
+
+    total_sectors = bdrv_getlength(bs) >> BDRV_SECTOR_BITS;
+    if (total_sectors < 0) {
+        error_report("Could not get the size of %s", filename);
+        bdrv_delete(bs);
+        return 1;
+    }
+
+    for (sector_num = 0; sector_num < total_sectors; sector_num += nb_sectors) {
+        nb_sectors = MIN(total_sectors - sector_num,
+                         INT_MAX / BDRV_SECTOR_SIZE);
+        flags = get_block_status(bs, sector_num, nb_sectors, &nb_sectors,
+                                 &depth, &file);
+        if (flags < 0) {
+            error_report("Could not read the allocation status of %s: %s",
+                         filename, strerror(-flags));
+            ret = 1;
+            break;
+        }
+
+        next = (MapEntry) {
+            .start  = sector_num << BDRV_SECTOR_BITS,
+            .length = (int64_t)nb_sectors << BDRV_SECTOR_BITS,
+            .flags  = flags,
+            .depth  = depth,
+            .file   = file,
+        };
+
+        /* Merge with the previous extent if it continues it */
+        if (curr.length != 0 && curr.depth == next.depth &&
+            curr.file == next.file &&
+            (curr.flags & ~BDRV_BLOCK_OFFSET_MASK) ==
+            (next.flags & ~BDRV_BLOCK_OFFSET_MASK) &&
+            (!(curr.flags & BDRV_BLOCK_OFFSET_VALID) ||
+             (curr.flags & BDRV_BLOCK_OFFSET_MASK) + curr.length ==
+             (next.flags & BDRV_BLOCK_OFFSET_MASK))) {
+            curr.length += next.length;
+            continue;
+        }
+
+        if (curr.length != 0) {
+            dump_map_entry(output, &curr, curr.start == 0);
+        }
+        curr = next;
+    }
+
+    if (curr.length != 0) {
+        dump_map_entry(output, &curr, curr.start == 0);
+    }
+    if (output == OUTPUT_JSON) {
+        printf("%s]\n", total_sectors ? "" : "[");
+    }
+
+    bdrv_delete(bs);
+    return ret;
+}
+
+static int img_resize(int argc, char **argv)
+{
+    int c, ret, relative;
+    const char *filename, *fmt, *size;
+    int64_t n, total_size;
+    BlockDriverState *bs = NULL;
+    QEMUOptionParameter *param;
+    QEMUOptionParameter resize_options[] = {
+        {
+            .name = BLOCK_OPT_SIZE,
+            .type = OPT_SIZE,
+            .help = "Virtual disk size"
+        },
+        { NULL }
+    };
+
+    /* Remove size from argv manually so that negative numbers are not treated
+     * as options by getopt. */
+    if (argc < 3) {
+        help();
+        return 1;
+    }
+
+    size = argv[--argc];
+
+    /* Parse getopt arguments */
+    fmt = NULL;
+    for(;;) {
+        c = getopt(argc, argv, "f:h");
+        if (c == -1) {
+            break;
+        }
+        switch(c) {
+        case '?':
+        case 'h':
+            help();
+            break;
+        case 'f':
+            fmt = optarg;
             break;
         }
     }
@@ -1647,6 +2324,394 @@ out:
     return 0;
 }
 
+/*
+ * Request latencies are collected in a histogram with BENCH_HIST_SUB
+ * buckets for each power of two, which keeps the error of the reported
+ * percentiles below 1/BENCH_HIST_SUB however long the benchmark runs.
+ */
+#define BENCH_HIST_SUB_BITS 4
+#define BENCH_HIST_SUB      (1 << BENCH_HIST_SUB_BITS)
+#define BENCH_HIST_SIZE     (64 * BENCH_HIST_SUB)
+
+typedef struct BenchStats {
+    int64_t nr_reads;
+    int64_t nr_writes;
+    int64_t lat_min;
+    int64_t lat_max;
+    double lat_total;
+    uint64_t hist[BENCH_HIST_SIZE];
+} BenchStats;
+
+typedef struct BenchData BenchData;
+
+typedef struct BenchRequest {
+    BenchData *b;
+    int64_t start;
+    bool write;
+} BenchRequest;
+
+struct BenchData {
+    BlockDriverState *bs;
+    int bufsize;
+    int64_t image_sectors;
+    int nrreq;
+    int n;                      /* requests that are still to be completed */
+    int n_issued;               /* requests that are still to be issued */
+    QEMUIOVector *qiov;
+    int in_flight;
+    int64_t sector;
+    int write_percent;
+    bool random;
+    int64_t deadline;           /* stop issuing requests after this time */
+    BenchStats stats;
+    BenchRequest *free_reqs[];
+};
+
+static int bench_hist_index(uint64_t ns)
+{
+    int shift;
+
+    if (ns < BENCH_HIST_SUB) {
+        return ns;
+    }
+    shift = 63 - clz64(ns) - BENCH_HIST_SUB_BITS;
+    return (shift + 1) * BENCH_HIST_SUB +
+           ((ns >> shift) & (BENCH_HIST_SUB - 1));
+}
+
+/* Returns the middle of the range of latencies that go into bucket i */
+static double bench_hist_value(int i)
+{
+    int shift = i / BENCH_HIST_SUB - 1;
+
+    if (shift < 0) {
+        return i;
+    }
+    return (double)((uint64_t)(BENCH_HIST_SUB + i % BENCH_HIST_SUB) << shift)
+           + ((1ULL << shift) - 1) / 2.0;
+}
+
+static double bench_percentile(BenchStats *st, int64_t total, double p)
+{
+    uint64_t sum = 0;
+    int i;
+
+    for (i = 0; i < BENCH_HIST_SIZE; i++) {
+        sum += st->hist[i];
+        if (sum >= total * p / 100 && sum > 0) {
+            return bench_hist_value(i);
+        }
+    }
+    return st->lat_max;
+}
+
+static void bench_record(BenchRequest *req)
+{
+    BenchStats *st = &req->b->stats;
+    int64_t lat = get_clock() - req->start;
+
+    if (req->write) {
+        st->nr_writes++;
+    } else {
+        st->nr_reads++;
+    }
+    if (st->nr_reads + st->nr_writes == 1 || lat < st->lat_min) {
+        st->lat_min = lat;
+    }
+    if (lat > st->lat_max) {
+        st->lat_max = lat;
+    }
+    st->lat_total += lat;
+    st->hist[bench_hist_index(lat)]++;
+}
+
+static int64_t bench_random(int64_t max)
+{
+    uint64_t r = ((uint64_t)random() << 31) ^ random();
+    return r % max;
+}
+
+static void bench_cb(void *opaque, int ret);
+
+static void bench_submit(BenchData *b)
+{
+    BlockDriverAIOCB *acb;
+    BenchRequest *req;
+    int nb_sectors = b->bufsize >> BDRV_SECTOR_BITS;
+
+    while (b->n_issued > 0 && b->in_flight < b->nrreq) {
+        if (b->deadline && get_clock() >= b->deadline) {
+            /* Only wait for the requests in flight */
+            b->n -= b->n_issued;
+            b->n_issued = 0;
+            break;
+        }
+
+        if (b->random) {
+            b->sector = bench_random(b->image_sectors / nb_sectors) *
+                        nb_sectors;
+        } else if (b->sector + nb_sectors > b->image_sectors) {
+            b->sector = 0;
+        }
+
+        req = b->free_reqs[b->in_flight];
+        req->write = b->write_percent == 100 ||
+                     (b->write_percent && random() % 100 < b->write_percent);
+        req->start = get_clock();
+        if (req->write) {
+            acb = bdrv_aio_writev(b->bs, b->sector, b->qiov, nb_sectors,
+                                  bench_cb, req);
+        } else {
+            acb = bdrv_aio_readv(b->bs, b->sector, b->qiov, nb_sectors,
+                                 bench_cb, req);
+        }
+        if (!acb) {
+            error_report("Failed to issue request");
+            exit(EXIT_FAILURE);
+        }
+        b->in_flight++;
+        b->n_issued--;
+        b->sector += nb_sectors;
+    }
+}
+
+static void bench_cb(void *opaque, int ret)
+{
+    BenchRequest *req = opaque;
+    BenchData *b = req->b;
+
+    if (ret < 0) {
+        error_report("Failed request: %s", strerror(-ret));
+        exit(EXIT_FAILURE);
+    }
+
+    bench_record(req);
+    b->n--;
+    b->in_flight--;
+    b->free_reqs[b->in_flight] = req;
+
+    bench_submit(b);
+}
+
+static int img_bench(int argc, char **argv)
+{
+    int c, ret, flags, i;
+    const char *filename, *fmt, *cache;
+    BlockDriverState *bs;
+    BenchData *data;
+    BenchRequest *reqs;
+    int count = 75000;
+    int depth = 64;
+    size_t bufsize = 4096;
+    int write_percent = 0;
+    bool random_offsets = false;
+    double duration = 0;
+    struct iovec iov;
+    QEMUIOVector qiov;
+    int64_t start, elapsed, total;
+    double seconds;
+    BenchStats *st;
+
+    fmt = NULL;
+    cache = BDRV_DEFAULT_CACHE;
+    flags = 0;
+    for (;;) {
+        c = getopt(argc, argv, "c:d:f:hM:nrs:t:T:w");
+        if (c == -1) {
+            break;
+        }
+        switch (c) {
+        case '?':
+        case 'h':
+            help();
+            break;
+        case 'c':
+        {
+            char *end;
+            errno = 0;
+            count = strtoul(optarg, &end, 0);
+            if (errno || *end || count <= 0) {
+                error_report("Invalid request count specified");
+                return 1;
+            }
+            break;
+        }
+        case 'd':
+        {
+            char *end;
+            errno = 0;
+            depth = strtoul(optarg, &end, 0);
+            if (errno || *end || depth <= 0) {
+                error_report("Invalid queue depth specified");
+                return 1;
+            }
+            break;
+        }
+        case 'f':
+            fmt = optarg;
+            break;
+        case 'M':
+        {
+            char *end;
+            long val;
+            errno = 0;
+            val = strtol(optarg, &end, 0);
+            if (errno || *end || end == optarg || val < 0 || val > 100) {
+                error_report("Invalid write percentage specified");
+                return 1;
+            }
+            write_percent = val;
+            break;
+        }
+        case 'n':
+            flags |= BDRV_O_NATIVE_AIO;
+            break;
+        case 'r':
+            random_offsets = true;
+            break;
+        case 's':
+        {
+            int64_t sval;
+            char *end;
+
+            sval = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (sval <= 0 || sval > INT_MAX || *end ||
+                (sval & (BDRV_SECTOR_SIZE - 1))) {
+                error_report("Invalid buffer size specified");
+                return 1;
+            }
+            bufsize = sval;
+            break;
+        }
+        case 't':
+            cache = optarg;
+            break;
+        case 'T':
+        {
+            char *end;
+            duration = strtod(optarg, &end);
+            if (*end || duration <= 0) {
+                error_report("Invalid duration specified");
+                return 1;
+            }
+            break;
+        }
+        case 'w':
+            write_percent = 100;
+            break;
+        }
+    }
+    if (optind >= argc) {
+        help();
+    }
+    filename = argv[optind++];
+
+    if (write_percent) {
+        flags |= BDRV_O_RDWR;
+    }
+    ret = bdrv_parse_cache_flags(cache, &flags);
+    if (ret < 0) {
+        error_report("Invalid cache option: %s", cache);
+        return 1;
+    }
+
+    bs = bdrv_new_open(filename, fmt, flags);
+    if (!bs) {
+        return 1;
+    }
+
+    if (duration) {
+        /* The time limit ends the run, not the number of requests */
+        count = INT_MAX;
+    }
+
+    data = g_malloc0(sizeof(*data) + depth * sizeof(data->free_reqs[0]));
+    reqs = g_malloc0(depth * sizeof(*reqs));
+    *data = (BenchData) {
+        .bs             = bs,
+        .bufsize        = bufsize,
+        .image_sectors  = bdrv_getlength(bs) >> BDRV_SECTOR_BITS,
+        .nrreq          = depth,
+        .n              = count,
+        .n_issued       = count,
+        .qiov           = &qiov,
+        .write_percent  = write_percent,
+        .random         = random_offsets,
+    };
+    for (i = 0; i < depth; i++) {
+        reqs[i].b = data;
+        data->free_reqs[i] = &reqs[i];
+    }
+    if (data->image_sectors < (bufsize >> BDRV_SECTOR_BITS)) {
+        error_report("Image is smaller than the buffer size");
+        g_free(reqs);
+        g_free(data);
+        bdrv_delete(bs);
+        return 1;
+    }
+
+    iov.iov_base = qemu_blockalign(bs, bufsize);
+    iov.iov_len = bufsize;
+    memset(iov.iov_base, 0xa5, bufsize);
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    /* Use the same sequence of offsets and request types in every run */
+    srandom(1);
+
+    if (duration) {
+        printf("Sending %s requests for %.1f seconds",
+               random_offsets ? "random" : "sequential", duration);
+    } else {
+        printf("Sending %d %s requests", count,
+               random_offsets ? "random" : "sequential");
+    }
+    if (write_percent == 0 || write_percent == 100) {
+        printf(" (%s)", write_percent ? "write" : "read");
+    } else {
+        printf(" (%d%% write)", write_percent);
+    }
+    printf(", %d bytes each, %d in parallel\n", (int) bufsize, depth);
+
+    start = get_clock();
+    if (duration) {
+        data->deadline = start + (int64_t)(duration * 1000000000.0);
+    }
+    bdrv_io_plug(bs);
+    bench_submit(data);
+    bdrv_io_unplug(bs);
+    while (data->n > 0) {
+        qemu_aio_wait();
+    }
+    elapsed = get_clock() - start;
+    seconds = elapsed / 1000000000.0;
+    st = &data->stats;
+    total = st->nr_reads + st->nr_writes;
+
+    printf("Run completed in %.3f seconds, %.1f MB/s.\n", seconds,
+           (double) total * bufsize / (1024 * 1024) / seconds);
+    printf("  requests: %" PRId64 " (%" PRId64 " reads, %" PRId64 " writes), "
+           "%.1f IOPS\n", total, st->nr_reads, st->nr_writes,
+           total / seconds);
+    if (total) {
+        printf("  latency (us): min %.1f, avg %.1f, max %.1f\n",
+               st->lat_min / 1000.0,
+               st->lat_total / total / 1000.0,
+               st->lat_max / 1000.0);
+        printf("  percentiles (us): 50th %.1f, 90th %.1f, 99th %.1f, "
+               "99.9th %.1f\n",
+               bench_percentile(st, total, 50) / 1000.0,
+               bench_percentile(st, total, 90) / 1000.0,
+               bench_percentile(st, total, 99) / 1000.0,
+               bench_percentile(st, total, 99.9) / 1000.0);
+    }
+
+    qemu_vfree(iov.iov_base);
+    g_free(reqs);
+    g_free(data);
+    bdrv_delete(bs);
+    return 0;
+}
+
 static const img_cmd_t img_cmds[] = {
 #define DEF(option, callback, arg_string)        \
     { option, callback },
@@ -19,6 +19,7 @@
 #include "qemu-common.h"
 #include "block.h"
 #include "nbd.h"
+#include "qemu_socket.h"
 
 #include <stdarg.h>
 #include <stdio.h>
@@ -32,6 +33,7 @@
 #include <signal.h>
 #include <libgen.h>
 #include <pthread.h>
+#include <sys/wait.h>
 
 #define SOCKET_PATH    "/var/lock/qemu-nbd-%s"
 
@@ -43,6 +45,8 @@ static bool sigterm_reported;
 static bool nbd_started;
 static int shared = 1;
 static int nb_fds;
+static int nb_workers = 1;
+static bool is_worker;
 
 static void usage(const char *name)
 {
@@ -63,6 +67,8 @@ static void usage(const char *name)
 "  -d, --disconnect     disconnect the specified device\n"
 "  -e, --shared=NUM     device can be shared by NUM clients (default '1')\n"
 "  -t, --persistent     don't exit on the last connection\n"
+"  -W, --workers=NUM    serve clients from NUM processes (read-only exports\n"
+"                       only, implies --persistent)\n"
 "  -v, --verbose        display extra debugging information\n"
 "  -h, --help           display this help and exit\n"
 "  -V, --version        output version information and exit\n"
@@ -247,6 +253,78 @@ out:
     return (void *) EXIT_FAILURE;
 }
 
+/*
+ * The block layer may only be used by one thread, so the worker mode runs
+ * several processes instead.  They share the listening socket and each of
+ * them opens the image by itself, which is only safe as long as nobody
+ * writes to it.  The parent process just waits for the workers and returns
+ * only in the workers.
+ */
+static void start_workers(int fd)
+{
+    pid_t *pids = g_new0(pid_t, nb_workers);
+    bool killed = false;
+    int i, status, nb_running = 0, ret = EXIT_SUCCESS;
+    pid_t pid;
+
+    /* Workers that lose the race for a new connection must not block */
+    socket_set_nonblock(fd);
+
+    for (i = 0; i < nb_workers; i++) {
+        pid = fork();
+        if (pid == 0) {
+            is_worker = true;
+            g_free(pids);
+            return;
+        }
+        if (pid < 0) {
+            warn("Failed to start worker");
+            ret = EXIT_FAILURE;
+            sigterm_reported = true;
+            break;
+        }
+        pids[i] = pid;
+        nb_running++;
+    }
+
+    while (nb_running > 0) {
+        if (sigterm_reported && !killed) {
+            for (i = 0; i < nb_workers; i++) {
+                if (pids[i] > 0) {
+                    kill(pids[i], SIGTERM);
+                }
+            }
+            killed = true;
+        }
+
+        pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (i = 0; i < nb_workers; i++) {
+            if (pids[i] == pid) {
+                pids[i] = 0;
+                nb_running--;
+            }
+        }
+
+        /* If one worker fails, e.g. to open the image, stop all of them */
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+            ret = EXIT_FAILURE;
+            sigterm_reported = true;
+        }
+    }
+
+    g_free(pids);
+    if (sockpath) {
+        unlink(sockpath);
+    }
+    exit(ret);
+}
+
 static int nbd_can_accept(void *opaque)
 {
     return nb_fds < shared;
@@ -281,7 +359,7 @@ int main(int argc, char **argv)
     char *device = NULL;
     int port = NBD_DEFAULT_PORT;
     off_t fd_size;
-    const char *sopt = "hVb:o:p:rsnP:c:dvk:e:t";
+    const char *sopt = "hVb:o:p:rsnP:c:dvk:e:tW:";
     struct option lopt[] = {
         { "help", 0, NULL, 'h' },
         { "version", 0, NULL, 'V' },
@@ -297,6 +375,7 @@ int main(int argc, char **argv)
         { "nocache", 0, NULL, 'n' },
         { "shared", 1, NULL, 'e' },
         { "persistent", 0, NULL, 't' },
+        { "workers", 1, NULL, 'W' },
         { "verbose", 0, NULL, 'v' },
         { NULL, 0, NULL, 0 }
     };
@@ -383,6 +462,15 @@ int main(int argc, char **argv)
 	case 't':
 	    persistent = 1;
 	    break;
+        case 'W':
+            nb_workers = strtol(optarg, &end, 0);
+            if (*end) {
+                errx(EXIT_FAILURE, "Invalid number of workers '%s'", optarg);
+            }
+            if (nb_workers < 1) {
+                errx(EXIT_FAILURE, "Number of workers must be greater than 0");
+            }
+            break;
         case 'v':
             verbose = 1;
             break;
@@ -406,6 +494,16 @@ int main(int argc, char **argv)
              argv[0]);
     }
 
+    if (nb_workers > 1) {
+        if (!(nbdflags & NBD_FLAG_READ_ONLY)) {
+            errx(EXIT_FAILURE, "--workers requires a read-only export");
+        }
+        if (device || disconnect) {
+            errx(EXIT_FAILURE, "--workers can't be used with a local device");
+        }
+        persistent = 1;
+    }
+
     if (disconnect) {
         fd = open(argv[optind], O_RDWR);
         if (fd < 0) {
@@ -477,6 +575,19 @@ int main(int argc, char **argv)
         snprintf(sockpath, 128, SOCKET_PATH, basename(device));
     }
 
+    fd = -1;
+    if (nb_workers > 1) {
+        if (sockpath) {
+            fd = unix_socket_incoming(sockpath);
+        } else {
+            fd = tcp_socket_incoming(bindto, port);
+        }
+        if (fd < 0) {
+            return 1;
+        }
+        start_workers(fd);
+    }
+
     bdrv_init();
     atexit(bdrv_close_all);
 
@@ -499,14 +610,15 @@ int main(int argc, char **argv)
 
     exp = nbd_export_new(bs, dev_offset, fd_size, nbdflags);
 
-    if (sockpath) {
-        fd = unix_socket_incoming(sockpath);
-    } else {
-        fd = tcp_socket_incoming(bindto, port);
-    }
-
     if (fd < 0) {
-        return 1;
+        if (sockpath) {
+            fd = unix_socket_incoming(sockpath);
+        } else {
+            fd = tcp_socket_incoming(bindto, port);
+        }
+        if (fd < 0) {
+            return 1;
+        }
     }
 
     if (device) {
@@ -537,7 +649,7 @@ int main(int argc, char **argv)
     } while (!sigterm_reported && (persistent || !nbd_started || nb_fds > 0));
 
     nbd_export_close(exp);
-    if (sockpath) {
+    if (sockpath && !is_worker) {
         unlink(sockpath);
     }
 
@@ -142,6 +142,7 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
+    "       [,l2-cache-size=size][,refcount-cache-size=size]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]][[,iops=i]|[[,iops_rd=r][,iops_wr=w]]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
@@ -196,6 +197,10 @@ Open drive @option{file} as read-only. Guest write attempts will fail.
 @item copy-on-read=@var{copy-on-read}
 @var{copy-on-read} is "on" or "off" and enables whether to copy read backing
 file sectors into the image file.
+@item l2-cache-size=@var{size},refcount-cache-size=@var{size}
+Set the maximum amount of memory that the image format may use to cache L2
+tables and refcount blocks (qcow2 only).  By default, qcow2 caches enough L2
+tables to cover the whole image, up to 32 MB, and four refcount blocks.
 @end table
 
 By default, writethrough caching is used for all block device.  This means that
@@ -1894,11 +1899,15 @@ QEMU supports NBD (Network Block Devices) both using TCP protocol as well
 as Unix Domain Sockets.
 
 Syntax for specifying a NBD device using TCP
-``nbd:<server-ip>:<port>[:exportname=<export>]''
+``nbd:<server-ip>:<port>[:connections=<n>][:readahead=on|off][:exportname=<export>]''
 
 Syntax for specifying a NBD device using Unix Domain Sockets
-``nbd:unix:<domain-socket>[:exportname=<export>]''
+``nbd:unix:<domain-socket>[:connections=<n>][:readahead=on|off][:exportname=<export>]''
 
+@option{connections} opens up to 16 connections to the server and spreads
+the requests over them; the server must accept that many clients.
+@option{readahead} controls whether data is read ahead when the guest reads
+sequentially (default on).
 
 Example for TCP
 @example
@@ -1937,6 +1946,25 @@ qemu-system-i386 --drive file=sheepdog:192.0.2.1:30000:MyVirtualMachine
 
 See also @url{http://http://www.osrg.net/sheepdog/}.
 
+@item Read cache
+A read cache keeps the data read from a slow image, for example one that is
+accessed with HTTP or NBD, in a local cache file, so that it is only fetched
+once.  The cache file is created if it doesn't exist, and is kept when QEMU
+exits.  It must not be used by several QEMU processes at the same time.
+
+Syntax for specifying a read cache
+``readcache:<cache-file>:<image>''
+
+With cache=writethrough and cache=directsync, writes are made to the image
+and update the cache.  With the other cache modes, they are only made to the
+cache file, and are written back to the image when the guest flushes its
+disk cache.
+
+Example
+@example
+qemu-system-i386 --drive file=readcache:/var/cache/qemu/debian.cache:http://192.0.2.1/debian.qcow2,format=qcow2,snapshot=on
+@end example
+
 @end table
 ETEXI
 
@@ -469,7 +469,7 @@ EQMP
 
     {
         .name       = "migrate",
-        .args_type  = "detach:-d,blk:-b,inc:-i,uri:s",
+        .args_type  = "detach:-d,blk:-b,inc:-i,uri:s,channels:i?",
         .mhandler.cmd_new = qmp_marshal_input_migrate,
     },
 
@@ -484,6 +484,8 @@ Arguments:
 - "blk": block migration, full disk copy (json-bool, optional)
 - "inc": incremental disk copy (json-bool, optional)
 - "uri": Destination URI (json-string)
+- "channels": number of TCP connections used to send guest RAM, tcp: URIs
+              only (json-int, optional, default 1)
 
 Example:
 
@@ -565,6 +567,60 @@ Example:
 -> { "execute": "migrate_set_downtime", "arguments": { "value": 0.1 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "migrate-set-capabilities",
+        .args_type  = "capabilities:O",
+        .params     = "capability:s,state:b",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_capabilities,
+    },
+
+SQMP
+migrate-set-capabilities
+------------------------
+
+Enable or disable optional features of the migration stream.  Only enable
+a capability if the destination understands it.
+
+Arguments:
+
+- "capabilities": json-array of json-objects with
+     - "capability": capability name (json-string)
+          - Possible values: "zero-blocks", "ram-runs"
+     - "state": true to enable the capability (json-bool)
+
+Example:
+
+-> { "execute": "migrate-set-capabilities", "arguments":
+     { "capabilities": [ { "capability": "zero-blocks", "state": true } ] } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-migrate-capabilities",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_capabilities,
+    },
+
+SQMP
+query-migrate-capabilities
+--------------------------
+
+Return the state of all migration capabilities.
+
+Returns a json-array of json-objects with:
+
+- "capability": capability name (json-string)
+- "state": true if the capability is enabled (json-bool)
+
+Example:
+
+-> { "execute": "query-migrate-capabilities" }
+<- { "return": [ { "capability": "zero-blocks", "state": false },
+                 { "capability": "ram-runs", "state": false } ] }
+
 EQMP
 
     {
@@ -703,6 +759,12 @@ EQMP
         .args_type  = "device:B",
         .mhandler.cmd_new = qmp_marshal_input_block_job_cancel,
     },
+
+    {
+        .name       = "block-job-complete",
+        .args_type  = "device:B",
+        .mhandler.cmd_new = qmp_marshal_input_block_job_complete,
+    },
     {
         .name       = "transaction",
         .args_type  = "actions:q",
@@ -789,6 +851,54 @@ Example:
                                                         "format": "qcow2" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "drive-mirror",
+        .args_type  = "sync:s,device:B,target:s,speed:o?,mode:s?,format:s?",
+        .mhandler.cmd_new = qmp_marshal_input_drive_mirror,
+    },
+
+SQMP
+drive-mirror
+------------
+
+Start mirroring a block device's writes to a new destination. target
+specifies the target of the new image. If the file exists, or if it is
+a device, it will be used as the new destination for writes. If it does
+not exist, a new file will be created. format specifies the format of
+the mirror image, default is to probe if mode='existing', else the format
+of the source.
+
+The job copies the device in the background and emits BLOCK_JOB_READY
+once the target is in sync.  From then on it keeps copying new guest
+writes until it is ended with block-job-complete, which switches the
+device over to the target, or with block-job-cancel, which keeps using
+the original image.
+
+Arguments:
+
+- "device": device name to operate on (json-string)
+- "target": name of new image file (json-string)
+- "format": format of new image (json-string, optional)
+- "mode": how an image file should be created into the target
+  file/device (NewImageMode, optional, default 'absolute-paths')
+- "speed": maximum speed of the mirroring job, in bytes per second
+  (json-int, optional)
+- "sync": what parts of the disk image should be copied to the destination;
+  possibilities include "full" for all the disk, "top" for only the sectors
+  allocated in the topmost image, or "none" to only replicate new I/O
+  (MirrorSyncMode).  A new image created for "none" uses the current image
+  of the device as its backing file.
+
+Example:
+
+-> { "execute": "drive-mirror", "arguments": { "device": "ide-hd0",
+                                               "target": "/some/place/my-image",
+                                               "sync": "full",
+                                               "format": "qcow2" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1334,6 +1444,32 @@ Each json-object contain the following:
     - "flush_total_time_ns": total time spend on cache flushes in nano-seconds (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "rd_merged": read requests merged into an adjacent one (json-int)
+    - "wr_merged": write requests merged into an adjacent one (json-int)
+    - "l2_cache_hits": L2 table lookups served by the metadata cache of the
+                       image format (json-int, optional)
+    - "l2_cache_misses": L2 tables read from the image file (json-int,
+                         optional)
+    - "refcount_cache_hits": refcount block lookups served by the metadata
+                             cache of the image format (json-int, optional)
+    - "refcount_cache_misses": refcount blocks read from the image file
+                               (json-int, optional)
+    - "readahead_hits": read requests served from data read ahead by the
+                        NBD client (json-int, optional)
+    - "readahead_bytes": bytes read ahead by the NBD client (json-int,
+                         optional)
+    - "nbd_connections": statistics of each connection of the NBD client
+                         (json-array, optional), each one containing:
+        - "requests": requests sent over the connection (json-int)
+        - "in_flight": requests waiting for a reply (json-int)
+        - "total_time_ns": total time spent waiting for replies in
+                           nano-seconds (json-int)
+        - "max_time_ns": longest time a request waited for its reply in
+                         nano-seconds (json-int)
+    - "read_cache_hits": clusters read from the local cache file of a
+                         readcache image (json-int, optional)
+    - "read_cache_misses": clusters fetched from the image cached by a
+                           readcache image (json-int, optional)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -81,6 +81,7 @@
 #include "migration.h"
 #include "qemu_socket.h"
 #include "qemu-queue.h"
+#include "iov.h"
 #include "qemu-timer.h"
 #include "cpus.h"
 #include "memory.h"
@@ -159,6 +160,11 @@ void qemu_announce_self(void)
 /* savevm/loadvm support */
 
 #define IO_BUF_SIZE 32768
+#define MAX_IOV_SIZE MIN(IOV_MAX, 64)
+
+/* Bytes of the following record that qemu_get_buffer_direct() prefetches
+ * into buf together with the payload */
+#define IO_DIRECT_TAIL 256
 
 struct QEMUFile {
     QEMUFilePutBufferFunc *put_buffer;
@@ -167,8 +173,11 @@ struct QEMUFile {
     QEMUFileRateLimit *rate_limit;
     QEMUFileSetRateLimit *set_rate_limit;
     QEMUFileGetRateLimit *get_rate_limit;
+    QEMUFileWritevBufferFunc *writev_buffer;
+    QEMUFileReadvBufferFunc *readv_buffer;
     void *opaque;
     int is_write;
+    int seekable;
 
     int64_t buf_offset; /* start of buffer when writing, end of buffer
                            when reading */
@@ -176,6 +185,11 @@ struct QEMUFile {
     int buf_size; /* 0 when writing */
     uint8_t buf[IO_BUF_SIZE];
 
+    /* With writev_buffer, pending output in stream order: slices of buf
+     * and caller-owned memory queued by qemu_put_buffer_async() */
+    struct iovec iov[MAX_IOV_SIZE];
+    unsigned int iovcnt;
+
     int last_error;
 };
 
@@ -206,6 +220,27 @@ static int socket_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
     return len;
 }
 
+static int socket_readv_buffer(void *opaque, struct iovec *iov, int iovcnt,
+                               int64_t pos)
+{
+    QEMUFileSocket *s = opaque;
+    ssize_t len;
+
+    do {
+#ifndef _WIN32
+        len = readv(s->fd, iov, iovcnt);
+#else
+        len = qemu_recv(s->fd, iov[0].iov_base, iov[0].iov_len, 0);
+#endif
+    } while (len == -1 && socket_error() == EINTR);
+
+    if (len == -1) {
+        len = -socket_error();
+    }
+
+    return len;
+}
+
 static int socket_close(void *opaque)
 {
     QEMUFileSocket *s = opaque;
@@ -270,10 +305,10 @@ QEMUFile *qemu_popen(FILE *stdio_file, const char *mode)
 
     if(mode[0] == 'r') {
         s->file = qemu_fopen_ops(s, NULL, stdio_get_buffer, stdio_pclose, 
-				 NULL, NULL, NULL);
+				 NULL, NULL, NULL, NULL, NULL);
     } else {
         s->file = qemu_fopen_ops(s, stdio_put_buffer, NULL, stdio_pclose, 
-				 NULL, NULL, NULL);
+				 NULL, NULL, NULL, NULL, NULL);
     }
     return s->file;
 }
@@ -319,10 +354,10 @@ QEMUFile *qemu_fdopen(int fd, const char *mode)
 
     if(mode[0] == 'r') {
         s->file = qemu_fopen_ops(s, NULL, stdio_get_buffer, stdio_fclose, 
-				 NULL, NULL, NULL);
+				 NULL, NULL, NULL, NULL, NULL);
     } else {
         s->file = qemu_fopen_ops(s, stdio_put_buffer, NULL, stdio_fclose, 
-				 NULL, NULL, NULL);
+				 NULL, NULL, NULL, NULL, NULL);
     }
     return s->file;
 
@@ -336,8 +371,8 @@ QEMUFile *qemu_fopen_socket(int fd)
     QEMUFileSocket *s = g_malloc0(sizeof(QEMUFileSocket));
 
     s->fd = fd;
-    s->file = qemu_fopen_ops(s, NULL, socket_get_buffer, socket_close, 
-			     NULL, NULL, NULL);
+    s->file = qemu_fopen_ops(s, NULL, socket_get_buffer, socket_close,
+                             NULL, NULL, NULL, NULL, socket_readv_buffer);
     return s->file;
 }
 
@@ -375,10 +410,10 @@ QEMUFile *qemu_fopen(const char *filename, const char *mode)
     
     if(mode[0] == 'w') {
         s->file = qemu_fopen_ops(s, file_put_buffer, NULL, stdio_fclose, 
-				 NULL, NULL, NULL);
+				 NULL, NULL, NULL, NULL, NULL);
     } else {
         s->file = qemu_fopen_ops(s, NULL, file_get_buffer, stdio_fclose, 
-			       NULL, NULL, NULL);
+			       NULL, NULL, NULL, NULL, NULL);
     }
     return s->file;
 fail:
@@ -398,6 +433,43 @@ static int block_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
     return bdrv_load_vmstate(opaque, buf, pos, size);
 }
 
+static int block_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
+                               int64_t pos)
+{
+    int64_t done = 0;
+    int i, ret;
+
+    for (i = 0; i < iovcnt; i++) {
+        ret = bdrv_save_vmstate(opaque, iov[i].iov_base, pos + done,
+                                iov[i].iov_len);
+        if (ret < 0) {
+            return ret;
+        }
+        done += iov[i].iov_len;
+    }
+    return done;
+}
+
+static int block_readv_buffer(void *opaque, struct iovec *iov, int iovcnt,
+                              int64_t pos)
+{
+    int64_t done = 0;
+    int i, ret;
+
+    for (i = 0; i < iovcnt; i++) {
+        ret = bdrv_load_vmstate(opaque, iov[i].iov_base, pos + done,
+                                iov[i].iov_len);
+        if (ret < 0) {
+            return done ? done : ret;
+        }
+        done += ret;
+        if (ret < iov[i].iov_len) {
+            break;
+        }
+    }
+    return done;
+}
+
 static int bdrv_fclose(void *opaque)
 {
     return 0;
@@ -405,10 +477,16 @@ static int bdrv_fclose(void *opaque)
 
 static QEMUFile *qemu_fopen_bdrv(BlockDriverState *bs, int is_writable)
 {
+    QEMUFile *f;
+
     if (is_writable)
-        return qemu_fopen_ops(bs, block_put_buffer, NULL, bdrv_fclose, 
-			      NULL, NULL, NULL);
-    return qemu_fopen_ops(bs, NULL, block_get_buffer, bdrv_fclose, NULL, NULL, NULL);
+        f = qemu_fopen_ops(bs, block_put_buffer, NULL, bdrv_fclose,
+                           NULL, NULL, NULL, block_writev_buffer, NULL);
+    else
+        f = qemu_fopen_ops(bs, NULL, block_get_buffer, bdrv_fclose,
+                           NULL, NULL, NULL, NULL, block_readv_buffer);
+    f->seekable = 1;
+    return f;
 }
 
 QEMUFile *qemu_fopen_ops(void *opaque, QEMUFilePutBufferFunc *put_buffer,
@@ -416,7 +494,9 @@ QEMUFile *qemu_fopen_ops(void *opaque, QEMUFilePutBufferFunc *put_buffer,
                          QEMUFileCloseFunc *close,
                          QEMUFileRateLimit *rate_limit,
                          QEMUFileSetRateLimit *set_rate_limit,
-                         QEMUFileGetRateLimit *get_rate_limit)
+                         QEMUFileGetRateLimit *get_rate_limit,
+                         QEMUFileWritevBufferFunc *writev_buffer,
+                         QEMUFileReadvBufferFunc *readv_buffer)
 {
     QEMUFile *f;
 
@@ -429,6 +509,8 @@ QEMUFile *qemu_fopen_ops(void *opaque, QEMUFilePutBufferFunc *put_buffer,
     f->rate_limit = rate_limit;
     f->set_rate_limit = set_rate_limit;
     f->get_rate_limit = get_rate_limit;
+    f->writev_buffer = writev_buffer;
+    f->readv_buffer = readv_buffer;
     f->is_write = 0;
 
     return f;
@@ -462,6 +544,24 @@ static void qemu_file_set_if_error(QEMUFile *f, int ret)
  */
 void qemu_fflush(QEMUFile *f)
 {
+    if (f->writev_buffer) {
+        if (f->is_write && f->iovcnt > 0) {
+            size_t expect = iov_size(f->iov, f->iovcnt);
+            int len;
+
+            len = f->writev_buffer(f->opaque, f->iov, f->iovcnt,
+                                   f->buf_offset);
+            if (len > 0) {
+                f->buf_offset += expect;
+            } else {
+                qemu_file_set_error(f, -EINVAL);
+            }
+            f->buf_index = 0;
+            f->iovcnt = 0;
+        }
+        return;
+    }
+
     if (!f->put_buffer)
         return;
 
@@ -550,6 +650,25 @@ void qemu_file_put_notify(QEMUFile *f)
     f->put_buffer(f->opaque, NULL, 0, 0);
 }
 
+/* Queue @size bytes at @buf for the next writev_buffer call, merging
+ * with the previous slice when the two are contiguous. */
+static void add_to_iovec(QEMUFile *f, const uint8_t *buf, int size)
+{
+    struct iovec *last = f->iovcnt > 0 ? &f->iov[f->iovcnt - 1] : NULL;
+
+    if (last && buf == (uint8_t *)last->iov_base + last->iov_len) {
+        last->iov_len += size;
+    } else {
+        f->iov[f->iovcnt].iov_base = (uint8_t *)buf;
+        f->iov[f->iovcnt].iov_len = size;
+        f->iovcnt++;
+    }
+
+    if (f->iovcnt >= MAX_IOV_SIZE) {
+        qemu_fflush(f);
+    }
+}
+
 void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
 {
     int l;
@@ -567,6 +686,9 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
         memcpy(f->buf + f->buf_index, buf, l);
         f->is_write = 1;
         f->buf_index += l;
+        if (f->writev_buffer) {
+            add_to_iovec(f, f->buf + f->buf_index - l, l);
+        }
         buf += l;
         size -= l;
         if (f->buf_index >= IO_BUF_SIZE)
@@ -574,6 +696,27 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
     }
 }
 
+void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size)
+{
+    if (!f->writev_buffer) {
+        qemu_put_buffer(f, buf, size);
+        return;
+    }
+
+    if (!f->last_error && f->is_write == 0 && f->buf_index > 0) {
+        fprintf(stderr,
+                "Attempted to write to buffer while read buffer is not empty\n");
+        abort();
+    }
+
+    if (f->last_error || size <= 0) {
+        return;
+    }
+
+    f->is_write = 1;
+    add_to_iovec(f, buf, size);
+}
+
 void qemu_put_byte(QEMUFile *f, int v)
 {
     if (!f->last_error && f->is_write == 0 && f->buf_index > 0) {
@@ -584,6 +727,9 @@ void qemu_put_byte(QEMUFile *f, int v)
 
     f->buf[f->buf_index++] = v;
     f->is_write = 1;
+    if (f->writev_buffer) {
+        add_to_iovec(f, f->buf + f->buf_index - 1, 1);
+    }
     if (f->buf_index >= IO_BUF_SIZE)
         qemu_fflush(f);
 }
@@ -643,6 +789,62 @@ int qemu_get_buffer(QEMUFile *f, uint8_t *buf, int size)
     return done;
 }
 
+int qemu_get_buffer_direct(QEMUFile *f, uint8_t *buf, int size)
+{
+    struct iovec iov[2];
+    int pending;
+    int done;
+
+    if (!f->readv_buffer || f->is_write) {
+        return qemu_get_buffer(f, buf, size);
+    }
+
+    /* Consume what is already buffered first */
+    pending = MIN(f->buf_size - f->buf_index, size);
+    if (pending > 0) {
+        memcpy(buf, f->buf + f->buf_index, pending);
+        f->buf_index += pending;
+    }
+    done = pending;
+    if (done == size) {
+        return done;
+    }
+
+    /* The buffer is now empty.  Read the rest of the payload straight into
+     * the destination, and let the same call pick up the start of the next
+     * record so that it does not cost another read. */
+    f->buf_index = 0;
+    f->buf_size = 0;
+    while (done < size) {
+        int len;
+
+        iov[0].iov_base = buf + done;
+        iov[0].iov_len = size - done;
+        iov[1].iov_base = f->buf;
+        iov[1].iov_len = IO_DIRECT_TAIL;
+
+        len = f->readv_buffer(f->opaque, iov, 2, f->buf_offset);
+        if (len == 0) {
+            f->last_error = -EIO;
+            break;
+        } else if (len < 0) {
+            if (len != -EAGAIN) {
+                qemu_file_set_error(f, len);
+            }
+            break;
+        }
+
+        f->buf_offset += len;
+        if (len > size - done) {
+            f->buf_size = len - (size - done);
+            len = size - done;
+        }
+        done += len;
+    }
+
+    return done;
+}
+
 static int qemu_peek_byte(QEMUFile *f, int offset)
 {
     int index = f->buf_index + offset;
@@ -670,8 +872,16 @@ int qemu_get_byte(QEMUFile *f)
     return result;
 }
 
+int qemu_file_is_seekable(QEMUFile *f)
+{
+    return f->seekable;
+}
+
 int64_t qemu_ftell(QEMUFile *f)
 {
+    if (f->writev_buffer && f->is_write) {
+        return f->buf_offset + iov_size(f->iov, f->iovcnt);
+    }
     return f->buf_offset - f->buf_size + f->buf_index;
 }
 
@@ -2041,11 +2251,75 @@ static int del_existing_snapshots(Monitor *mon, const char *name)
     return 0;
 }
 
+/* Look a snapshot up by id only; bdrv_snapshot_find() also matches names */
+static int snapshot_find_by_id(BlockDriverState *bs, QEMUSnapshotInfo *sn_info,
+                               const char *id)
+{
+    QEMUSnapshotInfo *sn_tab, *sn;
+    int nb_sns, i, ret;
+
+    ret = -ENOENT;
+    nb_sns = bdrv_snapshot_list(bs, &sn_tab);
+    if (nb_sns < 0) {
+        return ret;
+    }
+    for (i = 0; i < nb_sns; i++) {
+        sn = &sn_tab[i];
+        if (!strcmp(sn->id_str, id)) {
+            *sn_info = *sn;
+            ret = 0;
+            break;
+        }
+    }
+    g_free(sn_tab);
+    return ret;
+}
+
+/* The snapshot whose RAM contents are tracked by dirty logging, and that
+ * the next incremental snapshot can be taken relative to */
+static BlockDriverState *snapshot_base_bs;
+static QEMUSnapshotInfo snapshot_base;
+
+static void snapshot_set_base(BlockDriverState *bs, QEMUSnapshotInfo *sn)
+{
+    if (ram_snapshot_is_tracking()) {
+        snapshot_base_bs = bs;
+        snapshot_base = *sn;
+    } else {
+        snapshot_base_bs = NULL;
+    }
+}
+
+static bool snapshot_base_valid(BlockDriverState *bs)
+{
+    QEMUSnapshotInfo sn;
+    char fmt[32];
+
+    if (!ram_snapshot_is_tracking() || snapshot_base_bs != bs) {
+        return false;
+    }
+
+    /* Only qcow2 records the parent link */
+    bdrv_get_format(bs, fmt, sizeof(fmt));
+    if (strcmp(fmt, "qcow2")) {
+        return false;
+    }
+
+    /* The base may have been deleted, or replaced by another snapshot
+     * that got the same id */
+    return snapshot_find_by_id(bs, &sn, snapshot_base.id_str) == 0 &&
+           sn.date_sec == snapshot_base.date_sec &&
+           sn.date_nsec == snapshot_base.date_nsec &&
+           sn.vm_clock_nsec == snapshot_base.vm_clock_nsec;
+}
+
 void do_savevm(Monitor *mon, const QDict *qdict)
 {
     BlockDriverState *bs, *bs1;
     QEMUSnapshotInfo sn1, *sn = &sn1, old_sn1, *old_sn = &old_sn1;
+    char parent_id[sizeof(sn1.parent_id)];
     int ret;
+    bool saved = false;
     QEMUFile *f;
     int saved_vm_running;
     uint64_t vm_state_size;
@@ -2057,6 +2331,7 @@ void do_savevm(Monitor *mon, const QDict *qdict)
     struct tm tm;
 #endif
     const char *name = qdict_get_try_str(qdict, "name");
+    bool incremental = qdict_get_try_bool(qdict, "incremental", 0);
 
     /* Verify if there is a device that doesn't support snapshots and is writable */
     bs = NULL;
@@ -2121,6 +2396,13 @@ void do_savevm(Monitor *mon, const QDict *qdict)
         goto the_end;
     }
 
+    /* Only save RAM that changed since the base snapshot if possible;
+     * otherwise this is a full snapshot that becomes the new base */
+    if (incremental && snapshot_base_valid(bs)) {
+        pstrcpy(sn->parent_id, sizeof(sn->parent_id), snapshot_base.id_str);
+    }
+    ram_snapshot_begin(incremental, sn->parent_id[0] != '\0');
+
     /* save the VM state */
     f = qemu_fopen_bdrv(bs, 1);
     if (!f) {
@@ -2137,20 +2419,37 @@ void do_savevm(Monitor *mon, const QDict *qdict)
 
     /* create the snapshots */
 
+    pstrcpy(parent_id, sizeof(parent_id), sn->parent_id);
     bs1 = NULL;
     while ((bs1 = bdrv_next(bs1))) {
         if (bdrv_can_snapshot(bs1)) {
-            /* Write VM state size only to the image that contains the state */
-            sn->vm_state_size = (bs == bs1 ? vm_state_size : 0);
+            /* Write VM state size and parent only to the image that contains
+             * the state; the other disks are saved in full and need not have
+             * the parent snapshot at all */
+            if (bs == bs1) {
+                sn->vm_state_size = vm_state_size;
+                pstrcpy(sn->parent_id, sizeof(sn->parent_id), parent_id);
+            } else {
+                sn->vm_state_size = 0;
+                sn->parent_id[0] = '\0';
+            }
             ret = bdrv_snapshot_create(bs1, sn);
             if (ret < 0) {
                 monitor_printf(mon, "Error while creating snapshot on '%s'\n",
                                bdrv_get_device_name(bs1));
+            } else if (bs == bs1) {
+                saved = true;
             }
         }
     }
+    sn->vm_state_size = vm_state_size;
+    pstrcpy(sn->parent_id, sizeof(sn->parent_id), parent_id);
 
  the_end:
+    ram_snapshot_end(saved);
+    if (saved) {
+        snapshot_set_base(bs, sn);
+    }
     if (saved_vm_running)
         vm_start();
 }
@@ -2181,11 +2480,51 @@ void qmp_xen_save_devices_state(const char *filename, Error **errp)
     return;
 }
 
+/* Load the VM state of one snapshot on top of the current state.  With
+ * @all_devices false only the image holding the VM state is reverted, which
+ * is enough for the ancestors of an incremental snapshot. */
+static int load_snapshot_state(BlockDriverState *bs_vm_state, const char *id,
+                               bool all_devices)
+{
+    BlockDriverState *bs;
+    QEMUFile *f;
+    int ret;
+
+    bs = NULL;
+    while ((bs = bdrv_next(bs))) {
+        if (bdrv_can_snapshot(bs) && (all_devices || bs == bs_vm_state)) {
+            ret = bdrv_snapshot_goto(bs, id);
+            if (ret < 0) {
+                error_report("Error %d while activating snapshot '%s' on '%s'",
+                             ret, id, bdrv_get_device_name(bs));
+                return ret;
+            }
+        }
+    }
+
+    /* restore the VM state */
+    f = qemu_fopen_bdrv(bs_vm_state, 0);
+    if (!f) {
+        error_report("Could not open VM state file");
+        return -EINVAL;
+    }
+
+    ret = qemu_loadvm_state(f);
+
+    qemu_fclose(f);
+    if (ret < 0) {
+        error_report("Error %d while loading VM state", ret);
+        return ret;
+    }
+
+    return 0;
+}
+
 int load_vmstate(const char *name)
 {
     BlockDriverState *bs, *bs_vm_state;
-    QEMUSnapshotInfo sn;
-    QEMUFile *f;
+    QEMUSnapshotInfo sn, parent;
+    GSList *chain = NULL, *l;
     int ret;
 
     bs_vm_state = bdrv_snapshots();
@@ -2227,38 +2566,48 @@ int load_vmstate(const char *name)
         }
     }
 
-    /* Flush all IO requests so they don't interfere with the new state.  */
-    bdrv_drain_all();
+    /* The RAM of an incremental snapshot is relative to its parent, so
+     * the whole chain is loaded starting from the first full snapshot */
+    ret = bdrv_snapshot_find(bs_vm_state, &sn, name);
+    if (ret < 0) {
+        return ret;
+    }
+    parent = sn;
+    while (parent.parent_id[0] != '\0') {
+        const char *id = parent.parent_id;
 
-    bs = NULL;
-    while ((bs = bdrv_next(bs))) {
-        if (bdrv_can_snapshot(bs)) {
-            ret = bdrv_snapshot_goto(bs, name);
-            if (ret < 0) {
-                error_report("Error %d while activating snapshot '%s' on '%s'",
-                             ret, name, bdrv_get_device_name(bs));
-                return ret;
-            }
+        if (g_slist_length(chain) >= 1024 ||
+            snapshot_find_by_id(bs_vm_state, &parent, id) < 0 ||
+            parent.vm_state_size == 0) {
+            error_report("Parent snapshot '%s' of '%s' is missing", id, name);
+            g_slist_foreach(chain, (GFunc)g_free, NULL);
+            g_slist_free(chain);
+            return -ENOENT;
         }
+        chain = g_slist_prepend(chain, g_strdup(parent.id_str));
     }
 
-    /* restore the VM state */
-    f = qemu_fopen_bdrv(bs_vm_state, 0);
-    if (!f) {
-        error_report("Could not open VM state file");
-        return -EINVAL;
-    }
+    /* Flush all IO requests so they don't interfere with the new state.  */
+    bdrv_drain_all();
 
     qemu_system_reset(VMRESET_SILENT);
-    ret = qemu_loadvm_state(f);
 
-    qemu_fclose(f);
-    if (ret < 0) {
-        error_report("Error %d while loading VM state", ret);
-        return ret;
+    ret = 0;
+    for (l = chain; l && ret == 0; l = l->next) {
+        ret = load_snapshot_state(bs_vm_state, l->data, false);
     }
+    g_slist_foreach(chain, (GFunc)g_free, NULL);
+    g_slist_free(chain);
 
-    return 0;
+    if (ret == 0) {
+        ret = load_snapshot_state(bs_vm_state, sn.id_str, true);
+    }
+
+    ram_snapshot_loaded(ret == 0);
+    if (ret == 0) {
+        snapshot_set_base(bs_vm_state, &sn);
+    }
+    return ret;
 }
 
 void do_delvm(Monitor *mon, const QDict *qdict)
@@ -2282,6 +2631,10 @@ void do_delvm(Monitor *mon, const QDict *qdict)
                     monitor_printf(mon,
                                    "Snapshots not supported on device '%s'\n",
                                    bdrv_get_device_name(bs1));
+                else if (ret == -EBUSY)
+                    monitor_printf(mon, "Snapshot '%s' on '%s' is the parent "
+                                   "of an incremental snapshot\n", name,
+                                   bdrv_get_device_name(bs1));
                 else
                     monitor_printf(mon, "Error %d while deleting snapshot on "
                                    "'%s'\n", ret, bdrv_get_device_name(bs1));